@@ -289,7 +289,80 @@ typedef struct {
   uint64_t extensions;
 } JxlHeaderExtensions;
 
-/** The header of one displayed frame. */
+/** The different ways of blending a frame on top of the previous frames. */
+typedef enum {
+  /** The frame replaces the previous pixels. */
+  JXL_BLEND_REPLACE = 0,
+  /** The frame is added to the previous pixels. */
+  JXL_BLEND_ADD = 1,
+  /** The frame is alpha blended on top of the previous pixels. */
+  JXL_BLEND_BLEND = 2,
+  /** The frame, multiplied by its alpha, is added to the previous pixels. */
+  JXL_BLEND_MULADD = 3,
+  /** The previous pixels are multiplied by the frame. */
+  JXL_BLEND_MUL = 4,
+} JxlBlendMode;
+
+/** The information about blending the color channels or a single extra
+ * channel of a frame.
+ */
+typedef struct {
+  /** Blend mode.
+   */
+  JxlBlendMode blendmode;
+  /** Reference frame ID to use as the 'bottom' layer (0-3).
+   */
+  uint32_t source;
+  /** Which extra channel to use as the 'alpha' channel for blend modes
+   * JXL_BLEND_BLEND and JXL_BLEND_MULADD.
+   */
+  uint32_t alpha;
+  /** Clamp values to [0,1] for the purpose of blending.
+   */
+  JXL_BOOL clamp;
+} JxlBlendInfo;
+
+/** The information about layers. Only meaningful when the frames are not
+ * coalesced, see JxlDecoderSetCoalescing. The position and dimensions are
+ * given in the coordinates of the image before the orientation is applied.
+ */
+typedef struct {
+  /** Whether cropping is applied for this frame. When decoding with coalescing
+   * enabled, this is always JXL_FALSE. If JXL_FALSE, crop_x0, crop_y0, xsize
+   * and ysize describe the full image.
+   */
+  JXL_BOOL have_crop;
+
+  /** Horizontal offset of the frame (can be negative).
+   */
+  int32_t crop_x0;
+
+  /** Vertical offset of the frame (can be negative).
+   */
+  int32_t crop_y0;
+
+  /** Width of the frame (number of columns).
+   */
+  uint32_t xsize;
+
+  /** Height of the frame (number of rows).
+   */
+  uint32_t ysize;
+
+  /** The blending info for the color channels. Blending info for extra
+   * channels has to be retrieved separately using
+   * JxlDecoderGetExtraChannelBlendInfo.
+   */
+  JxlBlendInfo blend_info;
+
+  /** After blending, save the frame as reference frame with this ID (0-3).
+   * Special case: if the frame duration is nonzero, ID 0 means "will not be
+   * referenced in the future". This value is not used for the last frame.
+   */
+  uint32_t save_as_reference;
+} JxlLayerInfo;
+
+/** The header of one displayed frame or non-coalesced layer. */
 typedef struct {
   /** How long to wait after rendering in ticks. The duration in seconds of a
    * tick is given by tps_numerator and tps_denominator in JxlAnimationHeader.
@@ -314,6 +387,10 @@ typedef struct {
   /** Indicates this is the last animation frame.
    */
   JXL_BOOL is_last;
+
+  /** Information about the layer in case of no coalescing.
+   */
+  JxlLayerInfo layer_info;
 } JxlFrameHeader;
 
 #if defined(__cplusplus) || defined(c_plusplus)
@@ -100,6 +100,10 @@ JXL_EXPORT JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager);
  * another image. All state and settings are reset as if the object was
  * newly created with JxlDecoderCreate, but the memory manager is kept.
  *
+ * The scratch buffers that the decoder allocated for the previous image, whose
+ * size does not depend on the image dimensions, are kept and reused for the
+ * next image. Use JxlDecoderReleaseCachedBuffers to free them.
+ *
  * @param dec instance to be re-initialized.
  */
 JXL_EXPORT void JxlDecoderReset(JxlDecoder* dec);
@@ -211,7 +215,8 @@ typedef enum {
    * displayed frame, always later than JXL_DEC_COLOR_ENCODING, and always
    * earlier than any pixel data. While JPEG XL supports encoding a single frame
    * as the composition of multiple internal sub-frames also called frames, this
-   * event is not indicated for the internal frames.
+   * event is not indicated for the internal frames, unless coalescing is
+   * disabled with JxlDecoderSetCoalescing.
    */
   JXL_DEC_FRAME = 0x400,
 
@@ -304,6 +309,11 @@ JXL_EXPORT void JxlDecoderRewind(JxlDecoder* dec);
  * JXL_DEC_FRAME and JXL_FULL_IMAGE, frames that are internal to the file format
  * but are not rendered as part of an animation, or are not the final still
  * frame of a still image, are not counted.
+ * If the container has a frame index box ("jxli") before the codestream, the
+ * decoder jumps directly to the last indexed frame that is not beyond the
+ * frame being skipped to, without parsing the frames before it. Their bytes
+ * must still be passed as input, but are neither copied nor examined. The
+ * frame index is not used when coalescing is disabled.
  * @param dec decoder object
  * @param amount the amount of frames to skip
  */
@@ -418,6 +428,130 @@ JxlDecoderSetKeepOrientation(JxlDecoder* dec, JXL_BOOL keep_orientation);
 JXL_EXPORT JxlDecoderStatus
 JxlDecoderSetRenderSpotcolors(JxlDecoder* dec, JXL_BOOL render_spotcolors);
 
+/**
+ * Restricts the output of the full image to a rectangular region of it. Only
+ * the parts of the codestream needed to render this region are decoded when
+ * the frames allow it, which makes extracting a small region of a large image
+ * much faster than decoding the whole image.
+ *
+ * The region is given in the coordinates of the image before the orientation
+ * is applied, and must be fully inside of the image. The image out buffer, the
+ * extra channel buffers and the image out callback use the dimensions of the
+ * region (oriented as usual unless JxlDecoderSetKeepOrientation is enabled),
+ * and the coordinates passed to the callback are relative to the region.
+ *
+ * Must be called after JXL_DEC_BASIC_INFO is available and before the frame
+ * to which it applies starts to be decoded: at the latest when JXL_DEC_FRAME
+ * is returned for that frame, and before the image out buffer or callback is
+ * set. The region applies to all subsequent frames, until JxlDecoderReset is
+ * called.
+ *
+ * @param dec decoder object
+ * @param x0 horizontal position of the top-left corner of the region.
+ * @param y0 vertical position of the top-left corner of the region.
+ * @param xsize width of the region, must be non-zero.
+ * @param ysize height of the region, must be non-zero.
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetCropRegion(JxlDecoder* dec,
+                                                    uint32_t x0, uint32_t y0,
+                                                    uint32_t xsize,
+                                                    uint32_t ysize);
+
+/**
+ * Requests the full image to be output downsampled by the given factor, e.g.
+ * to generate thumbnails. The dimensions of the image out buffer, the extra
+ * channel buffers and the image out callback are divided by the factor,
+ * rounded up; if a crop region is set, its dimensions are divided instead.
+ *
+ * Only the parts of the codestream needed for the reduced resolution are
+ * decoded when the frames allow it: progressive passes that only add finer
+ * detail are skipped, and with a factor of 8 the image is rendered directly
+ * from the DC of VarDCT frames, without decoding any AC coefficient.
+ * Otherwise, the frame is decoded at full resolution and then downsampled.
+ * The downsampled image is an approximation, and it is not guaranteed to be
+ * identical for all the ways in which it can be obtained.
+ *
+ * Must be called before starting decoding.
+ *
+ * @param dec decoder object
+ * @param downsampling the downsampling factor: 1 (default), 2, 4 or 8.
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetDownsampling(JxlDecoder* dec,
+                                                      uint32_t downsampling);
+
+/**
+ * Enables or disables coalescing of zero-duration frames. By default, frames
+ * are returned with coalescing enabled, i.e. all frames have the image
+ * dimensions, and are blended if needed. When coalescing is disabled, frames
+ * can have arbitrary dimensions, a non-zero crop offset, and blending is not
+ * performed. For display, coalescing is recommended. For loading a multi-layer
+ * still image as separate layers (as opposed to the merged image), or for
+ * re-encoding or inspecting animation frames without compositing them,
+ * coalescing has to be disabled.
+ *
+ * When coalescing is disabled, every frame of the image is returned with
+ * JXL_DEC_FRAME, including the zero-duration frames that are otherwise merged
+ * into the next displayed frame. The image out buffer, the extra channel
+ * buffers and the image out callback use the dimensions of the frame, given
+ * by the layer_info of JxlFrameHeader together with its position and blending
+ * information. Frames that are only used as a reference for other frames
+ * (e.g. patches) are still not returned.
+ *
+ * Must be called before starting decoding. Disabling coalescing is not
+ * compatible with JxlDecoderSetCropRegion.
+ *
+ * @param dec decoder object
+ * @param coalescing JXL_TRUE to enable coalescing (default), JXL_FALSE to
+ * disable it.
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetCoalescing(JxlDecoder* dec,
+                                                    JXL_BOOL coalescing);
+
+/**
+ * Limits the memory used to decode a frame. Before decoding each frame, the
+ * decoder estimates from its header how much memory the frame needs, and
+ * returns JXL_DEC_ERROR right away if the frame does not fit in the limit even
+ * with the lowest-memory options. Otherwise, the decoder picks the options
+ * that fit: if needed, it decodes the groups of the frame one at a time
+ * instead of in parallel.
+ *
+ * The lowest-memory options avoid storing the whole frame in floating point,
+ * and require the image out buffer to be JXL_TYPE_UINT8 with 3 or 4 channels,
+ * or an image out callback with JXL_TYPE_FLOAT, and no extra channel buffers.
+ * They are also not available for frames that are blended or referenced by
+ * later frames, or with a crop region, downsampling or EXIF orientation to
+ * undo. Frames that need a full frame buffer fail when their dimensions alone
+ * exceed the limit.
+ *
+ * The estimate is approximate: it counts the large per-frame and per-thread
+ * buffers, but not the input data, the caller's output buffers, or small
+ * allocations.
+ *
+ * Must be called before starting decoding.
+ *
+ * @param dec decoder object
+ * @param memory_limit maximum memory in bytes, or 0 for no limit (default).
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetMemoryLimit(JxlDecoder* dec,
+                                                     uint64_t memory_limit);
+
+/**
+ * Frees the scratch buffers that the decoder keeps across JxlDecoderReset and
+ * JxlDecoderRewind to avoid allocating them again for every image. This is
+ * useful to reduce the memory held by an idle decoder; decoding works the same
+ * afterwards, but allocates the buffers again.
+ *
+ * Must be called before starting decoding, e.g. right after JxlDecoderReset.
+ *
+ * @param dec decoder object
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderReleaseCachedBuffers(JxlDecoder* dec);
+
 /**
  * Decodes JPEG XL file using the available bytes. Requires input has been
  * set with JxlDecoderSetInput. After JxlDecoderProcessInput, input can
@@ -735,6 +869,21 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderSetPreviewOutBuffer(
 JXL_EXPORT JxlDecoderStatus JxlDecoderGetFrameHeader(const JxlDecoder* dec,
                                                      JxlFrameHeader* header);
 
+/**
+ * Outputs the blend information for the current frame for a specific extra
+ * channel. This function can be called when JXL_DEC_FRAME occurred for the
+ * current frame, even when have_animation in the JxlBasicInfo is JXL_FALSE.
+ * This information is only useful if coalescing is disabled; otherwise the
+ * decoder will have performed blending already.
+ *
+ * @param dec decoder object
+ * @param index the index of the extra channel
+ * @param blend_info struct to copy the information into
+ * @return JXL_DEC_SUCCESS on success, JXL_DEC_ERROR on error
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetExtraChannelBlendInfo(
+    const JxlDecoder* dec, size_t index, JxlBlendInfo* blend_info);
+
 /**
  * Outputs name for the current frame. The buffer for name must have at least
  * name_length + 1 bytes allocated, gotten from the associated JxlFrameHeader.
@@ -810,6 +959,10 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderImageOutBufferSize(
  * JxlDecoderImageOutBufferSize. The buffer follows the format described by
  * JxlPixelFormat. The buffer is owned by the caller.
  *
+ * With JxlDecoderFlushImage, the decoder relies on the buffer keeping the
+ * pixels it wrote at the previous flush of the frame; see there. Setting the
+ * buffer again makes the next flush write the whole image.
+ *
  * @param dec decoder object
  * @param format format of the pixels. Object owned by user and its contents
  * are copied internally.
@@ -840,6 +993,53 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderSetImageOutBuffer(
 typedef void (*JxlImageOutCallback)(void* opaque, size_t x, size_t y,
                                     size_t num_pixels, const void* pixels);
 
+/**
+ * Initialization callback for JxlDecoderSetMultithreadedImageOutCallback.
+ *
+ * @param init_opaque optional user data, as given to
+ * JxlDecoderSetMultithreadedImageOutCallback.
+ * @param num_threads maximum number of threads that will call the run callback
+ * concurrently. The thread_id passed to the run callback is always smaller than
+ * this value.
+ * @param num_pixels_per_thread maximum number of pixels that will be passed in
+ * one call to the run callback.
+ * @return a pointer to data that will be passed to the run and destroy
+ * callbacks, or NULL if initialization failed.
+ */
+typedef void* (*JxlImageOutInitCallback)(void* init_opaque, size_t num_threads,
+                                         size_t num_pixels_per_thread);
+
+/**
+ * Run callback for JxlDecoderSetMultithreadedImageOutCallback. Same as
+ * JxlImageOutCallback, but with the index of the calling thread.
+ *
+ * The callback is called concurrently by the worker threads of the parallel
+ * runner, on different pixels. Calls with the same thread_id never overlap,
+ * so the callback can use per-thread state indexed by thread_id without
+ * locking.
+ *
+ * @param run_opaque user data returned by the init callback.
+ * @param thread_id index of the calling thread, smaller than the num_threads
+ * value given to the init callback.
+ * @param x horizontal position of leftmost pixel of the pixel data.
+ * @param y vertical position of the pixel data.
+ * @param num_pixels amount of pixels included in the pixel data, horizontally.
+ * @param pixels pixel data as a horizontal stripe, in the format passed to
+ * JxlDecoderSetMultithreadedImageOutCallback. The memory is not owned by the
+ * user, and is only valid during the time the callback is running.
+ */
+typedef void (*JxlImageOutRunCallback)(void* run_opaque, size_t thread_id,
+                                       size_t x, size_t y, size_t num_pixels,
+                                       const void* pixels);
+
+/**
+ * Destruction callback for JxlDecoderSetMultithreadedImageOutCallback, called
+ * after all the run callbacks that followed an init callback.
+ *
+ * @param run_opaque user data returned by the init callback.
+ */
+typedef void (*JxlImageOutDestroyCallback)(void* run_opaque);
+
 /**
  * Sets pixel output callback. This is an alternative to
  * JxlDecoderSetImageOutBuffer. This can be set when the JXL_DEC_FRAME event
@@ -886,6 +1086,38 @@ JXL_EXPORT JxlDecoderStatus
 JxlDecoderSetImageOutCallback(JxlDecoder* dec, const JxlPixelFormat* format,
                               JxlImageOutCallback callback, void* opaque);
 
+/**
+ * Similar to JxlDecoderSetImageOutCallback, except that the callback is given
+ * the index of the calling thread, so that it can keep per-thread state
+ * instead of locking. The run callback is called concurrently from the worker
+ * threads of the parallel runner set with JxlDecoderSetParallelRunner.
+ *
+ * Before the first run callback of a frame, the init callback is called once
+ * with the number of threads and the maximum number of pixels per call, and
+ * its return value is passed to the run callbacks. After the last run
+ * callback of that pass over the frame, the destroy callback is called with
+ * the same value. The init and destroy callbacks may be called more than once
+ * per frame, but the calls never overlap with each other or with run
+ * callbacks that use a different value.
+ *
+ * @param dec decoder object
+ * @param format format of the pixels. Object owned by user and its contents
+ * are copied internally.
+ * @param init_callback initialization callback, may be NULL, in which case
+ * NULL is passed to the run callback.
+ * @param run_callback the callback function receiving partial scanlines of
+ * pixel data.
+ * @param destroy_callback clean-up callback, may be NULL.
+ * @param init_opaque optional user data, which will be passed on to the init
+ * callback, may be NULL.
+ * @return JXL_DEC_SUCCESS on success, JXL_DEC_ERROR on error, such as
+ * JxlDecoderSetImageOutBuffer already set.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetMultithreadedImageOutCallback(
+    JxlDecoder* dec, const JxlPixelFormat* format,
+    JxlImageOutInitCallback init_callback, JxlImageOutRunCallback run_callback,
+    JxlImageOutDestroyCallback destroy_callback, void* init_opaque);
+
 /**
  * Returns the minimum size in bytes of an extra channel pixel buffer for the
  * given format. This is the buffer for JxlDecoderSetExtraChannelBuffer.
@@ -1085,6 +1317,9 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderGetBoxSizeRaw(const JxlDecoder* dec,
  * after the JXL_DEC_FRAME event already occurred and before the
  * JXL_DEC_FULL_IMAGE event occurred for a frame.
  *
+ * Each flush writes the whole image to the buffer, unless incremental
+ * flushing is enabled with JxlDecoderSetIncrementalFlush.
+ *
  * @param dec decoder object
  * @return JXL_DEC_SUCCESS if image data was flushed to the output buffer, or
  * JXL_DEC_ERROR when no flush was done, e.g. if not enough image data was
@@ -1094,6 +1329,24 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderGetBoxSizeRaw(const JxlDecoder* dec,
  */
 JXL_EXPORT JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec);
 
+/**
+ * Enables or disables incremental flushing. By default, each
+ * JxlDecoderFlushImage writes the whole image to the image out buffer. With
+ * incremental flushing, the flushes of a frame after the first one only write
+ * the parts of the image that changed since the previous flush, and leave the
+ * rest of the buffer as is, which is faster for large images. The caller must
+ * then not modify the contents of the buffer between flushes of a frame. To
+ * use another buffer (or to get the whole image written again), set it again
+ * with JxlDecoderSetImageOutBuffer: the next flush then writes the whole image
+ * to it.
+ *
+ * @param dec decoder object
+ * @param incremental_flush JXL_TRUE to enable, JXL_FALSE to disable (default).
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus
+JxlDecoderSetIncrementalFlush(JxlDecoder* dec, JXL_BOOL incremental_flush);
+
 #if defined(__cplusplus) || defined(c_plusplus)
 }
 #endif
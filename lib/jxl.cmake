@@ -119,6 +119,8 @@ set(JPEGXL_INTERNAL_SOURCES_DEC
   jxl/filters_internal.h
   jxl/frame_header.cc
   jxl/frame_header.h
+  jxl/frame_index.cc
+  jxl/frame_index.h
   jxl/gauss_blur.cc
   jxl/gauss_blur.h
   jxl/headers.cc
@@ -162,6 +164,7 @@ set(JPEGXL_INTERNAL_SOURCES_DEC
   jxl/modular/modular_image.cc
   jxl/modular/modular_image.h
   jxl/modular/options.h
+  jxl/modular/transform/palette.cc
   jxl/modular/transform/palette.h
   jxl/modular/transform/rct.cc
   jxl/modular/transform/rct.h
@@ -239,6 +242,8 @@ set(JPEGXL_INTERNAL_SOURCES_ENC
   jxl/enc_file.h
   jxl/enc_frame.cc
   jxl/enc_frame.h
+  jxl/enc_frame_index.cc
+  jxl/enc_frame_index.h
   jxl/enc_gamma_correct.h
   jxl/enc_group.cc
   jxl/enc_group.h
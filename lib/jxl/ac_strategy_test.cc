@@ -7,6 +7,7 @@
 
 #include <string.h>
 
+#include <algorithm>
 #include <cmath>
 #include <hwy/aligned_allocator.h>
 #include <hwy/base.h>  // HWY_ALIGN_MAX
@@ -75,6 +76,56 @@ HWY_TARGET_INSTANTIATE_TEST_SUITE_P_T(
 
 TEST_P(AcStrategyRoundtrip, Test) { Run(); }
 
+// Test that skipping zero coefficients in the IDCT does not change the output.
+class AcStrategySparse : public ::hwy::TestWithParamTargetAndT<int> {
+ protected:
+  void Run() {
+    const AcStrategy::Type type = static_cast<AcStrategy::Type>(GetParam());
+    const AcStrategy acs = AcStrategy::FromRawStrategy(type);
+    const size_t xsize = acs.covered_blocks_x() * 8;
+    const size_t ysize = acs.covered_blocks_y() * 8;
+    const size_t cols = std::max(xsize, ysize);
+    const size_t rows = std::min(xsize, ysize);
+
+    auto mem = hwy::AllocateAligned<float>(6 * AcStrategy::kMaxCoeffArea);
+    float* scratch_space = mem.get();
+    float* coeffs = scratch_space + 2 * AcStrategy::kMaxCoeffArea;
+    float* sparse_coeffs = coeffs + AcStrategy::kMaxCoeffArea;
+    float* idct = sparse_coeffs + AcStrategy::kMaxCoeffArea;
+    float* sparse_idct = idct + AcStrategy::kMaxCoeffArea;
+
+    for (size_t nrows = 1; nrows <= rows; nrows += 7) {
+      for (size_t ncols = 1; ncols <= cols; ncols += 11) {
+        std::fill_n(coeffs, AcStrategy::kMaxCoeffArea, 0.0f);
+        for (size_t y = 0; y < nrows; y++) {
+          for (size_t x = 0; x < ncols; x++) {
+            coeffs[y * cols + x] = ((y * 37 + x * 11) % 19) * 0.01f - 0.09f;
+          }
+        }
+        memcpy(sparse_coeffs, coeffs, rows * cols * sizeof(float));
+        size_t nonzero_rows, nonzero_cols;
+        NonZeroExtents(sparse_coeffs, rows, cols, &nonzero_rows,
+                       &nonzero_cols);
+        ASSERT_LE(nonzero_rows, nrows);
+        TransformToPixels(type, coeffs, idct, xsize, scratch_space);
+        TransformToPixels(type, sparse_coeffs, sparse_idct, xsize,
+                          scratch_space, nonzero_rows, nonzero_cols);
+        for (size_t j = 0; j < xsize * ysize; j++) {
+          ASSERT_EQ(idct[j], sparse_idct[j])
+              << "j = " << j << " rows = " << nrows << " cols = " << ncols
+              << " acs " << type;
+        }
+      }
+    }
+  }
+};
+
+HWY_TARGET_INSTANTIATE_TEST_SUITE_P_T(
+    AcStrategySparse,
+    ::testing::Range(0, int(AcStrategy::Type::kNumValidStrategies)));
+
+TEST_P(AcStrategySparse, Test) { Run(); }
+
 // Test that DC(2x2) -> DCT coefficients -> IDCT -> downsampled IDCT is a noop.
 class AcStrategyRoundtripDownsample
     : public ::hwy::TestWithParamTargetAndT<int> {
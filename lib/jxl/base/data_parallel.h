@@ -119,6 +119,20 @@ bool RunOnPool(ThreadPool* pool, const uint32_t begin, const uint32_t end,
   return ret;
 }
 
+// Returns the number of threads that `pool` runs its tasks on, which is an
+// upper bound of the thread indices it passes to the tasks.
+inline size_t NumThreads(ThreadPool* pool) {
+  size_t num_threads = 1;
+  RunOnPool(
+      pool, 0, 1,
+      [&num_threads](size_t threads) {
+        num_threads = threads;
+        return true;
+      },
+      [](uint32_t /* task */, size_t /* thread */) {}, "NumThreads");
+  return num_threads;
+}
+
 }  // namespace jxl
 
 #endif  // LIB_JXL_BASE_DATA_PARALLEL_H_
@@ -5,14 +5,43 @@
 
 #include "lib/jxl/blending.h"
 
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jxl/blending.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
 #include "lib/jxl/alpha.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/image_ops.h"
 
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// out = bg + fg. `out` may be the same row as `bg`.
+void AddRow(const float* bg, const float* fg, float* out, size_t xsize) {
+  const HWY_FULL(float) d;
+  size_t x = 0;
+  for (; x + Lanes(d) <= xsize; x += Lanes(d)) {
+    StoreU(LoadU(d, bg + x) + LoadU(d, fg + x), d, out + x);
+  }
+  for (; x < xsize; x++) {
+    out[x] = bg[x] + fg[x];
+  }
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
 namespace jxl {
 
 namespace {
 
+HWY_EXPORT(AddRow);
+
 // Given two rects A and B, returns a set of rects whose union is A \ B. This
 // may require from 0 to 4 rects, one for each non-empty side of B. `storage`
 // must have room to accommodate that many rects. The order is consistent when
@@ -351,13 +380,18 @@ Status PerformBlending(
       break;
     }
   }
-  ImageF tmp(xsize, 3 + num_ec);
+  // Without extra channels, each output pixel only depends on the input pixels
+  // at the same position, so the color channels are blended in place.
+  ImageF tmp;
+  float* color_out[3] = {out[0], out[1], out[2]};
+  if (num_ec != 0) {
+    tmp = ImageF(xsize, 3 + num_ec);
+    for (size_t p = 0; p < 3; p++) color_out[p] = tmp.Row(p);
+  }
   // Blend extra channels first so that we use the pre-blending alpha.
   for (size_t i = 0; i < num_ec; i++) {
     if (ec_blending[i].mode == PatchBlendMode::kAdd) {
-      for (size_t x = 0; x < xsize; x++) {
-        tmp.Row(3 + i)[x] = bg[3 + i][x] + fg[3 + i][x];
-      }
+      HWY_DYNAMIC_DISPATCH(AddRow)(bg[3 + i], fg[3 + i], tmp.Row(3 + i), xsize);
     } else if (ec_blending[i].mode == PatchBlendMode::kBlendAbove) {
       size_t alpha = ec_blending[i].alpha_channel;
       bool is_premultiplied = extra_channel_info[alpha].alpha_associated;
@@ -397,10 +431,7 @@ Status PerformBlending(
       (color_blending.mode == PatchBlendMode::kAlphaWeightedAddBelow &&
        !has_alpha)) {
     for (int p = 0; p < 3; p++) {
-      float* out = tmp.Row(p);
-      for (size_t x = 0; x < xsize; x++) {
-        out[x] = bg[p][x] + fg[p][x];
-      }
+      HWY_DYNAMIC_DISPATCH(AddRow)(bg[p], fg[p], color_out[p], xsize);
     }
   } else if (color_blending.mode == PatchBlendMode::kBlendAbove
              // blend without alpha is just replace
@@ -409,7 +440,7 @@ Status PerformBlending(
     PerformAlphaBlending(
         {bg[0], bg[1], bg[2], bg[3 + alpha]},
         {fg[0], fg[1], fg[2], fg[3 + alpha]},
-        {tmp.Row(0), tmp.Row(1), tmp.Row(2), tmp.Row(3 + alpha)}, xsize,
+        {color_out[0], color_out[1], color_out[2], tmp.Row(3 + alpha)}, xsize,
         is_premultiplied, color_blending.clamp);
   } else if (color_blending.mode == PatchBlendMode::kBlendBelow
              // blend without alpha is just replace
@@ -418,37 +449,41 @@ Status PerformBlending(
     PerformAlphaBlending(
         {fg[0], fg[1], fg[2], fg[3 + alpha]},
         {bg[0], bg[1], bg[2], bg[3 + alpha]},
-        {tmp.Row(0), tmp.Row(1), tmp.Row(2), tmp.Row(3 + alpha)}, xsize,
+        {color_out[0], color_out[1], color_out[2], tmp.Row(3 + alpha)}, xsize,
         is_premultiplied, color_blending.clamp);
   } else if (color_blending.mode == PatchBlendMode::kAlphaWeightedAddAbove) {
     JXL_DASSERT(has_alpha);
     for (size_t c = 0; c < 3; c++) {
-      PerformAlphaWeightedAdd(bg[c], fg[c], fg[3 + alpha], tmp.Row(c), xsize,
-                              color_blending.clamp);
+      PerformAlphaWeightedAdd(bg[c], fg[c], fg[3 + alpha], color_out[c],
+                              xsize, color_blending.clamp);
     }
   } else if (color_blending.mode == PatchBlendMode::kAlphaWeightedAddBelow) {
     JXL_DASSERT(has_alpha);
     for (size_t c = 0; c < 3; c++) {
-      PerformAlphaWeightedAdd(fg[c], bg[c], bg[3 + alpha], tmp.Row(c), xsize,
-                              color_blending.clamp);
+      PerformAlphaWeightedAdd(fg[c], bg[c], bg[3 + alpha], color_out[c],
+                              xsize, color_blending.clamp);
     }
   } else if (color_blending.mode == PatchBlendMode::kMul) {
     for (int p = 0; p < 3; p++) {
-      PerformMulBlending(bg[p], fg[p], tmp.Row(p), xsize, color_blending.clamp);
+      PerformMulBlending(bg[p], fg[p], color_out[p], xsize,
+                         color_blending.clamp);
     }
   } else if (color_blending.mode == PatchBlendMode::kReplace ||
              color_blending.mode == PatchBlendMode::kBlendAbove ||
              color_blending.mode == PatchBlendMode::kBlendBelow) {  // kReplace
     for (size_t p = 0; p < 3; p++) {
-      memcpy(tmp.Row(p), fg[p], xsize * sizeof(**fg));
+      if (color_out[p] == fg[p]) continue;
+      memcpy(color_out[p], fg[p], xsize * sizeof(**fg));
     }
   } else if (color_blending.mode == PatchBlendMode::kNone) {
     for (size_t p = 0; p < 3; p++) {
-      memcpy(tmp.Row(p), bg[p], xsize * sizeof(**fg));
+      if (color_out[p] == bg[p]) continue;
+      memcpy(color_out[p], bg[p], xsize * sizeof(**fg));
     }
   } else {
     JXL_ABORT("Unreachable");
   }
+  if (num_ec == 0) return true;
   for (size_t i = 0; i < 3 + num_ec; i++) {
     memcpy(out[i], tmp.Row(i), xsize * sizeof(**out));
   }
@@ -476,3 +511,4 @@ Status ImageBlender::RectBlender::DoBlending(size_t y) {
 }
 
 }  // namespace jxl
+#endif  // HWY_ONCE
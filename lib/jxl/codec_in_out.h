@@ -190,6 +190,10 @@ class CodecInOut {
   // if frames are cropped)
   uint64_t dec_pixels = 0;
 
+  // Largest amount of frames that DecodeFile decoded concurrently, 0 if the
+  // frames were decoded one after the other.
+  size_t dec_max_concurrent_frames = 0;
+
   // -- DECODER OUTPUT, ENCODER INPUT:
 
   // Metadata stored into / retrieved from bitstreams.
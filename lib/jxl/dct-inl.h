@@ -13,9 +13,13 @@
 #endif
 
 #include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
 
 #include <hwy/highway.h>
 
+#include "lib/jxl/common.h"
 #include "lib/jxl/dct_block-inl.h"
 #include "lib/jxl/dct_scales.h"
 #include "lib/jxl/transpose-inl.h"
@@ -317,6 +321,60 @@ struct ComputeScaledIDCT {
       IDCT1D<ROWS, COLS>()(DCTFrom(from, COLS), to);
     }
   }
+
+  // Same as above, for a block whose non-zero coefficients are all within the
+  // first nonzero_rows rows and nonzero_cols columns of `from` (which has
+  // min(ROWS, COLS) rows of max(ROWS, COLS) columns). The first 1D pass only
+  // runs on the lanes that can be non-zero, and a block with just a DC
+  // coefficient is filled directly.
+  template <class To>
+  HWY_MAYBE_UNUSED void operator()(float* JXL_RESTRICT from, const To& to,
+                                   float* JXL_RESTRICT scratch_space,
+                                   size_t nonzero_rows, size_t nonzero_cols) {
+    if (nonzero_rows <= 1 && nonzero_cols <= 1) {
+      // The IDCT of a DC-only block is constant.
+      const HWY_CAPPED(float, COLS) dc;
+      const auto value = Set(dc, nonzero_rows == 0 ? 0.0f : from[0]);
+      for (size_t y = 0; y < ROWS; y++) {
+        for (size_t x = 0; x < COLS; x += Lanes(dc)) {
+          to.StorePart(dc, value, y, x);
+        }
+      }
+      return;
+    }
+    // Number of lanes of the first pass that can be non-zero, in whole
+    // vectors; these are columns of `from` if ROWS >= COLS, rows otherwise.
+    const size_t nonzero = ROWS < COLS ? nonzero_rows : nonzero_cols;
+    const size_t align = std::max<size_t>(8, Lanes(FV<0>()));
+    const size_t n = nonzero >= ROWS ? ROWS : RoundUpTo(nonzero, align);
+    if (n >= ROWS) return (*this)(from, to, scratch_space);
+    float* JXL_RESTRICT block = scratch_space;
+    if (ROWS < COLS) {
+      TransposePart(DCTFrom(from, COLS), DCTTo(block, ROWS), n, COLS);
+      NoInlineWrapper(IDCT1DWrapper<COLS, 0, DCTFrom, DCTTo>,
+                      DCTFrom(block, ROWS), DCTTo(from, ROWS), n);
+      TransposePart(DCTFrom(from, ROWS), DCTTo(block, COLS), COLS, n);
+      memset(block + n * COLS, 0, (ROWS - n) * COLS * sizeof(float));
+      IDCT1D<ROWS, COLS>()(DCTFrom(block, COLS), to);
+    } else {
+      NoInlineWrapper(IDCT1DWrapper<COLS, 0, DCTFrom, DCTTo>,
+                      DCTFrom(from, ROWS), DCTTo(block, ROWS), n);
+      TransposePart(DCTFrom(block, ROWS), DCTTo(from, COLS), COLS, n);
+      memset(from + n * COLS, 0, (ROWS - n) * COLS * sizeof(float));
+      IDCT1D<ROWS, COLS>()(DCTFrom(from, COLS), to);
+    }
+  }
+
+ private:
+  // Transposes the top-left rows x cols part of a block.
+  static void TransposePart(const DCTFrom& from, const DCTTo& to, size_t rows,
+                            size_t cols) {
+    TransposeSimdTag<TransposeUseSimd(ROWS, COLS)> tag;
+    constexpr void (*transpose)(TransposeSimdTag<TransposeUseSimd(ROWS, COLS)>,
+                                const DCTFrom&, const DCTTo&, size_t, size_t) =
+        GenericTransposeBlock<0, 0, DCTFrom, DCTTo>;
+    NoInlineWrapper(transpose, tag, from, to, rows, cols);
+  }
 };
 
 }  // namespace
@@ -185,6 +185,70 @@ Status ReadHistogram(int precision_bits, std::vector<int>* counts,
   return true;
 }
 
+HybridUintToken ComputeHybridUintToken(const HybridUintConfig& config,
+                                       uint32_t token) {
+  HybridUintToken result;
+  result.lsb_in_token = config.lsb_in_token;
+  if (token < config.split_token) {
+    result.base = token;
+    result.nbits = 0;
+    return result;
+  }
+  const uint32_t msb_in_token = config.msb_in_token;
+  const uint32_t lsb_in_token = config.lsb_in_token;
+  // Same computation (and masking of invalid bit counts) as
+  // ANSSymbolReader::ReadHybridUintConfig.
+  uint32_t nbits = config.split_exponent - (msb_in_token + lsb_in_token) +
+                   ((token - config.split_token) >>
+                    (msb_in_token + lsb_in_token));
+  nbits &= 31u;
+  const uint64_t low = token & ((1 << lsb_in_token) - 1);
+  const uint64_t high = (1 << msb_in_token) |
+                        ((token >> lsb_in_token) & ((1 << msb_in_token) - 1));
+  result.base = static_cast<uint32_t>(((high << nbits) << lsb_in_token) | low);
+  result.nbits = nbits;
+  return result;
+}
+
+// Fills the lookup tables of `code` that ANSSymbolReader uses to decode
+// hybrid uints.
+void BuildHybridUintTables(ANSCode* code) {
+  const size_t num_histograms = code->uint_config.size();
+  const uint32_t lz77_threshold =
+      code->lz77.enabled ? code->lz77.min_symbol : ~0u;
+  if (!code->use_prefix_code) {
+    const size_t alphabet_size = 1 << code->log_alpha_size;
+    code->token_tables.resize(num_histograms * alphabet_size);
+    for (size_t c = 0; c < num_histograms; c++) {
+      for (size_t t = 0; t < alphabet_size; t++) {
+        code->token_tables[c * alphabet_size + t] =
+            ComputeHybridUintToken(code->uint_config[c], t);
+      }
+    }
+    return;
+  }
+  const size_t table_size = 1 << kHuffmanTableBits;
+  code->prefix_tables.resize(num_histograms * table_size);
+  for (size_t c = 0; c < num_histograms; c++) {
+    const HuffmanCode* huffman_table = code->huffman_data[c].table_.data();
+    for (size_t i = 0; i < table_size; i++) {
+      PrefixTableEntry& entry = code->prefix_tables[c * table_size + i];
+      entry.nbits = PrefixTableEntry::kSlowPath;
+      const HuffmanCode& symbol = huffman_table[i];
+      // Second-level entries and LZ77 lengths take the slow path.
+      if (symbol.bits > kHuffmanTableBits) continue;
+      if (symbol.value >= lz77_threshold) continue;
+      const HybridUintToken token =
+          ComputeHybridUintToken(code->uint_config[c], symbol.value);
+      if (symbol.bits + token.nbits > kHuffmanTableBits) continue;
+      const uint64_t bits = (i >> symbol.bits) & ((1 << token.nbits) - 1);
+      entry.value =
+          static_cast<uint32_t>(token.base + (bits << token.lsb_in_token));
+      entry.nbits = symbol.bits + token.nbits;
+    }
+  }
+}
+
 }  // namespace
 
 Status DecodeANSCodes(const size_t num_histograms,
@@ -360,6 +424,7 @@ Status DecodeHistograms(BitReader* br, size_t num_contexts, ANSCode* code,
   const size_t max_alphabet_size = 1 << code->log_alpha_size;
   JXL_RETURN_IF_ERROR(
       DecodeANSCodes(num_histograms, max_alphabet_size, br, code));
+  BuildHybridUintTables(code);
   // When using LZ77, flat codes might result in valid codestreams with
   // histograms that potentially allow very large bit counts.
   // TODO(veluca): in principle, a valid codestream might contain a histogram
@@ -12,6 +12,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <cstring>
 #include <vector>
 
@@ -134,10 +135,33 @@ static constexpr int8_t kSpecialDistances[kNumSpecialDistances][2] = {
     {-6, 6}, {8, 3},  {5, 7},  {-5, 7}, {7, 5},  {-7, 5}, {8, 4},  {6, 7},
     {-6, 7}, {7, 6},  {-7, 6}, {8, 5},  {7, 7},  {-7, 7}, {8, 6},  {8, 7}};
 
+// Precomputed decoding of a token of a HybridUintConfig: the decoded value is
+// `base + (bits << lsb_in_token)`, where `bits` are the next `nbits` bits.
+struct HybridUintToken {
+  uint32_t base;
+  uint8_t nbits;
+  uint8_t lsb_in_token;
+};
+
+// Entry of a lookup table indexed by the next kHuffmanTableBits bits of a
+// prefix-coded stream. If the symbol and its hybrid uint extra bits fit in
+// those bits, `value` is the decoded value and `nbits` the total number of bits
+// to consume; otherwise `nbits` is kSlowPath.
+struct PrefixTableEntry {
+  static constexpr uint8_t kSlowPath = 0xFF;
+  uint32_t value;
+  uint8_t nbits;
+};
+
 struct ANSCode {
   CacheAlignedUniquePtr alias_tables;
   std::vector<HuffmanDecodingData> huffman_data;
   std::vector<HybridUintConfig> uint_config;
+  // Lookup tables built by DecodeHistograms. For ANS, (1 << log_alpha_size)
+  // entries per histogram, indexed by token. For prefix codes,
+  // (1 << kHuffmanTableBits) entries per histogram.
+  std::vector<HybridUintToken> token_tables;
+  std::vector<PrefixTableEntry> prefix_tables;
   std::vector<int> degenerate_symbols;
   bool use_prefix_code;
   uint8_t log_alpha_size;  // for ANS.
@@ -148,15 +172,46 @@ struct ANSCode {
   void UpdateMaxNumBits(size_t ctx, size_t symbol);
 };
 
+// Memory for the LZ77 window of an ANSSymbolReader. Readers that are not used
+// at the same time, such as those of the groups decoded by one thread, can
+// share one instead of allocating a window each.
+class LZ77WindowStorage {
+ public:
+  // Returns space for `size` symbols; the contents are unspecified.
+  uint32_t* Get(size_t size) {
+    if (size > capacity_) {
+      // a std::vector incurs unacceptable decoding speed loss because of
+      // initialization.
+      storage_ = AllocateArray(size * sizeof(uint32_t));
+      capacity_ = size;
+    }
+    return reinterpret_cast<uint32_t*>(storage_.get());
+  }
+
+  size_t BytesUsed() const { return capacity_ * sizeof(uint32_t); }
+
+ private:
+  CacheAlignedUniquePtr storage_;
+  size_t capacity_ = 0;
+};
+
 class ANSSymbolReader {
  public:
   // Invalid symbol reader, to be overwritten.
   ANSSymbolReader() = default;
+  // `max_num_symbols` is an upper bound of the number of symbols that will be
+  // read; the window is not larger than necessary to hold them. If
+  // `window_storage` is not null, the window is taken from it instead of
+  // being allocated, and it must outlive the reader.
   ANSSymbolReader(const ANSCode* code, BitReader* JXL_RESTRICT br,
-                  size_t distance_multiplier = 0)
+                  size_t distance_multiplier = 0,
+                  size_t max_num_symbols = kWindowSize,
+                  LZ77WindowStorage* window_storage = nullptr)
       : alias_tables_(
             reinterpret_cast<AliasTable::Entry*>(code->alias_tables.get())),
         huffman_data_(code->huffman_data.data()),
+        token_tables_(code->token_tables.data()),
+        prefix_tables_(code->prefix_tables.data()),
         use_prefix_code_(code->use_prefix_code),
         configs(code->uint_config.data()) {
     if (!use_prefix_code_) {
@@ -168,10 +223,16 @@ class ANSSymbolReader {
       state_ = (ANS_SIGNATURE << 16u);
     }
     if (!code->lz77.enabled) return;
-    // a std::vector incurs unacceptable decoding speed loss because of
-    // initialization.
-    lz77_window_storage_ = AllocateArray(kWindowSize * sizeof(uint32_t));
-    lz77_window_ = reinterpret_cast<uint32_t*>(lz77_window_storage_.get());
+    // As long as fewer symbols than the window size are read, the window never
+    // wraps around and its size does not matter. Checkpoints need at least
+    // kMaxCheckpointInterval symbols.
+    window_size_ = std::max<size_t>(
+        kMaxCheckpointInterval,
+        size_t{1} << CeilLog2Nonzero(
+            std::max<size_t>(std::min(max_num_symbols, kWindowSize), 1)));
+    window_mask_ = window_size_ - 1;
+    if (window_storage == nullptr) window_storage = &lz77_window_storage_;
+    lz77_window_ = window_storage->Get(window_size_);
     lz77_ctx_ = code->lz77.nonserialized_distance_context;
     lz77_length_uint_ = code->lz77.length_uint_config;
     lz77_threshold_ = code->lz77.min_symbol;
@@ -271,16 +332,40 @@ class ANSSymbolReader {
     return static_cast<uint32_t>(ret);
   }
 
+  // Same as ReadHybridUintConfig, using a precomputed HybridUintToken.
+  static JXL_INLINE uint32_t ReadHybridUintToken(const HybridUintToken& token,
+                                                 BitReader* br) {
+    const uint64_t bits = br->PeekBits(token.nbits);
+    br->Consume(token.nbits);
+    return static_cast<uint32_t>(token.base + (bits << token.lsb_in_token));
+  }
+
   // Takes a *clustered* idx.
   size_t ReadHybridUintClustered(size_t ctx, BitReader* JXL_RESTRICT br) {
     if (JXL_UNLIKELY(num_to_copy_ > 0)) {
-      size_t ret = lz77_window_[(copy_pos_++) & kWindowMask];
+      size_t ret = lz77_window_[(copy_pos_++) & window_mask_];
       num_to_copy_--;
-      lz77_window_[(num_decoded_++) & kWindowMask] = ret;
+      lz77_window_[(num_decoded_++) & window_mask_] = ret;
       return ret;
     }
     br->Refill();  // covers ReadSymbolWithoutRefill + PeekBits
-    size_t token = ReadSymbolWithoutRefill(ctx, br);
+    size_t token;
+    if (JXL_UNLIKELY(use_prefix_code_)) {
+      // Short codes with few extra bits are decoded with a single lookup.
+      const PrefixTableEntry entry =
+          prefix_tables_[(ctx << kHuffmanTableBits) +
+                         br->PeekFixedBits<kHuffmanTableBits>()];
+      if (JXL_LIKELY(entry.nbits != PrefixTableEntry::kSlowPath)) {
+        br->Consume(entry.nbits);
+        if (lz77_window_) {
+          lz77_window_[(num_decoded_++) & window_mask_] = entry.value;
+        }
+        return entry.value;
+      }
+      token = ReadSymbolHuffWithoutRefill(ctx, br);
+    } else {
+      token = ReadSymbolANSWithoutRefill(ctx, br);
+    }
     if (JXL_UNLIKELY(token >= lz77_threshold_)) {
       num_to_copy_ =
           ReadHybridUintConfig(lz77_length_uint_, token - lz77_threshold_, br) +
@@ -297,22 +382,26 @@ class ANSSymbolReader {
       if (JXL_UNLIKELY(distance > num_decoded_)) {
         distance = num_decoded_;
       }
-      if (JXL_UNLIKELY(distance > kWindowSize)) {
-        distance = kWindowSize;
+      if (JXL_UNLIKELY(distance > window_size_)) {
+        distance = window_size_;
       }
       copy_pos_ = num_decoded_ - distance;
       if (JXL_UNLIKELY(distance == 0)) {
         JXL_DASSERT(lz77_window_ != nullptr);
         // distance 0 -> num_decoded_ == copy_pos_ == 0
-        size_t to_fill = std::min<size_t>(num_to_copy_, kWindowSize);
+        size_t to_fill = std::min<size_t>(num_to_copy_, window_size_);
         memset(lz77_window_, 0, to_fill * sizeof(lz77_window_[0]));
       }
       // TODO(eustas): overflow; mark BitReader as unhealthy
       if (num_to_copy_ < lz77_min_length_) return 0;
       return ReadHybridUintClustered(ctx, br);  // will trigger a copy.
     }
-    size_t ret = ReadHybridUintConfig(configs[ctx], token, br);
-    if (lz77_window_) lz77_window_[(num_decoded_++) & kWindowMask] = ret;
+    size_t ret =
+        use_prefix_code_
+            ? ReadHybridUintConfig(configs[ctx], token, br)
+            : ReadHybridUintToken(
+                  token_tables_[(ctx << log_alpha_size_) + token], br);
+    if (lz77_window_) lz77_window_[(num_decoded_++) & window_mask_] = ret;
     return ret;
   }
 
@@ -338,7 +427,7 @@ class ANSSymbolReader {
     *value = symbol.value;
     if (lz77_window_) {
       for (size_t i = 0; i < count; i++) {
-        lz77_window_[(num_decoded_++) & kWindowMask] = symbol.value;
+        lz77_window_[(num_decoded_++) & window_mask_] = symbol.value;
       }
     }
     return true;
@@ -358,15 +447,15 @@ class ANSSymbolReader {
     checkpoint->num_to_copy = num_to_copy_;
     checkpoint->copy_pos = copy_pos_;
     if (lz77_window_) {
-      size_t win_start = num_decoded_ & kWindowMask;
-      size_t win_end = (num_decoded_ + kMaxCheckpointInterval) & kWindowMask;
+      size_t win_start = num_decoded_ & window_mask_;
+      size_t win_end = (num_decoded_ + kMaxCheckpointInterval) & window_mask_;
       if (win_end > win_start) {
         memcpy(checkpoint->lz77_window, lz77_window_ + win_start,
                (win_end - win_start) * sizeof(*lz77_window_));
       } else {
         memcpy(checkpoint->lz77_window, lz77_window_ + win_start,
-               (kWindowSize - win_start) * sizeof(*lz77_window_));
-        memcpy(checkpoint->lz77_window + (kWindowSize - win_start),
+               (window_size_ - win_start) * sizeof(*lz77_window_));
+        memcpy(checkpoint->lz77_window + (window_size_ - win_start),
                lz77_window_, win_end * sizeof(*lz77_window_));
       }
     }
@@ -379,15 +468,16 @@ class ANSSymbolReader {
     num_to_copy_ = checkpoint.num_to_copy;
     copy_pos_ = checkpoint.copy_pos;
     if (lz77_window_) {
-      size_t win_start = num_decoded_ & kWindowMask;
-      size_t win_end = (num_decoded_ + kMaxCheckpointInterval) & kWindowMask;
+      size_t win_start = num_decoded_ & window_mask_;
+      size_t win_end = (num_decoded_ + kMaxCheckpointInterval) & window_mask_;
       if (win_end > win_start) {
         memcpy(lz77_window_ + win_start, checkpoint.lz77_window,
                (win_end - win_start) * sizeof(*lz77_window_));
       } else {
         memcpy(lz77_window_ + win_start, checkpoint.lz77_window,
-               (kWindowSize - win_start) * sizeof(*lz77_window_));
-        memcpy(lz77_window_, checkpoint.lz77_window + (kWindowSize - win_start),
+               (window_size_ - win_start) * sizeof(*lz77_window_));
+        memcpy(lz77_window_,
+               checkpoint.lz77_window + (window_size_ - win_start),
                win_end * sizeof(*lz77_window_));
       }
     }
@@ -396,6 +486,8 @@ class ANSSymbolReader {
  private:
   const AliasTable::Entry* JXL_RESTRICT alias_tables_;  // not owned
   const HuffmanDecodingData* huffman_data_;
+  const HybridUintToken* token_tables_;    // not owned
+  const PrefixTableEntry* prefix_tables_;  // not owned
   bool use_prefix_code_;
   uint32_t state_ = ANS_SIGNATURE << 16u;
   const HybridUintConfig* JXL_RESTRICT configs;
@@ -404,9 +496,10 @@ class ANSSymbolReader {
   uint32_t entry_size_minus_1_;
 
   // LZ77 structures and constants.
-  static constexpr size_t kWindowMask = kWindowSize - 1;
-  CacheAlignedUniquePtr lz77_window_storage_;
+  LZ77WindowStorage lz77_window_storage_;
   uint32_t* lz77_window_ = nullptr;
+  size_t window_size_ = kWindowSize;
+  size_t window_mask_ = kWindowSize - 1;
   uint32_t num_decoded_ = 0;
   uint32_t num_to_copy_ = 0;
   uint32_t copy_pos_ = 0;
@@ -15,6 +15,7 @@
 #include "lib/jxl/coeff_order.h"
 #include "lib/jxl/common.h"
 #include "lib/jxl/convolve.h"
+#include "lib/jxl/dec_ans.h"
 #include "lib/jxl/dec_group_border.h"
 #include "lib/jxl/dec_noise.h"
 #include "lib/jxl/dec_upsample.h"
@@ -26,6 +27,197 @@
 
 namespace jxl {
 
+// Bytes allocated for the pixels of an image, including the padding.
+template <typename T>
+uint64_t ImageBytes(const Plane<T>& image) {
+  return static_cast<uint64_t>(image.bytes_per_row()) * image.ysize();
+}
+template <typename T>
+uint64_t ImageBytes(const Image3<T>& image) {
+  return 3 * ImageBytes(image.Plane(0));
+}
+
+// Temp images required for decoding a single group. Reduces memory allocations
+// for large images because we only initialize min(#threads, #groups) instances.
+struct GroupDecCache {
+  void InitOnce(size_t num_passes, size_t used_acs) {
+    PROFILER_FUNC;
+
+    for (size_t i = 0; i < num_passes; i++) {
+      if (num_nzeroes[i].xsize() == 0) {
+        // Allocate enough for a whole group - partial groups on the
+        // right/bottom border just use a subset. The valid size is passed via
+        // Rect.
+
+        num_nzeroes[i] = Image3I(kGroupDimInBlocks, kGroupDimInBlocks);
+      }
+    }
+    size_t max_block_area = 0;
+
+    for (uint8_t o = 0; o < AcStrategy::kNumValidStrategies; ++o) {
+      AcStrategy acs = AcStrategy::FromRawStrategy(o);
+      if ((used_acs & (1 << o)) == 0) continue;
+      size_t area =
+          acs.covered_blocks_x() * acs.covered_blocks_y() * kDCTBlockSize;
+      max_block_area = std::max(area, max_block_area);
+    }
+
+    if (max_block_area > max_block_area_) {
+      max_block_area_ = max_block_area;
+      // We need 3x float blocks for dequantized coefficients and 1x for scratch
+      // space for transforms.
+      float_memory_ = hwy::AllocateAligned<float>(max_block_area_ * 4);
+      // We need 3x int32 or int16 blocks for quantized coefficients.
+      int32_memory_ = hwy::AllocateAligned<int32_t>(max_block_area_ * 3);
+      int16_memory_ = hwy::AllocateAligned<int16_t>(max_block_area_ * 3);
+    }
+
+    dec_group_block = float_memory_.get();
+    scratch_space = dec_group_block + max_block_area_ * 3;
+    dec_group_qblock = int32_memory_.get();
+    dec_group_qblock16 = int16_memory_.get();
+  }
+
+  // Bytes of the buffers held by this cache.
+  uint64_t BytesUsed() const {
+    uint64_t bytes = max_block_area_ * (4 * sizeof(float) +
+                                        3 * sizeof(int32_t) +
+                                        3 * sizeof(int16_t));
+    for (size_t i = 0; i < kMaxNumPasses; i++) {
+      bytes += ImageBytes(num_nzeroes[i]) + lz77_windows[i].BytesUsed();
+    }
+    return bytes;
+  }
+
+  // Scratch space used by DecGroupImpl().
+  float* dec_group_block;
+  int32_t* dec_group_qblock;
+  int16_t* dec_group_qblock16;
+
+  // For TransformToPixels.
+  float* scratch_space;
+  // Note that scratch_space is never used at the same time as dec_group_qblock.
+  // Moreover, only one of dec_group_qblock16 is ever used.
+  // TODO(veluca): figure out if we can save allocations.
+
+  // AC decoding
+  Image3I num_nzeroes[kMaxNumPasses];
+
+  // LZ77 windows of the AC decoders, one per pass. Modular group decoding uses
+  // the first one.
+  LZ77WindowStorage lz77_windows[kMaxNumPasses];
+
+ private:
+  hwy::AlignedFreeUniquePtr<float[]> float_memory_;
+  hwy::AlignedFreeUniquePtr<int32_t[]> int32_memory_;
+  hwy::AlignedFreeUniquePtr<int16_t[]> int16_memory_;
+  size_t max_block_area_ = 0;
+};
+
+// Per-thread scratch buffers of PassesDecoderState, whose sizes do not depend
+// on the image. JxlDecoderReset moves them into the decoder state of the next
+// image, so that they are reused by PassesDecoderState::EnsureStorage.
+struct PassesDecoderScratch {
+  // Storage for intermediate data during FinalizeRect steps.
+  // TODO(veluca): these buffers are larger than strictly necessary.
+  std::vector<Image3F> filter_input_storage;
+  std::vector<Image3F> upsampling_input_storage;
+  size_t upsampler_arena_size = 0;
+  std::vector<hwy::AlignedFreeUniquePtr<float[]>> upsampler_storage;
+  // We keep four arrays, one per upsampling level, to reduce memory usage in
+  // the common case of no upsampling.
+  std::vector<Image3F> output_pixel_data_storage[4] = {};
+  std::vector<ImageF> ec_temp_images;
+  std::vector<ImageF> ycbcr_temp_images;
+  std::vector<Image3F> ycbcr_out_images;
+  std::vector<NoiseStorage> noise_storage;
+
+  // Filter application pipeline used by ApplyImageFeatures. One entry is needed
+  // per thread.
+  std::vector<FilterPipeline> filter_pipelines;
+
+  // One row per thread
+  std::vector<std::vector<float>> pixel_callback_rows;
+
+  // Buffer for decoded pixel data for a group.
+  std::vector<Image3F> group_data;
+
+  // Scratch space for AC group decoding, one per thread. Kept here rather than
+  // in the FrameDecoder so that it survives across frames and images.
+  std::vector<GroupDecCache> group_dec_caches;
+
+  // Removes the elements of `buffers` after the first `size` ones. Unlike
+  // resize(), does not need the elements to be default-constructible.
+  template <typename T>
+  static void ShrinkTo(size_t size, std::vector<T>* buffers) {
+    while (buffers->size() > size) buffers->pop_back();
+  }
+
+  // Frees the buffers of all threads after the first `num_threads` ones.
+  // `num_extra_channels` is the amount of extra channels of the image.
+  void Shrink(size_t num_threads, size_t num_extra_channels) {
+    ShrinkTo(num_threads, &filter_pipelines);
+    ShrinkTo(num_threads, &filter_input_storage);
+    ShrinkTo(num_threads, &upsampling_input_storage);
+    ShrinkTo(num_threads, &upsampler_storage);
+    for (auto& storage : output_pixel_data_storage) {
+      ShrinkTo(num_threads, &storage);
+    }
+    ShrinkTo(num_extra_channels * num_threads, &ec_temp_images);
+    ShrinkTo(num_threads, &ycbcr_temp_images);
+    ShrinkTo(num_threads, &ycbcr_out_images);
+    ShrinkTo(num_threads, &noise_storage);
+    ShrinkTo(num_threads, &pixel_callback_rows);
+    ShrinkTo(num_threads, &group_data);
+    ShrinkTo(num_threads, &group_dec_caches);
+  }
+
+  // Returns the bytes held by the buffers of the first `num_threads` threads.
+  uint64_t BytesUsed(size_t num_threads, size_t num_extra_channels) const {
+    uint64_t bytes = 0;
+    for (size_t t = 0; t < num_threads; t++) {
+      if (t < filter_pipelines.size()) {
+        bytes += ImageBytes(filter_pipelines[t].storage);
+      }
+      if (t < filter_input_storage.size()) {
+        bytes += ImageBytes(filter_input_storage[t]);
+      }
+      if (t < upsampling_input_storage.size()) {
+        bytes += ImageBytes(upsampling_input_storage[t]);
+      }
+      if (t < upsampler_storage.size()) {
+        bytes += upsampler_arena_size * sizeof(float);
+      }
+      for (const auto& storage : output_pixel_data_storage) {
+        if (t < storage.size()) bytes += ImageBytes(storage[t]);
+      }
+      if (t < ycbcr_temp_images.size()) {
+        bytes += ImageBytes(ycbcr_temp_images[t]);
+      }
+      if (t < ycbcr_out_images.size()) {
+        bytes += ImageBytes(ycbcr_out_images[t]);
+      }
+      if (t < noise_storage.size()) {
+        bytes += ImageBytes(noise_storage[t].noise) +
+                 ImageBytes(noise_storage[t].random);
+      }
+      if (t < pixel_callback_rows.size()) {
+        bytes += pixel_callback_rows[t].capacity() * sizeof(float);
+      }
+      if (t < group_data.size()) bytes += ImageBytes(group_data[t]);
+      if (t < group_dec_caches.size()) {
+        bytes += group_dec_caches[t].BytesUsed();
+      }
+    }
+    const size_t num_ec_images =
+        std::min(ec_temp_images.size(), num_extra_channels * num_threads);
+    for (size_t i = 0; i < num_ec_images; i++) {
+      bytes += ImageBytes(ec_temp_images[i]);
+    }
+    return bytes;
+  }
+};
+
 // Per-frame decoder state. All the images here should be accessed through a
 // group rect (either with block units or pixel units).
 struct PassesDecoderState {
@@ -36,8 +228,11 @@ struct PassesDecoderState {
   // Upsamplers for all the possible upsampling factors (2 to 8).
   Upsampler upsamplers[3];
 
-  // Storage for RNG output for noise synthesis.
-  Image3F noise;
+  // Per-thread buffers, kept across images.
+  PassesDecoderScratch scratch;
+
+  // Noise synthesis, generated on demand by FinalizeImageRect.
+  NoiseGenerator noise;
 
   // Storage for pre-color-transform output for displayed
   // save_before_color_transform frames.
@@ -79,12 +274,12 @@ struct PassesDecoderState {
   // per pixel.
   bool rgb_output_is_rgba;
 
-  // Callback for line-by-line output.
-  std::function<void(const float*, size_t, size_t, size_t)> pixel_callback;
+  // Callback for line-by-line output, given the pixels, the thread index and
+  // the position and number of pixels of the line.
+  std::function<void(const float*, size_t, size_t, size_t, size_t)>
+      pixel_callback;
   // Buffer of upsampling * kApplyImageFeaturesTileDim ones.
   std::vector<float> opaque_alpha;
-  // One row per thread
-  std::vector<std::vector<float>> pixel_callback_rows;
 
   // Seed for noise, to have different noise per-frame.
   size_t noise_seed = 0;
@@ -95,10 +290,6 @@ struct PassesDecoderState {
   // Storage for coefficients if in "accumulate" mode.
   std::unique_ptr<ACImage> coefficients = make_unique<ACImageT<int32_t>>(0, 0);
 
-  // Filter application pipeline used by ApplyImageFeatures. One entry is needed
-  // per thread.
-  std::vector<FilterPipeline> filter_pipelines;
-
   // Input weights used by the filters. These are shared from multiple threads
   // but are read-only for the filter application.
   FilterWeights filter_weights;
@@ -106,6 +297,11 @@ struct PassesDecoderState {
   // Manages the status of borders.
   GroupBorderAssigner group_border_assigner;
 
+  // Area of the frame, in the coordinates of frame_dim, that is actually
+  // rendered by FinalizeFrameDecoding. Only smaller than the frame when
+  // decoding a crop region.
+  Rect render_rect;
+
   // TODO(veluca): this should eventually become "iff no global modular
   // transform was applied".
   bool EagerFinalizeImageRect() const {
@@ -133,22 +329,6 @@ struct PassesDecoderState {
     return padding;
   }
 
-  // Storage for intermediate data during FinalizeRect steps.
-  // TODO(veluca): these buffers are larger than strictly necessary.
-  std::vector<Image3F> filter_input_storage;
-  std::vector<Image3F> padded_upsampling_input_storage;
-  std::vector<Image3F> upsampling_input_storage;
-  size_t upsampler_arena_size = 0;
-  std::vector<hwy::AlignedFreeUniquePtr<float[]>> upsampler_storage;
-  // We keep four arrays, one per upsampling level, to reduce memory usage in
-  // the common case of no upsampling.
-  std::vector<Image3F> output_pixel_data_storage[4] = {};
-  std::vector<ImageF> ec_temp_images;
-  std::vector<ImageF> ycbcr_temp_images;
-  std::vector<Image3F> ycbcr_out_images;
-
-  // Buffer for decoded pixel data for a group.
-  std::vector<Image3F> group_data;
   static constexpr size_t kGroupDataYBorder = kMaxFinalizeRectPadding * 2;
   static constexpr size_t kGroupDataXBorder =
       RoundUpToBlockDim(kMaxFinalizeRectPadding) * 2 + kBlockDim;
@@ -157,65 +337,82 @@ struct PassesDecoderState {
     // We need one filter_storage per thread, ensure we have at least that many.
     if (shared->frame_header.loop_filter.epf_iters != 0 ||
         shared->frame_header.loop_filter.gab) {
-      if (filter_pipelines.size() < num_threads) {
-        filter_pipelines.resize(num_threads);
+      if (scratch.filter_pipelines.size() < num_threads) {
+        scratch.filter_pipelines.resize(num_threads);
       }
     }
     // We allocate filter_input_storage unconditionally to ensure that the image
     // is allocated if we need it for DC upsampling.
-    for (size_t _ = filter_input_storage.size(); _ < num_threads; _++) {
+    for (size_t _ = scratch.filter_input_storage.size(); _ < num_threads; _++) {
       // Extra padding along the x dimension to ensure memory accesses don't
       // load out-of-bounds pixels.
-      filter_input_storage.emplace_back(
+      scratch.filter_input_storage.emplace_back(
           kApplyImageFeaturesTileDim + 2 * kGroupDataXBorder,
           kApplyImageFeaturesTileDim + 2 * kGroupDataYBorder);
     }
     if (shared->frame_header.upsampling != 1) {
-      for (size_t _ = upsampling_input_storage.size(); _ < num_threads; _++) {
+      for (size_t _ = scratch.upsampling_input_storage.size(); _ < num_threads;
+           _++) {
         // At this point, we only need up to 2 pixels of border per side for
         // upsampling, but we add an extra border for aligned access.
-        upsampling_input_storage.emplace_back(
-            kApplyImageFeaturesTileDim + 2 * kBlockDim,
-            kApplyImageFeaturesTileDim + 4);
-        padded_upsampling_input_storage.emplace_back(
+        scratch.upsampling_input_storage.emplace_back(
             kApplyImageFeaturesTileDim + 2 * kBlockDim,
             kApplyImageFeaturesTileDim + 4);
       }
     }
     const size_t arena_size = Upsampler::GetArenaSize(
         kApplyImageFeaturesTileDim * shared->frame_header.upsampling);
-    if (arena_size > upsampler_arena_size) upsampler_storage.clear();
-    for (size_t _ = upsampler_storage.size(); _ < num_threads; _++) {
-      upsampler_storage.emplace_back(hwy::AllocateAligned<float>(arena_size));
+    if (arena_size > scratch.upsampler_arena_size) {
+      scratch.upsampler_storage.clear();
+    }
+    for (size_t _ = scratch.upsampler_storage.size(); _ < num_threads; _++) {
+      scratch.upsampler_storage.emplace_back(
+          hwy::AllocateAligned<float>(arena_size));
     }
-    upsampler_arena_size = arena_size;
-    for (size_t _ = group_data.size(); _ < num_threads; _++) {
-      group_data.emplace_back(kGroupDim + 2 * kGroupDataXBorder,
-                              kGroupDim + 2 * kGroupDataYBorder);
+    scratch.upsampler_arena_size = arena_size;
+    for (size_t _ = scratch.group_data.size(); _ < num_threads; _++) {
+      scratch.group_data.emplace_back(kGroupDim + 2 * kGroupDataXBorder,
+                                      kGroupDim + 2 * kGroupDataYBorder);
 #if MEMORY_SANITIZER
       // Avoid errors due to loading vectors on the outermost padding.
-      FillImage(msan::kSanitizerSentinel, &group_data.back());
+      FillImage(msan::kSanitizerSentinel, &scratch.group_data.back());
 #endif
     }
     if (!shared->frame_header.chroma_subsampling.Is444()) {
-      for (size_t _ = ycbcr_temp_images.size(); _ < num_threads; _++) {
-        ycbcr_temp_images.emplace_back(kGroupDim + 2 * kGroupDataXBorder,
-                                       kGroupDim + 2 * kGroupDataYBorder);
-        ycbcr_out_images.emplace_back(kGroupDim + 2 * kGroupDataXBorder,
-                                      kGroupDim + 2 * kGroupDataYBorder);
+      for (size_t _ = scratch.ycbcr_temp_images.size(); _ < num_threads; _++) {
+        scratch.ycbcr_temp_images.emplace_back(
+            kGroupDim + 2 * kGroupDataXBorder,
+            kGroupDim + 2 * kGroupDataYBorder);
+        scratch.ycbcr_out_images.emplace_back(
+            kGroupDim + 2 * kGroupDataXBorder,
+            kGroupDim + 2 * kGroupDataYBorder);
+      }
+    }
+    if (shared->frame_header.flags & FrameHeader::kNoise) {
+      const size_t tile_dim =
+          kApplyImageFeaturesTileDim * shared->frame_header.upsampling;
+      std::vector<NoiseStorage>& noise_storage = scratch.noise_storage;
+      if (!noise_storage.empty() && noise_storage[0].noise.xsize() < tile_dim) {
+        noise_storage.clear();
+      }
+      for (size_t _ = noise_storage.size(); _ < num_threads; _++) {
+        noise_storage.emplace_back(tile_dim);
       }
     }
     if (rgb_output || pixel_callback) {
       size_t log2_upsampling = CeilLog2Nonzero(shared->frame_header.upsampling);
-      for (size_t _ = output_pixel_data_storage[log2_upsampling].size();
-           _ < num_threads; _++) {
-        output_pixel_data_storage[log2_upsampling].emplace_back(
+      std::vector<Image3F>& output_pixel_data_storage =
+          scratch.output_pixel_data_storage[log2_upsampling];
+      for (size_t _ = output_pixel_data_storage.size(); _ < num_threads; _++) {
+        output_pixel_data_storage.emplace_back(
             kApplyImageFeaturesTileDim << log2_upsampling,
             kApplyImageFeaturesTileDim << log2_upsampling);
       }
       opaque_alpha.resize(
           kApplyImageFeaturesTileDim * shared->frame_header.upsampling, 1.0f);
       if (pixel_callback) {
+        std::vector<std::vector<float>>& pixel_callback_rows =
+            scratch.pixel_callback_rows;
         pixel_callback_rows.resize(num_threads);
         for (size_t i = 0; i < pixel_callback_rows.size(); ++i) {
           pixel_callback_rows[i].resize(kApplyImageFeaturesTileDim *
@@ -224,6 +421,7 @@ struct PassesDecoderState {
         }
       }
     }
+    std::vector<ImageF>& ec_temp_images = scratch.ec_temp_images;
     if (shared->metadata->m.num_extra_channels * num_threads >
         ec_temp_images.size()) {
       ec_temp_images.resize(shared->metadata->m.num_extra_channels *
@@ -266,9 +464,11 @@ struct PassesDecoderState {
     used_acs = 0;
 
     group_border_assigner.Init(shared->frame_dim);
+    render_rect = Rect(0, 0, shared->frame_dim.xsize_padded,
+                       shared->frame_dim.ysize_padded);
     const LoopFilter& lf = shared->frame_header.loop_filter;
     JXL_RETURN_IF_ERROR(filter_weights.Init(lf, shared->frame_dim));
-    for (auto& fp : filter_pipelines) {
+    for (auto& fp : scratch.filter_pipelines) {
       // De-initialize FilterPipelines.
       fp.num_filters = 0;
     }
@@ -294,35 +494,9 @@ struct PassesDecoderState {
       shared_storage.coeff_orders.resize(sz);
     }
     if (shared->frame_header.flags & FrameHeader::kNoise) {
-      noise = Image3F(shared->frame_dim.xsize_upsampled_padded,
-                      shared->frame_dim.ysize_upsampled_padded);
-      size_t num_x_groups = DivCeil(noise.xsize(), kGroupDim);
-      size_t num_y_groups = DivCeil(noise.ysize(), kGroupDim);
-      PROFILER_ZONE("GenerateNoise");
-      auto generate_noise = [&](int group_index, int _) {
-        size_t gx = group_index % num_x_groups;
-        size_t gy = group_index / num_x_groups;
-        Rect rect(gx * kGroupDim, gy * kGroupDim, kGroupDim, kGroupDim,
-                  noise.xsize(), noise.ysize());
-        RandomImage3(noise_seed + group_index, rect, &noise);
-      };
-      RunOnPool(pool, 0, num_x_groups * num_y_groups, ThreadPool::SkipInit(),
-                generate_noise, "Generate noise");
-      {
-        PROFILER_ZONE("High pass noise");
-        // 4 * (1 - box kernel)
-        WeightsSymmetric5 weights{{HWY_REP4(-3.84)}, {HWY_REP4(0.16)},
-                                  {HWY_REP4(0.16)},  {HWY_REP4(0.16)},
-                                  {HWY_REP4(0.16)},  {HWY_REP4(0.16)}};
-        // TODO(veluca): avoid copy.
-        // TODO(veluca): avoid having a full copy of the image in main memory.
-        ImageF noise_tmp(noise.xsize(), noise.ysize());
-        for (size_t c = 0; c < 3; c++) {
-          Symmetric5(noise.Plane(c), Rect(noise), weights, pool, &noise_tmp);
-          std::swap(noise.Plane(c), noise_tmp);
-        }
-        noise_seed += shared->frame_dim.num_groups;
-      }
+      noise.Init(noise_seed, shared->frame_dim.xsize_upsampled_padded,
+                 shared->frame_dim.ysize_upsampled_padded);
+      noise_seed += shared->frame_dim.num_groups;
     }
     EnsureBordersStorage();
     if (!EagerFinalizeImageRect()) {
@@ -344,68 +518,6 @@ struct PassesDecoderState {
                        ImageBundle* output);
 };
 
-// Temp images required for decoding a single group. Reduces memory allocations
-// for large images because we only initialize min(#threads, #groups) instances.
-struct GroupDecCache {
-  void InitOnce(size_t num_passes, size_t used_acs) {
-    PROFILER_FUNC;
-
-    for (size_t i = 0; i < num_passes; i++) {
-      if (num_nzeroes[i].xsize() == 0) {
-        // Allocate enough for a whole group - partial groups on the
-        // right/bottom border just use a subset. The valid size is passed via
-        // Rect.
-
-        num_nzeroes[i] = Image3I(kGroupDimInBlocks, kGroupDimInBlocks);
-      }
-    }
-    size_t max_block_area = 0;
-
-    for (uint8_t o = 0; o < AcStrategy::kNumValidStrategies; ++o) {
-      AcStrategy acs = AcStrategy::FromRawStrategy(o);
-      if ((used_acs & (1 << o)) == 0) continue;
-      size_t area =
-          acs.covered_blocks_x() * acs.covered_blocks_y() * kDCTBlockSize;
-      max_block_area = std::max(area, max_block_area);
-    }
-
-    if (max_block_area > max_block_area_) {
-      max_block_area_ = max_block_area;
-      // We need 3x float blocks for dequantized coefficients and 1x for scratch
-      // space for transforms.
-      float_memory_ = hwy::AllocateAligned<float>(max_block_area_ * 4);
-      // We need 3x int32 or int16 blocks for quantized coefficients.
-      int32_memory_ = hwy::AllocateAligned<int32_t>(max_block_area_ * 3);
-      int16_memory_ = hwy::AllocateAligned<int16_t>(max_block_area_ * 3);
-    }
-
-    dec_group_block = float_memory_.get();
-    scratch_space = dec_group_block + max_block_area_ * 3;
-    dec_group_qblock = int32_memory_.get();
-    dec_group_qblock16 = int16_memory_.get();
-  }
-
-  // Scratch space used by DecGroupImpl().
-  float* dec_group_block;
-  int32_t* dec_group_qblock;
-  int16_t* dec_group_qblock16;
-
-  // For TransformToPixels.
-  float* scratch_space;
-  // Note that scratch_space is never used at the same time as dec_group_qblock.
-  // Moreover, only one of dec_group_qblock16 is ever used.
-  // TODO(veluca): figure out if we can save allocations.
-
-  // AC decoding
-  Image3I num_nzeroes[kMaxNumPasses];
-
- private:
-  hwy::AlignedFreeUniquePtr<float[]> float_memory_;
-  hwy::AlignedFreeUniquePtr<int32_t[]> int32_memory_;
-  hwy::AlignedFreeUniquePtr<int16_t[]> int16_memory_;
-  size_t max_block_area_ = 0;
-};
-
 }  // namespace jxl
 
 #endif  // LIB_JXL_DEC_CACHE_H_
@@ -122,11 +122,12 @@ void StoreLEFloat(float value, uint8_t* p) {
 
 // The orientation may not be identity.
 // TODO(lode): SIMDify where possible
+// Only the pixels of `image` in `rect` are read.
 template <typename T>
 void UndoOrientation(jxl::Orientation undo_orientation, const Plane<T>& image,
-                     Plane<T>& out, jxl::ThreadPool* pool) {
-  const size_t xsize = image.xsize();
-  const size_t ysize = image.ysize();
+                     const Rect& rect, Plane<T>& out, jxl::ThreadPool* pool) {
+  const size_t xsize = rect.xsize();
+  const size_t ysize = rect.ysize();
 
   if (undo_orientation == Orientation::kFlipHorizontal) {
     out = Plane<T>(xsize, ysize);
@@ -134,7 +135,7 @@ void UndoOrientation(jxl::Orientation undo_orientation, const Plane<T>& image,
         pool, 0, static_cast<uint32_t>(ysize), ThreadPool::SkipInit(),
         [&](const int task, int /*thread*/) {
           const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
+          const T* JXL_RESTRICT row_in = rect.ConstRow(image, y);
           T* JXL_RESTRICT row_out = out.Row(y);
           for (size_t x = 0; x < xsize; ++x) {
             row_out[xsize - x - 1] = row_in[x];
@@ -147,7 +148,7 @@ void UndoOrientation(jxl::Orientation undo_orientation, const Plane<T>& image,
         pool, 0, static_cast<uint32_t>(ysize), ThreadPool::SkipInit(),
         [&](const int task, int /*thread*/) {
           const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
+          const T* JXL_RESTRICT row_in = rect.ConstRow(image, y);
           T* JXL_RESTRICT row_out = out.Row(ysize - y - 1);
           for (size_t x = 0; x < xsize; ++x) {
             row_out[xsize - x - 1] = row_in[x];
@@ -160,7 +161,7 @@ void UndoOrientation(jxl::Orientation undo_orientation, const Plane<T>& image,
         pool, 0, static_cast<uint32_t>(ysize), ThreadPool::SkipInit(),
         [&](const int task, int /*thread*/) {
           const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
+          const T* JXL_RESTRICT row_in = rect.ConstRow(image, y);
           T* JXL_RESTRICT row_out = out.Row(ysize - y - 1);
           for (size_t x = 0; x < xsize; ++x) {
             row_out[x] = row_in[x];
@@ -173,7 +174,7 @@ void UndoOrientation(jxl::Orientation undo_orientation, const Plane<T>& image,
         pool, 0, static_cast<uint32_t>(ysize), ThreadPool::SkipInit(),
         [&](const int task, int /*thread*/) {
           const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
+          const T* JXL_RESTRICT row_in = rect.ConstRow(image, y);
           for (size_t x = 0; x < xsize; ++x) {
             out.Row(x)[y] = row_in[x];
           }
@@ -185,7 +186,7 @@ void UndoOrientation(jxl::Orientation undo_orientation, const Plane<T>& image,
         pool, 0, static_cast<uint32_t>(ysize), ThreadPool::SkipInit(),
         [&](const int task, int /*thread*/) {
           const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
+          const T* JXL_RESTRICT row_in = rect.ConstRow(image, y);
           for (size_t x = 0; x < xsize; ++x) {
             out.Row(x)[ysize - y - 1] = row_in[x];
           }
@@ -197,7 +198,7 @@ void UndoOrientation(jxl::Orientation undo_orientation, const Plane<T>& image,
         pool, 0, static_cast<uint32_t>(ysize), ThreadPool::SkipInit(),
         [&](const int task, int /*thread*/) {
           const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
+          const T* JXL_RESTRICT row_in = rect.ConstRow(image, y);
           for (size_t x = 0; x < xsize; ++x) {
             out.Row(xsize - x - 1)[ysize - y - 1] = row_in[x];
           }
@@ -209,7 +210,7 @@ void UndoOrientation(jxl::Orientation undo_orientation, const Plane<T>& image,
         pool, 0, static_cast<uint32_t>(ysize), ThreadPool::SkipInit(),
         [&](const int task, int /*thread*/) {
           const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
+          const T* JXL_RESTRICT row_in = rect.ConstRow(image, y);
           for (size_t x = 0; x < xsize; ++x) {
             out.Row(xsize - x - 1)[y] = row_in[x];
           }
@@ -257,17 +258,18 @@ const size_t kConvertMaxChannels = 4;
 // The input channels are given as a (non-const!) array of channel pointers and
 // interleaved in that order.
 //
+// Only the pixels of the channels in `rect` are converted.
+//
 // Note: if a pointer in channels[] is nullptr, a 1.0 value will be used
 // instead. This is useful for handling when a user requests an alpha channel
 // from an image that doesn't have one. The first channel in the list may not
-// be nullptr, since it is used to determine the image size.
+// be nullptr.
 Status ConvertChannelsToExternal(const ImageF* channels[], size_t num_channels,
-                                 size_t bits_per_sample, bool float_out,
+                                 const Rect& rect, size_t bits_per_sample,
+                                 bool float_out,
                                  JxlEndianness endianness, size_t stride,
                                  jxl::ThreadPool* pool, void* out_image,
-                                 size_t out_size,
-                                 JxlImageOutCallback out_callback,
-                                 void* out_opaque,
+                                 size_t out_size, PixelCallback out_callback,
                                  jxl::Orientation undo_orientation) {
   JXL_DASSERT(num_channels != 0 && num_channels <= kConvertMaxChannels);
   JXL_DASSERT(channels[0] != nullptr);
@@ -275,7 +277,7 @@ Status ConvertChannelsToExternal(const ImageF* channels[], size_t num_channels,
   if (bits_per_sample < 1 || bits_per_sample > 32) {
     return JXL_FAILURE("Invalid bits_per_sample value.");
   }
-  if (!!out_image == !!out_callback) {
+  if (!!out_image == out_callback.IsPresent()) {
     return JXL_FAILURE(
         "Must provide either an out_image or an out_callback, but not both.");
   }
@@ -291,30 +293,35 @@ Status ConvertChannelsToExternal(const ImageF* channels[], size_t num_channels,
   const size_t bytes_per_channel = DivCeil(bits_per_sample, jxl::kBitsPerByte);
   const size_t bytes_per_pixel = num_channels * bytes_per_channel;
 
-  std::vector<std::vector<uint8_t>> row_out_callback;
-  auto InitOutCallback = [&](size_t num_threads) {
-    if (out_callback) {
-      row_out_callback.resize(num_threads);
-      for (size_t i = 0; i < num_threads; ++i) {
-        row_out_callback[i].resize(stride);
-      }
-    }
-  };
-
   // Channels used to store the transformed original channels if needed.
   ImageF temp_channels[kConvertMaxChannels];
+  Rect rect_in = rect;
   if (undo_orientation != Orientation::kIdentity) {
     for (size_t c = 0; c < num_channels; ++c) {
       if (channels[c]) {
-        UndoOrientation(undo_orientation, *channels[c], temp_channels[c], pool);
+        UndoOrientation(undo_orientation, *channels[c], rect,
+                        temp_channels[c], pool);
         channels[c] = &(temp_channels[c]);
       }
     }
+    // First channel may not be nullptr.
+    rect_in = Rect(*channels[0]);
   }
 
-  // First channel may not be nullptr.
-  size_t xsize = channels[0]->xsize();
-  size_t ysize = channels[0]->ysize();
+  size_t xsize = rect_in.xsize();
+  size_t ysize = rect_in.ysize();
+
+  std::vector<std::vector<uint8_t>> row_out_callback;
+  auto InitOutCallback = [&](size_t num_threads) -> Status {
+    if (out_callback.IsPresent()) {
+      row_out_callback.resize(num_threads);
+      for (size_t i = 0; i < num_threads; ++i) {
+        row_out_callback[i].resize(stride);
+      }
+      JXL_RETURN_IF_ERROR(out_callback.Init(num_threads, xsize));
+    }
+    return true;
+  };
 
   if (stride < bytes_per_pixel * xsize) {
     return JXL_FAILURE("stride is smaller than scanline width in bytes: %" PRIuS
@@ -337,23 +344,24 @@ Status ConvertChannelsToExternal(const ImageF* channels[], size_t num_channels,
     }
   }
 
+  bool ok = true;
   if (float_out) {
     if (bits_per_sample == 16) {
       bool swap_endianness = little_endian != IsLittleEndian();
       Plane<hwy::float16_t> f16_cache;
-      RunOnPool(
+      ok = RunOnPool(
           pool, 0, static_cast<uint32_t>(ysize),
           [&](size_t num_threads) {
             f16_cache =
                 Plane<hwy::float16_t>(xsize, num_channels * num_threads);
-            InitOutCallback(num_threads);
-            return true;
+            return InitOutCallback(num_threads);
           },
           [&](const int task, int thread) {
             const int64_t y = task;
             const float* JXL_RESTRICT row_in[kConvertMaxChannels];
             for (size_t c = 0; c < num_channels; c++) {
-              row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
+              row_in[c] =
+                  channels[c] ? rect_in.ConstRow(*channels[c], y) : ones.Row(0);
             }
             hwy::float16_t* JXL_RESTRICT row_f16[kConvertMaxChannels];
             for (size_t c = 0; c < num_channels; c++) {
@@ -362,7 +370,7 @@ Status ConvertChannelsToExternal(const ImageF* channels[], size_t num_channels,
               (row_in[c], row_f16[c], xsize);
             }
             uint8_t* row_out =
-                out_callback
+                out_callback.IsPresent()
                     ? row_out_callback[thread].data()
                     : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
             // interleave the one scanline
@@ -379,35 +387,35 @@ Status ConvertChannelsToExternal(const ImageF* channels[], size_t num_channels,
                 std::swap(row_out[i + 0], row_out[i + 1]);
               }
             }
-            if (out_callback) {
-              (*out_callback)(out_opaque, 0, y, xsize, row_out);
+            if (out_callback.IsPresent()) {
+              out_callback.Run(thread, 0, y, xsize, row_out);
             }
           },
           "ConvertF16");
     } else if (bits_per_sample == 32) {
-      RunOnPool(
+      ok = RunOnPool(
           pool, 0, static_cast<uint32_t>(ysize),
           [&](size_t num_threads) {
-            InitOutCallback(num_threads);
-            return true;
+            return InitOutCallback(num_threads);
           },
           [&](const int task, int thread) {
             const int64_t y = task;
             uint8_t* row_out =
-                out_callback
+                out_callback.IsPresent()
                     ? row_out_callback[thread].data()
                     : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
             const float* JXL_RESTRICT row_in[kConvertMaxChannels];
             for (size_t c = 0; c < num_channels; c++) {
-              row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
+              row_in[c] =
+                  channels[c] ? rect_in.ConstRow(*channels[c], y) : ones.Row(0);
             }
             if (little_endian) {
               StoreFloatRow<StoreLEFloat>(row_in, num_channels, xsize, row_out);
             } else {
               StoreFloatRow<StoreBEFloat>(row_in, num_channels, xsize, row_out);
             }
-            if (out_callback) {
-              (*out_callback)(out_opaque, 0, y, xsize, row_out);
+            if (out_callback.IsPresent()) {
+              out_callback.Run(thread, 0, y, xsize, row_out);
             }
           },
           "ConvertFloat");
@@ -419,22 +427,22 @@ Status ConvertChannelsToExternal(const ImageF* channels[], size_t num_channels,
     // range.
     float mul = (1ull << bits_per_sample) - 1;
     Plane<uint32_t> u32_cache;
-    RunOnPool(
+    ok = RunOnPool(
         pool, 0, static_cast<uint32_t>(ysize),
         [&](size_t num_threads) {
           u32_cache = Plane<uint32_t>(xsize, num_channels * num_threads);
-          InitOutCallback(num_threads);
-          return true;
+          return InitOutCallback(num_threads);
         },
         [&](const int task, int thread) {
           const int64_t y = task;
           uint8_t* row_out =
-              out_callback
+              out_callback.IsPresent()
                   ? row_out_callback[thread].data()
                   : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
           const float* JXL_RESTRICT row_in[kConvertMaxChannels];
           for (size_t c = 0; c < num_channels; c++) {
-            row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
+            row_in[c] =
+                  channels[c] ? rect_in.ConstRow(*channels[c], y) : ones.Row(0);
           }
           uint32_t* JXL_RESTRICT row_u32[kConvertMaxChannels];
           for (size_t c = 0; c < num_channels; c++) {
@@ -461,38 +469,46 @@ Status ConvertChannelsToExternal(const ImageF* channels[], size_t num_channels,
               StoreUintRow<StoreBE32>(row_u32, num_channels, xsize, 4, row_out);
             }
           }
-          if (out_callback) {
-            (*out_callback)(out_opaque, 0, y, xsize, row_out);
+          if (out_callback.IsPresent()) {
+            out_callback.Run(thread, 0, y, xsize, row_out);
           }
         },
         "ConvertUint");
   }
+  out_callback.Destroy();
+  if (!ok) return JXL_FAILURE("Conversion to external format failed");
   return true;
 }
 
 }  // namespace
 
-Status ConvertToExternal(const jxl::ImageBundle& ib, size_t bits_per_sample,
-                         bool float_out, size_t num_channels,
-                         JxlEndianness endianness, size_t stride,
-                         jxl::ThreadPool* pool, void* out_image,
-                         size_t out_size, JxlImageOutCallback out_callback,
-                         void* out_opaque, jxl::Orientation undo_orientation) {
+Status ConvertToExternal(const jxl::ImageBundle& ib, const Rect& rect,
+                         size_t bits_per_sample, bool float_out,
+                         size_t num_channels, JxlEndianness endianness,
+                         size_t stride, jxl::ThreadPool* pool, void* out_image,
+                         size_t out_size, PixelCallback out_callback,
+                         jxl::Orientation undo_orientation) {
   bool want_alpha = num_channels == 2 || num_channels == 4;
   size_t color_channels = num_channels <= 2 ? 1 : 3;
 
   const Image3F* color = &ib.color();
+  const ImageF* alpha = ib.HasAlpha() ? &ib.alpha() : nullptr;
+  Rect rect_in = rect;
   // Undo premultiplied alpha.
   Image3F unpremul;
+  ImageF alpha_copy;
   if (ib.AlphaIsPremultiplied() && ib.HasAlpha()) {
-    unpremul = Image3F(color->xsize(), color->ysize());
-    CopyImageTo(*color, &unpremul);
+    unpremul = Image3F(rect.xsize(), rect.ysize());
+    CopyImageTo(rect, *color, &unpremul);
+    alpha_copy = CopyImage(rect, ib.alpha());
     for (size_t y = 0; y < unpremul.ysize(); y++) {
       UnpremultiplyAlpha(unpremul.PlaneRow(0, y), unpremul.PlaneRow(1, y),
-                         unpremul.PlaneRow(2, y), ib.alpha().Row(y),
+                         unpremul.PlaneRow(2, y), alpha_copy.Row(y),
                          unpremul.xsize());
     }
     color = &unpremul;
+    alpha = &alpha_copy;
+    rect_in = Rect(unpremul);
   }
 
   const ImageF* channels[kConvertMaxChannels];
@@ -501,13 +517,61 @@ Status ConvertToExternal(const jxl::ImageBundle& ib, size_t bits_per_sample,
     channels[c] = &color->Plane(c);
   }
   if (want_alpha) {
-    channels[c++] = ib.HasAlpha() ? &ib.alpha() : nullptr;
+    channels[c++] = alpha;
   }
   JXL_ASSERT(num_channels == c);
 
   return ConvertChannelsToExternal(
-      channels, num_channels, bits_per_sample, float_out, endianness, stride,
-      pool, out_image, out_size, out_callback, out_opaque, undo_orientation);
+      channels, num_channels, rect_in, bits_per_sample, float_out, endianness,
+      stride, pool, out_image, out_size, out_callback, undo_orientation);
+}
+
+Status ConvertToExternal(const jxl::ImageBundle& ib, size_t bits_per_sample,
+                         bool float_out, size_t num_channels,
+                         JxlEndianness endianness, size_t stride,
+                         jxl::ThreadPool* pool, void* out_image,
+                         size_t out_size, PixelCallback out_callback,
+                         jxl::Orientation undo_orientation) {
+  return ConvertToExternal(ib, Rect(ib), bits_per_sample, float_out,
+                           num_channels, endianness, stride, pool, out_image,
+                           out_size, out_callback, undo_orientation);
+}
+
+Status ConvertToExternal(const jxl::ImageBundle& ib, size_t bits_per_sample,
+                         bool float_out, size_t num_channels,
+                         JxlEndianness endianness, size_t stride,
+                         jxl::ThreadPool* pool, void* out_image,
+                         size_t out_size, JxlImageOutCallback out_callback,
+                         void* out_opaque, jxl::Orientation undo_orientation) {
+  return ConvertToExternal(
+      ib, bits_per_sample, float_out, num_channels, endianness, stride, pool,
+      out_image, out_size,
+      out_callback ? PixelCallback(out_callback, out_opaque) : PixelCallback(),
+      undo_orientation);
+}
+
+Status ConvertToExternal(const jxl::ImageF& channel, const Rect& rect,
+                         size_t bits_per_sample, bool float_out,
+                         JxlEndianness endianness, size_t stride,
+                         jxl::ThreadPool* pool, void* out_image,
+                         size_t out_size, PixelCallback out_callback,
+                         jxl::Orientation undo_orientation) {
+  const ImageF* channels[1];
+  channels[0] = &channel;
+  return ConvertChannelsToExternal(channels, 1, rect, bits_per_sample,
+                                   float_out, endianness, stride, pool,
+                                   out_image, out_size, out_callback,
+                                   undo_orientation);
+}
+
+Status ConvertToExternal(const jxl::ImageF& channel, size_t bits_per_sample,
+                         bool float_out, JxlEndianness endianness,
+                         size_t stride, jxl::ThreadPool* pool, void* out_image,
+                         size_t out_size, PixelCallback out_callback,
+                         jxl::Orientation undo_orientation) {
+  return ConvertToExternal(channel, Rect(channel), bits_per_sample, float_out,
+                           endianness, stride, pool, out_image, out_size,
+                           out_callback, undo_orientation);
 }
 
 Status ConvertToExternal(const jxl::ImageF& channel, size_t bits_per_sample,
@@ -515,11 +579,11 @@ Status ConvertToExternal(const jxl::ImageF& channel, size_t bits_per_sample,
                          size_t stride, jxl::ThreadPool* pool, void* out_image,
                          size_t out_size, JxlImageOutCallback out_callback,
                          void* out_opaque, jxl::Orientation undo_orientation) {
-  const ImageF* channels[1];
-  channels[0] = &channel;
-  return ConvertChannelsToExternal(
-      channels, 1, bits_per_sample, float_out, endianness, stride, pool,
-      out_image, out_size, out_callback, out_opaque, undo_orientation);
+  return ConvertToExternal(
+      channel, bits_per_sample, float_out, endianness, stride, pool, out_image,
+      out_size,
+      out_callback ? PixelCallback(out_callback, out_opaque) : PixelCallback(),
+      undo_orientation);
 }
 
 }  // namespace jxl
@@ -20,6 +20,61 @@
 
 namespace jxl {
 
+// Pixel output callback of the decoder API: either a JxlImageOutCallback, or a
+// JxlImageOutRunCallback with per-thread state created by an init callback.
+class PixelCallback {
+ public:
+  PixelCallback() = default;
+  PixelCallback(JxlImageOutCallback callback, void* opaque)
+      : callback_(callback), opaque_(opaque) {}
+  PixelCallback(JxlImageOutInitCallback init, JxlImageOutRunCallback run,
+                JxlImageOutDestroyCallback destroy, void* init_opaque)
+      : init_(init), run_(run), destroy_(destroy), opaque_(init_opaque) {}
+
+  bool IsPresent() const { return callback_ != nullptr || run_ != nullptr; }
+  bool IsInitialized() const { return initialized_; }
+
+  // Must be called before Run, with an upper bound of the thread indices and
+  // of the number of pixels per Run call.
+  Status Init(size_t num_threads, size_t num_pixels) {
+    JXL_ASSERT(!initialized_);
+    if (init_ != nullptr) {
+      run_opaque_ = init_(opaque_, num_threads, num_pixels);
+      if (run_opaque_ == nullptr) {
+        return JXL_FAILURE("Pixel callback initialization failed");
+      }
+    }
+    initialized_ = true;
+    return true;
+  }
+
+  void Run(size_t thread, size_t x, size_t y, size_t num_pixels,
+           const void* pixels) const {
+    JXL_DASSERT(initialized_);
+    if (callback_ != nullptr) {
+      callback_(opaque_, x, y, num_pixels, pixels);
+    } else {
+      run_(run_opaque_, thread, x, y, num_pixels, pixels);
+    }
+  }
+
+  // Releases the state created by Init, if any.
+  void Destroy() {
+    if (initialized_ && destroy_ != nullptr) destroy_(run_opaque_);
+    run_opaque_ = nullptr;
+    initialized_ = false;
+  }
+
+ private:
+  JxlImageOutCallback callback_ = nullptr;
+  JxlImageOutInitCallback init_ = nullptr;
+  JxlImageOutRunCallback run_ = nullptr;
+  JxlImageOutDestroyCallback destroy_ = nullptr;
+  void* opaque_ = nullptr;
+  void* run_opaque_ = nullptr;
+  bool initialized_ = false;
+};
+
 // Converts ib to interleaved void* pixel buffer with the given format.
 // bits_per_sample: must be 8, 16 or 32, and must be 32 if float_out
 // is true. 1 and 32 int are not yet implemented.
@@ -27,7 +82,6 @@ namespace jxl {
 // This supports the features needed for the C API and does not perform
 // color space conversion.
 // TODO(lode): support 1-bit output (bits_per_sample == 1)
-// TODO(lode): support rectangle crop.
 // stride_out is output scanline size in bytes, must be >=
 // output_xsize * output_bytes_per_pixel.
 // undo_orientation is an EXIF orientation to undo. Depending on the
@@ -40,6 +94,15 @@ Status ConvertToExternal(const jxl::ImageBundle& ib, size_t bits_per_sample,
                          size_t out_size, JxlImageOutCallback out_callback,
                          void* out_opaque, jxl::Orientation undo_orientation);
 
+// Same as above, with a PixelCallback instead of a JxlImageOutCallback. The
+// callback, if present, is initialized and destroyed by this function.
+Status ConvertToExternal(const jxl::ImageBundle& ib, size_t bits_per_sample,
+                         bool float_out, size_t num_channels,
+                         JxlEndianness endianness, size_t stride_out,
+                         jxl::ThreadPool* thread_pool, void* out_image,
+                         size_t out_size, PixelCallback out_callback,
+                         jxl::Orientation undo_orientation);
+
 // Converts single-channel image to interleaved void* pixel buffer with the
 // given format, with a single channel.
 // bits_per_sample: must be 8, 16 or 32, and must be 32 if float_out
@@ -50,12 +113,37 @@ Status ConvertToExternal(const jxl::ImageBundle& ib, size_t bits_per_sample,
 // undo_orientation is an EXIF orientation to undo. Depending on the
 // orientation, the output xsize and ysize are swapped compared to input
 // xsize and ysize.
+// Same as above, but only converts the pixels of `ib` in `rect`.
+Status ConvertToExternal(const jxl::ImageBundle& ib, const jxl::Rect& rect,
+                         size_t bits_per_sample, bool float_out,
+                         size_t num_channels, JxlEndianness endianness,
+                         size_t stride_out, jxl::ThreadPool* thread_pool,
+                         void* out_image, size_t out_size,
+                         PixelCallback out_callback,
+                         jxl::Orientation undo_orientation);
+
 Status ConvertToExternal(const jxl::ImageF& channel, size_t bits_per_sample,
                          bool float_out, JxlEndianness endianness,
                          size_t stride_out, jxl::ThreadPool* thread_pool,
                          void* out_image, size_t out_size,
                          JxlImageOutCallback out_callback, void* out_opaque,
                          jxl::Orientation undo_orientation);
+
+// Same as above, with a PixelCallback instead of a JxlImageOutCallback.
+Status ConvertToExternal(const jxl::ImageF& channel, size_t bits_per_sample,
+                         bool float_out, JxlEndianness endianness,
+                         size_t stride_out, jxl::ThreadPool* thread_pool,
+                         void* out_image, size_t out_size,
+                         PixelCallback out_callback,
+                         jxl::Orientation undo_orientation);
+
+// Same as above, but only converts the pixels of `channel` in `rect`.
+Status ConvertToExternal(const jxl::ImageF& channel, const jxl::Rect& rect,
+                         size_t bits_per_sample, bool float_out,
+                         JxlEndianness endianness, size_t stride_out,
+                         jxl::ThreadPool* thread_pool, void* out_image,
+                         size_t out_size, PixelCallback out_callback,
+                         jxl::Orientation undo_orientation);
 }  // namespace jxl
 
 #endif  // LIB_JXL_DEC_EXTERNAL_IMAGE_H_
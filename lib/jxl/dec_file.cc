@@ -7,6 +7,9 @@
 
 #include <stddef.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <utility>
 #include <vector>
 
@@ -17,7 +20,9 @@
 #include "lib/jxl/color_management.h"
 #include "lib/jxl/common.h"
 #include "lib/jxl/dec_bit_reader.h"
+#include "lib/jxl/dec_cache.h"
 #include "lib/jxl/dec_frame.h"
+#include "lib/jxl/dec_reconstruct.h"
 #include "lib/jxl/frame_header.h"
 #include "lib/jxl/headers.h"
 #include "lib/jxl/icc_codec.h"
@@ -39,6 +44,146 @@ Status DecodeHeaders(BitReader* reader, CodecInOut* io) {
   return true;
 }
 
+// Maximum number of frames that are decoded concurrently. Their decoded, but
+// not yet blended, pixels are kept in memory until all of them are done.
+constexpr size_t kMaxConcurrentFrames = 16;
+
+// Whether the frame can be decoded independently of all other frames, i.e.
+// without patches or DC frames, and is not needed by later frames. Such a
+// frame only depends on the previous frames when it is blended.
+bool CanDecodeConcurrently(const FrameHeader& header) {
+  if (header.frame_type != FrameType::kRegularFrame &&
+      header.frame_type != FrameType::kSkipProgressive) {
+    return false;
+  }
+  if (header.CanBeReferenced()) return false;
+  return (header.flags & (FrameHeader::kPatches | FrameHeader::kUseDcFrame)) ==
+         0;
+}
+
+// Decodes the frames of a multi-frame image starting at the position of
+// `reader`, which must be at a byte boundary, and adds the displayed frames to
+// `io`. Runs of frames that can be decoded independently are decoded
+// concurrently, one frame per thread of `pool`, and are blended in order
+// afterwards; the other frames are decoded one at a time with `dec_state`,
+// spreading their groups over the threads.
+Status DecodeFramesConcurrently(const DecompressParams& dparams,
+                                const Span<const uint8_t> file,
+                                BitReader* JXL_RESTRICT reader,
+                                PassesDecoderState* dec_state, ThreadPool* pool,
+                                CodecInOut* JXL_RESTRICT io) {
+  const size_t start = reader->TotalBitsConsumed() / kBitsPerByte;
+  std::vector<FrameHeader> headers;
+  std::vector<size_t> frame_begin(1, start);
+  do {
+    headers.emplace_back(&io->metadata);
+    size_t end;
+    JXL_RETURN_IF_ERROR(
+        ScanFrame(file, frame_begin.back(), &headers.back(), &end));
+    frame_begin.push_back(end);
+  } while (!headers.back().is_last);
+  const size_t num_frames = headers.size();
+
+  const auto frame_span = [&](size_t i) {
+    return Span<const uint8_t>(file.data() + frame_begin[i],
+                               frame_begin[i + 1] - frame_begin[i]);
+  };
+  const auto add_frame = [&](ImageBundle* frame, const FrameHeader& header) {
+    if (header.frame_type != FrameType::kRegularFrame &&
+        header.frame_type != FrameType::kSkipProgressive) {
+      return;
+    }
+    io->dec_pixels += frame->xsize() * frame->ysize();
+    io->frames.push_back(std::move(*frame));
+  };
+
+  for (size_t i = 0; i < num_frames;) {
+    if (!CanDecodeConcurrently(headers[i])) {
+      ImageBundle frame(&io->metadata.m);
+      Status ret = true;
+      {
+        BitReader frame_reader(frame_span(i));
+        BitReaderScopedCloser frame_reader_closer(&frame_reader, &ret);
+        JXL_RETURN_IF_ERROR(DecodeFrame(dparams, dec_state, pool,
+                                        &frame_reader, &frame, io->metadata,
+                                        &io->constraints));
+      }
+      JXL_RETURN_IF_ERROR(ret);
+      add_frame(&frame, headers[i]);
+      i++;
+      continue;
+    }
+
+    size_t batch_end = i + 1;
+    while (batch_end < num_frames && batch_end - i < kMaxConcurrentFrames &&
+           CanDecodeConcurrently(headers[batch_end])) {
+      batch_end++;
+    }
+    const size_t batch_size = batch_end - i;
+    io->dec_max_concurrent_frames =
+        std::max(io->dec_max_concurrent_frames, batch_size);
+
+    // Each frame gets its own decoder state, continuing the sequence of noise
+    // seeds as if the frames were decoded one after the other.
+    std::vector<std::unique_ptr<PassesDecoderState>> states(batch_size);
+    for (size_t j = 0; j < batch_size; j++) {
+      states[j] = make_unique<PassesDecoderState>();
+      JXL_RETURN_IF_ERROR(states[j]->output_encoding_info.Set(
+          io->metadata, dec_state->output_encoding_info.color_encoding));
+      states[j]->noise_seed = dec_state->noise_seed;
+      if (headers[i + j].flags & FrameHeader::kNoise) {
+        dec_state->noise_seed +=
+            headers[i + j].ToFrameDimensions().num_groups;
+      }
+    }
+
+    std::vector<ImageBundle> frames;
+    frames.reserve(batch_size);
+    for (size_t j = 0; j < batch_size; j++) {
+      frames.emplace_back(&io->metadata.m);
+    }
+    std::atomic<bool> has_error{false};
+    RunOnPool(
+        pool, 0, batch_size, ThreadPool::SkipInit(),
+        [&](size_t j, size_t /*thread*/) {
+          Status ret = true;
+          {
+            BitReader frame_reader(frame_span(i + j));
+            BitReaderScopedCloser frame_reader_closer(&frame_reader, &ret);
+            if (!DecodeFrame(dparams, states[j].get(), /*pool=*/nullptr,
+                             &frame_reader, &frames[j], io->metadata,
+                             &io->constraints, /*is_preview=*/false,
+                             /*coalescing=*/false)) {
+              has_error = true;
+            }
+          }
+          if (!ret) has_error = true;
+        },
+        "DecodeFrames");
+    if (has_error) {
+      return JXL_FAILURE("Decoding frames failed");
+    }
+
+    // Blend the frames in order, on top of the reference frames of the
+    // sequential decoder state.
+    for (size_t j = 0; j < batch_size; j++) {
+      for (size_t r = 0; r < 4; r++) {
+        states[j]->shared_storage.reference_frames[r].frame =
+            dec_state->shared_storage.reference_frames[r].frame;
+        states[j]->shared_storage.reference_frames[r].ib_is_in_xyb =
+            dec_state->shared_storage.reference_frames[r].ib_is_in_xyb;
+      }
+      JXL_RETURN_IF_ERROR(BlendFrame(&frames[j], states[j].get(), pool));
+      add_frame(&frames[j], headers[i + j]);
+      states[j].reset();
+    }
+    i = batch_end;
+  }
+
+  reader->SkipBits((frame_begin.back() - start) * kBitsPerByte);
+  return true;
+}
+
 }  // namespace
 
 Status DecodePreview(const DecompressParams& dparams,
@@ -140,36 +285,50 @@ Status DecodeFile(const DecompressParams& dparams,
         ColorEncoding::LinearSRGB(io->metadata.m.color_encoding.IsGray())));
 
     io->frames.clear();
-    Status dec_ok(false);
-    do {
-      io->frames.emplace_back(&io->metadata.m);
-      if (jpeg_data) {
-        io->frames.back().jpeg_data = std::move(jpeg_data);
-      }
-      // Skip frames that are not displayed.
-      bool found_displayed_frame = true;
+    // Independent animation frames can be decoded concurrently when all of
+    // the codestream is available. Spot colors are rendered on the frames
+    // after blending, which is not supported there.
+    const bool decode_concurrently =
+        pool != nullptr && io->metadata.m.have_animation && !jpeg_data &&
+        !dparams.allow_partial_files &&
+        !(dparams.render_spotcolors &&
+          io->metadata.m.Find(ExtraChannel::kSpotColor));
+    if (decode_concurrently) {
+      JXL_RETURN_IF_ERROR(DecodeFramesConcurrently(dparams, file, &reader,
+                                                   &dec_state, pool, io));
+    } else {
+      Status dec_ok(false);
       do {
-        dec_ok =
-            DecodeFrame(dparams, &dec_state, pool, &reader, &io->frames.back(),
-                        io->metadata, &io->constraints);
-        if (!dparams.allow_partial_files) {
-          JXL_RETURN_IF_ERROR(dec_ok);
-        } else if (!dec_ok) {
-          io->frames.pop_back();
-          found_displayed_frame = false;
-          break;
+        io->frames.emplace_back(&io->metadata.m);
+        if (jpeg_data) {
+          io->frames.back().jpeg_data = std::move(jpeg_data);
         }
-      } while (dec_state.shared->frame_header.frame_type !=
-                   FrameType::kRegularFrame &&
-               dec_state.shared->frame_header.frame_type !=
-                   FrameType::kSkipProgressive);
-      if (found_displayed_frame) {
-        // if found_displayed_frame is true io->frames shouldn't be empty
-        // because we added a frame before the loop.
-        JXL_ASSERT(!io->frames.empty());
-        io->dec_pixels += io->frames.back().xsize() * io->frames.back().ysize();
-      }
-    } while (!dec_state.shared->frame_header.is_last && dec_ok);
+        // Skip frames that are not displayed.
+        bool found_displayed_frame = true;
+        do {
+          dec_ok = DecodeFrame(dparams, &dec_state, pool, &reader,
+                               &io->frames.back(), io->metadata,
+                               &io->constraints);
+          if (!dparams.allow_partial_files) {
+            JXL_RETURN_IF_ERROR(dec_ok);
+          } else if (!dec_ok) {
+            io->frames.pop_back();
+            found_displayed_frame = false;
+            break;
+          }
+        } while (dec_state.shared->frame_header.frame_type !=
+                     FrameType::kRegularFrame &&
+                 dec_state.shared->frame_header.frame_type !=
+                     FrameType::kSkipProgressive);
+        if (found_displayed_frame) {
+          // if found_displayed_frame is true io->frames shouldn't be empty
+          // because we added a frame before the loop.
+          JXL_ASSERT(!io->frames.empty());
+          io->dec_pixels +=
+              io->frames.back().xsize() * io->frames.back().ysize();
+        }
+      } while (!dec_state.shared->frame_header.is_last && dec_ok);
+    }
 
     if (io->frames.empty()) return JXL_FAILURE("Not enough data.");
 
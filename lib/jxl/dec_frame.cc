@@ -11,6 +11,7 @@
 #include <algorithm>
 #include <atomic>
 #include <hwy/aligned_allocator.h>
+#include <limits>
 #include <numeric>
 #include <utility>
 #include <vector>
@@ -114,6 +115,26 @@ Status SkipFrame(const CodecMetadata& metadata, BitReader* JXL_RESTRICT reader,
   return true;
 }
 
+Status ScanFrame(Span<const uint8_t> data, size_t begin,
+                 FrameHeader* JXL_RESTRICT header, size_t* end) {
+  if (begin >= data.size()) return JXL_FAILURE("Not enough data.");
+  const Span<const uint8_t> frame(data.data() + begin, data.size() - begin);
+  Status ret = true;
+  {
+    BitReader reader(frame);
+    BitReaderScopedCloser reader_closer(&reader, &ret);
+    JXL_RETURN_IF_ERROR(DecodeFrameHeader(&reader, header));
+  }
+  JXL_RETURN_IF_ERROR(ret);
+  {
+    BitReader reader(frame);
+    BitReaderScopedCloser reader_closer(&reader, &ret);
+    JXL_RETURN_IF_ERROR(SkipFrame(*header->nonserialized_metadata, &reader));
+    *end = begin + DivCeil(reader.TotalBitsConsumed(), kBitsPerByte);
+  }
+  return ret;
+}
+
 static BitReader* GetReaderForSection(
     size_t num_groups, size_t num_passes, size_t group_codes_begin,
     const std::vector<uint64_t>& group_offsets,
@@ -136,16 +157,38 @@ static BitReader* GetReaderForSection(
   return store;
 }
 
+size_t NumPassesForDownsampling(const FrameHeader& frame_header,
+                                size_t max_downsampling) {
+  // Do not use downsampling for kReferenceOnly frames.
+  if (frame_header.frame_type == FrameType::kReferenceOnly) {
+    return frame_header.passes.num_passes;
+  }
+  max_downsampling =
+      std::max(max_downsampling >> (frame_header.dc_level * 3), size_t(1));
+  // TODO(veluca): deal with downsamplings >= 8.
+  if (max_downsampling >= 8) return 0;
+  size_t max_passes = frame_header.passes.num_passes;
+  for (uint32_t i = 0; i < frame_header.passes.num_downsample; ++i) {
+    if (max_downsampling >= frame_header.passes.downsample[i] &&
+        max_passes > frame_header.passes.last_pass[i]) {
+      max_passes = frame_header.passes.last_pass[i] + 1;
+    }
+  }
+  return max_passes;
+}
+
 Status DecodeFrame(const DecompressParams& dparams,
                    PassesDecoderState* dec_state, ThreadPool* JXL_RESTRICT pool,
                    BitReader* JXL_RESTRICT reader, ImageBundle* decoded,
                    const CodecMetadata& metadata,
-                   const SizeConstraints* constraints, bool is_preview) {
+                   const SizeConstraints* constraints, bool is_preview,
+                   bool coalescing) {
   PROFILER_ZONE("DecodeFrame uninstrumented");
 
   FrameDecoder frame_decoder(dec_state, metadata, pool);
 
   frame_decoder.SetFrameSizeLimits(constraints);
+  frame_decoder.SetCoalescing(coalescing);
 
   JXL_RETURN_IF_ERROR(frame_decoder.InitFrame(
       reader, decoded, is_preview, dparams.allow_partial_files,
@@ -155,25 +198,12 @@ Status DecodeFrame(const DecompressParams& dparams,
   // Handling of progressive decoding.
   {
     const FrameHeader& frame_header = frame_decoder.GetFrameHeader();
-    size_t max_passes = dparams.max_passes;
-    size_t max_downsampling = std::max(
-        dparams.max_downsampling >> (frame_header.dc_level * 3), size_t(1));
-    // TODO(veluca): deal with downsamplings >= 8.
-    if (max_downsampling >= 8) {
-      max_passes = 0;
-    } else {
-      for (uint32_t i = 0; i < frame_header.passes.num_downsample; ++i) {
-        if (max_downsampling >= frame_header.passes.downsample[i] &&
-            max_passes > frame_header.passes.last_pass[i]) {
-          max_passes = frame_header.passes.last_pass[i] + 1;
-        }
-      }
-    }
+    size_t max_passes =
+        NumPassesForDownsampling(frame_header, dparams.max_downsampling);
     // Do not use downsampling for kReferenceOnly frames.
-    if (frame_header.frame_type == FrameType::kReferenceOnly) {
-      max_passes = frame_header.passes.num_passes;
+    if (frame_header.frame_type != FrameType::kReferenceOnly) {
+      max_passes = std::min<size_t>(max_passes, dparams.max_passes);
     }
-    max_passes = std::min<size_t>(max_passes, frame_header.passes.num_passes);
     frame_decoder.SetMaxPasses(max_passes);
   }
   frame_decoder.SetRenderSpotcolors(dparams.render_spotcolors);
@@ -272,6 +302,10 @@ Status FrameDecoder::InitFrame(BitReader* JXL_RESTRICT br, ImageBundle* decoded,
                                            num_passes, has_ac_global);
   JXL_RETURN_IF_ERROR(ReadGroupOffsets(toc_entries, br, &section_offsets_,
                                        &section_sizes_, &groups_total_size));
+  skipped_section_.clear();
+  skipped_section_.resize(section_offsets_.size());
+  num_skipped_sections_ = 0;
+  render_dc_only_ = false;
 
   JXL_DASSERT((br->TotalBitsConsumed() % kBitsPerByte) == 0);
   const size_t group_codes_begin = br->TotalBitsConsumed() / kBitsPerByte;
@@ -326,6 +360,15 @@ Status FrameDecoder::InitFrame(BitReader* JXL_RESTRICT br, ImageBundle* decoded,
     }
   }
 
+  // Fail early if even the lowest-memory way of decoding the frame does not
+  // fit in the memory limit.
+  if (memory_limit_ != 0 &&
+      EstimatedMemoryUsage(
+          /*full_frame_color=*/!CanDoLowMemoryPath(/*undo_orientation=*/false),
+          /*num_threads=*/1) > memory_limit_) {
+    return JXL_FAILURE("Decoding the frame needs more memory than allowed");
+  }
+
   // Clear the state.
   decoded_dc_global_ = false;
   decoded_ac_global_ = false;
@@ -335,14 +378,164 @@ Status FrameDecoder::InitFrame(BitReader* JXL_RESTRICT br, ImageBundle* decoded,
   decoded_dc_groups_.resize(frame_dim_.num_dc_groups);
   decoded_passes_per_ac_group_.clear();
   decoded_passes_per_ac_group_.resize(frame_dim_.num_groups, 0);
+  flushed_passes_per_ac_group_.clear();
+  flushed_ac_global_ = false;
   processed_section_.clear();
   processed_section_.resize(section_offsets_.size());
   max_passes_ = frame_header_.passes.num_passes;
+  // Modular data (also used for extra channels) has no lower resolution image
+  // unless it is squeezed, which is not known yet, so only VarDCT frames
+  // without extra channels can skip passes.
+  if (frame_header_.encoding == FrameEncoding::kVarDCT &&
+      frame_header_.nonserialized_metadata->m.num_extra_channels == 0) {
+    max_passes_ = NumPassesForDownsampling(frame_header_, downsampling_);
+  }
   num_renders_ = 0;
   allocated_ = false;
+  SkipSectionsOutsideCrop();
+  SkipSectionsForDownsampling();
   return true;
 }
 
+void FrameDecoder::SkipSectionsForDownsampling() {
+  if (section_offsets_.size() == 1) return;
+  const size_t ac_global_index = frame_dim_.num_dc_groups + 1;
+  for (size_t pass = max_passes_; pass < frame_header_.passes.num_passes;
+       pass++) {
+    for (size_t g = 0; g < frame_dim_.num_groups; g++) {
+      SkipSection(ac_global_index + 1 + pass * frame_dim_.num_groups + g);
+    }
+  }
+  if (!CanRenderFromDC()) return;
+  render_dc_only_ = true;
+  SkipSection(ac_global_index);
+}
+
+bool FrameDecoder::CanRenderFromDC() const {
+  if (downsampling_ < 8 || section_offsets_.size() == 1) return false;
+  // The DC image of the frame must be the 1:8 image, without any feature that
+  // is rendered at full resolution or blended.
+  if (frame_header_.encoding != FrameEncoding::kVarDCT ||
+      frame_header_.nonserialized_is_preview ||
+      (frame_header_.frame_type != FrameType::kRegularFrame &&
+       frame_header_.frame_type != FrameType::kSkipProgressive) ||
+      frame_header_.CanBeReferenced() || decoded_->IsJPEG() ||
+      frame_header_.upsampling != 1 ||
+      !frame_header_.chroma_subsampling.Is444() ||
+      frame_header_.custom_size_or_origin ||
+      frame_header_.blending_info.mode != BlendMode::kReplace ||
+      (frame_header_.flags & (FrameHeader::kPatches | FrameHeader::kSplines))) {
+    return false;
+  }
+  return frame_header_.nonserialized_metadata->m.num_extra_channels == 0;
+}
+
+Status FrameDecoder::RenderFromDC() {
+  PROFILER_FUNC;
+  const Image3F& dc = *dec_state_->shared->dc;
+  Image3F rendered(dc.xsize(), dc.ysize());
+  if (frame_header_.color_transform == ColorTransform::kXYB) {
+    UndoXYB(dc, &rendered, dec_state_->output_encoding_info, pool_);
+  } else if (frame_header_.color_transform == ColorTransform::kYCbCr) {
+    YcbcrToRgb(dc, &rendered, Rect(dc));
+  } else {
+    CopyImageTo(dc, &rendered);
+  }
+  rendered.ShrinkTo(frame_dim_.xsize_blocks, frame_dim_.ysize_blocks);
+  decoded_->SetFromImage(std::move(rendered),
+                         dec_state_->output_encoding_info.color_encoding);
+  num_renders_++;
+  return true;
+}
+
+void FrameDecoder::SkipSectionsOutsideCrop() {
+  if (crop_region_.xsize() == 0 || crop_region_.ysize() == 0) return;
+  if (section_offsets_.size() == 1) return;
+  // Referenced frames must be complete, and only VarDCT frames without extra
+  // channels have groups whose data is spatially local: global modular
+  // transforms may spread the data of any pixel over all the groups.
+  if (frame_header_.nonserialized_is_preview ||
+      (frame_header_.frame_type != FrameType::kRegularFrame &&
+       frame_header_.frame_type != FrameType::kSkipProgressive) ||
+      frame_header_.CanBeReferenced() || decoded_->IsJPEG() ||
+      !dec_state_->EagerFinalizeImageRect()) {
+    return;
+  }
+
+  // Crop region in the coordinates of the frame, before upsampling.
+  const int64_t origin_x =
+      frame_header_.custom_size_or_origin ? frame_header_.frame_origin.x0 : 0;
+  const int64_t origin_y =
+      frame_header_.custom_size_or_origin ? frame_header_.frame_origin.y0 : 0;
+  const int64_t upsampling = frame_header_.upsampling;
+  const int64_t x0 = std::max<int64_t>(crop_region_.x0() - origin_x, 0);
+  const int64_t y0 = std::max<int64_t>(crop_region_.y0() - origin_y, 0);
+  const int64_t x1 = std::min<int64_t>(
+      crop_region_.x0() + crop_region_.xsize() - origin_x,
+      frame_dim_.xsize_upsampled);
+  const int64_t y1 = std::min<int64_t>(
+      crop_region_.y0() + crop_region_.ysize() - origin_y,
+      frame_dim_.ysize_upsampled);
+  // Frames that do not intersect the crop region are decoded in full.
+  if (x1 <= x0 || y1 <= y0) return;
+  const size_t fx0 = x0 / upsampling;
+  const size_t fy0 = y0 / upsampling;
+  const size_t fx1 = DivCeil(x1, upsampling);
+  const size_t fy1 = DivCeil(y1, upsampling);
+  dec_state_->render_rect = Rect(fx0, fy0, fx1 - fx0, fy1 - fy0);
+
+  // The filters read up to kMaxFinalizeRectPadding pixels around each rendered
+  // pixel; adaptive DC smoothing reads one more block of DC.
+  constexpr size_t kCropPadding = RoundUpToBlockDim(kMaxFinalizeRectPadding);
+  const size_t group_dim = frame_dim_.group_dim;
+  const size_t gx0 = fx0 >= kCropPadding ? (fx0 - kCropPadding) / group_dim : 0;
+  const size_t gy0 = fy0 >= kCropPadding ? (fy0 - kCropPadding) / group_dim : 0;
+  const size_t gx1 =
+      std::min(DivCeil(fx1 + kCropPadding, group_dim), frame_dim_.xsize_groups);
+  const size_t gy1 =
+      std::min(DivCeil(fy1 + kCropPadding, group_dim), frame_dim_.ysize_groups);
+  const size_t bx0 = gx0 * group_dim >= kBlockDim
+                         ? (gx0 * group_dim - kBlockDim) / frame_dim_.dc_group_dim
+                         : 0;
+  const size_t by0 = gy0 * group_dim >= kBlockDim
+                         ? (gy0 * group_dim - kBlockDim) / frame_dim_.dc_group_dim
+                         : 0;
+  const size_t bx1 =
+      std::min(DivCeil(gx1 * group_dim + kBlockDim, frame_dim_.dc_group_dim),
+               frame_dim_.xsize_dc_groups);
+  const size_t by1 =
+      std::min(DivCeil(gy1 * group_dim + kBlockDim, frame_dim_.dc_group_dim),
+               frame_dim_.ysize_dc_groups);
+
+  for (size_t g = 0; g < frame_dim_.num_dc_groups; g++) {
+    const size_t gx = g % frame_dim_.xsize_dc_groups;
+    const size_t gy = g / frame_dim_.xsize_dc_groups;
+    if (gx >= bx0 && gx < bx1 && gy >= by0 && gy < by1) continue;
+    decoded_dc_groups_[g] = true;
+    processed_section_[1 + g] = true;
+    SkipSection(1 + g);
+  }
+  const size_t num_passes = frame_header_.passes.num_passes;
+  const size_t ac_group_begin = frame_dim_.num_dc_groups + 2;
+  for (size_t g = 0; g < frame_dim_.num_groups; g++) {
+    const size_t gx = g % frame_dim_.xsize_groups;
+    const size_t gy = g / frame_dim_.xsize_groups;
+    if (gx >= gx0 && gx < gx1 && gy >= gy0 && gy < gy1) continue;
+    decoded_passes_per_ac_group_[g] = num_passes;
+    for (size_t i = 0; i < num_passes; i++) {
+      const size_t id = ac_group_begin + i * frame_dim_.num_groups + g;
+      processed_section_[id] = true;
+      SkipSection(id);
+    }
+    // The group counts as done for the purpose of finalizing the borders of
+    // its neighbours; its own pixels are never rendered.
+    Rect rects_to_finalize[GroupBorderAssigner::kMaxToFinalize];
+    size_t num_rects = 0;
+    dec_state_->group_border_assigner.GroupDone(
+        g, dec_state_->FinalizeRectPadding(), rects_to_finalize, &num_rects);
+  }
+}
+
 Status FrameDecoder::ProcessDCGlobal(BitReader* br) {
   PROFILER_FUNC;
   PassesSharedState& shared = dec_state_->shared_storage;
@@ -431,10 +624,25 @@ void FrameDecoder::FinalizeDC() {
   finalized_dc_ = true;
 }
 
-void FrameDecoder::AllocateOutput() {
-  if (allocated_) return;
+Status FrameDecoder::AllocateOutput() {
+  if (allocated_ || render_dc_only_) return true;
   const CodecMetadata& metadata = *frame_header_.nonserialized_metadata;
-  if (dec_state_->rgb_output == nullptr && !dec_state_->pixel_callback) {
+  const bool full_frame_color =
+      dec_state_->rgb_output == nullptr && !dec_state_->pixel_callback;
+  if (memory_limit_ != 0 &&
+      EstimatedMemoryUsage(full_frame_color, NumThreads(pool_)) >
+          memory_limit_) {
+    if (EstimatedMemoryUsage(full_frame_color, 1) > memory_limit_) {
+      return JXL_FAILURE("Decoding the frame needs more memory than allowed");
+    }
+    // Only keep the buffers of a single group.
+    pool_ = nullptr;
+  }
+  // Buffers kept from earlier frames for threads that this frame does not use
+  // are freed, as EstimatedMemoryUsage does not count them.
+  dec_state_->scratch.Shrink(NumThreads(pool_),
+                             metadata.m.num_extra_channels);
+  if (full_frame_color) {
     modular_frame_decoder_.MaybeDropFullImage();
     decoded_->SetFromImage(Image3F(frame_dim_.xsize_upsampled_padded,
                                    frame_dim_.ysize_upsampled_padded),
@@ -468,6 +676,70 @@ void FrameDecoder::AllocateOutput() {
   decoded_->origin = dec_state_->shared->frame_header.frame_origin;
   dec_state_->InitForAC(nullptr);
   allocated_ = true;
+  return true;
+}
+
+uint64_t FrameDecoder::EstimatedMemoryUsage(bool full_frame_color,
+                                            size_t num_threads) const {
+  const CodecMetadata& metadata = *frame_header_.nonserialized_metadata;
+  constexpr uint64_t kMax = std::numeric_limits<uint64_t>::max();
+  uint64_t bytes = 0;
+  // Adds `count` elements of `size` bytes, saturating on overflow.
+  const auto add = [&bytes](uint64_t count, uint64_t size) {
+    if (size != 0 && count > (kMax - bytes) / size) {
+      bytes = kMax;
+    } else {
+      bytes += count * size;
+    }
+  };
+  const uint64_t xsize = frame_dim_.xsize_upsampled_padded;
+  const uint64_t ysize = frame_dim_.ysize_upsampled_padded;
+  const size_t num_ec = metadata.m.num_extra_channels;
+  // Full-frame color and extra channels; frames that can be referenced are
+  // also stored for later frames.
+  const size_t num_saved = frame_header_.CanBeReferenced() ? 1 : 0;
+  add(xsize * ysize,
+      3 * sizeof(float) * ((full_frame_color ? 1 : 0) + num_saved));
+  for (size_t i = 0; i < num_ec; i++) {
+    const size_t ecups = frame_header_.extra_channel_upsampling[i];
+    add(DivCeil(xsize, ecups) * DivCeil(ysize, ecups),
+        sizeof(float) * (1 + num_saved));
+  }
+  // Modular image: the extra channels, and the color of Modular frames.
+  const size_t num_modular_channels =
+      num_ec + (frame_header_.encoding == FrameEncoding::kModular ? 3 : 0);
+  add(frame_dim_.xsize_padded * frame_dim_.ysize_padded,
+      sizeof(pixel_type) * num_modular_channels);
+  if (frame_header_.encoding == FrameEncoding::kVarDCT) {
+    const uint64_t num_blocks =
+        frame_dim_.xsize_blocks * frame_dim_.ysize_blocks;
+    // DC, quantization field, AC strategy and filter parameters.
+    add(num_blocks, 32);
+    // AC coefficients accumulated across passes.
+    if (frame_header_.passes.num_passes > 1) {
+      add(num_blocks * kDCTBlockSize, 3 * sizeof(int32_t));
+    }
+    if (decoded_->IsJPEG()) {
+      add(num_blocks * kDCTBlockSize, 3 * sizeof(int16_t));
+    }
+  }
+  // Buffers of each group being decoded.
+  const size_t group_area =
+      (kGroupDim + 2 * PassesDecoderState::kGroupDataXBorder) *
+      (kGroupDim + 2 * PassesDecoderState::kGroupDataYBorder);
+  const size_t tile_dim = kApplyImageFeaturesTileDim * frame_header_.upsampling;
+  const size_t group_images = frame_header_.chroma_subsampling.Is444() ? 1 : 3;
+  const uint64_t per_thread =
+      group_area * 3 * sizeof(float) * group_images +
+      tile_dim * tile_dim * 3 * sizeof(float) * 2 +
+      AcStrategy::kMaxCoeffArea *
+          (4 * sizeof(float) + 3 * sizeof(int32_t) + 3 * sizeof(int16_t));
+  // Per-thread buffers kept from earlier frames are reused when they are large
+  // enough, so they only add to the estimate when they hold more than what
+  // this frame needs.
+  const uint64_t kept = dec_state_->scratch.BytesUsed(num_threads, num_ec);
+  add(1, std::max<uint64_t>(num_threads * per_thread, kept));
+  return bytes;
 }
 
 Status FrameDecoder::ProcessACGlobal(BitReader* br) {
@@ -479,6 +751,9 @@ Status FrameDecoder::ProcessACGlobal(BitReader* br) {
   if (frame_header_.encoding == FrameEncoding::kVarDCT) {
     JXL_RETURN_IF_ERROR(dec_state_->shared_storage.matrices.Decode(
         br, &modular_frame_decoder_));
+    // Only the matrices of the transforms used by the frame are computed.
+    JXL_RETURN_IF_ERROR(dec_state_->shared_storage.matrices.EnsureComputed(
+        dec_state_->used_acs));
 
     size_t num_histo_bits =
         CeilLog2Nonzero(dec_state_->shared->frame_dim.num_groups);
@@ -508,12 +783,16 @@ Status FrameDecoder::ProcessACGlobal(BitReader* br) {
       max_num_bits_ac =
           std::max(max_num_bits_ac, dec_state_->code[i].max_num_bits);
     }
-    max_num_bits_ac += CeilLog2Nonzero(
-        dec_state_->shared_storage.frame_header.passes.num_passes);
-    // 16-bit buffer for decoding to JPEG are not implemented.
+    // Coefficients of each pass are shifted left before being accumulated.
+    const Passes& passes = dec_state_->shared_storage.frame_header.passes;
+    uint32_t max_shift = 0;
+    for (size_t i = 0; i + 1 < passes.num_passes; i++) {
+      max_shift = std::max(max_shift, passes.shift[i]);
+    }
+    max_num_bits_ac += max_shift + CeilLog2Nonzero(passes.num_passes);
     // TODO(veluca): figure out the exact limit - 16 should still work with
     // 16-bit buffers, but we are excluding it for safety.
-    bool use_16_bit = max_num_bits_ac < 16 && !decoded_->IsJPEG();
+    bool use_16_bit = max_num_bits_ac < 16;
     bool store = frame_header_.passes.num_passes > 1;
     size_t xs = store ? kGroupDim * kGroupDim : 0;
     size_t ys = store ? frame_dim_.num_groups : 0;
@@ -579,12 +858,14 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
   const size_t x = gx * frame_dim_.group_dim;
   const size_t y = gy * frame_dim_.group_dim;
 
+  GroupDecCache* group_dec_cache =
+      &dec_state_->scratch.group_dec_caches[thread];
   if (frame_header_.encoding == FrameEncoding::kVarDCT) {
-    group_dec_caches_[thread].InitOnce(frame_header_.passes.num_passes,
-                                       dec_state_->used_acs);
+    group_dec_cache->InitOnce(frame_header_.passes.num_passes,
+                              dec_state_->used_acs);
     JXL_RETURN_IF_ERROR(DecodeGroup(
-        br, num_passes, ac_group_id, dec_state_, &group_dec_caches_[thread],
-        thread, decoded_, decoded_passes_per_ac_group_[ac_group_id], force_draw,
+        br, num_passes, ac_group_id, dec_state_, group_dec_cache, thread,
+        decoded_, decoded_passes_per_ac_group_[ac_group_id], force_draw,
         dc_only));
   }
 
@@ -598,7 +879,8 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
       JXL_RETURN_IF_ERROR(modular_frame_decoder_.DecodeGroup(
           mrect, br[i - decoded_passes_per_ac_group_[ac_group_id]], minShift,
           maxShift, ModularStreamId::ModularAC(ac_group_id, i),
-          /*zerofill=*/false, dec_state_, decoded_));
+          /*zerofill=*/false, dec_state_, decoded_,
+          &group_dec_cache->lz77_windows[0]));
     } else if (i >= decoded_passes_per_ac_group_[ac_group_id] + num_passes &&
                force_draw) {
       JXL_RETURN_IF_ERROR(modular_frame_decoder_.DecodeGroup(
@@ -704,7 +986,7 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
           true &&
       !finalized_dc_) {
     FinalizeDC();
-    AllocateOutput();
+    JXL_RETURN_IF_ERROR(AllocateOutput());
   }
 
   if (finalized_dc_) dec_state_->EnsureBordersStorage();
@@ -772,6 +1054,13 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
 }
 
 Status FrameDecoder::Flush() {
+  const Rect whole_frame(0, 0, frame_dim_.xsize_upsampled_padded,
+                         frame_dim_.ysize_upsampled_padded);
+  if (render_dc_only_) {
+    if (!finalized_dc_) return false;
+    flushed_rect_ = whole_frame;
+    return RenderFromDC();
+  }
   bool has_blending = frame_header_.blending_info.mode != BlendMode::kReplace ||
                       frame_header_.custom_size_or_origin;
   for (const auto& blending_info_ec :
@@ -779,20 +1068,34 @@ Status FrameDecoder::Flush() {
     if (blending_info_ec.mode != BlendMode::kReplace) has_blending = true;
   }
   // No early Flush() if blending is enabled.
-  if (has_blending && !is_finalized_) {
+  if (has_blending && !SkipBlending() && !is_finalized_) {
     return false;
   }
   // No early Flush() - nothing to do - if the frame is a kSkipProgressive
   // frame.
   if (frame_header_.frame_type == FrameType::kSkipProgressive &&
       !is_finalized_) {
+    flushed_rect_ = Rect();
     return true;
   }
   if (decoded_->IsJPEG()) {
     // Nothing to do.
+    flushed_rect_ = whole_frame;
     return true;
   }
-  AllocateOutput();
+  JXL_RETURN_IF_ERROR(AllocateOutput());
+
+  // Groups without all passes are drawn with the data they have so far. A
+  // group that did not receive anything since the previous Flush still has
+  // the same pixels, so it is only drawn again on the first Flush or once the
+  // AC global section arrived, which changes how missing passes are drawn.
+  const bool redraw_all = flushed_passes_per_ac_group_.empty() ||
+                          flushed_ac_global_ != decoded_ac_global_;
+  std::vector<uint8_t> changed(frame_dim_.num_groups);
+  for (size_t i = 0; i < frame_dim_.num_groups; i++) {
+    changed[i] = redraw_all || flushed_passes_per_ac_group_[i] !=
+                                   decoded_passes_per_ac_group_[i];
+  }
 
   uint32_t completely_decoded_ac_pass = *std::min_element(
       decoded_passes_per_ac_group_.begin(), decoded_passes_per_ac_group_.end());
@@ -800,8 +1103,10 @@ Status FrameDecoder::Flush() {
     // We don't have all AC yet: force a draw of all the missing areas.
     // Mark all sections as not complete.
     for (size_t i = 0; i < decoded_passes_per_ac_group_.size(); i++) {
-      if (decoded_passes_per_ac_group_[i] == frame_header_.passes.num_passes)
+      if (decoded_passes_per_ac_group_[i] == frame_header_.passes.num_passes ||
+          !changed[i]) {
         continue;
+      }
       dec_state_->group_border_assigner.ClearDone(i);
     }
     std::atomic<bool> has_error{false};
@@ -811,9 +1116,10 @@ Status FrameDecoder::Flush() {
           PrepareStorage(num_threads, decoded_passes_per_ac_group_.size());
           return true;
         },
-        [this, &has_error](size_t g, size_t thread) {
+        [this, &changed, &has_error](size_t g, size_t thread) {
           if (decoded_passes_per_ac_group_[g] ==
-              frame_header_.passes.num_passes) {
+                  frame_header_.passes.num_passes ||
+              !changed[g]) {
             // This group was drawn already, nothing to do.
             return;
           }
@@ -828,6 +1134,36 @@ Status FrameDecoder::Flush() {
       return JXL_FAILURE("Drawing groups failed");
     }
   }
+  flushed_passes_per_ac_group_ = decoded_passes_per_ac_group_;
+  flushed_ac_global_ = decoded_ac_global_;
+
+  if (redraw_all || is_finalized_ || !dec_state_->EagerFinalizeImageRect()) {
+    // Everything is drawn, or filtered, again below.
+    flushed_rect_ = whole_frame;
+  } else {
+    // The pixels of a group, and of its neighbours up to the filter padding,
+    // change when it is drawn.
+    const size_t pady = dec_state_->FinalizeRectPadding();
+    const size_t padx = GroupBorderAssigner::PaddingX(pady);
+    const size_t group_dim = frame_dim_.group_dim;
+    size_t x0 = whole_frame.xsize(), y0 = whole_frame.ysize(), x1 = 0, y1 = 0;
+    for (size_t i = 0; i < frame_dim_.num_groups; i++) {
+      if (!changed[i]) continue;
+      const size_t gx = i % frame_dim_.xsize_groups;
+      const size_t gy = i / frame_dim_.xsize_groups;
+      x0 = std::min(x0, gx * group_dim - std::min(gx * group_dim, padx));
+      y0 = std::min(y0, gy * group_dim - std::min(gy * group_dim, pady));
+      x1 = std::max(x1, (gx + 1) * group_dim + padx);
+      y1 = std::max(y1, (gy + 1) * group_dim + pady);
+    }
+    const size_t upsampling = frame_header_.upsampling;
+    flushed_rect_ =
+        x1 == 0 ? Rect()
+                : Rect(x0 * upsampling, y0 * upsampling,
+                       (x1 - x0) * upsampling, (y1 - y0) * upsampling,
+                       whole_frame.xsize(), whole_frame.ysize());
+  }
+
   // TODO(veluca): the rest of this function should be removed once we have full
   // support for per-group decoding.
 
@@ -836,7 +1172,7 @@ Status FrameDecoder::Flush() {
       dec_state_, pool_, decoded_, is_finalized_));
   JXL_RETURN_IF_ERROR(FinalizeFrameDecoding(decoded_, dec_state_, pool_,
                                             /*force_fir=*/false,
-                                            /*skip_blending=*/false,
+                                            /*skip_blending=*/SkipBlending(),
                                             /*move_ec=*/is_finalized_));
 
   num_renders_++;
@@ -855,6 +1191,27 @@ int FrameDecoder::SavedAs(const FrameHeader& header) {
   return 0;
 }
 
+int FrameDecoder::MaybeReferences(const FrameHeader& header) {
+  int result = 0;
+  if (header.frame_type == FrameType::kRegularFrame ||
+      header.frame_type == FrameType::kSkipProgressive) {
+    bool cropped = header.custom_size_or_origin;
+    if (cropped || header.blending_info.mode != BlendMode::kReplace) {
+      result |= (1 << header.blending_info.source);
+    }
+    for (const BlendingInfo& info : header.extra_channel_blending_info) {
+      if (cropped || info.mode != BlendMode::kReplace) {
+        result |= (1 << info.source);
+      }
+    }
+  }
+  if (header.flags & FrameHeader::kPatches) result |= 0xF;
+  if (header.flags & FrameHeader::kUseDcFrame) {
+    result |= (16 << header.dc_level);
+  }
+  return result;
+}
+
 int FrameDecoder::References() const {
   if (is_finalized_) {
     return 0;
@@ -909,6 +1266,12 @@ Status FrameDecoder::FinalizeFrame() {
     // Nothing to do.
     return true;
   }
+  if (render_dc_only_) {
+    if (!finalized_dc_ && !allow_partial_frames_) {
+      return JXL_FAILURE("FinalizeFrame called before the DC was decoded");
+    }
+    return RenderFromDC();
+  }
   if (!finalized_dc_) {
     // We don't have all of DC: EPF might not behave correctly (and is not
     // particularly useful anyway on upsampling results), so we disable it.
@@ -926,11 +1289,25 @@ Status FrameDecoder::FinalizeFrame() {
 
   if (!finalized_dc_) {
     JXL_ASSERT(allow_partial_frames_);
-    AllocateOutput();
+    JXL_RETURN_IF_ERROR(AllocateOutput());
   }
 
   JXL_RETURN_IF_ERROR(Flush());
 
+  // The layer that is output when not coalescing. If the frame is saved as a
+  // reference, later frames need the blended frame instead, so the frame is
+  // blended here and the layer restored after saving the reference.
+  ImageBundle layer;
+  const bool blend_reference =
+      SkipBlending() && dec_state_->shared->frame_header.CanBeReferenced() &&
+      ImageBlender::NeedsBlending(dec_state_);
+  if (blend_reference) {
+    layer = std::move(*decoded_);
+    *decoded_ = layer.Copy();
+    decoded_->origin = layer.origin;
+    JXL_RETURN_IF_ERROR(BlendFrame(decoded_, dec_state_, pool_));
+  }
+
   if (dec_state_->shared->frame_header.CanBeReferenced()) {
     size_t id = dec_state_->shared->frame_header.save_as_reference;
     auto& reference_frame = dec_state_->shared_storage.reference_frames[id];
@@ -970,6 +1347,9 @@ Status FrameDecoder::FinalizeFrame() {
       reference_frame.storage.ShrinkTo(metadata->xsize(), metadata->ysize());
     }
   }
+  if (blend_reference) {
+    *decoded_ = std::move(layer);
+  }
   if (frame_header_.nonserialized_is_preview) {
     // Fix possible larger image size (multiple of kBlockDim)
     // TODO(lode): verify if and when that happens.
@@ -979,8 +1359,10 @@ Status FrameDecoder::FinalizeFrame() {
     // coalesced frame of size equal to image dimensions. Other frames are not
     // blended, thus their final size is the size that was defined in the
     // frame_header.
-    if (frame_header_.frame_type == kRegularFrame ||
-        frame_header_.frame_type == kSkipProgressive) {
+    // When not coalescing, regular frames keep their own size as well.
+    if ((frame_header_.frame_type == kRegularFrame ||
+         frame_header_.frame_type == kSkipProgressive) &&
+        !SkipBlending()) {
       decoded_->ShrinkTo(
           dec_state_->shared->frame_header.nonserialized_metadata->xsize(),
           dec_state_->shared->frame_header.nonserialized_metadata->ysize());
@@ -38,17 +38,32 @@ Status DecodeFrameHeader(BitReader* JXL_RESTRICT reader,
 // `dec_state` with the new frame header.
 // `metadata` is the metadata that applies to all frames of the codestream
 // `decoded->metadata` must already be set and must match metadata.m.
+// If `coalescing` is false, regular frames are not blended, see
+// FrameDecoder::SetCoalescing.
 Status DecodeFrame(const DecompressParams& dparams,
                    PassesDecoderState* dec_state, ThreadPool* JXL_RESTRICT pool,
                    BitReader* JXL_RESTRICT reader, ImageBundle* decoded,
                    const CodecMetadata& metadata,
-                   const SizeConstraints* constraints, bool is_preview = false);
+                   const SizeConstraints* constraints, bool is_preview = false,
+                   bool coalescing = true);
 
 // Leaves reader in the same state as DecodeFrame would. Used to skip preview.
 // Also updates `dec_state` with the new frame header.
 Status SkipFrame(const CodecMetadata& metadata, BitReader* JXL_RESTRICT reader,
                  bool is_preview = false);
 
+// Reads the header of the frame that starts at byte `begin` of `data`, and
+// stores in `end` the position of the byte right after the frame.
+// `header->nonserialized_metadata` must be set.
+Status ScanFrame(Span<const uint8_t> data, size_t begin,
+                 FrameHeader* JXL_RESTRICT header, size_t* end);
+
+// Returns the number of passes of a frame that need to be decoded to obtain an
+// image downsampled by up to `max_downsampling` compared to the full
+// resolution.
+size_t NumPassesForDownsampling(const FrameHeader& frame_header,
+                                size_t max_downsampling);
+
 // TODO(veluca): implement "forced drawing".
 class FrameDecoder {
  public:
@@ -63,6 +78,27 @@ class FrameDecoder {
     constraints_ = constraints;
   }
   void SetRenderSpotcolors(bool rsc) { render_spotcolors_ = rsc; }
+  // Only the part of the frame that is needed to render `crop` (in image
+  // coordinates) will be decoded, if the frame allows it; an empty rect means
+  // the whole frame. Must be called before InitFrame. The pixels of the output
+  // outside of `crop` are unspecified.
+  void SetCropRegion(const Rect& crop) { crop_region_ = crop; }
+  // The frame will be output downsampled by `downsampling` (1, 2, 4 or 8):
+  // passes that only add detail beyond that resolution are not decoded, and,
+  // when the frame allows it, an 8x downsampled frame is rendered directly from
+  // the DC without decoding any AC. Must be called before InitFrame.
+  void SetDownsampling(size_t downsampling) { downsampling_ = downsampling; }
+  // If `coalescing` is false, regular frames are not blended with the previous
+  // frames: the output has the frame's own size and is positioned at the
+  // frame's origin, and blending is left to the caller. Frames that are saved
+  // as reference are still blended for use by later frames. Must be called
+  // before InitFrame.
+  void SetCoalescing(bool coalescing) { coalescing_ = coalescing; }
+  // If non-zero, decoding fails as soon as the frame is estimated to need more
+  // than `memory_limit` bytes even with the lowest-memory options, and groups
+  // are decoded one at a time if that is needed to stay within the limit. Must
+  // be called before InitFrame.
+  void SetMemoryLimit(uint64_t memory_limit) { memory_limit_ = memory_limit; }
 
   // Read FrameHeader and table of contents from the given BitReader.
   // Also checks frame dimensions for their limits, and sets the output
@@ -97,9 +133,15 @@ class FrameDecoder {
   Status ProcessSections(const SectionInfo* sections, size_t num,
                          SectionStatus* section_status);
 
-  // Flushes all the data decoded so far to pixels.
+  // Flushes all the data decoded so far to pixels. Only the groups that
+  // received data since the previous call are drawn again.
   Status Flush();
 
+  // Returns the area of the decoded image, in the coordinates of the upsampled
+  // frame, whose pixels may have changed during the last call to Flush. It can
+  // extend beyond the decoded image. Only valid after Flush.
+  const Rect& FlushedRect() const { return flushed_rect_; }
+
   // Runs final operations once a frame data is decoded.
   // Must be called exactly once per frame, after all calls to ProcessSections.
   Status FinalizeFrame();
@@ -118,6 +160,12 @@ class FrameDecoder {
   // soon as the frame header is known.
   static int SavedAs(const FrameHeader& header);
 
+  // Returns the storage locations the frame may read from, using the bit mask
+  // of References. Unlike References, only needs the frame header: patches
+  // are not parsed, so a frame with patches is assumed to read all reference
+  // frames.
+  static int MaybeReferences(const FrameHeader& header);
+
   // Returns offset of this section after the end of the TOC. The end of the TOC
   // is the byte position of the bit reader after InitFrame was called.
   const std::vector<uint64_t>& SectionOffsets() const {
@@ -126,6 +174,19 @@ class FrameDecoder {
   const std::vector<uint32_t>& SectionSizes() const { return section_sizes_; }
   size_t NumSections() const { return section_sizes_.size(); }
 
+  // Returns true if the section with the given id is not needed to render the
+  // crop region; such sections do not need to be passed to ProcessSections.
+  // Only valid after InitFrame.
+  bool SectionIsSkipped(size_t id) const {
+    return id < skipped_section_.size() && skipped_section_[id];
+  }
+  size_t NumSkippedSections() const { return num_skipped_sections_; }
+
+  // Returns the factor by which the decoded frame is downsampled compared to
+  // the size of the frame: either 1, or 8 if the frame is rendered from the DC.
+  // Only valid after InitFrame.
+  size_t RenderedDownsampling() const { return render_dc_only_ ? 8 : 1; }
+
   // TODO(veluca): remove once we remove --downsampling flag.
   void SetMaxPasses(size_t max_passes) { max_passes_ = max_passes; }
   const FrameHeader& GetFrameHeader() const { return frame_header_; }
@@ -164,6 +225,9 @@ class FrameDecoder {
 
   // Same as MaybeSetRGB8OutputBuffer, but with a float callback. This is not
   // supported for all images. If it succeeds, HasRGBBuffer() will return true.
+  // The callback is called concurrently from the threads of the pool, `thread`
+  // is smaller than the number of threads of the pool and identifies the
+  // calling thread.
   // If it does not succeed, the image is decoded to the ImageBundle passed to
   // InitFrame instead.
   // If a RGB8 output buffer is set, this function *may not* be called.
@@ -174,8 +238,8 @@ class FrameDecoder {
   // results in not setting the buffer if the image has a non-identity EXIF
   // orientation. When outputting to the ImageBundle, no orientation is undone.
   void MaybeSetFloatCallback(
-      const std::function<void(const float* pixels, size_t x, size_t y,
-                               size_t num_pixels)>& cb,
+      const std::function<void(const float* pixels, size_t thread, size_t x,
+                               size_t y, size_t num_pixels)>& cb,
       bool is_rgba, bool undo_orientation) const {
     if (!CanDoLowMemoryPath(undo_orientation)) return;
     dec_state_->pixel_callback = cb;
@@ -195,7 +259,28 @@ class FrameDecoder {
   Status ProcessDCGlobal(BitReader* br);
   Status ProcessDCGroup(size_t dc_group_id, BitReader* br);
   void FinalizeDC();
-  void AllocateOutput();
+  Status AllocateOutput();
+  // Returns an estimate of the peak memory, in bytes, needed to decode the
+  // frame with `num_threads` groups in flight, with or without a full-frame
+  // float copy of the color channels. Includes the per-thread buffers that
+  // the decoder state keeps from earlier frames for those threads.
+  uint64_t EstimatedMemoryUsage(bool full_frame_color,
+                                size_t num_threads) const;
+  // Marks the DC and AC groups that do not contribute to the crop region as
+  // already decoded.
+  void SkipSectionsOutsideCrop();
+  // Marks the sections that are not needed for the requested downsampling as
+  // skipped.
+  void SkipSectionsForDownsampling();
+  void SkipSection(size_t id) {
+    if (skipped_section_[id]) return;
+    skipped_section_[id] = true;
+    num_skipped_sections_++;
+  }
+  // Returns true if the frame can be rendered at 1:8 resolution from its DC.
+  bool CanRenderFromDC() const;
+  // Renders the frame from the DC image, at 1:8 resolution.
+  Status RenderFromDC();
   Status ProcessACGlobal(BitReader* br);
   Status ProcessACGroup(size_t ac_group_id, BitReader* JXL_RESTRICT* br,
                         size_t num_passes, size_t thread, bool force_draw,
@@ -208,8 +293,8 @@ class FrameDecoder {
   // than the value of `num_tasks` passed here.
   void PrepareStorage(size_t num_threads, size_t num_tasks) {
     size_t storage_size = std::min(num_threads, num_tasks);
-    if (storage_size > group_dec_caches_.size()) {
-      group_dec_caches_.resize(storage_size);
+    if (storage_size > dec_state_->scratch.group_dec_caches.size()) {
+      dec_state_->scratch.group_dec_caches.resize(storage_size);
     }
     dec_state_->EnsureStorage(storage_size);
     use_task_id_ = num_threads > num_tasks;
@@ -220,11 +305,17 @@ class FrameDecoder {
     return thread;
   }
 
+  // Whether this frame is output as a layer, without blending it.
+  bool SkipBlending() const {
+    return !coalescing_ && (frame_header_.frame_type == kRegularFrame ||
+                            frame_header_.frame_type == kSkipProgressive);
+  }
+
   // If the image has default exif orientation (or has an orientation but should
   // not be undone) and no blending, the current frame cannot be referenced by
-  // future frames, there are no spot colors to be rendered, and alpha is not
-  // premultiplied, then low memory options can be used
-  // (uint8 output buffer or float pixel callback).
+  // future frames, there are no spot colors to be rendered, alpha is not
+  // premultiplied and no crop region or downsampling is set, then low memory
+  // options can be used (uint8 output buffer or float pixel callback).
   // TODO(veluca): reduce this set of restrictions.
   bool CanDoLowMemoryPath(bool undo_orientation) const {
     if (undo_orientation &&
@@ -238,6 +329,8 @@ class FrameDecoder {
       return false;
     }
     if (decoded_->AlphaIsPremultiplied()) return false;
+    if (crop_region_.xsize() != 0) return false;
+    if (downsampling_ != 1) return false;
     return true;
   }
 
@@ -257,7 +350,20 @@ class FrameDecoder {
 
   std::vector<uint8_t> processed_section_;
   std::vector<uint8_t> decoded_passes_per_ac_group_;
+  // Amount of passes of each AC group drawn by the last Flush, or empty if
+  // Flush was not called yet for this frame.
+  std::vector<uint8_t> flushed_passes_per_ac_group_;
+  // Whether the AC global section was decoded at the last Flush.
+  bool flushed_ac_global_ = false;
+  Rect flushed_rect_;
   std::vector<uint8_t> decoded_dc_groups_;
+  std::vector<uint8_t> skipped_section_;
+  size_t num_skipped_sections_ = 0;
+  Rect crop_region_;
+  size_t downsampling_ = 1;
+  bool coalescing_ = true;
+  uint64_t memory_limit_ = 0;
+  bool render_dc_only_ = false;
   bool decoded_dc_global_;
   bool decoded_ac_global_;
   bool finalized_dc_ = true;
@@ -265,8 +371,6 @@ class FrameDecoder {
   size_t num_renders_ = 0;
   bool allocated_ = false;
 
-  std::vector<GroupDecCache> group_dec_caches_;
-
   // Frame size limits.
   const SizeConstraints* constraints_ = nullptr;
 
@@ -45,13 +45,27 @@
 #define LIB_JXL_DEC_GROUP_CC
 namespace jxl {
 
+// Bounds of the non-zero quantized AC coefficients of one channel of a
+// varblock: they all lie in the first `rows` rows and `cols` columns of the
+// block, which is stored transposed if it is taller than wide.
+struct CoeffExtents {
+  // False if the bounds are not known, e.g. because the block also holds
+  // coefficients loaded by an earlier call.
+  bool known;
+  size_t rows;
+  size_t cols;
+};
+
 // Interface for reading groups for DecodeGroupImpl.
 class GetBlock {
  public:
   virtual void StartRow(size_t by) = 0;
+  // Adds the quantized coefficients of a varblock to `block`, and sets
+  // `extents` to the bounds of the non-zero ones of each channel.
   virtual Status LoadBlock(size_t bx, size_t by, const AcStrategy& acs,
                            size_t size, size_t log2_covered_blocks,
-                           ACPtr block[3], ACType ac_type) = 0;
+                           ACPtr block[3], ACType ac_type,
+                           CoeffExtents extents[3]) = 0;
   virtual ~GetBlock() {}
 };
 
@@ -97,15 +111,13 @@ void Transpose8x8InPlace(int32_t* JXL_RESTRICT block) {
 template <ACType ac_type>
 void DequantLane(Vec<D> scaled_dequant_x, Vec<D> scaled_dequant_y,
                  Vec<D> scaled_dequant_b,
-                 const float* JXL_RESTRICT dequant_matrices, size_t dq_ofs,
-                 size_t size, size_t k, Vec<D> x_cc_mul, Vec<D> b_cc_mul,
+                 const float* JXL_RESTRICT dequant_matrix, size_t size,
+                 size_t k, Vec<D> x_cc_mul, Vec<D> b_cc_mul,
                  const float* JXL_RESTRICT biases, ACPtr qblock[3],
                  float* JXL_RESTRICT block) {
-  const auto x_mul = Load(d, dequant_matrices + dq_ofs + k) * scaled_dequant_x;
-  const auto y_mul =
-      Load(d, dequant_matrices + dq_ofs + size + k) * scaled_dequant_y;
-  const auto b_mul =
-      Load(d, dequant_matrices + dq_ofs + 2 * size + k) * scaled_dequant_b;
+  const auto x_mul = Load(d, dequant_matrix + k) * scaled_dequant_x;
+  const auto y_mul = Load(d, dequant_matrix + size + k) * scaled_dequant_y;
+  const auto b_mul = Load(d, dequant_matrix + 2 * size + k) * scaled_dequant_b;
 
   Vec<DI> quantized_x_int;
   Vec<DI> quantized_y_int;
@@ -139,9 +151,8 @@ template <ACType ac_type>
 void DequantBlock(const AcStrategy& acs, float inv_global_scale, int quant,
                   float x_dm_multiplier, float b_dm_multiplier, Vec<D> x_cc_mul,
                   Vec<D> b_cc_mul, size_t kind, size_t size,
-                  const Quantizer& quantizer,
-                  const float* JXL_RESTRICT dequant_matrices,
-                  size_t covered_blocks, const size_t* sbx,
+                  const Quantizer& quantizer, size_t covered_blocks,
+                  const size_t* sbx,
                   const float* JXL_RESTRICT* JXL_RESTRICT dc_row,
                   size_t dc_stride, const float* JXL_RESTRICT biases,
                   ACPtr qblock[3], float* JXL_RESTRICT block) {
@@ -153,12 +164,12 @@ void DequantBlock(const AcStrategy& acs, float inv_global_scale, int quant,
   const auto scaled_dequant_y = Set(d, scaled_dequant_s);
   const auto scaled_dequant_b = Set(d, scaled_dequant_s * b_dm_multiplier);
 
-  const size_t dq_ofs = quantizer.DequantMatrixOffset(kind, 0);
+  const float* JXL_RESTRICT dequant_matrix = quantizer.DequantMatrix(kind, 0);
 
   for (size_t k = 0; k < covered_blocks * kDCTBlockSize; k += Lanes(d)) {
     DequantLane<ac_type>(scaled_dequant_x, scaled_dequant_y, scaled_dequant_b,
-                         dequant_matrices, dq_ofs, size, k, x_cc_mul, b_cc_mul,
-                         biases, qblock, block);
+                         dequant_matrix, size, k, x_cc_mul, b_cc_mul, biases,
+                         qblock, block);
   }
   for (size_t c = 0; c < 3; c++) {
     LowestFrequenciesFromDC(acs.Strategy(), dc_row[c] + sbx[c], dc_stride,
@@ -185,15 +196,14 @@ Status DecodeGroupImpl(GetBlock* JXL_RESTRICT get_block,
   const size_t dc_stride = dec_state->shared->dc->PixelsPerRow();
 
   const float inv_global_scale = dec_state->shared->quantizer.InvGlobalScale();
-  const float* JXL_RESTRICT dequant_matrices =
-      dec_state->shared->quantizer.DequantMatrix(0, 0);
 
   const YCbCrChromaSubsampling& cs =
       dec_state->shared->frame_header.chroma_subsampling;
 
-  const size_t idct_stride = dec_state->EagerFinalizeImageRect()
-                                 ? dec_state->group_data[thread].PixelsPerRow()
-                                 : dec_state->decoded.PixelsPerRow();
+  const size_t idct_stride =
+      dec_state->EagerFinalizeImageRect()
+          ? dec_state->scratch.group_data[thread].PixelsPerRow()
+          : dec_state->decoded.PixelsPerRow();
 
   HWY_ALIGN int32_t scaled_qtable[64 * 3];
 
@@ -279,7 +289,7 @@ Status DecodeGroupImpl(GetBlock* JXL_RESTRICT get_block,
     int16_t* JXL_RESTRICT jpeg_row[3];
     for (size_t c = 0; c < 3; c++) {
       if (dec_state->EagerFinalizeImageRect()) {
-        idct_row[c] = dec_state->group_data[thread].PlaneRow(
+        idct_row[c] = dec_state->scratch.group_data[thread].PlaneRow(
                           c, sby[c] * kBlockDim + kGroupDataYBorder) +
                       kGroupDataXBorder;
       } else {
@@ -345,8 +355,10 @@ Status DecodeGroupImpl(GetBlock* JXL_RESTRICT get_block,
             }
           }
         }
-        JXL_RETURN_IF_ERROR(get_block->LoadBlock(
-            bx, by, acs, size, log2_covered_blocks, qblock, ac_type));
+        CoeffExtents extents[3];
+        JXL_RETURN_IF_ERROR(get_block->LoadBlock(bx, by, acs, size,
+                                                 log2_covered_blocks, qblock,
+                                                 ac_type, extents));
         offset += size;
         if (draw == kDontDraw) {
           bx += llf_x;
@@ -371,7 +383,15 @@ Status DecodeGroupImpl(GetBlock* JXL_RESTRICT get_block,
             int16_t* JXL_RESTRICT jpeg_pos =
                 jpeg_row[c] + sbx[c] * kDCTBlockSize;
             // JPEG XL is transposed, JPEG is not.
-            auto transposed_dct = qblock[c].ptr32;
+            HWY_ALIGN int32_t transposed_dct[64];
+            if (ac_type == ACType::k16) {
+              for (size_t i = 0; i < 64; i += Lanes(d)) {
+                const auto ini16 = Load(di16, qblock[c].ptr16 + i);
+                Store(PromoteTo(di, ini16), di, transposed_dct + i);
+              }
+            } else {
+              memcpy(transposed_dct, qblock[c].ptr32, sizeof(transposed_dct));
+            }
             Transpose8x8InPlace(transposed_dct);
             // No CfL - no need to store the y block converted to integers.
             if (!cs.Is444() ||
@@ -414,20 +434,43 @@ Status DecodeGroupImpl(GetBlock* JXL_RESTRICT get_block,
           dequant_block(
               acs, inv_global_scale, row_quant[bx], dec_state->x_dm_multiplier,
               dec_state->b_dm_multiplier, x_cc_mul, b_cc_mul, acs.RawStrategy(),
-              size, dec_state->shared->quantizer, dequant_matrices,
+              size, dec_state->shared->quantizer,
               acs.covered_blocks_y() * acs.covered_blocks_x(), sbx, dc_rows,
               dc_stride,
               dec_state->output_encoding_info.opsin_params.quant_biases, qblock,
               block);
 
+          // Coefficients are stored as the transposed DCT if the block is
+          // taller than wide.
+          const size_t coeffs_xsize =
+              std::max(acs.covered_blocks_x(), acs.covered_blocks_y()) *
+              kBlockDim;
+          const size_t coeffs_ysize = size / coeffs_xsize;
+          // Only the DCTs of 8x8 pixels or more skip zero coefficients.
+          const bool sparse_idct = acs.IsMultiblock() ||
+                                   acs.Strategy() == AcStrategy::Type::DCT;
           for (size_t c : {1, 0, 2}) {
             if ((sbx[c] << hshift[c] != bx) || (sby[c] << vshift[c] != by)) {
               continue;
             }
             // IDCT
             float* JXL_RESTRICT idct_pos = idct_row[c] + sbx[c] * kBlockDim;
+            size_t nonzero_rows = coeffs_ysize;
+            size_t nonzero_cols = coeffs_xsize;
+            if (sparse_idct && extents[c].known && extents[1].known) {
+              // The LLF coefficients come from the DC, and chroma-from-luma
+              // adds the Y coefficients to those of X and B.
+              nonzero_rows = std::max({coeffs_ysize / kBlockDim,
+                                       extents[c].rows, extents[1].rows});
+              nonzero_cols = std::max({coeffs_xsize / kBlockDim,
+                                       extents[c].cols, extents[1].cols});
+            } else if (sparse_idct) {
+              NonZeroExtents(block + c * size, coeffs_ysize, coeffs_xsize,
+                             &nonzero_rows, &nonzero_cols);
+            }
             TransformToPixels(acs.Strategy(), block + c * size, idct_pos,
-                              idct_stride, group_dec_cache->scratch_space);
+                              idct_stride, group_dec_cache->scratch_space,
+                              nonzero_rows, nonzero_cols);
           }
         }
         bx += llf_x;
@@ -440,7 +483,7 @@ Status DecodeGroupImpl(GetBlock* JXL_RESTRICT get_block,
   // No ApplyImageFeatures in JPEG mode or when we need to delay it.
   if (!decoded->IsJPEG() && dec_state->EagerFinalizeImageRect()) {
     JXL_RETURN_IF_ERROR(dec_state->FinalizeGroup(
-        group_idx, thread, &dec_state->group_data[thread], decoded));
+        group_idx, thread, &dec_state->scratch.group_data[thread], decoded));
   }
   return true;
 }
@@ -467,6 +510,7 @@ Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
                         const std::vector<uint8_t>& context_map,
                         const uint8_t* qdc_row, const int32_t* qf_row,
                         const BlockCtxMap& block_ctx_map, ACPtr block,
+                        size_t log2_coeffs_xsize, CoeffExtents* extents,
                         size_t shift = 0) {
   PROFILER_FUNC;
   // Equal to number of LLF coefficients.
@@ -500,6 +544,9 @@ Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
   // Skip LLF
   {
     PROFILER_ZONE("AcDecSkipLLF, reader");
+    const size_t coeffs_xmask = (size_t{1} << log2_coeffs_xsize) - 1;
+    size_t nonzero_rows = 0;
+    size_t nonzero_cols = 0;
     size_t prev = (nzeros > size / 16 ? 0 : 1);
     for (size_t k = covered_blocks; k < size && nzeros != 0; ++k) {
       const size_t ctx =
@@ -520,7 +567,14 @@ Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
       }
       prev = static_cast<size_t>(u_coeff != 0);
       nzeros -= prev;
+      if (prev) {
+        const size_t pos = order[k];
+        nonzero_rows = std::max(nonzero_rows, (pos >> log2_coeffs_xsize) + 1);
+        nonzero_cols = std::max(nonzero_cols, (pos & coeffs_xmask) + 1);
+      }
     }
+    extents->rows = std::max(extents->rows, nonzero_rows);
+    extents->cols = std::max(extents->cols, nonzero_cols);
     if (JXL_UNLIKELY(nzeros != 0)) {
       return JXL_FAILURE("Invalid AC: nzeros not 0. Block (%" PRIuS ", %" PRIuS
                          "), channel %" PRIuS,
@@ -552,12 +606,19 @@ struct GetBlockFromBitstream : public GetBlock {
   }
 
   Status LoadBlock(size_t bx, size_t by, const AcStrategy& acs, size_t size,
-                   size_t log2_covered_blocks, ACPtr block[3],
-                   ACType ac_type) override {
+                   size_t log2_covered_blocks, ACPtr block[3], ACType ac_type,
+                   CoeffExtents extents[3]) override {
     auto decode_ac_varblock = ac_type == ACType::k16
                                   ? DecodeACVarBlock<ACType::k16>
                                   : DecodeACVarBlock<ACType::k32>;
+    const size_t log2_coeffs_xsize = CeilLog2Nonzero(
+        std::max(acs.covered_blocks_x(), acs.covered_blocks_y()) * kBlockDim);
     for (size_t c : {1, 0, 2}) {
+      // Coefficients of earlier passes were added to the block by an earlier
+      // call, and their positions were not kept.
+      extents[c].known = first_pass == 0;
+      extents[c].rows = 0;
+      extents[c].cols = 0;
       size_t sbx = bx >> hshift[c];
       size_t sby = by >> vshift[c];
       if (JXL_UNLIKELY((sbx << hshift[c] != bx) || (sby << vshift[c] != by))) {
@@ -570,7 +631,8 @@ struct GetBlockFromBitstream : public GetBlock {
             row_nzeros_top[pass][c], nzeros_stride, c, sbx, sby, bx, acs,
             &coeff_orders[pass * coeff_order_size], readers[pass],
             &decoders[pass], context_map[pass], quant_dc_row, qf_row,
-            *block_ctx_map, block[c], shift_for_pass[pass]));
+            *block_ctx_map, block[c], log2_coeffs_xsize, &extents[c],
+            shift_for_pass[pass]));
       }
     }
     return true;
@@ -592,6 +654,7 @@ struct GetBlockFromBitstream : public GetBlock {
     this->num_passes = num_passes;
     this->shift_for_pass =
         dec_state->shared->frame_header.passes.shift + first_pass;
+    this->first_pass = first_pass;
     this->group_dec_cache = group_dec_cache;
     this->rect = rect;
     block_ctx_map = &dec_state->shared->block_ctx_map;
@@ -609,8 +672,13 @@ struct GetBlockFromBitstream : public GetBlock {
       }
       ctx_offset[pass] = cur_histogram * block_ctx_map->NumACContexts();
 
-      decoders[pass] =
-          ANSSymbolReader(&dec_state->code[pass + first_pass], readers[pass]);
+      // Each varblock has, per channel, one symbol for the number of non-zero
+      // coefficients and at most one per remaining coefficient.
+      decoders[pass] = ANSSymbolReader(
+          &dec_state->code[pass + first_pass], readers[pass],
+          /*distance_multiplier=*/0,
+          /*max_num_symbols=*/3 * kDCTBlockSize * rect.xsize() * rect.ysize(),
+          &group_dec_cache->lz77_windows[pass]);
     }
     nzeros_stride = group_dec_cache->num_nzeroes[0].PixelsPerRow();
     for (size_t i = 0; i < num_passes; i++) {
@@ -628,6 +696,7 @@ struct GetBlockFromBitstream : public GetBlock {
   ANSSymbolReader decoders[kMaxNumPasses];
   BitReader* JXL_RESTRICT* JXL_RESTRICT readers;
   size_t num_passes;
+  size_t first_pass;
   size_t ctx_offset[kMaxNumPasses];
   size_t nzeros_stride;
   int32_t* JXL_RESTRICT row_nzeros[kMaxNumPasses][3];
@@ -646,10 +715,11 @@ struct GetBlockFromEncoder : public GetBlock {
   void StartRow(size_t by) override {}
 
   Status LoadBlock(size_t bx, size_t by, const AcStrategy& acs, size_t size,
-                   size_t log2_covered_blocks, ACPtr block[3],
-                   ACType ac_type) override {
+                   size_t log2_covered_blocks, ACPtr block[3], ACType ac_type,
+                   CoeffExtents extents[3]) override {
     JXL_DASSERT(ac_type == ACType::k32);
     for (size_t c = 0; c < 3; c++) {
+      extents[c].known = false;
       // for each pass
       for (size_t i = 0; i < quantized_ac->size(); i++) {
         for (size_t k = 0; k < size; k++) {
@@ -711,30 +781,30 @@ Status DecodeGroup(BitReader* JXL_RESTRICT* JXL_RESTRICT readers,
           Rect(src_rect_precs.x0() >> hs, src_rect_precs.y0() >> vs,
                src_rect_precs.xsize() >> hs, src_rect_precs.ysize() >> vs);
       const Rect copy_rect(kBlockDim, 2, src_rect.xsize(), src_rect.ysize());
-      CopyImageToWithPadding(src_rect, dec_state->shared->dc->Plane(c), 2,
-                             copy_rect,
-                             &dec_state->filter_input_storage[thread].Plane(c));
+      CopyImageToWithPadding(
+          src_rect, dec_state->shared->dc->Plane(c), 2, copy_rect,
+          &dec_state->scratch.filter_input_storage[thread].Plane(c));
       EnsurePaddingInPlace(
-          &dec_state->filter_input_storage[thread].Plane(c), copy_rect,
+          &dec_state->scratch.filter_input_storage[thread].Plane(c), copy_rect,
           src_rect, DivCeil(dec_state->shared->frame_dim.xsize_blocks, 1 << hs),
           DivCeil(dec_state->shared->frame_dim.ysize_blocks, 1 << vs), 2, 2);
       ImageF* upsampling_dst = &dec_state->decoded.Plane(c);
       Rect dst_rect(src_rect.x0() * 8, src_rect.y0() * 8, src_rect.xsize() * 8,
                     src_rect.ysize() * 8);
       if (dec_state->EagerFinalizeImageRect()) {
-        upsampling_dst = &dec_state->group_data[thread].Plane(c);
+        upsampling_dst = &dec_state->scratch.group_data[thread].Plane(c);
         dst_rect = Rect(PassesDecoderState::kGroupDataXBorder,
                         PassesDecoderState::kGroupDataYBorder, dst_rect.xsize(),
                         dst_rect.ysize());
       }
       JXL_ASSERT(dst_rect.IsInside(*upsampling_dst));
       dec_state->upsamplers[2].UpsampleRect(
-          dec_state->filter_input_storage[thread].Plane(c), copy_rect,
+          dec_state->scratch.filter_input_storage[thread].Plane(c), copy_rect,
           upsampling_dst, dst_rect,
           static_cast<ssize_t>(src_rect.y0()) -
               static_cast<ssize_t>(copy_rect.y0()),
           dec_state->shared->frame_dim.ysize_blocks >> vs,
-          dec_state->upsampler_storage[thread].get());
+          dec_state->scratch.upsampler_storage[thread].get());
     }
     draw = kOnlyImageFeatures;
   }
@@ -261,7 +261,8 @@ Status ModularFrameDecoder::DecodeGroup(const Rect& rect, BitReader* reader,
                                         const ModularStreamId& stream,
                                         bool zerofill,
                                         PassesDecoderState* dec_state,
-                                        ImageBundle* output) {
+                                        ImageBundle* output,
+                                        LZ77WindowStorage* lz77_window) {
   JXL_DASSERT(stream.kind == ModularStreamId::kModularDC ||
               stream.kind == ModularStreamId::kModularAC);
   const size_t xsize = rect.xsize();
@@ -303,7 +304,8 @@ Status ModularFrameDecoder::DecodeGroup(const Rect& rect, BitReader* reader,
   if (!zerofill) {
     if (!ModularGenericDecompress(
             reader, gi, /*header=*/nullptr, stream.ID(frame_dim), &options,
-            /*undo_transforms=*/true, &tree, &code, &context_map)) {
+            /*undo_transforms=*/true, &tree, &code, &context_map,
+            /*allow_truncated_group=*/false, lz77_window)) {
       return JXL_FAILURE("Failed to decode modular group");
     }
   }
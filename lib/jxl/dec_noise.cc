@@ -258,6 +258,44 @@ void RandomImage3(size_t seed, const Rect& rect, Image3F* JXL_RESTRICT noise) {
   RandomImage(&rng, rect, &noise->Plane(2));
 }
 
+// Weighted sum of 1x5 pixels around `row` with [wx2 wx1 wx0 wx1 wx2], in the
+// same order as Symmetric5.
+template <class DF, class V>
+HWY_INLINE V WeightedSum(const DF df, const float* JXL_RESTRICT row,
+                         const V wx0, const V wx1, const V wx2) {
+  const auto sum_2 = wx2 * (LoadU(df, row - 2) + LoadU(df, row + 2));
+  const auto sum_1 = wx1 * (LoadU(df, row - 1) + LoadU(df, row + 1));
+  const auto sum_0 = wx0 * LoadU(df, row);
+  return sum_2 + sum_1 + sum_0;
+}
+
+// Applies the 5x5 high-pass filter 4 * (1 - box kernel) to the pixels of
+// `rect` in `random`, which must have 2 valid pixels around `rect`, and stores
+// the result in `out_rect` of `out`. Writes up to a vector past each row.
+void HighPassNoise(const Image3F& random, const Rect& rect,
+                   const Rect& out_rect, Image3F* JXL_RESTRICT out) {
+  const HWY_FULL(float) df;
+  const auto w_center = Set(df, -3.84f);
+  const auto w_other = Set(df, 0.16f);
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < rect.ysize(); y++) {
+      const float* JXL_RESTRICT rows[5];
+      for (size_t i = 0; i < 5; i++) {
+        rows[i] = random.ConstPlaneRow(c, rect.y0() + y + i - 2) + rect.x0();
+      }
+      float* JXL_RESTRICT row_out = out_rect.PlaneRow(out, c, y);
+      for (size_t x = 0; x < rect.xsize(); x += Lanes(df)) {
+        auto sum0 = WeightedSum(df, rows[2] + x, w_center, w_other, w_other);
+        sum0 += WeightedSum(df, rows[0] + x, w_other, w_other, w_other);
+        auto sum1 = WeightedSum(df, rows[4] + x, w_other, w_other, w_other);
+        sum0 += WeightedSum(df, rows[1] + x, w_other, w_other, w_other);
+        sum1 += WeightedSum(df, rows[3] + x, w_other, w_other, w_other);
+        StoreU(sum0 + sum1, df, row_out + x);
+      }
+    }
+  }
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -279,6 +317,206 @@ void RandomImage3(size_t seed, const Rect& rect, Image3F* JXL_RESTRICT noise) {
   return HWY_DYNAMIC_DISPATCH(RandomImage3)(seed, rect, noise);
 }
 
+HWY_EXPORT(HighPassNoise);
+
+namespace {
+
+// Pixels read by the high-pass filter on each side.
+constexpr size_t kNoiseBorder = 2;
+
+// The borders of a group hold, for each plane, its first two and last two rows
+// followed by its first two and last two columns. Returns the row (or column)
+// stored in `slot`.
+size_t BorderPosition(size_t slot, size_t size) {
+  if (slot < 2) return std::min(slot, size - 1);
+  return std::max<int64_t>(static_cast<int64_t>(size + slot) - 4, 0);
+}
+
+// Inverse of BorderPosition, for `pos` < 2 or `pos` >= `size` - 2.
+size_t BorderSlot(size_t pos, size_t size) {
+  return pos < 2 ? pos : pos + 4 - size;
+}
+
+std::vector<float> ExtractBorders(const Image3F& random, const Rect& rect) {
+  const size_t xsize = rect.xsize();
+  const size_t ysize = rect.ysize();
+  std::vector<float> borders(3 * 4 * (xsize + ysize));
+  float* JXL_RESTRICT pos = borders.data();
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t slot = 0; slot < 4; slot++) {
+      const size_t y = BorderPosition(slot, ysize);
+      memcpy(pos, rect.ConstPlaneRow(random, c, y), xsize * sizeof(float));
+      pos += xsize;
+    }
+    for (size_t slot = 0; slot < 4; slot++) {
+      const size_t x = BorderPosition(slot, xsize);
+      for (size_t y = 0; y < ysize; y++) {
+        *pos++ = rect.ConstPlaneRow(random, c, y)[x];
+      }
+    }
+  }
+  return borders;
+}
+
+// Pixel (x, y) of plane `c` of a group of the given size, which must be within
+// 2 pixels of a border of the group.
+float BorderValue(const std::vector<float>& borders, size_t xsize,
+                  size_t ysize, size_t c, size_t x, size_t y) {
+  const float* JXL_RESTRICT plane = borders.data() + c * 4 * (xsize + ysize);
+  if (y < 2 || y + 2 >= ysize) {
+    return plane[BorderSlot(y, ysize) * xsize + x];
+  }
+  JXL_DASSERT(x < 2 || x + 2 >= xsize);
+  return plane[4 * xsize + BorderSlot(x, xsize) * ysize + y];
+}
+
+// Calls f(x, y) for the frame positions, possibly outside of the frame, that
+// are within kNoiseBorder pixels of `tile` but not in `group`.
+template <class F>
+void ForEachBorderPixel(const Rect& group, const Rect& tile, const F& f) {
+  const int64_t group_x1 = group.x0() + group.xsize();
+  const int64_t group_y1 = group.y0() + group.ysize();
+  const int64_t x0 = static_cast<int64_t>(tile.x0()) - kNoiseBorder;
+  const int64_t x1 = tile.x0() + tile.xsize() + kNoiseBorder;
+  const int64_t y0 = static_cast<int64_t>(tile.y0()) - kNoiseBorder;
+  const int64_t y1 = tile.y0() + tile.ysize() + kNoiseBorder;
+  for (int64_t y = y0; y < y1; y++) {
+    const bool group_row =
+        y >= static_cast<int64_t>(group.y0()) && y < group_y1;
+    for (int64_t x = x0; x < x1; x++) {
+      if (group_row && x >= static_cast<int64_t>(group.x0()) &&
+          x < group_x1) {
+        x = group_x1 - 1;
+        continue;
+      }
+      f(x, y);
+    }
+  }
+}
+
+}  // namespace
+
+void NoiseGenerator::Init(size_t seed, size_t xsize, size_t ysize) {
+  seed_ = seed;
+  xsize_ = xsize;
+  ysize_ = ysize;
+  xsize_groups_ = DivCeil(xsize, kGroupDim);
+  borders_.clear();
+  borders_.resize(xsize_groups_ * DivCeil(ysize, kGroupDim));
+}
+
+const std::vector<float>& NoiseGenerator::SetBorders(
+    size_t group, std::vector<float>&& borders) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (borders_[group].empty()) borders_[group] = std::move(borders);
+  return borders_[group];
+}
+
+const std::vector<float>& NoiseGenerator::Borders(size_t gx, size_t gy,
+                                                  Image3F* random) {
+  const size_t group_index = gy * xsize_groups_ + gx;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!borders_[group_index].empty()) return borders_[group_index];
+  }
+  const Rect group(gx * kGroupDim, gy * kGroupDim, kGroupDim, kGroupDim,
+                   xsize_, ysize_);
+  const Rect rect(NoiseStorage::kRandomX0, kNoiseBorder, group.xsize(),
+                  group.ysize());
+  RandomImage3(seed_ + group_index, rect, random);
+  return SetBorders(group_index, ExtractBorders(*random, rect));
+}
+
+void NoiseGenerator::Generate(const Rect& rect, NoiseStorage* storage) {
+  Image3F* JXL_RESTRICT random = &storage->random;
+  const size_t gx0 = rect.x0() / kGroupDim;
+  const size_t gx1 = DivCeil(rect.x0() + rect.xsize(), kGroupDim);
+  const size_t gy0 = rect.y0() / kGroupDim;
+  const size_t gy1 = DivCeil(rect.y0() + rect.ysize(), kGroupDim);
+  for (size_t gy = gy0; gy < gy1; gy++) {
+    for (size_t gx = gx0; gx < gx1; gx++) {
+      const size_t group_index = gy * xsize_groups_ + gx;
+      const Rect group(gx * kGroupDim, gy * kGroupDim, kGroupDim, kGroupDim,
+                       xsize_, ysize_);
+      const Rect tile = group.Intersection(rect);
+      // Position of the group in `random`.
+      const Rect group_rect(NoiseStorage::kRandomX0, kNoiseBorder,
+                            group.xsize(), group.ysize());
+
+      // The filter mirrors the random values at the frame borders. Returns
+      // the group that holds the value at (x, y), and the position there.
+      const auto locate = [&](int64_t x, int64_t y, size_t* gx_src,
+                              size_t* gy_src, size_t* x_src, size_t* y_src) {
+        const size_t mx = Mirror(x, xsize_);
+        const size_t my = Mirror(y, ysize_);
+        *gx_src = mx / kGroupDim;
+        *gy_src = my / kGroupDim;
+        *x_src = mx % kGroupDim;
+        *y_src = my % kGroupDim;
+      };
+
+      // Make sure the borders of the neighbours are available before `random`
+      // is used for this group.
+      size_t last_neighbour = group_index;
+      ForEachBorderPixel(group, tile, [&](int64_t x, int64_t y) {
+        size_t gxs, gys, xs, ys;
+        locate(x, y, &gxs, &gys, &xs, &ys);
+        const size_t neighbour = gys * xsize_groups_ + gxs;
+        if (neighbour == group_index || neighbour == last_neighbour) return;
+        Borders(gxs, gys, random);
+        last_neighbour = neighbour;
+      });
+
+      RandomImage3(seed_ + group_index, group_rect, random);
+      bool has_borders;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        has_borders = !borders_[group_index].empty();
+      }
+      if (!has_borders) {
+        SetBorders(group_index, ExtractBorders(*random, group_rect));
+      }
+      last_neighbour = group_index;
+
+      const std::vector<float>* borders = nullptr;
+      Rect src;
+      ForEachBorderPixel(group, tile, [&](int64_t x, int64_t y) {
+        size_t gxs, gys, xs, ys;
+        locate(x, y, &gxs, &gys, &xs, &ys);
+        const size_t neighbour = gys * xsize_groups_ + gxs;
+        const size_t bx = x - group.x0() + group_rect.x0();
+        const size_t by = y - group.y0() + group_rect.y0();
+        if (neighbour == group_index) {
+          for (size_t c = 0; c < 3; c++) {
+            random->PlaneRow(c, by)[bx] =
+                group_rect.ConstPlaneRow(*random, c, ys)[xs];
+          }
+          return;
+        }
+        if (neighbour != last_neighbour) {
+          // Already cached above, so this does not touch `random`.
+          borders = &Borders(gxs, gys, random);
+          src = Rect(gxs * kGroupDim, gys * kGroupDim, kGroupDim, kGroupDim,
+                     xsize_, ysize_);
+          last_neighbour = neighbour;
+        }
+        for (size_t c = 0; c < 3; c++) {
+          random->PlaneRow(c, by)[bx] =
+              BorderValue(*borders, src.xsize(), src.ysize(), c, xs, ys);
+        }
+      });
+
+      const Rect tile_in_random(tile.x0() - group.x0() + group_rect.x0(),
+                                tile.y0() - group.y0() + group_rect.y0(),
+                                tile.xsize(), tile.ysize());
+      const Rect tile_in_noise(tile.x0() - rect.x0(), tile.y0() - rect.y0(),
+                               tile.xsize(), tile.ysize());
+      HWY_DYNAMIC_DISPATCH(HighPassNoise)
+      (*random, tile_in_random, tile_in_noise, &storage->noise);
+    }
+  }
+}
+
 void DecodeFloatParam(float precision, float* val, BitReader* br) {
   const int absval_quant = br->ReadFixedBits<10>();
   *val = absval_quant / precision;
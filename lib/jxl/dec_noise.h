@@ -11,9 +11,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <mutex>
+#include <vector>
+
 #include "lib/jxl/aux_out_fwd.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/chroma_from_luma.h"
+#include "lib/jxl/common.h"
 #include "lib/jxl/dec_bit_reader.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/noise.h"
@@ -28,6 +32,53 @@ void AddNoise(const NoiseParams& noise_params, const Rect& noise_rect,
 
 void RandomImage3(size_t seed, const Rect& rect, Image3F* JXL_RESTRICT noise);
 
+// Per-thread storage for NoiseGenerator.
+struct NoiseStorage {
+  // Column of `random` where a group starts; keeps the group aligned for any
+  // vector size while leaving room for the border on the left.
+  static constexpr size_t kRandomX0 = 16;
+
+  // `tile_dim` is the largest width and height passed to Generate.
+  explicit NoiseStorage(size_t tile_dim)
+      : noise(tile_dim, tile_dim),
+        random(kRandomX0 + kGroupDim + 2, kGroupDim + 4) {}
+
+  // High-passed noise of the last rect passed to NoiseGenerator::Generate.
+  Image3F noise;
+  // Random values of one group, with a border of 2 pixels.
+  Image3F random;
+};
+
+// Generates the noise of a frame on demand, so that only the rendered parts of
+// the frame are generated and no frame-sized image is needed. The random
+// values come from one RNG per kGroupDim x kGroupDim group, seeded with the
+// frame seed plus the group index. As the high-pass filter reads 2 pixels
+// across group borders, those borders are cached for every generated group.
+class NoiseGenerator {
+ public:
+  // `xsize` and `ysize` are the dimensions of the (upsampled) frame.
+  void Init(size_t seed, size_t xsize, size_t ysize);
+
+  // Stores the noise of `rect`, in frame coordinates, at the top-left corner of
+  // storage->noise. Can be called concurrently with different `storage`.
+  void Generate(const Rect& rect, NoiseStorage* storage);
+
+ private:
+  // Returns the cached borders of a group, generating them if needed.
+  const std::vector<float>& Borders(size_t gx, size_t gy, Image3F* random);
+  const std::vector<float>& SetBorders(size_t group,
+                                       std::vector<float>&& borders);
+
+  size_t seed_ = 0;
+  size_t xsize_ = 0;
+  size_t ysize_ = 0;
+  size_t xsize_groups_ = 0;
+
+  // Guards borders_. An entry is never modified once it is not empty.
+  std::mutex mutex_;
+  std::vector<std::vector<float>> borders_;
+};
+
 // Must only call if FrameHeader.flags.kNoise.
 Status DecodeNoise(BitReader* br, NoiseParams* noise_params);
 
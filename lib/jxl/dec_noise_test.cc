@@ -0,0 +1,158 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/dec_noise.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/common.h"
+#include "lib/jxl/convolve.h"
+#include "lib/jxl/image.h"
+
+namespace jxl {
+namespace {
+
+constexpr size_t kSeed = 1234;
+
+// Noise of a whole frame, computed as before NoiseGenerator: the random values
+// of all groups in a frame-sized image, high-passed with Symmetric5.
+Image3F FullFrameNoise(size_t xsize, size_t ysize) {
+  Image3F noise(xsize, ysize);
+  const size_t num_x_groups = DivCeil(xsize, kGroupDim);
+  const size_t num_y_groups = DivCeil(ysize, kGroupDim);
+  for (size_t gy = 0; gy < num_y_groups; gy++) {
+    for (size_t gx = 0; gx < num_x_groups; gx++) {
+      const Rect rect(gx * kGroupDim, gy * kGroupDim, kGroupDim, kGroupDim,
+                      xsize, ysize);
+      RandomImage3(kSeed + gy * num_x_groups + gx, rect, &noise);
+    }
+  }
+  // 4 * (1 - box kernel)
+  const WeightsSymmetric5 weights{{HWY_REP4(-3.84)}, {HWY_REP4(0.16)},
+                                  {HWY_REP4(0.16)},  {HWY_REP4(0.16)},
+                                  {HWY_REP4(0.16)},  {HWY_REP4(0.16)}};
+  Image3F out(xsize, ysize);
+  for (size_t c = 0; c < 3; c++) {
+    Symmetric5(noise.Plane(c), Rect(noise), weights, /*pool=*/nullptr,
+               &out.Plane(c));
+  }
+  return out;
+}
+
+// Checks that the noise generated for `rect` matches `expected`.
+void ExpectSameNoise(const Image3F& expected, const Rect& rect,
+                     const NoiseStorage& storage) {
+  size_t mismatches = 0;
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < rect.ysize(); y++) {
+      const float* JXL_RESTRICT row_expected =
+          rect.ConstPlaneRow(expected, c, y);
+      const float* JXL_RESTRICT row = storage.noise.ConstPlaneRow(c, y);
+      for (size_t x = 0; x < rect.xsize(); x++) {
+        if (row_expected[x] == row[x]) continue;
+        ADD_FAILURE() << "noise mismatch in rect " << rect.x0() << ","
+                      << rect.y0() << " " << rect.xsize() << "x"
+                      << rect.ysize() << " at " << x << "," << y << " c" << c
+                      << ": " << row_expected[x] << " != " << row[x];
+        if (++mismatches > 4) return;
+      }
+    }
+  }
+}
+
+// Returns the positions of the tile borders along a dimension of `size`
+// pixels: 0, then `first` and every `step` pixels after it, then `size`.
+std::vector<size_t> TileBorders(size_t size, size_t first, size_t step) {
+  std::vector<size_t> borders = {0};
+  for (size_t pos = (first == 0 ? step : first); pos < size; pos += step) {
+    borders.push_back(pos);
+  }
+  borders.push_back(size);
+  return borders;
+}
+
+// Generates the noise of the frame in tiles of `tile_xsize` x `tile_ysize`,
+// starting at (x0, y0) so that the tiles are not aligned to groups, and in
+// reverse order so that the borders of most groups are cached before the
+// groups themselves are generated.
+void TestTiles(size_t xsize, size_t ysize, size_t x0, size_t y0,
+               size_t tile_xsize, size_t tile_ysize) {
+  const Image3F expected = FullFrameNoise(xsize, ysize);
+  NoiseGenerator generator;
+  generator.Init(kSeed, xsize, ysize);
+  NoiseStorage storage(std::max(xsize, ysize));
+  const std::vector<size_t> xs = TileBorders(xsize, x0, tile_xsize);
+  const std::vector<size_t> ys = TileBorders(ysize, y0, tile_ysize);
+  for (size_t iy = ys.size() - 1; iy > 0; iy--) {
+    for (size_t ix = xs.size() - 1; ix > 0; ix--) {
+      const Rect tile(xs[ix - 1], ys[iy - 1], xs[ix] - xs[ix - 1],
+                      ys[iy] - ys[iy - 1]);
+      generator.Generate(tile, &storage);
+      ExpectSameNoise(expected, tile, storage);
+    }
+  }
+}
+
+// Generates the noise of `rect` alone, with no cached borders.
+void TestRect(size_t xsize, size_t ysize, const Rect& rect) {
+  const Image3F expected = FullFrameNoise(xsize, ysize);
+  NoiseGenerator generator;
+  generator.Init(kSeed, xsize, ysize);
+  NoiseStorage storage(std::max(rect.xsize(), rect.ysize()));
+  generator.Generate(rect, &storage);
+  ExpectSameNoise(expected, rect, storage);
+}
+
+TEST(NoiseTest, WholeFrame) {
+  for (size_t size : {1, 2, 3, 5, 17, 64, 255, 256, 257, 300}) {
+    TestRect(size, size, Rect(0, 0, size, size));
+  }
+  TestRect(300, 200, Rect(0, 0, 300, 200));
+  TestRect(513, 259, Rect(0, 0, 513, 259));
+}
+
+TEST(NoiseTest, ThinFrames) {
+  for (size_t size : {1, 2, 3, 4, 5, 131, 256, 257, 520}) {
+    TestRect(1, size, Rect(0, 0, 1, size));
+    TestRect(size, 1, Rect(0, 0, size, 1));
+    TestRect(2, size, Rect(0, 0, 2, size));
+    TestRect(size, 3, Rect(0, 0, size, 3));
+  }
+  TestRect(1, 520, Rect(0, 255, 1, 3));
+  TestRect(520, 1, Rect(254, 0, 5, 1));
+}
+
+TEST(NoiseTest, UnalignedRects) {
+  TestRect(300, 300, Rect(3, 5, 61, 17));
+  TestRect(300, 300, Rect(1, 1, 1, 1));
+  TestRect(300, 300, Rect(255, 255, 1, 1));
+  TestRect(300, 300, Rect(299, 299, 1, 1));
+  TestRect(300, 300, Rect(298, 7, 2, 100));
+}
+
+TEST(NoiseTest, RectsAcrossGroups) {
+  TestRect(600, 600, Rect(250, 250, 20, 20));
+  TestRect(600, 600, Rect(254, 511, 260, 3));
+  TestRect(600, 600, Rect(100, 200, 500, 400));
+  TestRect(513, 515, Rect(255, 257, 258, 258));
+  TestRect(513, 515, Rect(511, 511, 2, 4));
+}
+
+TEST(NoiseTest, Tiles) {
+  TestTiles(600, 550, 0, 0, 64, 64);
+  TestTiles(600, 550, 37, 11, 64, 64);
+  TestTiles(513, 259, 1, 255, 97, 31);
+  TestTiles(257, 1, 3, 0, 50, 1);
+  TestTiles(1, 257, 0, 129, 1, 256);
+  TestTiles(300, 300, 0, 0, 300, 300);
+}
+
+}  // namespace
+}  // namespace jxl
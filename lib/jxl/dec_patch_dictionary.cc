@@ -175,27 +175,37 @@ int PatchDictionary::GetReferences() const {
 void PatchDictionary::ComputePatchCache() {
   patch_starts_.clear();
   sorted_patches_.clear();
+  num_columns_ = 0;
   if (positions_.empty()) return;
+  size_t num_rows = 0;
+  for (const PatchPosition& pos : positions_) {
+    num_rows = std::max(num_rows, pos.y + pos.ref_pos.ysize);
+    num_columns_ = std::max(
+        num_columns_, DivCeil(pos.x + pos.ref_pos.xsize, kPatchColumnWidth));
+  }
   std::vector<std::pair<size_t, size_t>> sorted_patches_y;
   for (size_t i = 0; i < positions_.size(); i++) {
     const PatchPosition& pos = positions_[i];
+    const size_t column0 = pos.x / kPatchColumnWidth;
+    const size_t column1 =
+        (pos.x + pos.ref_pos.xsize - 1) / kPatchColumnWidth;
     for (size_t y = pos.y; y < pos.y + pos.ref_pos.ysize; y++) {
-      sorted_patches_y.emplace_back(y, i);
+      for (size_t column = column0; column <= column1; column++) {
+        sorted_patches_y.emplace_back(y * num_columns_ + column, i);
+      }
     }
   }
   // The relative order of patches that affect the same pixels is preserved.
   // This is important for patches that have a blend mode different from kAdd.
   std::sort(sorted_patches_y.begin(), sorted_patches_y.end());
-  patch_starts_.resize(sorted_patches_y.back().first + 2,
-                       sorted_patches_y.size());
+  patch_starts_.assign(num_rows * num_columns_ + 1, 0);
   sorted_patches_.resize(sorted_patches_y.size());
   for (size_t i = 0; i < sorted_patches_y.size(); i++) {
     sorted_patches_[i] = sorted_patches_y[i].second;
-    patch_starts_[sorted_patches_y[i].first] =
-        std::min(patch_starts_[sorted_patches_y[i].first], i);
+    patch_starts_[sorted_patches_y[i].first + 1]++;
   }
-  for (size_t i = patch_starts_.size() - 1; i > 0; i--) {
-    patch_starts_[i - 1] = std::min(patch_starts_[i], patch_starts_[i - 1]);
+  for (size_t i = 0; i + 1 < patch_starts_.size(); i++) {
+    patch_starts_[i + 1] += patch_starts_[i];
   }
 }
 
@@ -207,41 +217,53 @@ Status PatchDictionary::AddTo(Image3F* opsin, const Rect& opsin_rect,
   size_t num_ec = shared_->metadata->m.num_extra_channels;
   std::vector<const float*> fg_ptrs(3 + num_ec);
   std::vector<float*> bg_ptrs(3 + num_ec);
+  const size_t rect_x1 = image_rect.x0() + image_rect.xsize();
   for (size_t y = image_rect.y0(); y < image_rect.y0() + image_rect.ysize();
        y++) {
-    if (y + 1 >= patch_starts_.size()) continue;
-    for (size_t id = patch_starts_[y]; id < patch_starts_[y + 1]; id++) {
-      const PatchPosition& pos = positions_[sorted_patches_[id]];
-      size_t by = pos.y;
-      size_t bx = pos.x;
-      size_t xsize = pos.ref_pos.xsize;
-      JXL_DASSERT(y >= by);
-      JXL_DASSERT(y < by + pos.ref_pos.ysize);
-      size_t iy = y - by;
-      size_t ref = pos.ref_pos.ref;
-      if (bx >= image_rect.x0() + image_rect.xsize()) continue;
-      if (bx + xsize < image_rect.x0()) continue;
-      size_t x0 = std::max(bx, image_rect.x0());
-      size_t x1 = std::min(bx + xsize, image_rect.x0() + image_rect.xsize());
-      for (size_t c = 0; c < 3; c++) {
-        fg_ptrs[c] =
-            shared_->reference_frames[ref].frame->color()->ConstPlaneRow(
-                c, pos.ref_pos.y0 + iy) +
-            pos.ref_pos.x0 + x0 - bx;
-        bg_ptrs[c] = opsin_rect.PlaneRow(opsin, c, y - image_rect.y0()) + x0 -
-                     image_rect.x0();
-      }
-      for (size_t i = 0; i < num_ec; i++) {
-        fg_ptrs[3 + i] =
-            shared_->reference_frames[ref].frame->extra_channels()[i].ConstRow(
-                pos.ref_pos.y0 + iy) +
-            pos.ref_pos.x0 + x0 - bx;
-        bg_ptrs[3 + i] = extra_channels[i] + x0 - image_rect.x0();
+    if ((y + 1) * num_columns_ >= patch_starts_.size()) continue;
+    const size_t* row_starts = patch_starts_.data() + y * num_columns_;
+    // A patch is listed in every column it overlaps, so each column only
+    // blends the pixels inside of it.
+    for (size_t column = image_rect.x0() / kPatchColumnWidth;
+         column < num_columns_ && column * kPatchColumnWidth < rect_x1;
+         column++) {
+      const size_t column_x0 =
+          std::max(image_rect.x0(), column * kPatchColumnWidth);
+      const size_t column_x1 =
+          std::min(rect_x1, (column + 1) * kPatchColumnWidth);
+      for (size_t id = row_starts[column]; id < row_starts[column + 1]; id++) {
+        const PatchPosition& pos = positions_[sorted_patches_[id]];
+        size_t by = pos.y;
+        size_t bx = pos.x;
+        size_t xsize = pos.ref_pos.xsize;
+        JXL_DASSERT(y >= by);
+        JXL_DASSERT(y < by + pos.ref_pos.ysize);
+        size_t iy = y - by;
+        size_t ref = pos.ref_pos.ref;
+        if (bx >= column_x1) continue;
+        if (bx + xsize <= column_x0) continue;
+        size_t x0 = std::max(bx, column_x0);
+        size_t x1 = std::min(bx + xsize, column_x1);
+        for (size_t c = 0; c < 3; c++) {
+          fg_ptrs[c] =
+              shared_->reference_frames[ref].frame->color()->ConstPlaneRow(
+                  c, pos.ref_pos.y0 + iy) +
+              pos.ref_pos.x0 + x0 - bx;
+          bg_ptrs[c] = opsin_rect.PlaneRow(opsin, c, y - image_rect.y0()) +
+                       x0 - image_rect.x0();
+        }
+        for (size_t i = 0; i < num_ec; i++) {
+          fg_ptrs[3 + i] = shared_->reference_frames[ref]
+                               .frame->extra_channels()[i]
+                               .ConstRow(pos.ref_pos.y0 + iy) +
+                           pos.ref_pos.x0 + x0 - bx;
+          bg_ptrs[3 + i] = extra_channels[i] + x0 - image_rect.x0();
+        }
+        JXL_RETURN_IF_ERROR(
+            PerformBlending(bg_ptrs.data(), fg_ptrs.data(), bg_ptrs.data(),
+                            x1 - x0, pos.blending[0], pos.blending.data() + 1,
+                            shared_->metadata->m.extra_channel_info));
       }
-      JXL_RETURN_IF_ERROR(
-          PerformBlending(bg_ptrs.data(), fg_ptrs.data(), bg_ptrs.data(),
-                          x1 - x0, pos.blending[0], pos.blending.data() + 1,
-                          shared_->metadata->m.extra_channel_info));
     }
   }
   return true;
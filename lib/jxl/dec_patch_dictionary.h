@@ -23,6 +23,10 @@
 
 namespace jxl {
 
+// Width of the columns in which the patches of each row are indexed, so that
+// applying the patches to a rect only visits the ones that overlap it.
+constexpr size_t kPatchColumnWidth = 256;
+
 enum class PatchBlendMode : uint8_t {
   // The new values are the old ones. Useful to skip some channels.
   kNone = 0,
@@ -137,18 +141,21 @@ class PatchDictionary {
   const PassesSharedState* shared_;
   std::vector<PatchPosition> positions_;
 
-  // Patch occurrences sorted by y.
+  // Patch occurrences sorted by y and then by column of kPatchColumnWidth
+  // pixels, with a patch listed in every column it overlaps.
   std::vector<size_t> sorted_patches_;
-  // Index of the first patch for each y value.
+  // Index of the first patch for each (y, column) pair, at
+  // y * num_columns_ + column.
   std::vector<size_t> patch_starts_;
+  size_t num_columns_ = 0;
 
-  // Patch IDs in position [patch_starts_[y], patch_start_[y+1]) of
-  // sorted_patches_ are all the patches that intersect the horizontal line at
-  // y.
+  // Patch IDs in position [patch_starts_[i], patch_start_[i+1]) of
+  // sorted_patches_, with i = y * num_columns_ + column, are all the patches
+  // that intersect the horizontal line at y inside of the column.
   // The relative order of patches that affect the same pixels is the same -
   // important when applying patches is noncommutative.
 
-  // Compute patches_by_y_ after updating positions_.
+  // Compute the patch cache after updating positions_.
   void ComputePatchCache();
 };
 
@@ -418,10 +418,13 @@ HWY_EXPORT(DoYCbCrUpsampling);
 void UndoXYB(const Image3F& src, Image3F* dst,
              const OutputEncodingInfo& output_info, ThreadPool* pool) {
   CopyImageTo(src, dst);
-  pool->Run(0, src.ysize(), ThreadPool::SkipInit(), [&](int y, int /*thread*/) {
-    JXL_CHECK(HWY_DYNAMIC_DISPATCH(UndoXYBInPlace)(dst, Rect(*dst).Line(y),
-                                                   output_info));
-  });
+  RunOnPool(
+      pool, 0, src.ysize(), ThreadPool::SkipInit(),
+      [&](int y, int /*thread*/) {
+        JXL_CHECK(HWY_DYNAMIC_DISPATCH(UndoXYBInPlace)(dst, Rect(*dst).Line(y),
+                                                       output_info));
+      },
+      "UndoXYB");
 }
 
 namespace {
@@ -672,7 +675,7 @@ Status FinalizeImageRect(
     frame_rect_for_ycbcr_upsampling =
         Rect(frame_rect.x0() - ifbx0, frame_rect.y0() - ifby0,
              rect_for_if_input.xsize(), rect_for_if_input.ysize());
-    storage_for_if = &dec_state->upsampling_input_storage[thread];
+    storage_for_if = &dec_state->scratch.upsampling_input_storage[thread];
   }
 
   // +--------------------------- STEP 1.5 ------------------------------+
@@ -687,14 +690,14 @@ Status FinalizeImageRect(
       // The per-thread output is used for the first time here. Poison the temp
       // image on this thread to prevent leaking initialized data from a
       // previous run in this thread in msan builds.
-      msan::PoisonImage(dec_state->ycbcr_out_images[thread].Plane(c));
+      msan::PoisonImage(dec_state->scratch.ycbcr_out_images[thread].Plane(c));
       HWY_DYNAMIC_DISPATCH(DoYCbCrUpsampling)
       (hs, vs, &input_image->Plane(c), rect_for_if_input,
        frame_rect_for_ycbcr_upsampling, frame_dim,
-       &dec_state->ycbcr_out_images[thread].Plane(c), lf,
-       &dec_state->ycbcr_temp_images[thread]);
+       &dec_state->scratch.ycbcr_out_images[thread].Plane(c), lf,
+       &dec_state->scratch.ycbcr_temp_images[thread]);
     }
-    input = &dec_state->ycbcr_out_images[thread];
+    input = &dec_state->scratch.ycbcr_out_images[thread];
   }
 
   // Variables for upsampling and filtering.
@@ -714,7 +717,7 @@ Status FinalizeImageRect(
   ssize_t ensure_padding_filter_y0 = 0;
   ssize_t ensure_padding_filter_y1 = 0;
   if (lf.epf_iters != 0 || lf.gab) {
-    fp = &dec_state->filter_pipelines[thread];
+    fp = &dec_state->scratch.filter_pipelines[thread];
   }
 
   // +----------------------------- STEP 2 ------------------------------+
@@ -727,12 +730,14 @@ Status FinalizeImageRect(
     size_t log2_upsampling = CeilLog2Nonzero(frame_header.upsampling);
     if (storage_for_if == output_color) {
       storage_for_if =
-          &dec_state->output_pixel_data_storage[log2_upsampling][thread];
+          &dec_state->scratch
+               .output_pixel_data_storage[log2_upsampling][thread];
       rect_for_if_storage =
           Rect(0, 0, rect_for_if_storage.xsize(), rect_for_if_storage.ysize());
     }
     output_pixel_data_storage =
-        &dec_state->output_pixel_data_storage[log2_upsampling][thread];
+        &dec_state->scratch
+             .output_pixel_data_storage[log2_upsampling][thread];
     upsampled_frame_rect_for_storage =
         Rect(0, 0, upsampled_frame_rect.xsize(), upsampled_frame_rect.ysize());
     if (frame_header.upsampling == 1 && fp == nullptr) {
@@ -820,7 +825,7 @@ Status FinalizeImageRect(
           &output_image->extra_channels()[ec], upsampled_frame_rect,
           static_cast<ssize_t>(ec_image_rect.y0()) -
               static_cast<ssize_t>(extra_channels[ec].second.y0()),
-          ecys, dec_state->upsampler_storage[thread].get());
+          ecys, dec_state->scratch.upsampler_storage[thread].get());
       extra_channels_for_patches.emplace_back(
           &output_image->extra_channels()[ec], upsampled_frame_rect);
     }
@@ -871,6 +876,12 @@ Status FinalizeImageRect(
                                thread, storage_for_if, rect_for_if_storage);
   }
 
+  if (frame_header.flags & FrameHeader::kNoise) {
+    PROFILER_ZONE("GenerateNoise");
+    dec_state->noise.Generate(upsampled_frame_rect,
+                              &dec_state->scratch.noise_storage[thread]);
+  }
+
   // +----------------------------- STEP 5 ------------------------------+
   // | Run the prepared pipeline of operations.                          |
   // +-------------------------------------------------------------------+
@@ -973,7 +984,8 @@ Status FinalizeImageRect(
           upsampled_frame_rect_for_storage.Lines(upsampled_available_y, num_ys),
           static_cast<ssize_t>(frame_rect.y0()) -
               static_cast<ssize_t>(rect_for_upsampling.y0()),
-          frame_dim.ysize_padded, dec_state->upsampler_storage[thread].get());
+          frame_dim.ysize_padded,
+          dec_state->scratch.upsampler_storage[thread].get());
       if (late_ec_upsample) {
         for (size_t ec = 0; ec < extra_channels.size(); ec++) {
           // Upsampler takes care of mirroring, and checks "physical"
@@ -986,7 +998,8 @@ Status FinalizeImageRect(
               upsampled_frame_rect.Lines(upsampled_available_y, num_ys),
               static_cast<ssize_t>(frame_rect.y0()) -
                   static_cast<ssize_t>(extra_channels[ec].second.y0()),
-              frame_dim.ysize, dec_state->upsampler_storage[thread].get());
+              frame_dim.ysize,
+              dec_state->scratch.upsampler_storage[thread].get());
         }
       }
       available_y = upsampled_available_y;
@@ -1001,8 +1014,8 @@ Status FinalizeImageRect(
     if (frame_header.flags & FrameHeader::kNoise) {
       PROFILER_ZONE("AddNoise");
       AddNoise(image_features.noise_params,
-               upsampled_frame_rect.Lines(available_y, num_ys),
-               dec_state->noise,
+               Rect(0, available_y, upsampled_frame_rect.xsize(), num_ys),
+               dec_state->scratch.noise_storage[thread].noise,
                upsampled_frame_rect_for_storage.Lines(available_y, num_ys),
                dec_state->shared_storage.cmap, output_pixel_data_storage);
     }
@@ -1079,7 +1092,7 @@ Status FinalizeImageRect(
             line_buffers[3] = dec_state->opaque_alpha.data();
           }
           std::vector<float>& interleaved =
-              dec_state->pixel_callback_rows[thread];
+              dec_state->scratch.pixel_callback_rows[thread];
           size_t j = 0;
           for (size_t i = 0; i < image_line_rect.xsize(); i++) {
             interleaved[j++] = line_buffers[0][i];
@@ -1089,7 +1102,8 @@ Status FinalizeImageRect(
               interleaved[j++] = line_buffers[3][i];
             }
           }
-          dec_state->pixel_callback(interleaved.data(), image_line_rect.x0(),
+          dec_state->pixel_callback(interleaved.data(), thread,
+                                    image_line_rect.x0(),
                                     image_line_rect.y0() + iy,
                                     image_line_rect.xsize());
         }
@@ -1114,6 +1128,8 @@ Status FinalizeFrameDecoding(ImageBundle* decoded,
         Rect rect(x, y, kGroupDim, kGroupDim, frame_dim.xsize_padded,
                   frame_dim.ysize_padded);
         if (rect.xsize() == 0 || rect.ysize() == 0) continue;
+        const Rect rendered = rect.Intersection(dec_state->render_rect);
+        if (rendered.xsize() == 0 || rendered.ysize() == 0) continue;
         rects_to_process.push_back(rect);
       }
     }
@@ -1156,10 +1172,10 @@ Status FinalizeFrameDecoding(ImageBundle* decoded,
         Rect group_data_rect(xstart, ystart, rh.xsize(), rh.ysize());
         // Poison the image in this thread to prevent leaking initialized data
         // from a previous run in this thread in msan builds.
-        msan::PoisonImage(dec_state->group_data[thread].Plane(c));
+        msan::PoisonImage(dec_state->scratch.group_data[thread].Plane(c));
         CopyImageToWithPadding(
             rh, dec_state->decoded.Plane(c), dec_state->FinalizeRectPadding(),
-            group_data_rect, &dec_state->group_data[thread].Plane(c));
+            group_data_rect, &dec_state->scratch.group_data[thread].Plane(c));
       }
       Rect group_data_rect(xstart, ystart, rects_to_process[rect_id].xsize(),
                            rects_to_process[rect_id].ysize());
@@ -1172,9 +1188,9 @@ Status FinalizeFrameDecoding(ImageBundle* decoded,
         if (frame_header.extra_channel_upsampling[i] != 1) {
           Rect ec_input_rect(kBlockDim, 2, r.xsize(), r.ysize());
           auto eti =
-              &dec_state
-                   ->ec_temp_images[thread * decoded->extra_channels().size() +
-                                    i];
+              &dec_state->scratch
+                   .ec_temp_images[thread * decoded->extra_channels().size() +
+                                   i];
           // Poison the temp image on this thread to prevent leaking initialized
           // data from a previous run in this thread in msan builds.
           msan::PoisonImage(*eti);
@@ -1187,9 +1203,9 @@ Status FinalizeFrameDecoding(ImageBundle* decoded,
           ec_rects.emplace_back(&decoded->extra_channels()[i], r);
         }
       }
-      if (!FinalizeImageRect(&dec_state->group_data[thread], group_data_rect,
-                             ec_rects, dec_state, thread, decoded,
-                             rects_to_process[rect_id])) {
+      if (!FinalizeImageRect(&dec_state->scratch.group_data[thread],
+                             group_data_rect, ec_rects, dec_state, thread,
+                             decoded, rects_to_process[rect_id])) {
         apply_features_ok = false;
       }
     };
@@ -1210,7 +1226,19 @@ Status FinalizeFrameDecoding(ImageBundle* decoded,
     dec_state->pre_color_transform_frame.ShrinkTo(xsize, ysize);
   }
 
-  if (!skip_blending && ImageBlender::NeedsBlending(dec_state)) {
+  if (!skip_blending) {
+    JXL_RETURN_IF_ERROR(BlendFrame(decoded, dec_state, pool));
+  }
+
+  return true;
+}
+
+Status BlendFrame(ImageBundle* decoded, PassesDecoderState* dec_state,
+                  ThreadPool* pool) {
+  const FrameHeader& frame_header = dec_state->shared->frame_header;
+  const FrameDimensions& frame_dim = dec_state->shared->frame_dim;
+
+  if (ImageBlender::NeedsBlending(dec_state)) {
     if (dec_state->pre_color_transform_frame.xsize() != 0) {
       // Extra channels are going to be modified. Make a copy.
       dec_state->pre_color_transform_ec.clear();
@@ -36,6 +36,13 @@ Status FinalizeFrameDecoding(ImageBundle* JXL_RESTRICT decoded,
                              PassesDecoderState* dec_state, ThreadPool* pool,
                              bool force_fir, bool skip_blending, bool move_ec);
 
+// Blends the frame in `decoded`, of the size and origin given by the frame
+// header, on top of the reference frames, replacing `decoded` by the resulting
+// image of the full image size. Does nothing if the frame does not need
+// blending. Called by FinalizeFrameDecoding unless `skip_blending` is set.
+Status BlendFrame(ImageBundle* JXL_RESTRICT decoded,
+                  PassesDecoderState* dec_state, ThreadPool* pool);
+
 // Renders the `frame_rect` portion of the final image to `output_image`
 // (unless the frame is upsampled - in which case, `frame_rect` is scaled
 // accordingly). `input_rect` should have the same shape. `input_rect` always
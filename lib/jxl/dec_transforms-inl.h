@@ -12,6 +12,8 @@
 
 #include <stddef.h>
 
+#include <algorithm>
+
 #include <hwy/highway.h>
 
 #include "lib/jxl/ac_strategy.h"
@@ -449,11 +451,38 @@ void AFVTransformToPixels(const float* JXL_RESTRICT coefficients,
       scratch_space);
 }
 
-HWY_MAYBE_UNUSED void TransformToPixels(const AcStrategy::Type strategy,
-                                        float* JXL_RESTRICT coefficients,
-                                        float* JXL_RESTRICT pixels,
-                                        size_t pixels_stride,
-                                        float* scratch_space) {
+// Computes the number of leading rows and columns of the rows x cols block of
+// coefficients that contain non-zero values. The number of columns is only
+// exact when it is at most 1, and is otherwise rounded up to a whole vector.
+HWY_MAYBE_UNUSED void NonZeroExtents(const float* JXL_RESTRICT coefficients,
+                                     size_t rows, size_t cols,
+                                     size_t* nonzero_rows,
+                                     size_t* nonzero_cols) {
+  const HWY_CAPPED(float, kBlockDim) d;
+  const auto zero = Zero(d);
+  *nonzero_rows = 0;
+  *nonzero_cols = 0;
+  for (size_t y = 0; y < rows; y++) {
+    for (size_t x = 0; x < cols; x += Lanes(d)) {
+      if (AllTrue(Load(d, coefficients + y * cols + x) == zero)) continue;
+      *nonzero_rows = y + 1;
+      *nonzero_cols = std::max(*nonzero_cols, x + Lanes(d));
+    }
+  }
+  if (*nonzero_rows != 1 || *nonzero_cols != Lanes(d)) return;
+  *nonzero_cols = 1;
+  for (size_t x = 1; x < Lanes(d); x++) {
+    if (coefficients[x] != 0.0f) *nonzero_cols = x + 1;
+  }
+}
+
+// Inverse of TransformFromPixels. If given, nonzero_rows and nonzero_cols (as
+// computed by NonZeroExtents) allow skipping part of the work for DCTs.
+HWY_MAYBE_UNUSED void TransformToPixels(
+    const AcStrategy::Type strategy, float* JXL_RESTRICT coefficients,
+    float* JXL_RESTRICT pixels, size_t pixels_stride, float* scratch_space,
+    size_t nonzero_rows = AcStrategy::kMaxBlockDim,
+    size_t nonzero_cols = AcStrategy::kMaxBlockDim) {
   using Type = AcStrategy::Type;
   switch (strategy) {
     case Type::IDENTITY: {
@@ -583,55 +612,55 @@ HWY_MAYBE_UNUSED void TransformToPixels(const AcStrategy::Type strategy,
     case Type::DCT16X16: {
       PROFILER_ZONE("IDCT 16");
       ComputeScaledIDCT<16, 16>()(coefficients, DCTTo(pixels, pixels_stride),
-                                  scratch_space);
+                                  scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT16X8: {
       PROFILER_ZONE("IDCT 16x8");
       ComputeScaledIDCT<16, 8>()(coefficients, DCTTo(pixels, pixels_stride),
-                                 scratch_space);
+                                 scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT8X16: {
       PROFILER_ZONE("IDCT 8x16");
       ComputeScaledIDCT<8, 16>()(coefficients, DCTTo(pixels, pixels_stride),
-                                 scratch_space);
+                                 scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT32X8: {
       PROFILER_ZONE("IDCT 32x8");
       ComputeScaledIDCT<32, 8>()(coefficients, DCTTo(pixels, pixels_stride),
-                                 scratch_space);
+                                 scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT8X32: {
       PROFILER_ZONE("IDCT 8x32");
       ComputeScaledIDCT<8, 32>()(coefficients, DCTTo(pixels, pixels_stride),
-                                 scratch_space);
+                                 scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT32X16: {
       PROFILER_ZONE("IDCT 32x16");
       ComputeScaledIDCT<32, 16>()(coefficients, DCTTo(pixels, pixels_stride),
-                                  scratch_space);
+                                  scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT16X32: {
       PROFILER_ZONE("IDCT 16x32");
       ComputeScaledIDCT<16, 32>()(coefficients, DCTTo(pixels, pixels_stride),
-                                  scratch_space);
+                                  scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT32X32: {
       PROFILER_ZONE("IDCT 32");
       ComputeScaledIDCT<32, 32>()(coefficients, DCTTo(pixels, pixels_stride),
-                                  scratch_space);
+                                  scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT: {
       PROFILER_ZONE("IDCT 8");
       ComputeScaledIDCT<8, 8>()(coefficients, DCTTo(pixels, pixels_stride),
-                                scratch_space);
+                                scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::AFV0: {
@@ -657,55 +686,55 @@ HWY_MAYBE_UNUSED void TransformToPixels(const AcStrategy::Type strategy,
     case Type::DCT64X32: {
       PROFILER_ZONE("IDCT 64x32");
       ComputeScaledIDCT<64, 32>()(coefficients, DCTTo(pixels, pixels_stride),
-                                  scratch_space);
+                                  scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT32X64: {
       PROFILER_ZONE("IDCT 32x64");
       ComputeScaledIDCT<32, 64>()(coefficients, DCTTo(pixels, pixels_stride),
-                                  scratch_space);
+                                  scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT64X64: {
       PROFILER_ZONE("IDCT 64");
       ComputeScaledIDCT<64, 64>()(coefficients, DCTTo(pixels, pixels_stride),
-                                  scratch_space);
+                                  scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT128X64: {
       PROFILER_ZONE("IDCT 128x64");
       ComputeScaledIDCT<128, 64>()(coefficients, DCTTo(pixels, pixels_stride),
-                                   scratch_space);
+                                   scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT64X128: {
       PROFILER_ZONE("IDCT 64x128");
       ComputeScaledIDCT<64, 128>()(coefficients, DCTTo(pixels, pixels_stride),
-                                   scratch_space);
+                                   scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT128X128: {
       PROFILER_ZONE("IDCT 128");
       ComputeScaledIDCT<128, 128>()(coefficients, DCTTo(pixels, pixels_stride),
-                                    scratch_space);
+                                    scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT256X128: {
       PROFILER_ZONE("IDCT 256x128");
       ComputeScaledIDCT<256, 128>()(coefficients, DCTTo(pixels, pixels_stride),
-                                    scratch_space);
+                                    scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT128X256: {
       PROFILER_ZONE("IDCT 128x256");
       ComputeScaledIDCT<128, 256>()(coefficients, DCTTo(pixels, pixels_stride),
-                                    scratch_space);
+                                    scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::DCT256X256: {
       PROFILER_ZONE("IDCT 256");
       ComputeScaledIDCT<256, 256>()(coefficients, DCTTo(pixels, pixels_stride),
-                                    scratch_space);
+                                    scratch_space, nonzero_rows, nonzero_cols);
       break;
     }
     case Type::kNumValidStrategies:
@@ -20,9 +20,18 @@ HWY_EXPORT(TransformToPixels);
 void TransformToPixels(AcStrategy::Type strategy,
                        float* JXL_RESTRICT coefficients,
                        float* JXL_RESTRICT pixels, size_t pixels_stride,
-                       float* scratch_space) {
-  return HWY_DYNAMIC_DISPATCH(TransformToPixels)(strategy, coefficients, pixels,
-                                                 pixels_stride, scratch_space);
+                       float* scratch_space, size_t nonzero_rows,
+                       size_t nonzero_cols) {
+  return HWY_DYNAMIC_DISPATCH(TransformToPixels)(
+      strategy, coefficients, pixels, pixels_stride, scratch_space,
+      nonzero_rows, nonzero_cols);
+}
+
+HWY_EXPORT(NonZeroExtents);
+void NonZeroExtents(const float* JXL_RESTRICT coefficients, size_t rows,
+                    size_t cols, size_t* nonzero_rows, size_t* nonzero_cols) {
+  return HWY_DYNAMIC_DISPATCH(NonZeroExtents)(coefficients, rows, cols,
+                                              nonzero_rows, nonzero_cols);
 }
 
 HWY_EXPORT(LowestFrequenciesFromDC);
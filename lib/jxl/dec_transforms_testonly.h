@@ -19,7 +19,12 @@ namespace jxl {
 void TransformToPixels(AcStrategy::Type strategy,
                        float* JXL_RESTRICT coefficients,
                        float* JXL_RESTRICT pixels, size_t pixels_stride,
-                       float* JXL_RESTRICT scratch_space);
+                       float* JXL_RESTRICT scratch_space,
+                       size_t nonzero_rows = AcStrategy::kMaxBlockDim,
+                       size_t nonzero_cols = AcStrategy::kMaxBlockDim);
+
+void NonZeroExtents(const float* JXL_RESTRICT coefficients, size_t rows,
+                    size_t cols, size_t* nonzero_rows, size_t* nonzero_cols);
 
 // Equivalent of the above for DC image.
 void LowestFrequenciesFromDC(const jxl::AcStrategy::Type strategy,
@@ -90,10 +90,13 @@ void Upsample(const ImageF& src, const Rect& src_rect, ImageF* dst,
   // Round-down to complete vectors.
   const size_t dsx_v = V * (dsx / V);
 
+  // Input pixels and upsampled pixels of the cells of a tile.
+  constexpr const size_t C = Upsampler::cells_per_tile();
+  const size_t in_stride = RoundUpTo(num_coeffs, V);
   float* JXL_RESTRICT in = arena;
-  arena += RoundUpTo(num_coeffs, V);
+  arena += C * in_stride;
   float* JXL_RESTRICT out = arena;
-  arena += stride;
+  arena += C * stride;
   float* JXL_RESTRICT raw_min_row = arena;
   arena += RoundUpTo(dsx + V, V);
   float* JXL_RESTRICT raw_max_row = arena;
@@ -184,20 +187,30 @@ void Upsample(const ImageF& src, const Rect& src_rect, ImageF* dst,
       }
     }
 
-    for (size_t x = 0; x < dst_rect.xsize(); x += NX) {
-      const size_t sx = x / N;
-      const size_t xbase = sx + sx0;
-      // Copy input pixels for "linearization".
-      for (size_t iy = 0; iy < M; iy++) {
-        memcpy(in + MX * iy, src_rows[iy] + xbase, MX * sizeof(float));
-      }
-      if (x_repeat > 1) {
-        // Even if filter coeffs contain 0 at "undefined" values, the result
-        // might be undefined, because NaN will poison the sum.
-        if (JXL_UNLIKELY(xbase + MX > src_x_limit)) {
-          for (size_t iy = 0; iy < M; iy++) {
-            for (size_t ix = src_x_limit - xbase; ix < MX; ++ix) {
-              in[MX * iy + ix] = 0.0f;
+    // Each tile holds C horizontally adjacent cells of NX x N output pixels,
+    // so that every kernel vector is loaded once for all of them.
+    for (size_t tx = 0; tx < dst_rect.xsize(); tx += C * NX) {
+      const size_t num_cells = std::min(C, DivCeil(dst_rect.xsize() - tx, NX));
+      for (size_t cell = 0; cell < C; cell++) {
+        float* JXL_RESTRICT cell_in = in + cell * in_stride;
+        if (cell >= num_cells) {
+          // Past the end of the row; the results are not used.
+          memset(cell_in, 0, num_coeffs * sizeof(float));
+          continue;
+        }
+        const size_t xbase = (tx + cell * NX) / N + sx0;
+        // Copy input pixels for "linearization".
+        for (size_t iy = 0; iy < M; iy++) {
+          memcpy(cell_in + MX * iy, src_rows[iy] + xbase, MX * sizeof(float));
+        }
+        if (x_repeat > 1) {
+          // Even if filter coeffs contain 0 at "undefined" values, the result
+          // might be undefined, because NaN will poison the sum.
+          if (JXL_UNLIKELY(xbase + MX > src_x_limit)) {
+            for (size_t iy = 0; iy < M; iy++) {
+              for (size_t ix = src_x_limit - xbase; ix < MX; ++ix) {
+                cell_in[MX * iy + ix] = 0.0f;
+              }
             }
           }
         }
@@ -207,47 +220,60 @@ void Upsample(const ImageF& src, const Rect& src_rect, ImageF* dst,
       constexpr size_t tail_length = num_coeffs - tail;
       for (size_t kernel_idx = 0; kernel_idx < num_kernels; kernel_idx += V) {
         const float* JXL_RESTRICT kernel_base = kernels + kernel_idx;
-        decltype(Zero(df)) results[U];
+        decltype(Zero(df)) results[C][U];
         for (size_t i = 0; i < U; i++) {
-          results[i] = Set(df, in[i]) * Load(df, kernel_base + i * stride);
+          const auto kernel = Load(df, kernel_base + i * stride);
+          for (size_t cell = 0; cell < C; cell++) {
+            results[cell][i] = Set(df, in[cell * in_stride + i]) * kernel;
+          }
         }
         for (size_t i = U; i < tail; i += U) {
           for (size_t j = 0; j < U; ++j) {
-            results[j] =
-                MulAdd(Set(df, in[i + j]),
-                       Load(df, kernel_base + (i + j) * stride), results[j]);
+            const auto kernel = Load(df, kernel_base + (i + j) * stride);
+            for (size_t cell = 0; cell < C; cell++) {
+              results[cell][j] = MulAdd(Set(df, in[cell * in_stride + i + j]),
+                                        kernel, results[cell][j]);
+            }
           }
         }
         for (size_t i = 0; i < tail_length; ++i) {
-          results[i] =
-              MulAdd(Set(df, in[tail + i]),
-                     Load(df, kernel_base + (tail + i) * stride), results[i]);
+          const auto kernel = Load(df, kernel_base + (tail + i) * stride);
+          for (size_t cell = 0; cell < C; cell++) {
+            results[cell][i] = MulAdd(Set(df, in[cell * in_stride + tail + i]),
+                                      kernel, results[cell][i]);
+          }
+        }
+        for (size_t cell = 0; cell < C; cell++) {
+          auto result = results[cell][0];
+          for (size_t i = 1; i < U; ++i) result += results[cell][i];
+          Store(result, df, out + cell * stride + kernel_idx);
         }
-        auto result = results[0];
-        for (size_t i = 1; i < U; ++i) result += results[i];
-        Store(result, df, out + kernel_idx);
       }
       const size_t oy_max = std::min<size_t>(dst_rect.ysize(), y + N);
-      const size_t ox_max = std::min<size_t>(dst_rect.xsize(), x + NX);
-      const size_t copy_len = ox_max - x;
-      const size_t copy_last = RoundUpTo(copy_len, V);
-      if (JXL_LIKELY(x + copy_last <= dst_rect.xsize())) {
-        for (size_t dx = 0; dx < copy_len; dx += V) {
-          auto min = LoadU(df, min_row + x + dx);
-          auto max = LoadU(df, max_row + x + dx);
-          float* pixels = out;
-          for (size_t oy = sy * N; oy < oy_max; ++oy, pixels += NX) {
-            StoreU(Clamp(LoadU(df, pixels + dx), min, max), df,
-                   dst_rect.Row(dst, oy) + x + dx);
+      for (size_t cell = 0; cell < num_cells; cell++) {
+        const size_t x = tx + cell * NX;
+        const float* JXL_RESTRICT cell_out = out + cell * stride;
+        const size_t ox_max = std::min<size_t>(dst_rect.xsize(), x + NX);
+        const size_t copy_len = ox_max - x;
+        const size_t copy_last = RoundUpTo(copy_len, V);
+        if (JXL_LIKELY(x + copy_last <= dst_rect.xsize())) {
+          for (size_t dx = 0; dx < copy_len; dx += V) {
+            auto min = LoadU(df, min_row + x + dx);
+            auto max = LoadU(df, max_row + x + dx);
+            const float* pixels = cell_out;
+            for (size_t oy = sy * N; oy < oy_max; ++oy, pixels += NX) {
+              StoreU(Clamp(LoadU(df, pixels + dx), min, max), df,
+                     dst_rect.Row(dst, oy) + x + dx);
+            }
           }
-        }
-      } else {
-        for (size_t dx = 0; dx < copy_len; dx++) {
-          auto min = min_row[x + dx];
-          auto max = max_row[x + dx];
-          float* pixels = out;
-          for (size_t oy = sy * N; oy < oy_max; ++oy, pixels += NX) {
-            dst_rect.Row(dst, oy)[x + dx] = Clamp1(pixels[dx], min, max);
+        } else {
+          for (size_t dx = 0; dx < copy_len; dx++) {
+            auto min = min_row[x + dx];
+            auto max = max_row[x + dx];
+            const float* pixels = cell_out;
+            for (size_t oy = sy * N; oy < oy_max; ++oy, pixels += NX) {
+              dst_rect.Row(dst, oy)[x + dx] = Clamp1(pixels[dx], min, max);
+            }
           }
         }
       }
@@ -293,23 +319,56 @@ size_t NumLanes() {
   return Lanes(df);
 }
 
-void Init(size_t upsampling, CacheAlignedUniquePtr* kernel_storage,
-          const CustomTransformData& data, size_t x_repeat) {
+size_t XRepeat(size_t upsampling) {
+  // 2 * 2 = 4 kernels; repeat cell, if there is more lanes available
+  if (upsampling != 2) return 1;
+  const size_t V = NumLanes();
+  if (V >= 16) return 4;
+  if (V >= 8) return 2;
+  return 1;
+}
+
+const float* GetWeights(size_t upsampling, const CustomTransformData& data) {
+  return (upsampling == 2)   ? data.upsampling2_weights
+         : (upsampling == 4) ? data.upsampling4_weights
+                             : data.upsampling8_weights;
+}
+
+// Returns the kernels of the default weights, which only depend on the target.
+// They are computed on first use and never freed.
+const float* DefaultKernels(size_t upsampling) {
+  static const CacheAlignedUniquePtr* const kKernels = [] {
+    const CustomTransformData defaults;
+    CacheAlignedUniquePtr* kernels = new CacheAlignedUniquePtr[3];
+    for (size_t i = 0; i < 3; i++) {
+      const size_t N = 2 << i;
+      InitKernel(GetWeights(N, defaults), &kernels[i], N, XRepeat(N));
+    }
+    return kernels;
+  }();
+  return reinterpret_cast<const float*>(
+      kKernels[CeilLog2Nonzero(upsampling) - 1].get());
+}
+
+const float* Init(size_t upsampling, const CustomTransformData& data,
+                  CacheAlignedUniquePtr* kernel_storage, size_t* x_repeat) {
   if ((upsampling & (upsampling - 1)) != 0 ||
       upsampling > Upsampler::max_upsampling()) {
     JXL_ABORT("Invalid upsample");
   }
-  if ((x_repeat & (x_repeat - 1)) != 0 ||
-      x_repeat > Upsampler::max_x_repeat()) {
-    JXL_ABORT("Invalid x_repeat");
-  }
+  *x_repeat = XRepeat(upsampling);
+  JXL_ASSERT(*x_repeat <= Upsampler::max_x_repeat());
 
   // No-op upsampling.
-  if (upsampling == 1) return;
-  const float* weights = (upsampling == 2)   ? data.upsampling2_weights
-                         : (upsampling == 4) ? data.upsampling4_weights
-                                             : data.upsampling8_weights;
-  InitKernel(weights, kernel_storage, upsampling, x_repeat);
+  if (upsampling == 1) return nullptr;
+  // Bits 0, 1 and 2 of the mask signal custom 2x, 4x and 8x weights.
+  if ((data.custom_weights_mask & (upsampling >> 1)) == 0) {
+    kernel_storage->reset();
+    return DefaultKernels(upsampling);
+  }
+  InitKernel(GetWeights(upsampling, data), kernel_storage, upsampling,
+             *x_repeat);
+  return reinterpret_cast<const float*>(kernel_storage->get());
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -328,14 +387,8 @@ HWY_EXPORT(UpsampleRect);
 
 void Upsampler::Init(size_t upsampling, const CustomTransformData& data) {
   upsampling_ = upsampling;
-  size_t V = HWY_DYNAMIC_DISPATCH(NumLanes)();
-  x_repeat_ = 1;
-  if (upsampling_ == 2) {
-    // 2 * 2 = 4 kernels; repeat cell, if there is more lanes available
-    if (V >= 8) x_repeat_ = 2;
-    if (V >= 16) x_repeat_ = 4;
-  }
-  HWY_DYNAMIC_DISPATCH(Init)(upsampling, &kernel_storage_, data, x_repeat_);
+  kernels_ = HWY_DYNAMIC_DISPATCH(Init)(upsampling, data, &kernel_storage_,
+                                        &x_repeat_);
 }
 
 size_t Upsampler::GetArenaSize(size_t max_dst_xsize) {
@@ -347,7 +400,8 @@ size_t Upsampler::GetArenaSize(size_t max_dst_xsize) {
   constexpr const size_t N = max_upsampling();
   // TODO(eustas): raw_(min|max)_row and (min|max)_row could overlap almost
   // completely.
-  return RoundUpTo(N * N * X, V) + RoundUpTo(M * MX, V) +
+  constexpr size_t C = cells_per_tile();
+  return C * RoundUpTo(N * N * X, V) + C * RoundUpTo(M * MX, V) +
          2 * RoundUpTo(DivCeil(max_dst_xsize, 8) * 4 + 2 * M2 + V, V) +
          2 * RoundUpTo(max_dst_xsize + V, V);
 }
@@ -359,8 +413,8 @@ void Upsampler::UpsampleRect(const ImageF& src, const Rect& src_rect,
   JXL_CHECK(arena);
   JXL_CHECK_IMAGE_INITIALIZED(src, src_rect);
   HWY_DYNAMIC_DISPATCH(UpsampleRect)
-  (upsampling_, reinterpret_cast<float*>(kernel_storage_.get()), src, src_rect,
-   dst, dst_rect, image_y_offset, image_ysize, arena, x_repeat_);
+  (upsampling_, kernels_, src, src_rect, dst, dst_rect, image_y_offset,
+   image_ysize, arena, x_repeat_);
   JXL_CHECK_IMAGE_INITIALIZED(*dst, dst_rect);
 }
 
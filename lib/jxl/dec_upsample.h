@@ -29,6 +29,10 @@ struct Upsampler {
   // the wasted multiplications we increase the effective kernel count.
   static constexpr size_t max_x_repeat() { return 4; }
 
+  // Number of horizontally adjacent cells upsampled together, sharing the
+  // loads of the kernels.
+  static constexpr size_t cells_per_tile() { return 2; }
+
   // Get the size of "arena" required for UpsampleRect;
   // "arena" should be an aligned piece of memory with at least `GetArenaSize()`
   // float values accessible.
@@ -49,6 +53,9 @@ struct Upsampler {
  private:
   size_t upsampling_ = 1;
   size_t x_repeat_ = 1;
+  // Either points to kernel_storage_ or, for the default weights, to kernels
+  // that are computed once and shared by all the Upsamplers.
+  const float* kernels_ = nullptr;
   CacheAlignedUniquePtr kernel_storage_ = {nullptr};
 };
 
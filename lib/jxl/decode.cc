@@ -6,6 +6,7 @@
 #include "jxl/decode.h"
 
 #include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/box_content_decoder.h"
@@ -15,9 +16,11 @@
 #include "lib/jxl/dec_reconstruct.h"
 #include "lib/jxl/decode_to_jpeg.h"
 #include "lib/jxl/fields.h"
+#include "lib/jxl/frame_index.h"
 #include "lib/jxl/headers.h"
 #include "lib/jxl/icc_codec.h"
 #include "lib/jxl/image_bundle.h"
+#include "lib/jxl/image_ops.h"
 #include "lib/jxl/loop_filter.h"
 #include "lib/jxl/memory_manager_internal.h"
 #include "lib/jxl/toc.h"
@@ -197,8 +200,12 @@ enum class BoxStage : uint32_t {
   kCodestream,  // Handling codestream box contents, or non-container stream
   kPartialCodestream,  // Handling the extra header of partial codestream box
   kJpegRecon,          // Handling jpeg reconstruction box
+  kFrameIndex,         // Handling frame index box
 };
 
+// Frame index boxes larger than this are skipped instead of being stored.
+constexpr size_t kMaxFrameIndexSize = 1 << 24;
+
 enum class JpegReconStage : uint32_t {
   kNone,             // Not outputting
   kSettingMetadata,  // Ready to output, must set metadata to the jpeg_data
@@ -231,6 +238,7 @@ struct Sections {
   // frame_dec_ must have been Inited already, but not yet done ProcessSections.
   JxlDecoderStatus Init() {
     section_received.resize(frame_dec_->NumSections(), 0);
+    section_processed.resize(frame_dec_->NumSections(), 0);
 
     const auto& offsets = frame_dec_->SectionOffsets();
     const auto& sizes = frame_dec_->SectionSizes();
@@ -245,33 +253,75 @@ struct Sections {
     return JXL_DEC_SUCCESS;
   }
 
-  // Sets the input data for the frame. The frame pointer must point to the
-  // beginning of the frame, size is the amount of bytes gotten so far and
-  // should increase with next calls until the full frame is loaded.
-  // TODO(lode): allow caller to provide only later chunks of memory when
-  // earlier sections are fully processed already.
-  void SetInput(const uint8_t* frame, size_t size) {
+  // Sets the input data for the frame. The data pointer must point to the
+  // byte at position begin in the frame, and the bytes up to position end of
+  // the frame must be available. end should increase with next calls until
+  // the full frame is loaded. begin may increase as well, but must never be
+  // larger than FirstNeededByte().
+  void SetInput(const uint8_t* data, size_t begin, size_t end) {
     const auto& offsets = frame_dec_->SectionOffsets();
     const auto& sizes = frame_dec_->SectionSizes();
 
     for (size_t i = 0; i < frame_dec_->NumSections(); i++) {
       if (section_received[i]) continue;
-      if (!OutOfBounds(sections_begin_, offsets[i], sizes[i], size)) {
+      // Sections outside of the crop region are never read.
+      if (frame_dec_->SectionIsSkipped(i)) continue;
+      if (sections_begin_ + offsets[i] < begin) continue;
+      if (!OutOfBounds(sections_begin_, offsets[i], sizes[i], end)) {
         section_received[i] = 1;
+        num_received++;
         section_info.emplace_back(jxl::FrameDecoder::SectionInfo{nullptr, i});
         section_status.emplace_back();
       }
     }
-    // Reset all the bitreaders, because the address of the frame pointer may
-    // change, even if it always represents the same frame start.
+    // Reset all the bitreaders, because the address of the data pointer may
+    // change, even if it always represents the same position in the frame.
     for (size_t i = 0; i < section_info.size(); i++) {
       size_t id = section_info[i].id;
       JXL_ASSERT(section_info[i].br == nullptr);
+      JXL_ASSERT(sections_begin_ + offsets[id] >= begin);
       section_info[i].br = new jxl::BitReader(jxl::Span<const uint8_t>(
-          frame + sections_begin_ + offsets[id], sizes[id]));
+          data + sections_begin_ + offsets[id] - begin, sizes[id]));
     }
   }
 
+  // Forgets the sections that the FrameDecoder has processed, since their
+  // input bytes are not needed anymore. Must be called after CloseInput().
+  void RemoveProcessed() {
+    size_t num = 0;
+    for (size_t i = 0; i < section_info.size(); i++) {
+      if (section_status[i] == jxl::FrameDecoder::kDone ||
+          section_status[i] == jxl::FrameDecoder::kDuplicate) {
+        section_processed[section_info[i].id] = 1;
+        continue;
+      }
+      section_info[num] = section_info[i];
+      section_status[num] = section_status[i];
+      num++;
+    }
+    section_info.resize(num);
+    section_status.resize(num);
+  }
+
+  // Returns the position in the frame of the first byte that may still be
+  // needed, that is the beginning of the first section that has not been
+  // processed yet, or the frame size if all sections have been processed.
+  size_t FirstNeededByte() const {
+    size_t i = FirstNeededSection();
+    if (i == frame_dec_->NumSections()) return frame_size_;
+    return sections_begin_ + frame_dec_->SectionOffsets()[i];
+  }
+
+  // Returns the position in the frame just after the first section that has
+  // not been processed yet, or the frame size if all sections have been
+  // processed.
+  size_t FirstNeededSectionEnd() const {
+    size_t i = FirstNeededSection();
+    if (i == frame_dec_->NumSections()) return frame_size_;
+    return sections_begin_ + frame_dec_->SectionOffsets()[i] +
+           frame_dec_->SectionSizes()[i];
+  }
+
   JxlDecoderStatus CloseInput() {
     bool out_of_bounds = false;
     for (size_t i = 0; i < section_info.size(); i++) {
@@ -294,15 +344,32 @@ struct Sections {
     return JXL_DEC_SUCCESS;
   }
 
+  // Returns the index of the section with the lowest offset among the ones
+  // that have not been processed yet, or NumSections() if there is none.
+  size_t FirstNeededSection() const {
+    const auto& offsets = frame_dec_->SectionOffsets();
+    size_t first = frame_dec_->NumSections();
+    for (size_t i = 0; i < frame_dec_->NumSections(); i++) {
+      if (section_processed[i] || frame_dec_->SectionIsSkipped(i)) continue;
+      if (first == frame_dec_->NumSections() || offsets[i] < offsets[first]) {
+        first = i;
+      }
+    }
+    return first;
+  }
+
   // Not managed by us.
   jxl::FrameDecoder* frame_dec_;
 
   size_t frame_size_;
   size_t sections_begin_;
 
+  // Sections that were received but not yet processed.
   std::vector<jxl::FrameDecoder::SectionInfo> section_info;
   std::vector<jxl::FrameDecoder::SectionStatus> section_status;
   std::vector<char> section_received;
+  std::vector<char> section_processed;
+  size_t num_received = 0;
 };
 
 /*
@@ -453,6 +520,21 @@ struct JxlDecoderStruct {
   // Settings
   bool keep_orientation;
   bool render_spotcolors;
+  // Region of the image, before orientation, to output. Empty if the whole
+  // image is output.
+  jxl::Rect crop_region;
+  // Factor by which the output is downsampled: 1, 2, 4 or 8.
+  size_t downsampling;
+  // Whether regular frames are blended into full images (true), or returned
+  // one by one at their own size and position (false).
+  bool coalescing;
+  // Maximum estimated memory, in bytes, to use for decoding a frame, or 0 if
+  // unlimited.
+  uint64_t memory_limit;
+  // Whether JxlDecoderFlushImage may only write the rows that changed since
+  // the previous flush of the frame (true), or always writes the whole image
+  // (false).
+  bool incremental_flush;
 
   // Bitfield, for which informative events (JXL_DEC_BASIC_INFO, etc...) the
   // decoder returns a status. By default, do not return for any of the events,
@@ -472,12 +554,15 @@ struct JxlDecoderStruct {
   bool preview_out_buffer_set;
   // Idem for the image buffer.
   bool image_out_buffer_set;
+  // The image buffer holds the pixels of the current frame as of the last
+  // JxlDecoderFlushImage, so that with incremental_flush the next flush only
+  // needs to convert the pixels that changed since.
+  bool image_out_flushed;
 
   // Owned by the caller, buffers for DC image and full resolution images
   void* preview_out_buffer;
   void* image_out_buffer;
-  JxlImageOutCallback image_out_callback;
-  void* image_out_opaque;
+  jxl::PixelCallback image_out_callback;
 
   size_t preview_out_size;
   size_t image_out_size;
@@ -545,17 +630,28 @@ struct JxlDecoderStruct {
   // vector, it must be treated as a required frame.
   std::vector<char> frame_required;
 
+  // Set once frames were jumped over with the frame index. The internal index
+  // of the frames after that is unknown, so the above vectors are cleared and
+  // no longer filled in until the next rewind.
+  bool frames_untracked;
+
+  // Frame index from the jxli box, if any, and the contents of that box while
+  // they are being read.
+  jxl::FrameIndex frame_index;
+  std::vector<uint8_t> frame_index_box;
+
   // Codestream input data is stored here, when the decoder takes in and stores
   // the user input bytes. If the decoder does not do that (e.g. in one-shot
   // case), this field is unused.
-  // TODO(lode): avoid needing this field once the C++ decoder doesn't need
-  // all bytes at once, to save memory. Find alternative to std::vector doubling
-  // strategy to prevent some memory usage.
+  // Bytes that the codestream decoder no longer needs are erased from the
+  // beginning, so this only holds the not yet processed part of the input.
   std::vector<uint8_t> codestream_copy;
   // Position in the actual codestream, which codestream_copy.begin() points to.
   // Non-zero once earlier parts of the codestream vector have been erased.
-  // TODO(lode): use this variable to allow pruning codestream_copy
+  // If codestream_copy is empty, next_in is at this position instead.
   size_t codestream_pos;
+  // Total amount of bytes that were added to codestream_copy.
+  size_t codestream_bytes_copied;
 
   BoxStage box_stage;
 
@@ -646,10 +742,11 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->box_count = 0;
   dec->preview_out_buffer_set = false;
   dec->image_out_buffer_set = false;
+  dec->image_out_flushed = false;
   dec->preview_out_buffer = nullptr;
   dec->image_out_buffer = nullptr;
-  dec->image_out_callback = nullptr;
-  dec->image_out_opaque = nullptr;
+  dec->image_out_callback.Destroy();
+  dec->image_out_callback = jxl::PixelCallback();
   dec->preview_out_size = 0;
   dec->image_out_size = 0;
   dec->extra_channel_output.clear();
@@ -657,7 +754,14 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->next_in = 0;
   dec->avail_in = 0;
 
-  dec->passes_state.reset(nullptr);
+  // The decoder state of the next image starts fresh, but takes over the
+  // per-thread buffers so that they are not allocated again.
+  if (dec->passes_state) {
+    std::unique_ptr<jxl::PassesDecoderState> passes_state(
+        new jxl::PassesDecoderState());
+    passes_state->scratch = std::move(dec->passes_state->scratch);
+    dec->passes_state = std::move(passes_state);
+  }
   dec->frame_dec.reset(nullptr);
   dec->sections.reset(nullptr);
   dec->frame_dec_in_progress = false;
@@ -667,6 +771,8 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->frame_header.reset(new jxl::FrameHeader(&dec->metadata));
 
   dec->codestream_copy.clear();
+  dec->codestream_pos = 0;
+  dec->codestream_bytes_copied = 0;
 
   dec->frame_stage = FrameStage::kHeader;
   dec->frame_start = 0;
@@ -677,6 +783,9 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->skipping_frame = false;
   dec->internal_frames = 0;
   dec->external_frames = 0;
+  dec->frames_untracked = false;
+  dec->frame_index.entries.clear();
+  dec->frame_index_box.clear();
 }
 
 void JxlDecoderReset(JxlDecoder* dec) {
@@ -685,6 +794,11 @@ void JxlDecoderReset(JxlDecoder* dec) {
   dec->thread_pool.reset();
   dec->keep_orientation = false;
   dec->render_spotcolors = true;
+  dec->crop_region = jxl::Rect();
+  dec->downsampling = 1;
+  dec->coalescing = true;
+  dec->memory_limit = 0;
+  dec->incremental_flush = false;
   dec->orig_events_wanted = 0;
   dec->frame_references.clear();
   dec->frame_saved_as.clear();
@@ -712,6 +826,9 @@ JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager) {
 
 void JxlDecoderDestroy(JxlDecoder* dec) {
   if (dec) {
+    // Release the state of a multithreaded pixel callback of an unfinished
+    // frame.
+    dec->image_out_callback.Destroy();
     // Call destructor directly since custom free function is used.
     dec->~JxlDecoder();
     jxl::MemoryManagerFree(&dec->memory_manager, dec);
@@ -795,6 +912,74 @@ JxlDecoderStatus JxlDecoderSetRenderSpotcolors(JxlDecoder* dec,
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderSetCropRegion(JxlDecoder* dec, uint32_t x0,
+                                         uint32_t y0, uint32_t xsize,
+                                         uint32_t ysize) {
+  if (!dec->got_basic_info) {
+    return JXL_API_ERROR("Basic info must be known to set the crop region");
+  }
+  // The frame decoder gets the crop region when the frame starts to be
+  // decoded, after JXL_DEC_FRAME.
+  if (dec->frame_stage == FrameStage::kFull || dec->image_out_buffer_set) {
+    return JXL_API_ERROR("Must set the crop region before decoding the frame");
+  }
+  if (!dec->coalescing) {
+    return JXL_API_ERROR("Crop region requires coalescing");
+  }
+  if (xsize == 0 || ysize == 0 || x0 >= dec->metadata.xsize() ||
+      y0 >= dec->metadata.ysize() || xsize > dec->metadata.xsize() - x0 ||
+      ysize > dec->metadata.ysize() - y0) {
+    return JXL_API_ERROR("Crop region outside of the image");
+  }
+  if (x0 == 0 && y0 == 0 && xsize == dec->metadata.xsize() &&
+      ysize == dec->metadata.ysize()) {
+    dec->crop_region = jxl::Rect();
+  } else {
+    dec->crop_region = jxl::Rect(x0, y0, xsize, ysize);
+  }
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetDownsampling(JxlDecoder* dec,
+                                           uint32_t downsampling) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set downsampling option before starting");
+  }
+  if (downsampling != 1 && downsampling != 2 && downsampling != 4 &&
+      downsampling != 8) {
+    return JXL_API_ERROR("Invalid downsampling factor");
+  }
+  dec->downsampling = downsampling;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetCoalescing(JxlDecoder* dec, JXL_BOOL coalescing) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set coalescing option before starting");
+  }
+  dec->coalescing = !!coalescing;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetMemoryLimit(JxlDecoder* dec,
+                                          uint64_t memory_limit) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set memory limit before starting");
+  }
+  dec->memory_limit = memory_limit;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderReleaseCachedBuffers(JxlDecoder* dec) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Can only release buffers before starting");
+  }
+  if (dec->passes_state) {
+    dec->passes_state->scratch = jxl::PassesDecoderScratch();
+  }
+  return JXL_DEC_SUCCESS;
+}
+
 namespace jxl {
 namespace {
 
@@ -963,14 +1148,47 @@ JxlDecoderStatus JxlDecoderReadAllHeaders(JxlDecoder* dec, const uint8_t* in,
   return JXL_DEC_SUCCESS;
 }
 
-static size_t GetStride(const JxlDecoder* dec, const JxlPixelFormat& format,
-                        const jxl::ImageBundle* frame = nullptr) {
-  size_t xsize = dec->metadata.xsize();
+// Returns the dimensions of the decoded frame, before downsampling and
+// orientation: the image dimensions, or the dimensions of the current frame if
+// frames are not coalesced and its header is known.
+static void GetFrameSize(const JxlDecoder* dec, size_t* xsize, size_t* ysize) {
+  *xsize = dec->metadata.xsize();
+  *ysize = dec->metadata.ysize();
+  if (!dec->coalescing && dec->frame_header &&
+      dec->frame_stage != FrameStage::kHeader) {
+    const jxl::FrameDimensions frame_dim =
+        dec->frame_header->ToFrameDimensions();
+    *xsize = frame_dim.xsize_upsampled;
+    *ysize = frame_dim.ysize_upsampled;
+  }
+}
+
+// Returns the dimensions of the full image output, taking into account the
+// crop region, the downsampling and the orientation.
+static void GetOutputSize(const JxlDecoder* dec, size_t* xsize,
+                          size_t* ysize) {
+  GetFrameSize(dec, xsize, ysize);
+  if (dec->crop_region.xsize() != 0) {
+    *xsize = dec->crop_region.xsize();
+    *ysize = dec->crop_region.ysize();
+  }
+  *xsize = jxl::DivCeil(*xsize, dec->downsampling);
+  *ysize = jxl::DivCeil(*ysize, dec->downsampling);
   if (!dec->keep_orientation && dec->metadata.m.orientation > 4) {
-    xsize = dec->metadata.ysize();
+    std::swap(*xsize, *ysize);
   }
-  if (frame) {
-    xsize = dec->keep_orientation ? frame->xsize() : frame->oriented_xsize();
+}
+
+// If `rect` is given, returns the stride of the output of the pixels in `rect`
+// instead of the whole output.
+static size_t GetStride(const JxlDecoder* dec, const JxlPixelFormat& format,
+                        const jxl::Rect* rect = nullptr) {
+  size_t xsize, ysize;
+  GetOutputSize(dec, &xsize, &ysize);
+  if (rect) {
+    xsize = dec->keep_orientation || dec->metadata.m.orientation <= 4
+                ? rect->xsize()
+                : rect->ysize();
   }
   size_t stride = xsize * (BitsPerChannel(format.data_type) *
                            format.num_channels / jxl::kBitsPerByte);
@@ -980,20 +1198,69 @@ static size_t GetStride(const JxlDecoder* dec, const JxlPixelFormat& format,
   return stride;
 }
 
+// Copies the pixels of `frame` in `rect`, downsampled by `downsampling`, to
+// `storage`.
+static const jxl::ImageBundle& CopyImageRect(const jxl::ImageBundle& frame,
+                                             const jxl::Rect& rect,
+                                             size_t downsampling,
+                                             jxl::ImageBundle* storage) {
+  *storage = jxl::ImageBundle(frame.metadata());
+  jxl::Image3F color(rect.xsize(), rect.ysize());
+  jxl::CopyImageTo(rect, frame.color(), &color);
+  if (downsampling != 1) jxl::DownsampleImage(&color, downsampling);
+  storage->SetFromImage(std::move(color), frame.c_current());
+  std::vector<jxl::ImageF> extra_channels;
+  for (const jxl::ImageF& extra_channel : frame.extra_channels()) {
+    extra_channels.push_back(jxl::CopyImage(rect, extra_channel));
+    if (downsampling != 1) {
+      jxl::DownsampleImage(&extra_channels.back(), downsampling);
+    }
+  }
+  storage->SetExtraChannels(std::move(extra_channels));
+  return *storage;
+}
+
+// Returns the image that holds the part of the decoded `frame` that is output,
+// and sets `rect` to that part: the crop region of `frame`, downsampled by the
+// requested factor. `frame` itself may already be downsampled by
+// `frame_downsampling`, which is either 1 or the requested factor. The pixels
+// are only copied, to `storage`, if they still have to be downsampled.
+static const jxl::ImageBundle& GetOutputImage(const JxlDecoder* dec,
+                                              const jxl::ImageBundle& frame,
+                                              size_t frame_downsampling,
+                                              jxl::ImageBundle* storage,
+                                              jxl::Rect* rect) {
+  const size_t downsampling = dec->downsampling / frame_downsampling;
+  *rect = jxl::Rect(frame);
+  if (dec->crop_region.xsize() != 0) {
+    const jxl::Rect& crop = dec->crop_region;
+    *rect = jxl::Rect(crop.x0() / frame_downsampling,
+                      crop.y0() / frame_downsampling,
+                      jxl::DivCeil(crop.xsize(), frame_downsampling),
+                      jxl::DivCeil(crop.ysize(), frame_downsampling));
+  }
+  if (downsampling == 1) return frame;
+  const jxl::ImageBundle& output =
+      CopyImageRect(frame, *rect, downsampling, storage);
+  *rect = jxl::Rect(output);
+  return output;
+}
+
 // Internal wrapper around jxl::ConvertToExternal which converts the stride,
 // format and orientation and allows to choose whether to get all RGB(A)
-// channels or alternatively get a single extra channel.
+// channels or alternatively get a single extra channel. Only the pixels of
+// `frame` in `rect` are converted.
 // If want_extra_channel, a valid index to a single extra channel must be
 // given, the output must be single-channel, and format.num_channels is ignored
 // and treated as if it is 1.
 static JxlDecoderStatus ConvertImageInternal(
     const JxlDecoder* dec, const jxl::ImageBundle& frame,
-    const JxlPixelFormat& format, bool want_extra_channel,
-    size_t extra_channel_index, void* out_image, size_t out_size,
-    JxlImageOutCallback out_callback, void* out_opaque) {
+    const jxl::Rect& rect, const JxlPixelFormat& format,
+    bool want_extra_channel, size_t extra_channel_index, void* out_image,
+    size_t out_size, const PixelCallback& out_callback) {
   // TODO(lode): handle mismatch of RGB/grayscale color profiles and pixel data
   // color/grayscale format
-  const size_t stride = GetStride(dec, format, &frame);
+  const size_t stride = GetStride(dec, format, &rect);
 
   bool float_format = format.data_type == JXL_TYPE_FLOAT ||
                       format.data_type == JXL_TYPE_FLOAT16;
@@ -1005,18 +1272,16 @@ static JxlDecoderStatus ConvertImageInternal(
   jxl::Status status(true);
   if (want_extra_channel) {
     status = jxl::ConvertToExternal(
-        frame.extra_channels()[extra_channel_index],
+        frame.extra_channels()[extra_channel_index], rect,
         BitsPerChannel(format.data_type), float_format, format.endianness,
         stride, dec->thread_pool.get(), out_image, out_size,
-        /*out_callback=*/out_callback,
-        /*out_opaque=*/out_opaque, undo_orientation);
+        /*out_callback=*/out_callback, undo_orientation);
   } else {
     status = jxl::ConvertToExternal(
-        frame, BitsPerChannel(format.data_type), float_format,
+        frame, rect, BitsPerChannel(format.data_type), float_format,
         format.num_channels, format.endianness, stride, dec->thread_pool.get(),
         out_image, out_size,
-        /*out_callback=*/out_callback,
-        /*out_opaque=*/out_opaque, undo_orientation);
+        /*out_callback=*/out_callback, undo_orientation);
   }
 
   return status ? JXL_DEC_SUCCESS : JXL_DEC_ERROR;
@@ -1089,9 +1354,68 @@ JxlDecoderStatus ParseFrameHeader(jxl::FrameHeader* frame_header,
   return JXL_DEC_SUCCESS;
 }
 
+// Checks that decoding can start at the frame at `offset` in the codestream,
+// i.e. that the header and TOC of a displayed frame can be parsed there and
+// that the frame does not read any storage location. `in` holds `size` bytes
+// of the codestream, starting at dec->codestream_pos. Returns
+// JXL_DEC_NEED_MORE_INPUT if the frame header is not fully available yet.
+JxlDecoderStatus CheckIndexedFrame(const JxlDecoder* dec, uint64_t offset,
+                                   const uint8_t* in, size_t size) {
+  if (offset - dec->codestream_pos >= size) return JXL_DEC_NEED_MORE_INPUT;
+  FrameHeader header(&dec->metadata);
+  size_t frame_size;
+  JxlDecoderStatus status =
+      ParseFrameHeader(&header, in, size, offset - dec->codestream_pos,
+                       /*is_preview=*/false, &frame_size, /*saved_as=*/nullptr);
+  if (status != JXL_DEC_SUCCESS) return status;
+  // Not API errors: the caller falls back to skipping the frames one by one.
+  if (header.frame_type != FrameType::kRegularFrame &&
+      header.frame_type != FrameType::kSkipProgressive) {
+    return JXL_DEC_ERROR;
+  }
+  if (FrameDecoder::MaybeReferences(header) != 0) return JXL_DEC_ERROR;
+  return JXL_DEC_SUCCESS;
+}
+
+// When frames are being skipped, moves frame_start to the last frame of the
+// frame index that is not beyond the frame being skipped to, so that the frames
+// before it are not parsed at all. Must be called before parsing a frame
+// header. Only jumps to frames whose header is already available in `in`,
+// which holds `size` bytes of the codestream starting at dec->codestream_pos.
+// If the index points to a frame that cannot be decoded on its own, the index
+// is discarded and the frames are skipped one at a time.
+void JumpToIndexedFrame(JxlDecoder* dec, const uint8_t* in, size_t size) {
+  // Without coalescing, the frame index does not count the returned frames.
+  if (dec->skip_frames == 0 || !dec->coalescing) return;
+  const auto& entries = dec->frame_index.entries;
+  for (size_t i = entries.size(); i > 0; i--) {
+    const FrameIndexEntry& entry = entries[i - 1];
+    if (entry.frame_number > dec->external_frames + dec->skip_frames) continue;
+    if (entry.frame_number <= dec->external_frames ||
+        entry.codestream_offset <= dec->frame_start) {
+      return;
+    }
+    JxlDecoderStatus status =
+        CheckIndexedFrame(dec, entry.codestream_offset, in, size);
+    if (status == JXL_DEC_NEED_MORE_INPUT) continue;
+    if (status != JXL_DEC_SUCCESS) {
+      dec->frame_index.entries.clear();
+      return;
+    }
+    dec->skip_frames -= entry.frame_number - dec->external_frames;
+    dec->external_frames = entry.frame_number;
+    dec->frame_start = entry.codestream_offset;
+    dec->frames_untracked = true;
+    dec->frame_references.clear();
+    dec->frame_saved_as.clear();
+    dec->frame_external_to_internal.clear();
+    dec->frame_required.clear();
+    return;
+  }
+}
+
 // TODO(eustas): no CodecInOut -> no image size reinforcement -> possible OOM.
-// TODO(lode): allow this function to indicate bytes of in that have already
-// been processed and no longer need to be stored in codestream_copy.
+// The byte in[0] is at position dec->codestream_pos in the codestream.
 JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
                                              size_t size) {
   // If no parallel runner is set, use the default
@@ -1149,7 +1473,7 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       // Want to decode the preview, not just skip the frame
       bool want_preview = (dec->events_wanted & JXL_DEC_PREVIEW_IMAGE);
       size_t frame_size;
-      size_t pos = dec->frame_start;
+      size_t pos = dec->frame_start - dec->codestream_pos;
       dec->frame_header.reset(new FrameHeader(&dec->metadata));
       JxlDecoderStatus status = ParseFrameHeader(dec->frame_header.get(), in,
                                                  size, pos, true, &frame_size,
@@ -1163,8 +1487,7 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
         return JXL_DEC_NEED_PREVIEW_OUT_BUFFER;
       }
 
-      jxl::Span<const uint8_t> compressed(in + dec->frame_start,
-                                          size - dec->frame_start);
+      jxl::Span<const uint8_t> compressed(in + pos, size - pos);
       auto reader = GetBitReader(compressed);
       jxl::DecompressParams dparams;
       dparams.preview = want_preview ? jxl::Override::kOn : jxl::Override::kOff;
@@ -1188,10 +1511,10 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       if (want_preview) {
         if (dec->preview_out_buffer) {
           JxlDecoderStatus status = ConvertImageInternal(
-              dec, ib, dec->preview_out_format, /*want_extra_channel=*/false,
+              dec, ib, jxl::Rect(ib), dec->preview_out_format,
+              /*want_extra_channel=*/false,
               /*extra_channel_index=*/0, dec->preview_out_buffer,
-              dec->preview_out_size, /*out_callback=*/nullptr,
-              /*out_opaque=*/nullptr);
+              dec->preview_out_size, /*out_callback=*/PixelCallback());
           if (status != JXL_DEC_SUCCESS) return status;
         }
         return JXL_DEC_PREVIEW_IMAGE;
@@ -1218,6 +1541,7 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
         return JXL_API_ERROR(
             "cannot decode a next frame after JPEG reconstruction frame");
       }
+      JumpToIndexedFrame(dec, in, size);
       size_t pos = dec->frame_start - dec->codestream_pos;
       if (pos >= size) {
         return JXL_DEC_NEED_MORE_INPUT;
@@ -1234,6 +1558,13 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       // is last of current still
       dec->is_last_of_still =
           dec->is_last_total || dec->frame_header->animation_frame.duration > 0;
+      // Without coalescing, every frame that would be blended into a displayed
+      // frame is returned on its own.
+      if (!dec->coalescing &&
+          (dec->frame_header->frame_type == FrameType::kRegularFrame ||
+           dec->frame_header->frame_type == FrameType::kSkipProgressive)) {
+        dec->is_last_of_still = true;
+      }
 
       const size_t internal_frame_index = dec->internal_frames;
       const size_t external_frame_index = dec->external_frames;
@@ -1241,6 +1572,7 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       dec->internal_frames++;
 
       dec->frame_stage = FrameStage::kTOC;
+      dec->image_out_flushed = false;
 
       if (dec->skip_frames > 0) {
         dec->skipping_frame = true;
@@ -1251,13 +1583,15 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
         dec->skipping_frame = false;
       }
 
-      if (external_frame_index >= dec->frame_external_to_internal.size()) {
+      if (!dec->frames_untracked &&
+          external_frame_index >= dec->frame_external_to_internal.size()) {
         dec->frame_external_to_internal.push_back(internal_frame_index);
         JXL_ASSERT(dec->frame_external_to_internal.size() ==
                    external_frame_index + 1);
       }
 
-      if (internal_frame_index >= dec->frame_saved_as.size()) {
+      if (!dec->frames_untracked &&
+          internal_frame_index >= dec->frame_saved_as.size()) {
         dec->frame_saved_as.push_back(saved_as);
         JXL_ASSERT(dec->frame_saved_as.size() == internal_frame_index + 1);
 
@@ -1317,6 +1651,10 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       dec->frame_dec.reset(new FrameDecoder(
           dec->passes_state.get(), dec->metadata, dec->thread_pool.get()));
       dec->frame_dec->SetRenderSpotcolors(dec->render_spotcolors);
+      dec->frame_dec->SetCropRegion(dec->crop_region);
+      dec->frame_dec->SetDownsampling(dec->downsampling);
+      dec->frame_dec->SetCoalescing(dec->coalescing);
+      dec->frame_dec->SetMemoryLimit(dec->memory_limit);
 
       // If JPEG reconstruction is wanted and possible, set the jpeg_data of
       // the ImageBundle.
@@ -1382,24 +1720,40 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
 
       // TODO(lode): Support more formats than just native endian float32 for
       // the low-memory callback path
-      if (dec->image_out_buffer_set && !!dec->image_out_callback &&
+      if (dec->image_out_buffer_set && dec->image_out_callback.IsPresent() &&
           dec->image_out_format.data_type == JXL_TYPE_FLOAT &&
           dec->image_out_format.num_channels >= 3 && !swap_endianness &&
           dec->frame_dec_in_progress) {
         bool is_rgba = dec->image_out_format.num_channels == 4;
         dec->frame_dec->MaybeSetFloatCallback(
-            [dec](const float* pixels, size_t x, size_t y, size_t num_pixels) {
-              dec->image_out_callback(dec->image_out_opaque, x, y, num_pixels,
-                                      pixels);
+            [dec](const float* pixels, size_t thread, size_t x, size_t y,
+                  size_t num_pixels) {
+              dec->image_out_callback.Run(thread, x, y, num_pixels, pixels);
             },
             is_rgba, !dec->keep_orientation);
+        if (dec->frame_dec->HasRGBBuffer() &&
+            !dec->image_out_callback.IsInitialized()) {
+          // The frame decoder calls the callback from the threads of the pool,
+          // with rows of at most the width of the frame.
+          JXL_API_RETURN_IF_ERROR(dec->image_out_callback.Init(
+              NumThreads(dec->thread_pool.get()),
+              dec->frame_header->ToFrameDimensions().xsize_upsampled));
+        }
       }
 
-      size_t pos = dec->frame_start - dec->codestream_pos;
+      // The beginning of the frame may have been erased from codestream_copy
+      // already, if its sections were processed.
+      size_t frame_pos = 0;
+      size_t pos = 0;
+      if (dec->codestream_pos > dec->frame_start) {
+        frame_pos = dec->codestream_pos - dec->frame_start;
+      } else {
+        pos = dec->frame_start - dec->codestream_pos;
+      }
       if (pos >= size) {
         return JXL_DEC_NEED_MORE_INPUT;
       }
-      dec->sections->SetInput(in + pos, size - pos);
+      dec->sections->SetInput(in + pos, frame_pos, frame_pos + size - pos);
 
       if (cpu_limit_base_ != 0) {
         FrameDimensions frame_dim = dec->frame_header->ToFrameDimensions();
@@ -1422,22 +1776,24 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       if (status.IsFatalError()) {
         return JXL_API_ERROR("decoding frame failed");
       }
-
-      // TODO(lode): allow next_in to move forward if sections from the
-      // beginning of the stream have been processed
+      dec->sections->RemoveProcessed();
 
       if (status.code() == StatusCode::kNotEnoughBytes ||
-          dec->sections->section_info.size() < dec->frame_dec->NumSections()) {
+          dec->sections->num_received +
+                  dec->frame_dec->NumSkippedSections() <
+              dec->frame_dec->NumSections()) {
         // Not all sections have been processed yet
         return JXL_DEC_NEED_MORE_INPUT;
       }
 
-      size_t internal_index = dec->internal_frames - 1;
-      JXL_ASSERT(dec->frame_references.size() > internal_index);
-      // Always fill this in, even if it was already written, it could be that
-      // this frame was skipped before and set to 255, while only now we know
-      // the true value.
-      dec->frame_references[internal_index] = dec->frame_dec->References();
+      if (!dec->frames_untracked) {
+        size_t internal_index = dec->internal_frames - 1;
+        JXL_ASSERT(dec->frame_references.size() > internal_index);
+        // Always fill this in, even if it was already written, it could be
+        // that this frame was skipped before and set to 255, while only now we
+        // know the true value.
+        dec->frame_references[internal_index] = dec->frame_dec->References();
+      }
       if (!dec->frame_dec->FinalizeFrame()) {
         return JXL_API_ERROR("decoding frame failed");
       }
@@ -1448,6 +1804,8 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
 
       dec->frame_dec_in_progress = false;
       dec->frame_stage = FrameStage::kFullOutput;
+      // All pixels of the low-memory path were output by FinalizeFrame.
+      dec->image_out_callback.Destroy();
     }
 
     bool output_jpeg_reconstruction = false;
@@ -1469,14 +1827,19 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
         if (dec->jpeg_decoder.IsOutputSet() && dec->ib->jpeg_data != nullptr) {
           output_jpeg_reconstruction = true;
         } else if (return_full_image && dec->image_out_buffer_set) {
+          jxl::ImageBundle output_storage;
+          jxl::Rect output_rect;
+          const jxl::ImageBundle& output =
+              GetOutputImage(dec, *dec->ib,
+                             dec->frame_dec->RenderedDownsampling(),
+                             &output_storage, &output_rect);
           if (!dec->frame_dec->HasRGBBuffer()) {
             // Copy pixels if desired.
             JxlDecoderStatus status = ConvertImageInternal(
-                dec, *dec->ib, dec->image_out_format,
+                dec, output, output_rect, dec->image_out_format,
                 /*want_extra_channel=*/false,
                 /*extra_channel_index=*/0, dec->image_out_buffer,
-                dec->image_out_size, dec->image_out_callback,
-                dec->image_out_opaque);
+                dec->image_out_size, dec->image_out_callback);
             if (status != JXL_DEC_SUCCESS) return status;
           }
           dec->image_out_buffer_set = false;
@@ -1487,9 +1850,9 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
             if (!buffer) continue;
             const JxlPixelFormat* format = &dec->extra_channel_output[i].format;
             JxlDecoderStatus status = ConvertImageInternal(
-                dec, *dec->ib, *format,
+                dec, output, output_rect, *format,
                 /*want_extra_channel=*/true, i, buffer,
-                dec->extra_channel_output[i].buffer_size, nullptr, nullptr);
+                dec->extra_channel_output[i].buffer_size, PixelCallback());
             if (status != JXL_DEC_SUCCESS) return status;
           }
 
@@ -1519,6 +1882,42 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
   return JXL_DEC_SUCCESS;
 }
 
+// Returns the position in the codestream before which the bytes are no longer
+// needed by JxlDecoderProcessCodestream.
+size_t FirstNeededCodestreamPos(const JxlDecoder* dec) {
+  // The headers and the preview frame are read from the start of the
+  // codestream.
+  if (!dec->got_all_headers || !dec->got_preview_image) {
+    return dec->codestream_pos;
+  }
+  size_t pos = dec->frame_start;
+  if (dec->frame_stage == FrameStage::kFull && dec->sections) {
+    pos += dec->sections->FirstNeededByte();
+  }
+  return std::max(pos, dec->codestream_pos);
+}
+
+// Returns the position in the codestream up to which the bytes are needed to
+// process the first section that has not been processed yet, or 0 if this is
+// not known because the decoder is not in the middle of a frame.
+size_t NeededCodestreamEnd(const JxlDecoder* dec) {
+  if (!dec->got_all_headers || !dec->got_preview_image) return 0;
+  if (dec->frame_stage != FrameStage::kFull || !dec->sections) return 0;
+  return dec->frame_start + dec->sections->FirstNeededSectionEnd();
+}
+
+// Erases the bytes that are no longer needed from the beginning of
+// codestream_copy, so that it holds at most the sections of the current frame
+// that were not processed yet rather than the whole codestream.
+void PruneCodestreamCopy(JxlDecoder* dec) {
+  size_t prune = std::min(FirstNeededCodestreamPos(dec) - dec->codestream_pos,
+                          dec->codestream_copy.size());
+  if (prune == 0) return;
+  dec->codestream_copy.erase(dec->codestream_copy.begin(),
+                             dec->codestream_copy.begin() + prune);
+  dec->codestream_pos += prune;
+}
+
 }  // namespace
 }  // namespace jxl
 
@@ -1813,6 +2212,11 @@ JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
         dec->box_stage = BoxStage::kCodestream;
       } else if (memcmp(dec->box_type, "jxlp", 4) == 0) {
         dec->box_stage = BoxStage::kPartialCodestream;
+      } else if (memcmp(dec->box_type, "jxli", 4) == 0 &&
+                 !dec->box_contents_unbounded &&
+                 dec->box_contents_size <= kMaxFrameIndexSize) {
+        dec->box_stage = BoxStage::kFrameIndex;
+        dec->frame_index_box.clear();
       } else if ((dec->orig_events_wanted & JXL_DEC_JPEG_RECONSTRUCTION) &&
                  memcmp(dec->box_type, "jbrd", 4) == 0) {
         if (!(dec->events_wanted & JXL_DEC_JPEG_RECONSTRUCTION)) {
@@ -1864,11 +2268,20 @@ JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
       }
 
       bool have_copy = !dec->codestream_copy.empty();
+      bool copy_limited = false;
       if (have_copy) {
-        // TODO(lode): prune the codestream_copy vector if the codestream
-        // decoder no longer needs data from previous frames.
+        // Only append the bytes needed to complete the section that the copy
+        // ends in. Once that section is processed the copy becomes empty, and
+        // decoding continues directly from the input, without copying it.
+        size_t copy_end = dec->codestream_pos + dec->codestream_copy.size();
+        size_t needed_end = jxl::NeededCodestreamEnd(dec);
+        if (needed_end > copy_end && needed_end - copy_end < avail_codestream) {
+          avail_codestream = needed_end - copy_end;
+          copy_limited = true;
+        }
         dec->codestream_copy.insert(dec->codestream_copy.end(), dec->next_in,
                                     dec->next_in + avail_codestream);
+        dec->codestream_bytes_copied += avail_codestream;
         dec->AdvanceInput(avail_codestream);
         avail_codestream = dec->codestream_copy.size();
       }
@@ -1878,6 +2291,7 @@ JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
 
       JxlDecoderStatus status =
           jxl::JxlDecoderProcessCodestream(dec, codestream, avail_codestream);
+      if (have_copy) jxl::PruneCodestreamCopy(dec);
       if (status == JXL_DEC_FULL_IMAGE) {
         if (dec->recon_output_jpeg != JpegReconStage::kNone) {
           continue;
@@ -1885,8 +2299,16 @@ JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
       }
       if (status == JXL_DEC_NEED_MORE_INPUT) {
         if (!have_copy) {
-          dec->codestream_copy.insert(dec->codestream_copy.end(), dec->next_in,
+          // Only store the bytes that are still needed, next_in is at
+          // codestream_pos since codestream_copy is empty.
+          size_t skip = std::min(
+              jxl::FirstNeededCodestreamPos(dec) - dec->codestream_pos,
+              avail_codestream);
+          dec->codestream_pos += skip;
+          dec->codestream_copy.insert(dec->codestream_copy.end(),
+                                      dec->next_in + skip,
                                       dec->next_in + avail_codestream);
+          dec->codestream_bytes_copied += avail_codestream - skip;
           dec->AdvanceInput(avail_codestream);
         }
 
@@ -1894,6 +2316,8 @@ JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
           dec->box_stage = BoxStage::kHeader;
           continue;
         }
+        // There is more input in this box that was not added to the copy.
+        if (copy_limited) continue;
       }
 
       if (status == JXL_DEC_SUCCESS) {
@@ -1966,6 +2390,21 @@ JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
         // If anything else, return the result.
         return recon_result;
       }
+    } else if (dec->box_stage == BoxStage::kFrameIndex) {
+      size_t remaining = dec->box_contents_end - dec->file_pos;
+      size_t amount = std::min(remaining, dec->avail_in);
+      dec->frame_index_box.insert(dec->frame_index_box.end(), dec->next_in,
+                                  dec->next_in + amount);
+      dec->AdvanceInput(amount);
+      if (amount < remaining) return JXL_DEC_NEED_MORE_INPUT;
+      // The frame index only speeds up skipping frames, so an invalid one is
+      // ignored rather than failing the decoding.
+      if (!jxl::ReadFrameIndex(jxl::Span<const uint8_t>(dec->frame_index_box),
+                               &dec->frame_index)) {
+        dec->frame_index.entries.clear();
+      }
+      std::vector<uint8_t>().swap(dec->frame_index_box);
+      dec->box_stage = BoxStage::kHeader;
     } else if (dec->box_stage == BoxStage::kSkip) {
       if (dec->box_contents_unbounded) {
         // Nothing further to do, an unbounded box is the last box,
@@ -2240,7 +2679,7 @@ JxlDecoderStatus PrepareSizeCheck(const JxlDecoder* dec,
 
 JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec) {
   if (!dec->image_out_buffer) return JXL_DEC_ERROR;
-  if (!dec->sections || dec->sections->section_info.empty()) {
+  if (!dec->sections || dec->sections->num_received == 0) {
     return JXL_DEC_ERROR;
   }
   if (!dec->frame_dec || !dec->frame_dec_in_progress) {
@@ -2264,14 +2703,51 @@ JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec) {
   // ConvertImageInternal.
   size_t xsize = dec->ib->xsize();
   size_t ysize = dec->ib->ysize();
-  dec->ib->ShrinkTo(dec->metadata.size.xsize(), dec->metadata.size.ysize());
+  const size_t frame_downsampling = dec->frame_dec->RenderedDownsampling();
+  size_t frame_xsize, frame_ysize;
+  jxl::GetFrameSize(dec, &frame_xsize, &frame_ysize);
+  dec->ib->ShrinkTo(jxl::DivCeil(frame_xsize, frame_downsampling),
+                    jxl::DivCeil(frame_ysize, frame_downsampling));
+  jxl::ImageBundle output_storage;
+  jxl::Rect rect;
+  const jxl::ImageBundle& output = jxl::GetOutputImage(
+      dec, *dec->ib, frame_downsampling, &output_storage, &rect);
+  uint8_t* out_image = reinterpret_cast<uint8_t*>(dec->image_out_buffer);
+  size_t out_size = dec->image_out_size;
+  // If incremental flushing is enabled and the output buffer already has the
+  // previous flush of this frame, only the rows that were drawn again are
+  // converted. This is only done when the rows of the frame map to the rows of
+  // the output buffer.
+  const bool keep_rows =
+      dec->keep_orientation ||
+      dec->metadata.m.GetOrientation() == jxl::Orientation::kIdentity;
+  if (dec->incremental_flush && dec->image_out_flushed &&
+      &output == dec->ib.get() && keep_rows) {
+    const jxl::Rect flushed =
+        dec->frame_dec->FlushedRect().Intersection(rect);
+    if (flushed.ysize() == 0) {
+      dec->ib->ShrinkTo(xsize, ysize);
+      return JXL_DEC_SUCCESS;
+    }
+    const size_t stride = jxl::GetStride(dec, dec->image_out_format, &rect);
+    out_image += (flushed.y0() - rect.y0()) * stride;
+    out_size -= (flushed.y0() - rect.y0()) * stride;
+    rect = jxl::Rect(rect.x0(), flushed.y0(), rect.xsize(), flushed.ysize());
+  }
   JxlDecoderStatus status = jxl::ConvertImageInternal(
-      dec, *dec->ib, dec->image_out_format,
+      dec, output, rect, dec->image_out_format,
       /*want_extra_channel=*/false,
-      /*extra_channel_index=*/0, dec->image_out_buffer, dec->image_out_size,
-      /*out_callback=*/nullptr, /*out_opaque=*/nullptr);
+      /*extra_channel_index=*/0, out_image, out_size,
+      /*out_callback=*/jxl::PixelCallback());
   dec->ib->ShrinkTo(xsize, ysize);
   if (status != JXL_DEC_SUCCESS) return status;
+  dec->image_out_flushed = true;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetIncrementalFlush(JxlDecoder* dec,
+                                              JXL_BOOL incremental_flush) {
+  dec->incremental_flush = !!incremental_flush;
   return JXL_DEC_SUCCESS;
 }
 
@@ -2358,14 +2834,14 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderImageOutBufferSize(
     return JXL_API_ERROR("Grayscale output not possible for color image");
   }
 
+  size_t xsize, ysize;
+  jxl::GetOutputSize(dec, &xsize, &ysize);
   size_t row_size =
-      jxl::DivCeil(dec->metadata.oriented_xsize(dec->keep_orientation) *
-                       format->num_channels * bits,
-                   jxl::kBitsPerByte);
+      jxl::DivCeil(xsize * format->num_channels * bits, jxl::kBitsPerByte);
   if (format->align > 1) {
     row_size = jxl::DivCeil(row_size, format->align) * format->align;
   }
-  *size = row_size * dec->metadata.oriented_ysize(dec->keep_orientation);
+  *size = row_size * ysize;
 
   return JXL_DEC_SUCCESS;
 }
@@ -2376,7 +2852,7 @@ JxlDecoderStatus JxlDecoderSetImageOutBuffer(JxlDecoder* dec,
   if (!dec->got_basic_info || !(dec->orig_events_wanted & JXL_DEC_FULL_IMAGE)) {
     return JXL_API_ERROR("No image out buffer needed at this time");
   }
-  if (dec->image_out_buffer_set && !!dec->image_out_callback) {
+  if (dec->image_out_buffer_set && dec->image_out_callback.IsPresent()) {
     return JXL_API_ERROR(
         "Cannot change from image out callback to image out buffer");
   }
@@ -2396,6 +2872,8 @@ JxlDecoderStatus JxlDecoderSetImageOutBuffer(JxlDecoder* dec,
   dec->image_out_buffer = buffer;
   dec->image_out_size = size;
   dec->image_out_format = *format;
+  // The new buffer may not hold the pixels of the previous flush.
+  dec->image_out_flushed = false;
 
   return JXL_DEC_SUCCESS;
 }
@@ -2418,13 +2896,14 @@ JxlDecoderStatus JxlDecoderExtraChannelBufferSize(const JxlDecoder* dec,
   JxlDecoderStatus status = PrepareSizeCheck(dec, format, &bits);
   if (status != JXL_DEC_SUCCESS) return status;
 
-  size_t row_size = jxl::DivCeil(
-      dec->metadata.oriented_xsize(dec->keep_orientation) * num_channels * bits,
-      jxl::kBitsPerByte);
+  size_t xsize, ysize;
+  jxl::GetOutputSize(dec, &xsize, &ysize);
+  size_t row_size =
+      jxl::DivCeil(xsize * num_channels * bits, jxl::kBitsPerByte);
   if (format->align > 1) {
     row_size = jxl::DivCeil(row_size, format->align) * format->align;
   }
-  *size = row_size * dec->metadata.oriented_ysize(dec->keep_orientation);
+  *size = row_size * ysize;
 
   return JXL_DEC_SUCCESS;
 }
@@ -2457,14 +2936,17 @@ JxlDecoderStatus JxlDecoderSetExtraChannelBuffer(JxlDecoder* dec,
   return JXL_DEC_SUCCESS;
 }
 
-JxlDecoderStatus JxlDecoderSetImageOutCallback(JxlDecoder* dec,
-                                               const JxlPixelFormat* format,
-                                               JxlImageOutCallback callback,
-                                               void* opaque) {
+namespace {
+JxlDecoderStatus SetImageOutCallback(JxlDecoder* dec,
+                                     const JxlPixelFormat* format,
+                                     const jxl::PixelCallback& callback) {
   if (dec->image_out_buffer_set && !!dec->image_out_buffer) {
     return JXL_API_ERROR(
         "Cannot change from image out buffer to image out callback");
   }
+  if (dec->image_out_callback.IsInitialized()) {
+    return JXL_API_ERROR("Cannot change image out callback during a frame");
+  }
 
   // Perform error checking for invalid format.
   size_t bits_dummy;
@@ -2473,11 +2955,32 @@ JxlDecoderStatus JxlDecoderSetImageOutCallback(JxlDecoder* dec,
 
   dec->image_out_buffer_set = true;
   dec->image_out_callback = callback;
-  dec->image_out_opaque = opaque;
   dec->image_out_format = *format;
 
   return JXL_DEC_SUCCESS;
 }
+}  // namespace
+
+JxlDecoderStatus JxlDecoderSetImageOutCallback(JxlDecoder* dec,
+                                               const JxlPixelFormat* format,
+                                               JxlImageOutCallback callback,
+                                               void* opaque) {
+  return SetImageOutCallback(dec, format,
+                             jxl::PixelCallback(callback, opaque));
+}
+
+JxlDecoderStatus JxlDecoderSetMultithreadedImageOutCallback(
+    JxlDecoder* dec, const JxlPixelFormat* format,
+    JxlImageOutInitCallback init_callback, JxlImageOutRunCallback run_callback,
+    JxlImageOutDestroyCallback destroy_callback, void* init_opaque) {
+  if (run_callback == nullptr) {
+    return JXL_API_ERROR("run callback is required");
+  }
+  return SetImageOutCallback(
+      dec, format,
+      jxl::PixelCallback(init_callback, run_callback, destroy_callback,
+                         init_opaque));
+}
 
 JxlDecoderStatus JxlDecoderGetFrameHeader(const JxlDecoder* dec,
                                           JxlFrameHeader* header) {
@@ -2493,6 +2996,46 @@ JxlDecoderStatus JxlDecoderGetFrameHeader(const JxlDecoder* dec,
   }
   header->name_length = dec->frame_header->name.size();
   header->is_last = dec->frame_header->is_last;
+  size_t xsize, ysize;
+  jxl::GetFrameSize(dec, &xsize, &ysize);
+  header->layer_info.xsize = xsize;
+  header->layer_info.ysize = ysize;
+  if (!dec->coalescing && dec->frame_header->custom_size_or_origin) {
+    header->layer_info.crop_x0 = dec->frame_header->frame_origin.x0;
+    header->layer_info.crop_y0 = dec->frame_header->frame_origin.y0;
+    header->layer_info.have_crop = JXL_TRUE;
+  } else {
+    header->layer_info.crop_x0 = 0;
+    header->layer_info.crop_y0 = 0;
+    header->layer_info.have_crop = JXL_FALSE;
+  }
+  const jxl::BlendingInfo& blending = dec->frame_header->blending_info;
+  header->layer_info.blend_info.blendmode =
+      static_cast<JxlBlendMode>(blending.mode);
+  header->layer_info.blend_info.source = blending.source;
+  header->layer_info.blend_info.alpha = blending.alpha_channel;
+  header->layer_info.blend_info.clamp = blending.clamp;
+  header->layer_info.save_as_reference = dec->frame_header->save_as_reference;
+
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderGetExtraChannelBlendInfo(const JxlDecoder* dec,
+                                                    size_t index,
+                                                    JxlBlendInfo* blend_info) {
+  if (!dec->frame_header || dec->frame_stage == FrameStage::kHeader) {
+    return JXL_API_ERROR("no frame header available");
+  }
+  const auto& metadata = dec->metadata.m;
+  if (index >= metadata.num_extra_channels) {
+    return JXL_API_ERROR("Invalid extra channel index");
+  }
+  const jxl::BlendingInfo& blending =
+      dec->frame_header->extra_channel_blending_info[index];
+  blend_info->blendmode = static_cast<JxlBlendMode>(blending.mode);
+  blend_info->source = blending.source;
+  blend_info->alpha = blending.alpha_channel;
+  blend_info->clamp = blending.clamp;
 
   return JXL_DEC_SUCCESS;
 }
@@ -2547,6 +3090,17 @@ void SetDecoderMemoryLimitBase_(size_t memory_limit_base) {
   cpu_limit_base_ = 5 * memory_limit_base;
 }
 
+// These functions are "package-private". They are only used by tests to check
+// that the copy of the codestream kept by the decoder stays bounded, and that
+// only the parts that are not available in one piece are copied.
+size_t GetDecoderCodestreamCopySize_(const JxlDecoder* dec) {
+  return dec->codestream_copy.size();
+}
+
+size_t GetDecoderCodestreamBytesCopied_(const JxlDecoder* dec) {
+  return dec->codestream_bytes_copied;
+}
+
 JxlDecoderStatus JxlDecoderSetBoxBuffer(JxlDecoder* dec, uint8_t* data,
                                         size_t size) {
   if (dec->box_out_buffer_set) {
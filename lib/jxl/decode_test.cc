@@ -8,6 +8,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <sstream>
 #include <string>
 #include <utility>
@@ -24,23 +27,32 @@
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/common.h"
+#include "lib/jxl/dec_bit_reader.h"
 #include "lib/jxl/dec_external_image.h"
 #include "lib/jxl/dec_file.h"
+#include "lib/jxl/dec_frame.h"
 #include "lib/jxl/enc_butteraugli_comparator.h"
 #include "lib/jxl/enc_external_image.h"
 #include "lib/jxl/enc_file.h"
+#include "lib/jxl/enc_frame_index.h"
 #include "lib/jxl/enc_gamma_correct.h"
 #include "lib/jxl/enc_icc_codec.h"
 #include "lib/jxl/encode_internal.h"
 #include "lib/jxl/fields.h"
+#include "lib/jxl/frame_header.h"
 #include "lib/jxl/headers.h"
 #include "lib/jxl/icc_codec.h"
 #include "lib/jxl/image_test_utils.h"
 #include "lib/jxl/jpeg/enc_jpeg_data.h"
 #include "lib/jxl/test_utils.h"
 #include "lib/jxl/testdata.h"
+#include "lib/jxl/toc.h"
 #include "tools/box/box.h"
 
+// Defined in decode.cc.
+size_t GetDecoderCodestreamCopySize_(const JxlDecoder* dec);
+size_t GetDecoderCodestreamBytesCopied_(const JxlDecoder* dec);
+
 ////////////////////////////////////////////////////////////////////////////////
 
 namespace {
@@ -572,6 +584,43 @@ std::vector<uint8_t> DecodeWithAPI(Span<const uint8_t> compressed,
   return pixels;
 }
 
+// Returns the [begin, end) byte ranges of the sections of all frames in the
+// bare codestream, which must not have an ICC profile or a preview.
+std::vector<std::pair<size_t, size_t>> GetSectionRanges(
+    Span<const uint8_t> codestream) {
+  std::vector<std::pair<size_t, size_t>> ranges;
+  CodecMetadata metadata;
+  BitReader reader(codestream);
+  JXL_CHECK(ReadSizeHeader(&reader, &metadata.size));
+  JXL_CHECK(ReadImageMetadata(&reader, &metadata.m));
+  metadata.transform_data.nonserialized_xyb_encoded = metadata.m.xyb_encoded;
+  JXL_CHECK(Bundle::Read(&reader, &metadata.transform_data));
+  JXL_CHECK(!metadata.m.color_encoding.WantICC());
+  JXL_CHECK(!metadata.m.have_preview);
+  for (bool is_last = false; !is_last;) {
+    JXL_CHECK(reader.JumpToByteBoundary());
+    FrameHeader frame_header(&metadata);
+    JXL_CHECK(ReadFrameHeader(&reader, &frame_header));
+    is_last = frame_header.is_last;
+    const FrameDimensions frame_dim = frame_header.ToFrameDimensions();
+    const size_t toc_entries =
+        NumTocEntries(frame_dim.num_groups, frame_dim.num_dc_groups,
+                      frame_header.passes.num_passes, /*has_ac_global=*/true);
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> sizes;
+    uint64_t total_size;
+    JXL_CHECK(
+        ReadGroupOffsets(toc_entries, &reader, &offsets, &sizes, &total_size));
+    const size_t begin = reader.TotalBitsConsumed() / kBitsPerByte;
+    for (size_t i = 0; i < offsets.size(); i++) {
+      ranges.emplace_back(begin + offsets[i], begin + offsets[i] + sizes[i]);
+    }
+    reader.SkipBits(total_size * kBitsPerByte);
+  }
+  JXL_CHECK(reader.Close());
+  return ranges;
+}
+
 }  // namespace
 }  // namespace jxl
 
@@ -2266,6 +2315,482 @@ TEST(DecodeTest, AlignTest) {
   }
 }
 
+TEST(DecodeTest, CropRegionTest) {
+  size_t xsize = 700, ysize = 600;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, false);
+
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  std::vector<uint8_t> full = jxl::DecodeWithAPI(
+      jxl::Span<const uint8_t>(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false);
+  ASSERT_EQ(xsize * ysize * 3, full.size());
+
+  // A region in the middle of the image, far from the groups at the borders.
+  const size_t x0 = 300, y0 = 290, crop_xsize = 50, crop_ysize = 40;
+
+  JxlDecoder* dec = JxlDecoderCreate(NULL);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO | JXL_DEC_FRAME |
+                                               JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+  EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetCropRegion(dec, x0, y0, xsize, 1));
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetCropRegion(dec, x0, y0, 0, 1));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetCropRegion(dec, 0, 0, 10, 10));
+  // The region can still be changed when the frame header is known.
+  EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetCropRegion(dec, x0, y0, crop_xsize, crop_ysize));
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetCropRegion(dec, 0, 0, 10, 10));
+  size_t buffer_size;
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderImageOutBufferSize(dec, &format, &buffer_size));
+  EXPECT_EQ(crop_xsize * crop_ysize * 3, buffer_size);
+  std::vector<uint8_t> cropped(buffer_size);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                 dec, &format, cropped.data(), cropped.size()));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+  JxlDecoderDestroy(dec);
+
+  for (size_t y = 0; y < crop_ysize; y++) {
+    for (size_t x = 0; x < crop_xsize * 3; x++) {
+      ASSERT_EQ(full[((y0 + y) * xsize + x0) * 3 + x],
+                cropped[y * crop_xsize * 3 + x])
+          << "x: " << x / 3 << " y: " << y;
+    }
+  }
+}
+
+TEST(DecodeTest, DownsamplingTest) {
+  size_t xsize = 500, ysize = 300;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, false);
+
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  std::vector<uint8_t> full = jxl::DecodeWithAPI(
+      jxl::Span<const uint8_t>(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false);
+  ASSERT_EQ(xsize * ysize * 3, full.size());
+
+  for (size_t factor : {2, 4, 8}) {
+    JxlDecoder* dec = JxlDecoderCreate(NULL);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetDownsampling(dec, factor));
+    std::vector<uint8_t> downsampled = jxl::DecodeWithAPI(
+        dec, jxl::Span<const uint8_t>(compressed.data(), compressed.size()),
+        format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    JxlDecoderDestroy(dec);
+    const size_t out_xsize = jxl::DivCeil(xsize, factor);
+    const size_t out_ysize = jxl::DivCeil(ysize, factor);
+    ASSERT_EQ(out_xsize * out_ysize * 3, downsampled.size());
+
+    // Compare with the box-filtered full resolution image.
+    double total_error = 0;
+    for (size_t y = 0; y < out_ysize; y++) {
+      for (size_t x = 0; x < out_xsize; x++) {
+        for (size_t c = 0; c < 3; c++) {
+          double sum = 0;
+          size_t count = 0;
+          for (size_t iy = y * factor; iy < std::min((y + 1) * factor, ysize);
+               iy++) {
+            for (size_t ix = x * factor;
+                 ix < std::min((x + 1) * factor, xsize); ix++) {
+              sum += full[(iy * xsize + ix) * 3 + c];
+              count++;
+            }
+          }
+          total_error +=
+              std::abs(sum / count - downsampled[(y * out_xsize + x) * 3 + c]);
+        }
+      }
+    }
+    EXPECT_LT(total_error / (out_xsize * out_ysize * 3), 3.0)
+        << "factor: " << factor;
+  }
+}
+
+TEST(DecodeTest, MemoryLimitTest) {
+  size_t xsize = 500, ysize = 300;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, false);
+
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  std::vector<uint8_t> full = jxl::DecodeWithAPI(
+      jxl::Span<const uint8_t>(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false);
+  ASSERT_EQ(xsize * ysize * 3, full.size());
+
+  // A limit that is large enough does not change the result.
+  JxlDecoder* dec = JxlDecoderCreate(NULL);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetMemoryLimit(dec, 1ull << 30));
+  std::vector<uint8_t> limited = jxl::DecodeWithAPI(
+      dec, jxl::Span<const uint8_t>(compressed.data(), compressed.size()),
+      format, /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false);
+  JxlDecoderDestroy(dec);
+  EXPECT_EQ(full, limited);
+
+  // A frame that cannot fit fails before any pixel is decoded.
+  dec = JxlDecoderCreate(NULL);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetMemoryLimit(dec, 1000));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderProcessInput(dec));
+  // The limit can only be set before decoding starts.
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetMemoryLimit(dec, 0));
+  JxlDecoderDestroy(dec);
+
+  // Decodes with a pool of several threads, returning no pixels on error.
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 4);
+  const auto decode_with = [&](JxlDecoder* dec,
+                               uint64_t memory_limit) -> std::vector<uint8_t> {
+    std::vector<uint8_t> pixels(xsize * ysize * 3);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetParallelRunner(dec, JxlThreadParallelRunner,
+                                          runner.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetMemoryLimit(dec, memory_limit));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+    for (;;) {
+      JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+      if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderSetImageOutBuffer(dec, &format, pixels.data(),
+                                              pixels.size()));
+      } else if (status == JXL_DEC_FULL_IMAGE) {
+        return pixels;
+      } else {
+        EXPECT_EQ(JXL_DEC_ERROR, status);
+        return std::vector<uint8_t>();
+      }
+    }
+  };
+  // Returns the smallest limit with which `decode` returns pixels.
+  const auto smallest_limit = [](const std::function<bool(uint64_t)>& decode) {
+    uint64_t fails = 0;
+    uint64_t works = 1ull << 30;
+    while (works - fails > 1) {
+      const uint64_t limit = fails + (works - fails) / 2;
+      if (decode(limit)) {
+        works = limit;
+      } else {
+        fails = limit;
+      }
+    }
+    return works;
+  };
+
+  // The smallest limit that works only fits the per-thread buffers of a single
+  // thread, since the frame is also rejected if that does not fit. Decoding
+  // then falls back to decoding the groups one at a time.
+  const auto decode = [&](uint64_t memory_limit) {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    return decode_with(dec.get(), memory_limit);
+  };
+  const uint64_t works = smallest_limit(
+      [&](uint64_t memory_limit) { return !decode(memory_limit).empty(); });
+  EXPECT_EQ(full, decode(works));
+
+  // Same with a decoder that keeps the buffers of all the threads of the pool
+  // from an earlier image: the fallback frees all but those of one thread.
+  const auto decode_reused = [&](uint64_t memory_limit) {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(full, decode_with(dec.get(), 1ull << 30));
+    JxlDecoderReset(dec.get());
+    return decode_with(dec.get(), memory_limit);
+  };
+  const uint64_t works_reused = smallest_limit([&](uint64_t memory_limit) {
+    return !decode_reused(memory_limit).empty();
+  });
+  EXPECT_EQ(full, decode_reused(works_reused));
+}
+
+// Decodes different images with the same decoder, which keeps its scratch
+// buffers across JxlDecoderReset, and checks that nothing from one image leaks
+// into the next one.
+TEST(DecodeTest, ReuseDecoderStateTest) {
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  std::vector<jxl::PaddedBytes> compressed;
+  std::vector<std::vector<uint8_t>> expected;
+  for (size_t i = 0; i < 2; i++) {
+    size_t xsize = 300 + 100 * i, ysize = 200 + 150 * i;
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, i);
+    jxl::CompressParams cparams;
+    cparams.photon_noise_iso = i == 0 ? 3200 : 0;
+    compressed.push_back(jxl::CreateTestJXLCodestream(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize,
+        3, cparams, kCSBF_None, JXL_ORIENT_IDENTITY, false));
+    expected.push_back(jxl::DecodeWithAPI(
+        jxl::Span<const uint8_t>(compressed[i].data(), compressed[i].size()),
+        format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false));
+  }
+
+  JxlDecoder* dec = JxlDecoderCreate(NULL);
+  for (size_t i : {0, 1, 0, 1}) {
+    if (i == 0) {
+      EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderReleaseCachedBuffers(dec));
+    }
+    std::vector<uint8_t> pixels = jxl::DecodeWithAPI(
+        dec,
+        jxl::Span<const uint8_t>(compressed[i].data(), compressed[i].size()),
+        format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    EXPECT_EQ(expected[i], pixels);
+    // The buffers can only be released before decoding starts.
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderReleaseCachedBuffers(dec));
+    JxlDecoderReset(dec);
+  }
+  JxlDecoderDestroy(dec);
+}
+
+// Feeds a multi-group image in small chunks, releasing the consumed input each
+// time, so that the decoder has to store and prune its own copy of the
+// sections that are only partially available.
+TEST(DecodeTest, SmallChunksStreamingTest) {
+  size_t xsize = 700, ysize = 600;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  for (bool progressive : {false, true}) {
+    jxl::CompressParams cparams;
+    cparams.progressive_mode = progressive;
+    jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize,
+        3, cparams, kCSBF_Multi, JXL_ORIENT_IDENTITY, false);
+
+    JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+    std::vector<uint8_t> full = jxl::DecodeWithAPI(
+        jxl::Span<const uint8_t>(compressed.data(), compressed.size()), format,
+        /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    ASSERT_EQ(xsize * ysize * 3, full.size());
+
+    // The decoder only stores the sections that are not complete yet, so its
+    // copy never holds much more than the largest section, or the headers and
+    // TOC before the first section, plus the last chunk of input.
+    jxl::PaddedBytes codestream = jxl::CreateTestJXLCodestream(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize,
+        3, cparams, kCSBF_None, JXL_ORIENT_IDENTITY, false);
+    std::vector<std::pair<size_t, size_t>> sections = jxl::GetSectionRanges(
+        jxl::Span<const uint8_t>(codestream.data(), codestream.size()));
+    ASSERT_GT(sections.size(), 1u);
+    size_t max_section_size = sections[0].first;
+    for (const auto& section : sections) {
+      max_section_size =
+          std::max(max_section_size, section.second - section.first);
+    }
+
+    JxlDecoder* dec = JxlDecoderCreate(NULL);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+    std::vector<uint8_t> streamed(full.size());
+    const size_t kChunkSize = 100;
+    size_t max_copy_size = 0;
+    size_t pos = 0;
+    size_t avail = 0;
+    bool seen_full_image = false;
+    for (;;) {
+      JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+      if (status == JXL_DEC_NEED_MORE_INPUT) {
+        max_copy_size =
+            std::max(max_copy_size, GetDecoderCodestreamCopySize_(dec));
+        size_t remaining = JxlDecoderReleaseInput(dec);
+        pos += avail - remaining;
+        ASSERT_LT(pos + remaining, compressed.size());
+        avail = std::min(remaining + kChunkSize, compressed.size() - pos);
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderSetInput(dec, compressed.data() + pos, avail));
+      } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderSetImageOutBuffer(dec, &format, streamed.data(),
+                                              streamed.size()));
+      } else if (status == JXL_DEC_FULL_IMAGE) {
+        seen_full_image = true;
+      } else {
+        EXPECT_EQ(JXL_DEC_SUCCESS, status);
+        break;
+      }
+    }
+    JxlDecoderDestroy(dec);
+
+    EXPECT_TRUE(seen_full_image);
+    EXPECT_EQ(full, streamed) << "progressive: " << progressive;
+    EXPECT_GT(max_copy_size, 0u);
+    EXPECT_LE(max_copy_size, max_section_size + kChunkSize)
+        << "progressive: " << progressive;
+  }
+}
+
+// Decodes a multi-group image whose codestream is split over several jxlp
+// boxes, with all input available at once, so that only the sections spanning
+// box boundaries need to be copied.
+TEST(DecodeTest, SplitCodestreamTest) {
+  size_t xsize = 700, ysize = 600;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::CompressParams cparams;
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  std::vector<uint8_t> expected;
+  // Size of the sections that contain one of the boundaries between the
+  // jxlp boxes, which are placed at a third and two thirds of the codestream.
+  size_t spanning_size = 0;
+  for (CodeStreamBoxFormat box_format : {kCSBF_None, kCSBF_Multi}) {
+    jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize,
+        3, cparams, box_format, JXL_ORIENT_IDENTITY, false);
+    if (box_format == kCSBF_None) {
+      std::vector<std::pair<size_t, size_t>> sections = jxl::GetSectionRanges(
+          jxl::Span<const uint8_t>(compressed.data(), compressed.size()));
+      size_t third = compressed.size() / 3;
+      for (size_t boundary : {third, 2 * third}) {
+        // The boundaries must be inside the sections of the frame for the
+        // test to be meaningful.
+        ASSERT_GT(boundary, sections[0].first);
+        for (const auto& section : sections) {
+          if (section.first < boundary && boundary < section.second) {
+            spanning_size += section.second - section.first;
+          }
+        }
+      }
+    }
+    JxlDecoder* dec = JxlDecoderCreate(NULL);
+    std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+        dec, jxl::Span<const uint8_t>(compressed.data(), compressed.size()),
+        format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    size_t bytes_copied = GetDecoderCodestreamBytesCopied_(dec);
+    JxlDecoderDestroy(dec);
+    ASSERT_EQ(xsize * ysize * 3, decoded.size());
+    if (box_format == kCSBF_None) {
+      expected = decoded;
+      EXPECT_EQ(0u, bytes_copied);
+    } else {
+      EXPECT_EQ(expected, decoded);
+      // Sections fully inside one box are decoded directly from the input.
+      EXPECT_LE(bytes_copied, spanning_size);
+      EXPECT_EQ(spanning_size != 0, bytes_copied != 0);
+    }
+  }
+}
+
+namespace {
+// State of the callbacks of JxlDecoderSetMultithreadedImageOutCallback,
+// storing the pixels in `pixels`.
+struct MultithreadedCallbackState {
+  std::vector<uint8_t> pixels;
+  size_t xsize;
+  size_t bytes_per_pixel;
+  size_t num_threads = 0;
+  size_t num_inits = 0;
+  size_t num_destroys = 0;
+  // Incremented only by the thread with the corresponding index.
+  std::vector<size_t> calls_per_thread;
+  std::atomic<bool> thread_id_too_large{false};
+
+  static void* Init(void* opaque, size_t num_threads, size_t num_pixels) {
+    auto* state = static_cast<MultithreadedCallbackState*>(opaque);
+    EXPECT_EQ(state->num_inits, state->num_destroys);
+    state->num_inits++;
+    state->num_threads = num_threads;
+    state->calls_per_thread.assign(num_threads, 0);
+    return state;
+  }
+
+  static void Run(void* opaque, size_t thread_id, size_t x, size_t y,
+                  size_t num_pixels, const void* pixels) {
+    auto* state = static_cast<MultithreadedCallbackState*>(opaque);
+    if (thread_id >= state->num_threads) {
+      state->thread_id_too_large = true;
+      return;
+    }
+    state->calls_per_thread[thread_id]++;
+    size_t pos = (y * state->xsize + x) * state->bytes_per_pixel;
+    memcpy(state->pixels.data() + pos, pixels,
+           num_pixels * state->bytes_per_pixel);
+  }
+
+  static void Destroy(void* opaque) {
+    static_cast<MultithreadedCallbackState*>(opaque)->num_destroys++;
+  }
+};
+}  // namespace
+
+TEST(DecodeTest, MultithreadedImageOutCallbackTest) {
+  size_t xsize = 700, ysize = 600;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, false);
+
+  // Float output uses the low-memory path of the frame decoder, uint8 output
+  // is converted after decoding the whole frame.
+  for (JxlDataType data_type : {JXL_TYPE_FLOAT, JXL_TYPE_UINT8}) {
+    JxlPixelFormat format = {4, data_type, JXL_NATIVE_ENDIAN, 0};
+    std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+        jxl::Span<const uint8_t>(compressed.data(), compressed.size()), format,
+        /*use_callback=*/true, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+
+    MultithreadedCallbackState state;
+    state.xsize = xsize;
+    state.bytes_per_pixel = 4 * GetDataBits(data_type) / jxl::kBitsPerByte;
+    state.pixels.resize(xsize * ysize * state.bytes_per_pixel);
+    ASSERT_EQ(expected.size(), state.pixels.size());
+
+    JxlThreadParallelRunnerPtr runner =
+        JxlThreadParallelRunnerMake(nullptr, 4);
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetParallelRunner(dec.get(), JxlThreadParallelRunner,
+                                          runner.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+    EXPECT_EQ(JXL_DEC_ERROR,
+              JxlDecoderSetMultithreadedImageOutCallback(
+                  dec.get(), &format, &MultithreadedCallbackState::Init,
+                  /*run_callback=*/nullptr,
+                  &MultithreadedCallbackState::Destroy, &state));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetMultithreadedImageOutCallback(
+                  dec.get(), &format, &MultithreadedCallbackState::Init,
+                  &MultithreadedCallbackState::Run,
+                  &MultithreadedCallbackState::Destroy, &state));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+
+    EXPECT_GE(state.num_inits, 1u);
+    EXPECT_EQ(state.num_inits, state.num_destroys);
+    EXPECT_FALSE(state.thread_id_too_large);
+    size_t num_calls = 0;
+    for (size_t calls : state.calls_per_thread) num_calls += calls;
+    EXPECT_GE(num_calls, ysize);
+    EXPECT_EQ(expected, state.pixels) << "data type: " << data_type;
+  }
+}
+
 TEST(DecodeTest, AnimationTest) {
   size_t xsize = 123, ysize = 77;
   static const size_t num_frames = 2;
@@ -2944,6 +3469,344 @@ TEST(DecodeTest, SkipFrameWithBlendingTest) {
   JxlDecoderDestroy(dec);
 }
 
+TEST(DecodeTest, SkipFramesWithFrameIndexTest) {
+  size_t xsize = 90, ysize = 120;
+  constexpr size_t num_frames = 16;
+  std::vector<uint8_t> frames[num_frames];
+  for (size_t i = 0; i < num_frames; i++) {
+    frames[i] = jxl::test::GetSomeTestImage(xsize, ysize, 3, i);
+  }
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  jxl::CodecInOut io;
+  io.SetSize(xsize, ysize);
+  io.metadata.m.SetUintSamples(16);
+  io.metadata.m.color_encoding = jxl::ColorEncoding::SRGB(false);
+  io.metadata.m.have_animation = true;
+  io.frames.clear();
+  io.frames.reserve(num_frames);
+  io.SetSize(xsize, ysize);
+
+  std::vector<uint32_t> frame_durations(num_frames);
+  for (size_t i = 0; i < num_frames; ++i) {
+    frame_durations[i] = 5 + i;
+  }
+
+  for (size_t i = 0; i < num_frames; ++i) {
+    jxl::ImageBundle bundle(&io.metadata.m);
+    EXPECT_TRUE(ConvertFromExternal(
+        jxl::Span<const uint8_t>(frames[i].data(), frames[i].size()), xsize,
+        ysize, jxl::ColorEncoding::SRGB(/*is_gray=*/false), /*has_alpha=*/false,
+        /*alpha_is_premultiplied=*/false, /*bits_per_sample=*/16,
+        JXL_BIG_ENDIAN, /*flipped_y=*/false, /*pool=*/nullptr, &bundle,
+        /*float_in=*/false));
+    bundle.duration = frame_durations[i];
+    io.frames.push_back(std::move(bundle));
+  }
+
+  jxl::CompressParams cparams;
+  cparams.SetLossless();  // Lossless to verify pixels exactly after roundtrip.
+  jxl::AuxOut aux_out;
+  jxl::PaddedBytes compressed;
+  jxl::PassesEncoderState enc_state;
+  EXPECT_TRUE(jxl::EncodeFile(cparams, &io, &enc_state, &compressed, &aux_out,
+                              nullptr));
+
+  // None of the frames references another one, so all of them are indexed.
+  jxl::FrameIndex index;
+  ASSERT_TRUE(jxl::ComputeFrameIndex(jxl::Span<const uint8_t>(compressed),
+                                     &index));
+  ASSERT_EQ(num_frames, index.entries.size());
+  uint64_t timestamp = 0;
+  for (size_t i = 0; i < num_frames; ++i) {
+    EXPECT_EQ(i, index.entries[i].frame_number);
+    EXPECT_EQ(timestamp, index.entries[i].timestamp);
+    timestamp += frame_durations[i];
+  }
+  jxl::PaddedBytes index_box;
+  jxl::WriteFrameIndex(index, &index_box);
+  jxl::FrameIndex index2;
+  ASSERT_TRUE(
+      jxl::ReadFrameIndex(jxl::Span<const uint8_t>(index_box), &index2));
+  ASSERT_EQ(num_frames, index2.entries.size());
+  for (size_t i = 0; i < num_frames; ++i) {
+    EXPECT_EQ(index.entries[i].codestream_offset,
+              index2.entries[i].codestream_offset);
+    EXPECT_EQ(index.entries[i].timestamp, index2.entries[i].timestamp);
+  }
+
+  jxl::PaddedBytes container;
+  container.append(jxl::kContainerHeader,
+                   jxl::kContainerHeader + sizeof(jxl::kContainerHeader));
+  jxl::AppendBoxHeader(jxl::MakeBoxType("jxli"), index_box.size(), false,
+                       &container);
+  container.append(index_box.data(), index_box.data() + index_box.size());
+  jxl::AppendBoxHeader(jxl::MakeBoxType("jxlc"), 0, true, &container);
+  size_t codestream_begin = container.size();
+  container.append(compressed.data(), compressed.data() + compressed.size());
+
+  // Corrupt the frames that are jumped over: decoding only succeeds if they
+  // are not parsed.
+  constexpr size_t skip = 12;
+  for (size_t i = codestream_begin + index.entries[0].codestream_offset;
+       i < codestream_begin + index.entries[skip].codestream_offset; i++) {
+    container[i] = 0xff;
+  }
+
+  JxlDecoder* dec = JxlDecoderCreate(NULL);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(
+                dec, JXL_DEC_BASIC_INFO | JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, container.data(), container.size()));
+  EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
+  size_t buffer_size;
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderImageOutBufferSize(dec, &format, &buffer_size));
+  JxlDecoderSkipFrames(dec, skip);
+
+  for (size_t i = skip; i < num_frames; ++i) {
+    std::vector<uint8_t> pixels(buffer_size);
+
+    EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec));
+    JxlFrameHeader frame_header;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameHeader(dec, &frame_header));
+    EXPECT_EQ(frame_durations[i], frame_header.duration);
+
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                   dec, &format, pixels.data(), pixels.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(0u, ComparePixels(frames[i].data(), pixels.data(), xsize, ysize,
+                                format, format));
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+
+  JxlDecoderDestroy(dec);
+}
+
+TEST(DecodeTest, SkipFramesWithInvalidFrameIndexTest) {
+  size_t xsize = 90, ysize = 120;
+  constexpr size_t num_frames = 16;
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  jxl::CodecInOut io;
+  io.SetSize(xsize, ysize);
+  io.metadata.m.SetUintSamples(16);
+  io.metadata.m.color_encoding = jxl::ColorEncoding::SRGB(false);
+  io.metadata.m.have_animation = true;
+  io.frames.clear();
+  io.frames.reserve(num_frames);
+
+  // The frames from `first_blended` on are added to the previous frame, so
+  // they can only be decoded after decoding all the frames before them.
+  constexpr size_t first_blended = 10;
+  for (size_t i = 0; i < num_frames; ++i) {
+    std::vector<uint8_t> frame =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, i);
+    jxl::ImageBundle bundle(&io.metadata.m);
+    EXPECT_TRUE(ConvertFromExternal(
+        jxl::Span<const uint8_t>(frame.data(), frame.size()), xsize, ysize,
+        jxl::ColorEncoding::SRGB(/*is_gray=*/false), /*has_alpha=*/false,
+        /*alpha_is_premultiplied=*/false, /*bits_per_sample=*/16,
+        JXL_BIG_ENDIAN, /*flipped_y=*/false, /*pool=*/nullptr, &bundle,
+        /*float_in=*/false));
+    bundle.duration = 5;
+    bundle.use_for_next_frame = true;
+    bundle.blend = (i >= first_blended);
+    bundle.blendmode = jxl::BlendMode::kAdd;
+    io.frames.push_back(std::move(bundle));
+  }
+
+  jxl::CompressParams cparams;
+  cparams.SetLossless();
+  jxl::AuxOut aux_out;
+  jxl::PaddedBytes compressed;
+  jxl::PassesEncoderState enc_state;
+  EXPECT_TRUE(jxl::EncodeFile(cparams, &io, &enc_state, &compressed, &aux_out,
+                              nullptr));
+
+  // Index every frame, including the ones that depend on earlier frames, as
+  // an index written for a different codestream could.
+  jxl::FrameIndex index;
+  ASSERT_TRUE(jxl::ComputeFrameIndex(jxl::Span<const uint8_t>(compressed),
+                                     &index));
+  ASSERT_EQ(first_blended, index.entries.size());
+  size_t pos = index.entries[0].codestream_offset;
+  index.entries.clear();
+  for (size_t i = 0; i < num_frames; ++i) {
+    jxl::FrameHeader header(&io.metadata);
+    size_t end;
+    ASSERT_TRUE(jxl::ScanFrame(jxl::Span<const uint8_t>(compressed), pos,
+                               &header, &end));
+    index.entries.push_back({pos, i, i * 5});
+    pos = end;
+  }
+  jxl::PaddedBytes index_box;
+  jxl::WriteFrameIndex(index, &index_box);
+
+  jxl::PaddedBytes container;
+  container.append(jxl::kContainerHeader,
+                   jxl::kContainerHeader + sizeof(jxl::kContainerHeader));
+  jxl::AppendBoxHeader(jxl::MakeBoxType("jxli"), index_box.size(), false,
+                       &container);
+  container.append(index_box.data(), index_box.data() + index_box.size());
+  jxl::AppendBoxHeader(jxl::MakeBoxType("jxlc"), 0, true, &container);
+  container.append(compressed.data(), compressed.data() + compressed.size());
+
+  // Decodes the frames after the skipped ones.
+  constexpr size_t skip = 12;
+  const auto decode = [&](const jxl::PaddedBytes& data) {
+    std::vector<std::vector<uint8_t>> result;
+    JxlDecoder* dec = JxlDecoderCreate(NULL);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, data.data(), data.size()));
+    JxlDecoderSkipFrames(dec, skip);
+    for (size_t i = skip; i < num_frames; ++i) {
+      EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+      size_t buffer_size;
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderImageOutBufferSize(dec, &format, &buffer_size));
+      result.emplace_back(buffer_size);
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetImageOutBuffer(dec, &format, result.back().data(),
+                                            result.back().size()));
+      EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    }
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+    JxlDecoderDestroy(dec);
+    return result;
+  };
+
+  // The indexed frame that would be jumped to adds to the previous frame, so
+  // the index must be ignored and the frames skipped one by one.
+  std::vector<std::vector<uint8_t>> expected = decode(compressed);
+  std::vector<std::vector<uint8_t>> pixels = decode(container);
+  ASSERT_EQ(num_frames - skip, expected.size());
+  ASSERT_EQ(num_frames - skip, pixels.size());
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    EXPECT_EQ(0u, ComparePixels(expected[i].data(), pixels[i].data(), xsize,
+                                ysize, format, format));
+  }
+}
+
+TEST(DecodeTest, NoCoalescingTest) {
+  size_t xsize = 90, ysize = 120;
+  constexpr size_t num_frames = 3;
+  // Position and size of each frame: a full background and two cropped frames
+  // blended on top of it.
+  const int32_t frame_x0[num_frames] = {0, 10, 50};
+  const int32_t frame_y0[num_frames] = {0, 20, 60};
+  const size_t frame_xsize[num_frames] = {xsize, 30, 20};
+  const size_t frame_ysize[num_frames] = {ysize, 40, 25};
+  std::vector<uint8_t> frames[num_frames];
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  jxl::CodecInOut io;
+  io.SetSize(xsize, ysize);
+  io.metadata.m.SetUintSamples(16);
+  io.metadata.m.color_encoding = jxl::ColorEncoding::SRGB(false);
+  io.metadata.m.have_animation = true;
+  io.frames.clear();
+  io.frames.reserve(num_frames);
+
+  for (size_t i = 0; i < num_frames; ++i) {
+    frames[i] = jxl::test::GetSomeTestImage(frame_xsize[i], frame_ysize[i], 3,
+                                            i * 3 + 1);
+    jxl::ImageBundle bundle(&io.metadata.m);
+    EXPECT_TRUE(ConvertFromExternal(
+        jxl::Span<const uint8_t>(frames[i].data(), frames[i].size()),
+        frame_xsize[i], frame_ysize[i],
+        jxl::ColorEncoding::SRGB(/*is_gray=*/false), /*has_alpha=*/false,
+        /*alpha_is_premultiplied=*/false, /*bits_per_sample=*/16,
+        JXL_BIG_ENDIAN, /*flipped_y=*/false, /*pool=*/nullptr, &bundle,
+        /*float_in=*/false));
+    bundle.origin.x0 = frame_x0[i];
+    bundle.origin.y0 = frame_y0[i];
+    // All frames are composed into a single displayed frame.
+    bundle.duration = (i + 1 == num_frames) ? 5 : 0;
+    bundle.use_for_next_frame = (i + 1 != num_frames);
+    if (i != 0) {
+      bundle.blend = true;
+      bundle.blendmode = jxl::BlendMode::kAdd;
+    }
+    io.frames.push_back(std::move(bundle));
+  }
+
+  jxl::CompressParams cparams;
+  cparams.SetLossless();  // Lossless to verify pixels exactly after roundtrip.
+  jxl::AuxOut aux_out;
+  jxl::PaddedBytes compressed;
+  jxl::PassesEncoderState enc_state;
+  EXPECT_TRUE(jxl::EncodeFile(cparams, &io, &enc_state, &compressed, &aux_out,
+                              nullptr));
+
+  // With coalescing, only the composed frame is returned.
+  {
+    JxlDecoder* dec = JxlDecoderCreate(NULL);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSubscribeEvents(
+                                   dec, JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+    EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec));
+    JxlFrameHeader frame_header;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameHeader(dec, &frame_header));
+    EXPECT_EQ(JXL_FALSE, frame_header.layer_info.have_crop);
+    EXPECT_EQ(xsize, frame_header.layer_info.xsize);
+    EXPECT_EQ(ysize, frame_header.layer_info.ysize);
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    std::vector<uint8_t> pixels(xsize * ysize * 6);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                   dec, &format, pixels.data(), pixels.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+    JxlDecoderDestroy(dec);
+  }
+
+  // Without coalescing, each frame is returned at its own size and position.
+  JxlDecoder* dec = JxlDecoderCreate(NULL);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetCoalescing(dec, JXL_FALSE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(
+                dec, JXL_DEC_BASIC_INFO | JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+  EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetCropRegion(dec, 0, 0, 10, 10));
+
+  for (size_t i = 0; i < num_frames; ++i) {
+    EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec));
+    JxlFrameHeader frame_header;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameHeader(dec, &frame_header));
+    EXPECT_EQ(i + 1 == num_frames, frame_header.is_last);
+    EXPECT_EQ(i != 0, frame_header.layer_info.have_crop);
+    EXPECT_EQ(frame_x0[i], frame_header.layer_info.crop_x0);
+    EXPECT_EQ(frame_y0[i], frame_header.layer_info.crop_y0);
+    EXPECT_EQ(frame_xsize[i], frame_header.layer_info.xsize);
+    EXPECT_EQ(frame_ysize[i], frame_header.layer_info.ysize);
+    EXPECT_EQ(i == 0 ? JXL_BLEND_REPLACE : JXL_BLEND_ADD,
+              frame_header.layer_info.blend_info.blendmode);
+
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    size_t buffer_size;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderImageOutBufferSize(dec, &format, &buffer_size));
+    EXPECT_EQ(frame_xsize[i] * frame_ysize[i] * 6, buffer_size);
+    std::vector<uint8_t> pixels(buffer_size);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                   dec, &format, pixels.data(), pixels.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(0u, ComparePixels(frames[i].data(), pixels.data(),
+                                frame_xsize[i], frame_ysize[i], format,
+                                format));
+  }
+
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+  JxlDecoderDestroy(dec);
+}
+
 TEST(DecodeTest, FlushTest) {
   // Size large enough for multiple groups, required to have progressive
   // stages
@@ -3018,6 +3881,73 @@ TEST(DecodeTest, FlushTest) {
   JxlDecoderDestroy(dec);
 }
 
+TEST(DecodeTest, FlushTestIncremental) {
+  // Size large enough for multiple groups, so that flushes after more data
+  // arrived only need to draw some of the groups again.
+  size_t xsize = 600, ysize = 550;
+  uint32_t num_channels = 3;
+  std::vector<uint8_t> pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, num_channels, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes data = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize,
+      num_channels, cparams, kCSBF_None, JXL_ORIENT_IDENTITY, false);
+  JxlPixelFormat format = {num_channels, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  // The first decoder flushes incrementally, so each flush only converts the
+  // pixels that changed. The second decoder clears its buffer before each
+  // flush, which by default converts the whole frame.
+  std::vector<uint8_t> pixels_incremental(pixels.size());
+  std::vector<uint8_t> pixels_full(pixels.size());
+  JxlDecoder* dec_incremental = JxlDecoderCreate(nullptr);
+  JxlDecoder* dec_full = JxlDecoderCreate(nullptr);
+  for (JxlDecoder* dec : {dec_incremental, dec_full}) {
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSubscribeEvents(
+                                   dec, JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetIncrementalFlush(dec_incremental, JXL_TRUE));
+
+  const auto process = [&](JxlDecoder* dec, size_t* pos, size_t end,
+                           std::vector<uint8_t>* out) {
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, data.data() + *pos, end - *pos));
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+    if (status == JXL_DEC_FRAME) {
+      EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                     dec, &format, out->data(), out->size()));
+      status = JxlDecoderProcessInput(dec);
+    }
+    *pos = end - JxlDecoderReleaseInput(dec);
+    return status;
+  };
+
+  size_t pos_incremental = 0, pos_full = 0;
+  size_t num_flushes = 0;
+  constexpr size_t kNumSteps = 16;
+  for (size_t step = 1; step <= kNumSteps; step++) {
+    size_t end = data.size() * step / kNumSteps;
+    JxlDecoderStatus status = process(dec_incremental, &pos_incremental, end,
+                                      &pixels_incremental);
+    EXPECT_EQ(status, process(dec_full, &pos_full, end, &pixels_full));
+    if (status == JXL_DEC_FULL_IMAGE) break;
+    EXPECT_EQ(JXL_DEC_NEED_MORE_INPUT, status);
+    // Flushing fails as long as the DC is not complete.
+    if (JxlDecoderFlushImage(dec_incremental) != JXL_DEC_SUCCESS) continue;
+    std::fill(pixels_full.begin(), pixels_full.end(), 0);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderFlushImage(dec_full));
+    EXPECT_EQ(0u, ComparePixels(pixels_incremental.data(), pixels_full.data(),
+                                xsize, ysize, format, format));
+    num_flushes++;
+  }
+  EXPECT_LT(0u, num_flushes);
+  EXPECT_EQ(0u, ComparePixels(pixels_incremental.data(), pixels_full.data(),
+                              xsize, ysize, format, format));
+
+  JxlDecoderDestroy(dec_incremental);
+  JxlDecoderDestroy(dec_full);
+}
+
 TEST(DecodeTest, FlushTestLossyProgressiveAlpha) {
   // Size large enough for multiple groups, required to have progressive
   // stages
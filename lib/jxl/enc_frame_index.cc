@@ -0,0 +1,154 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/enc_frame_index.h"
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "jxl/decode.h"
+#include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/codec_in_out.h"
+#include "lib/jxl/common.h"
+#include "lib/jxl/dec_bit_reader.h"
+#include "lib/jxl/dec_frame.h"
+#include "lib/jxl/frame_header.h"
+#include "lib/jxl/headers.h"
+#include "lib/jxl/icc_codec.h"
+#include "lib/jxl/image_metadata.h"
+
+namespace jxl {
+namespace {
+
+// Reads the headers, ICC profile and preview frame, and stores in `start` the
+// byte position of the first frame.
+Status SkipHeaders(Span<const uint8_t> codestream, CodecMetadata* metadata,
+                   size_t* start) {
+  if (JxlSignatureCheck(codestream.data(), codestream.size()) !=
+      JXL_SIG_CODESTREAM) {
+    return JXL_FAILURE("Not a JPEG XL codestream");
+  }
+  Status ret = true;
+  {
+    BitReader reader(codestream);
+    BitReaderScopedCloser reader_closer(&reader, &ret);
+    (void)reader.ReadFixedBits<16>();  // skip marker
+    JXL_RETURN_IF_ERROR(ReadSizeHeader(&reader, &metadata->size));
+    JXL_RETURN_IF_ERROR(ReadImageMetadata(&reader, &metadata->m));
+    metadata->transform_data.nonserialized_xyb_encoded =
+        metadata->m.xyb_encoded;
+    JXL_RETURN_IF_ERROR(Bundle::Read(&reader, &metadata->transform_data));
+    if (metadata->m.color_encoding.WantICC()) {
+      PaddedBytes icc;
+      JXL_RETURN_IF_ERROR(ReadICC(&reader, &icc));
+    }
+    if (metadata->m.have_preview) {
+      JXL_RETURN_IF_ERROR(reader.JumpToByteBoundary());
+      JXL_RETURN_IF_ERROR(SkipFrame(*metadata, &reader, /*is_preview=*/true));
+    }
+    JXL_RETURN_IF_ERROR(reader.JumpToByteBoundary());
+    *start = reader.TotalBitsConsumed() / kBitsPerByte;
+  }
+  return ret;
+}
+
+void AppendVarint(uint64_t value, PaddedBytes* out) {
+  while (value >= 128) {
+    out->push_back(static_cast<uint8_t>((value & 127) | 128));
+    value >>= 7;
+  }
+  out->push_back(static_cast<uint8_t>(value));
+}
+
+}  // namespace
+
+Status ComputeFrameIndex(Span<const uint8_t> codestream, FrameIndex* index) {
+  CodecMetadata metadata;
+  size_t start;
+  JXL_RETURN_IF_ERROR(SkipHeaders(codestream, &metadata, &start));
+  if (!metadata.m.have_animation) {
+    return JXL_FAILURE("Frame index requires an animation");
+  }
+  // The animation header counts ticks per second.
+  index->tnum = metadata.m.animation.tps_denominator;
+  index->tden = metadata.m.animation.tps_numerator;
+  index->entries.clear();
+
+  // For the frame with index i, `invalid[i]` counts the reads of frames at or
+  // after i from storage locations last written before i; decoding cannot
+  // start at such a frame. Stored as differences and summed up below.
+  std::vector<int> invalid(1, 0);
+  std::vector<size_t> frame_begin;
+  std::vector<uint32_t> displayed_duration;
+  std::vector<char> displayed;
+  int last_writer[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+  size_t pos = start;
+  for (;;) {
+    FrameHeader header(&metadata);
+    size_t end;
+    JXL_RETURN_IF_ERROR(ScanFrame(codestream, pos, &header, &end));
+    const int i = frame_begin.size();
+    frame_begin.push_back(pos);
+    invalid.push_back(0);
+    const int references = FrameDecoder::MaybeReferences(header);
+    for (int slot = 0; slot < 8; slot++) {
+      if (!(references & (1 << slot)) || last_writer[slot] < 0) continue;
+      invalid[last_writer[slot] + 1]++;
+      invalid[i + 1]--;
+    }
+    const int saved_as = FrameDecoder::SavedAs(header);
+    for (int slot = 0; slot < 8; slot++) {
+      if (saved_as & (1 << slot)) last_writer[slot] = i;
+    }
+    displayed.push_back(header.is_last ||
+                        header.animation_frame.duration > 0);
+    displayed_duration.push_back(header.animation_frame.duration);
+    pos = end;
+    if (header.is_last) break;
+  }
+
+  FrameIndexEntry entry = {0, 0, 0};
+  bool group_start = true;
+  int sum = 0;
+  for (size_t i = 0; i < frame_begin.size(); i++) {
+    sum += invalid[i];
+    if (group_start && (i == 0 || sum == 0)) {
+      entry.codestream_offset = frame_begin[i];
+      index->entries.push_back(entry);
+    }
+    group_start = displayed[i];
+    if (displayed[i]) {
+      entry.frame_number++;
+      entry.timestamp += displayed_duration[i];
+    }
+  }
+  return true;
+}
+
+void WriteFrameIndex(const FrameIndex& index, PaddedBytes* out) {
+  AppendVarint(index.entries.size(), out);
+  uint8_t tick_unit[8];
+  StoreBE32(index.tnum, tick_unit);
+  StoreBE32(index.tden, tick_unit + 4);
+  out->append(tick_unit, tick_unit + 8);
+  uint64_t previous_offset = 0;
+  for (size_t i = 0; i < index.entries.size(); i++) {
+    const FrameIndexEntry& entry = index.entries[i];
+    AppendVarint(entry.codestream_offset - previous_offset, out);
+    previous_offset = entry.codestream_offset;
+    // The last entry has no next entry to count the ticks and frames to.
+    if (i + 1 == index.entries.size()) {
+      AppendVarint(0, out);
+      AppendVarint(0, out);
+    } else {
+      const FrameIndexEntry& next = index.entries[i + 1];
+      AppendVarint(next.timestamp - entry.timestamp, out);
+      AppendVarint(next.frame_number - entry.frame_number, out);
+    }
+  }
+}
+
+}  // namespace jxl
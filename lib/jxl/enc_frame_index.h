@@ -0,0 +1,33 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_ENC_FRAME_INDEX_H_
+#define LIB_JXL_ENC_FRAME_INDEX_H_
+
+// Creates the frame index ("jxli" box) of an encoded animation.
+
+#include <stdint.h>
+
+#include "lib/jxl/base/padded_bytes.h"
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/frame_index.h"
+
+namespace jxl {
+
+// Scans the frame headers and TOCs of the animation in `codestream`, a bare
+// codestream without container, and adds to `index` every displayed frame
+// from which decoding can start: one that, together with the frames after it,
+// does not read any reference frame or DC frame saved before it. The first
+// frame is always indexed.
+Status ComputeFrameIndex(Span<const uint8_t> codestream, FrameIndex* index);
+
+// Appends the contents of the "jxli" box, in the format read by
+// ReadFrameIndex, to `out`.
+void WriteFrameIndex(const FrameIndex& index, PaddedBytes* out);
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_ENC_FRAME_INDEX_H_
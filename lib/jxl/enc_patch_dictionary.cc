@@ -115,44 +115,52 @@ void PatchDictionaryEncoder::SubtractFrom(const PatchDictionary& pdic,
                                           Image3F* opsin) {
   // TODO(veluca): this can likely be optimized knowing it runs on full images.
   for (size_t y = 0; y < opsin->ysize(); y++) {
-    if (y + 1 >= pdic.patch_starts_.size()) continue;
+    if ((y + 1) * pdic.num_columns_ >= pdic.patch_starts_.size()) continue;
     float* JXL_RESTRICT rows[3] = {
         opsin->PlaneRow(0, y),
         opsin->PlaneRow(1, y),
         opsin->PlaneRow(2, y),
     };
-    for (size_t id = pdic.patch_starts_[y]; id < pdic.patch_starts_[y + 1];
-         id++) {
-      const PatchPosition& pos = pdic.positions_[pdic.sorted_patches_[id]];
-      size_t by = pos.y;
-      size_t bx = pos.x;
-      size_t xsize = pos.ref_pos.xsize;
-      JXL_DASSERT(y >= by);
-      JXL_DASSERT(y < by + pos.ref_pos.ysize);
-      size_t iy = y - by;
-      size_t ref = pos.ref_pos.ref;
-      const float* JXL_RESTRICT ref_rows[3] = {
-          pdic.shared_->reference_frames[ref].frame->color()->ConstPlaneRow(
-              0, pos.ref_pos.y0 + iy) +
-              pos.ref_pos.x0,
-          pdic.shared_->reference_frames[ref].frame->color()->ConstPlaneRow(
-              1, pos.ref_pos.y0 + iy) +
-              pos.ref_pos.x0,
-          pdic.shared_->reference_frames[ref].frame->color()->ConstPlaneRow(
-              2, pos.ref_pos.y0 + iy) +
-              pos.ref_pos.x0,
-      };
-      for (size_t ix = 0; ix < xsize; ix++) {
-        for (size_t c = 0; c < 3; c++) {
-          if (pos.blending[0].mode == PatchBlendMode::kAdd) {
-            rows[c][bx + ix] -= ref_rows[c][ix];
-          } else if (pos.blending[0].mode == PatchBlendMode::kReplace) {
-            rows[c][bx + ix] = 0;
-          } else if (pos.blending[0].mode == PatchBlendMode::kNone) {
-            // Nothing to do.
-          } else {
-            JXL_ABORT("Blending mode %u not yet implemented",
-                      (uint32_t)pos.blending[0].mode);
+    const size_t* row_starts =
+        pdic.patch_starts_.data() + y * pdic.num_columns_;
+    for (size_t column = 0; column < pdic.num_columns_; column++) {
+      const size_t column_x0 = column * kPatchColumnWidth;
+      const size_t column_x1 = column_x0 + kPatchColumnWidth;
+      for (size_t id = row_starts[column]; id < row_starts[column + 1]; id++) {
+        const PatchPosition& pos = pdic.positions_[pdic.sorted_patches_[id]];
+        size_t by = pos.y;
+        size_t bx = pos.x;
+        size_t xsize = pos.ref_pos.xsize;
+        JXL_DASSERT(y >= by);
+        JXL_DASSERT(y < by + pos.ref_pos.ysize);
+        size_t iy = y - by;
+        size_t ref = pos.ref_pos.ref;
+        const float* JXL_RESTRICT ref_rows[3] = {
+            pdic.shared_->reference_frames[ref].frame->color()->ConstPlaneRow(
+                0, pos.ref_pos.y0 + iy) +
+                pos.ref_pos.x0,
+            pdic.shared_->reference_frames[ref].frame->color()->ConstPlaneRow(
+                1, pos.ref_pos.y0 + iy) +
+                pos.ref_pos.x0,
+            pdic.shared_->reference_frames[ref].frame->color()->ConstPlaneRow(
+                2, pos.ref_pos.y0 + iy) +
+                pos.ref_pos.x0,
+        };
+        // Patches are listed in every column they overlap.
+        const size_t ix0 = std::max(bx, column_x0) - bx;
+        const size_t ix1 = std::min(bx + xsize, column_x1) - bx;
+        for (size_t ix = ix0; ix < ix1; ix++) {
+          for (size_t c = 0; c < 3; c++) {
+            if (pos.blending[0].mode == PatchBlendMode::kAdd) {
+              rows[c][bx + ix] -= ref_rows[c][ix];
+            } else if (pos.blending[0].mode == PatchBlendMode::kReplace) {
+              rows[c][bx + ix] = 0;
+            } else if (pos.blending[0].mode == PatchBlendMode::kNone) {
+              // Nothing to do.
+            } else {
+              JXL_ABORT("Blending mode %u not yet implemented",
+                        (uint32_t)pos.blending[0].mode);
+            }
           }
         }
       }
@@ -198,6 +198,9 @@ void DequantMatricesSetCustom(DequantMatrices* matrices,
   // Called only in the encoder: should fail only for programmer errors.
   JXL_CHECK(matrices->Decode(&br));
   JXL_CHECK(br.Close());
+  // The encoder may try any transform.
+  JXL_CHECK(matrices->EnsureComputed((1u << AcStrategy::kNumValidStrategies) -
+                                     1));
 }
 
 }  // namespace jxl
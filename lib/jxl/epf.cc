@@ -44,64 +44,106 @@ namespace jxl {
 namespace HWY_NAMESPACE {
 
 // These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftRight;
 using hwy::HWY_NAMESPACE::Vec;
 
 // The EPF logic treats 8x8 blocks as one unit, each with their own sigma.
-// It should be possible to do two blocks at a time in AVX3 vectors, at some
-// increase in complexity (broadcasting sigma0/1 to lanes 0..7 and 8..15).
+// Vectors of up to kBlockDim lanes never straddle two blocks and use the same
+// sigma for all lanes; wider vectors (AVX3) load one sigma per lane.
 using DF = HWY_CAPPED(float, GroupBorderAssigner::kPaddingXRound);
 using DU = HWY_CAPPED(uint32_t, GroupBorderAssigner::kPaddingXRound);
+using DFull = HWY_FULL(float);
 
 // kInvSigmaNum / 0.3
 constexpr float kMinSigma = -3.90524291751269967465540850526868f;
 
 DF df;
 
-JXL_INLINE Vec<DF> Weight(Vec<DF> sad, Vec<DF> inv_sigma, Vec<DF> thres) {
-  auto v = MulAdd(sad, inv_sigma, Set(DF(), 1.0f));
+// Filter x values are multiples of GroupBorderAssigner::kPaddingXRound, so
+// loads and stores at them are only aligned for vectors up to that size.
+template <class D>
+JXL_INLINE Vec<D> LoadPixels(D d, const float* JXL_RESTRICT p) {
+  return MaxLanes(d) <= GroupBorderAssigner::kPaddingXRound ? Load(d, p)
+                                                             : LoadU(d, p);
+}
+
+template <class D>
+JXL_INLINE void StorePixels(Vec<D> v, D d, float* JXL_RESTRICT p) {
+  if (MaxLanes(d) <= GroupBorderAssigner::kPaddingXRound) {
+    Store(v, d, p);
+  } else {
+    StoreU(v, d, p);
+  }
+}
+
+// Returns the sigma of each lane of the vector of pixels starting at `x`,
+// measured from the start of `row_sigma`.
+template <class D>
+JXL_INLINE Vec<D> LoadSigma(D d, const float* JXL_RESTRICT row_sigma,
+                            size_t x) {
+  const float* JXL_RESTRICT sigma = row_sigma + x / kBlockDim;
+  if (MaxLanes(d) <= kBlockDim) return Set(d, *sigma);
+  static_assert(kBlockDim == 8, "Update the shift below");
+  const Rebind<int32_t, D> di;
+  return GatherIndex(d, sigma, ShiftRight<3>(Iota(di, x % kBlockDim)));
+}
+
+// Lanes whose block has a sigma below kMinSigma are not filtered. This can only
+// apply to some of the lanes of vectors wider than a block.
+template <class D>
+JXL_INLINE void StoreFiltered(D d, decltype(Zero(D()) < Zero(D())) skip,
+                              Vec<D> center, Vec<D> filtered,
+                              float* JXL_RESTRICT p) {
+  if (MaxLanes(d) > kBlockDim) filtered = IfThenElse(skip, center, filtered);
+  StorePixels(filtered, d, p);
+}
+
+template <class D>
+JXL_INLINE Vec<D> Weight(D d, Vec<D> sad, Vec<D> inv_sigma, Vec<D> thres) {
+  auto v = MulAdd(sad, inv_sigma, Set(d, 1.0f));
   auto v2 = v * v;
   return IfThenZeroElse(v <= thres, v2);
 }
 
-template <bool aligned>
-JXL_INLINE void AddPixelStep1(int row, const FilterRows& rows, size_t x,
-                              Vec<DF> sad, Vec<DF> inv_sigma,
-                              const LoopFilter& lf, Vec<DF>* JXL_RESTRICT X,
-                              Vec<DF>* JXL_RESTRICT Y, Vec<DF>* JXL_RESTRICT B,
-                              Vec<DF>* JXL_RESTRICT w) {
-  auto cx = aligned ? Load(DF(), rows.GetInputRow(row, 0) + x)
-                    : LoadU(DF(), rows.GetInputRow(row, 0) + x);
-  auto cy = aligned ? Load(DF(), rows.GetInputRow(row, 1) + x)
-                    : LoadU(DF(), rows.GetInputRow(row, 1) + x);
-  auto cb = aligned ? Load(DF(), rows.GetInputRow(row, 2) + x)
-                    : LoadU(DF(), rows.GetInputRow(row, 2) + x);
-
-  auto weight = Weight(sad, inv_sigma, Set(df, lf.epf_pass1_zeroflush));
+template <bool aligned, class D>
+JXL_INLINE void AddPixelStep1(D d, int row, const FilterRows& rows, size_t x,
+                              Vec<D> sad, Vec<D> inv_sigma,
+                              const LoopFilter& lf, Vec<D>* JXL_RESTRICT X,
+                              Vec<D>* JXL_RESTRICT Y, Vec<D>* JXL_RESTRICT B,
+                              Vec<D>* JXL_RESTRICT w) {
+  auto cx = aligned ? LoadPixels(d, rows.GetInputRow(row, 0) + x)
+                    : LoadU(d, rows.GetInputRow(row, 0) + x);
+  auto cy = aligned ? LoadPixels(d, rows.GetInputRow(row, 1) + x)
+                    : LoadU(d, rows.GetInputRow(row, 1) + x);
+  auto cb = aligned ? LoadPixels(d, rows.GetInputRow(row, 2) + x)
+                    : LoadU(d, rows.GetInputRow(row, 2) + x);
+
+  auto weight = Weight(d, sad, inv_sigma, Set(d, lf.epf_pass1_zeroflush));
   *w += weight;
   *X = MulAdd(weight, cx, *X);
   *Y = MulAdd(weight, cy, *Y);
   *B = MulAdd(weight, cb, *B);
 }
 
-template <bool aligned>
-JXL_INLINE void AddPixelStep2(int row, const FilterRows& rows, size_t x,
-                              Vec<DF> rx, Vec<DF> ry, Vec<DF> rb,
-                              Vec<DF> inv_sigma, const LoopFilter& lf,
-                              Vec<DF>* JXL_RESTRICT X, Vec<DF>* JXL_RESTRICT Y,
-                              Vec<DF>* JXL_RESTRICT B,
-                              Vec<DF>* JXL_RESTRICT w) {
-  auto cx = aligned ? Load(DF(), rows.GetInputRow(row, 0) + x)
-                    : LoadU(DF(), rows.GetInputRow(row, 0) + x);
-  auto cy = aligned ? Load(DF(), rows.GetInputRow(row, 1) + x)
-                    : LoadU(DF(), rows.GetInputRow(row, 1) + x);
-  auto cb = aligned ? Load(DF(), rows.GetInputRow(row, 2) + x)
-                    : LoadU(DF(), rows.GetInputRow(row, 2) + x);
-
-  auto sad = AbsDiff(cx, rx) * Set(df, lf.epf_channel_scale[0]);
-  sad = MulAdd(AbsDiff(cy, ry), Set(df, lf.epf_channel_scale[1]), sad);
-  sad = MulAdd(AbsDiff(cb, rb), Set(df, lf.epf_channel_scale[2]), sad);
-
-  auto weight = Weight(sad, inv_sigma, Set(df, lf.epf_pass2_zeroflush));
+template <bool aligned, class D>
+JXL_INLINE void AddPixelStep2(D d, int row, const FilterRows& rows, size_t x,
+                              Vec<D> rx, Vec<D> ry, Vec<D> rb,
+                              Vec<D> inv_sigma, const LoopFilter& lf,
+                              Vec<D>* JXL_RESTRICT X, Vec<D>* JXL_RESTRICT Y,
+                              Vec<D>* JXL_RESTRICT B, Vec<D>* JXL_RESTRICT w) {
+  auto cx = aligned ? LoadPixels(d, rows.GetInputRow(row, 0) + x)
+                    : LoadU(d, rows.GetInputRow(row, 0) + x);
+  auto cy = aligned ? LoadPixels(d, rows.GetInputRow(row, 1) + x)
+                    : LoadU(d, rows.GetInputRow(row, 1) + x);
+  auto cb = aligned ? LoadPixels(d, rows.GetInputRow(row, 2) + x)
+                    : LoadU(d, rows.GetInputRow(row, 2) + x);
+
+  auto sad = AbsDiff(cx, rx) * Set(d, lf.epf_channel_scale[0]);
+  sad = MulAdd(AbsDiff(cy, ry), Set(d, lf.epf_channel_scale[1]), sad);
+  sad = MulAdd(AbsDiff(cb, rb), Set(d, lf.epf_channel_scale[2]), sad);
+
+  auto weight = Weight(d, sad, inv_sigma, Set(d, lf.epf_pass2_zeroflush));
 
   *w += weight;
   *X = MulAdd(weight, cx, *X);
@@ -188,8 +230,95 @@ void GaborishRow(const FilterRows& rows, const LoopFilter& /* lf */,
   }
 }
 
+// Multipliers of the SADs of the pixels of a row, with period kBlockDim: pixels
+// on the left and right border of a block use `bsm`, the others `sm`. Rows on
+// the top and bottom border of a block use `bsm` for all pixels. There is one
+// extra period so that full vectors can be loaded at any position in a block.
+struct SadMul {
+  SadMul(float sm, float bsm, size_t image_y_mod_8) {
+    const bool border_row =
+        image_y_mod_8 == 0 || image_y_mod_8 == kBlockDim - 1;
+    for (size_t i = 0; i < kSize; i++) {
+      const size_t ix = i % kBlockDim;
+      values[i] = border_row || ix == 0 || ix == kBlockDim - 1 ? bsm : sm;
+    }
+  }
+  static constexpr size_t kSize = kBlockDim + MaxLanes(DFull());
+  HWY_ALIGN float values[kSize];
+};
+
 // Step 0: 5x5 plus-shaped kernel with 5 SADs per pixel (3x3
 // plus-shaped). So this makes this filter a 7x7 filter.
+template <class D>
+JXL_INLINE void Epf0Vector(D d, const FilterRows& rows, const LoopFilter& lf,
+                           const float* JXL_RESTRICT row_sigma,
+                           const SadMul& sad_mul, size_t x,
+                           size_t sigma_x_offset) {
+  const size_t ix = (x + sigma_x_offset) % kBlockDim;
+  const auto sigma = LoadSigma(d, row_sigma, x + sigma_x_offset);
+  const auto skip = sigma < Set(d, kMinSigma);
+  if (AllTrue(skip)) {
+    for (size_t c = 0; c < 3; c++) {
+      auto px = LoadPixels(d, rows.GetInputRow(0, c) + x);
+      StorePixels(px, d, rows.GetOutputRow(c) + x);
+    }
+    return;
+  }
+
+  const auto sm = LoadPixels(d, sad_mul.values + ix);
+  const auto inv_sigma = sigma * sm;
+
+  decltype(Zero(d)) sads[12];
+  for (size_t i = 0; i < 12; i++) sads[i] = Zero(d);
+  constexpr std::array<int, 2> sads_off[12] = {
+      {{-2, 0}}, {{-1, -1}}, {{-1, 0}}, {{-1, 1}}, {{0, -2}}, {{0, -1}},
+      {{0, 1}},  {{0, 2}},   {{1, -1}}, {{1, 0}},  {{1, 1}},  {{2, 0}},
+  };
+
+  // compute sads
+  // TODO(veluca): consider unrolling and optimizing this.
+  for (size_t c = 0; c < 3; c++) {
+    auto scale = Set(d, lf.epf_channel_scale[c]);
+    for (size_t i = 0; i < 12; i++) {
+      auto sad = Zero(d);
+      constexpr std::array<int, 2> plus_off[] = {
+          {{0, 0}}, {{-1, 0}}, {{0, -1}}, {{1, 0}}, {{0, 1}}};
+      for (size_t j = 0; j < 5; j++) {
+        const auto r11 = LoadU(
+            d, rows.GetInputRow(plus_off[j][0], c) + x + plus_off[j][1]);
+        const auto c11 =
+            LoadU(d, rows.GetInputRow(sads_off[i][0] + plus_off[j][0], c) +
+                         x + sads_off[i][1] + plus_off[j][1]);
+        sad += AbsDiff(r11, c11);
+      }
+      sads[i] = MulAdd(sad, scale, sads[i]);
+    }
+  }
+  const auto x_cc = LoadU(d, rows.GetInputRow(0, 0) + x);
+  const auto y_cc = LoadU(d, rows.GetInputRow(0, 1) + x);
+  const auto b_cc = LoadU(d, rows.GetInputRow(0, 2) + x);
+
+  auto w = Set(d, 1);
+  auto X = x_cc;
+  auto Y = y_cc;
+  auto B = b_cc;
+
+  for (size_t i = 0; i < 12; i++) {
+    AddPixelStep1</*aligned=*/false>(d, /*row=*/sads_off[i][0], rows,
+                                     x + sads_off[i][1], sads[i], inv_sigma, lf,
+                                     &X, &Y, &B, &w);
+  }
+
+#if JXL_HIGH_PRECISION
+  auto inv_w = Set(d, 1.0f) / w;
+#else
+  auto inv_w = ApproximateReciprocal(w);
+#endif
+  StoreFiltered(d, skip, x_cc, X * inv_w, rows.GetOutputRow(0) + x);
+  StoreFiltered(d, skip, y_cc, Y * inv_w, rows.GetOutputRow(1) + x);
+  StoreFiltered(d, skip, b_cc, B * inv_w, rows.GetOutputRow(2) + x);
+}
+
 void Epf0Row(const FilterRows& rows, const LoopFilter& lf,
              const FilterWeights& filter_weights, size_t x0, size_t x1,
              size_t sigma_x_offset, size_t image_y_mod_8) {
@@ -198,83 +327,132 @@ void Epf0Row(const FilterRows& rows, const LoopFilter& lf,
 
   float sm = lf.epf_pass0_sigma_scale;
   float bsm = sm * lf.epf_border_sad_mul;
+  const SadMul sad_mul(sm, bsm, image_y_mod_8);
 
-  HWY_ALIGN float sad_mul[kBlockDim] = {bsm, sm, sm, sm, sm, sm, sm, bsm};
-
-  if (image_y_mod_8 == 0 || image_y_mod_8 == kBlockDim - 1) {
-    for (size_t i = 0; i < kBlockDim; i += Lanes(df)) {
-      Store(Set(df, bsm), df, sad_mul + i);
-    }
+  const DFull dfull;
+  size_t x = x0;
+  for (; x + Lanes(dfull) <= x1; x += Lanes(dfull)) {
+    Epf0Vector(dfull, rows, lf, row_sigma, sad_mul, x, sigma_x_offset);
   }
+  for (; x < x1; x += Lanes(df)) {
+    Epf0Vector(df, rows, lf, row_sigma, sad_mul, x, sigma_x_offset);
+  }
+}
 
-  for (size_t x = x0; x < x1; x += Lanes(df)) {
-    size_t bx = (x + sigma_x_offset) / kBlockDim;
-    size_t ix = (x + sigma_x_offset) % kBlockDim;
-    if (row_sigma[bx] < kMinSigma) {
-      for (size_t c = 0; c < 3; c++) {
-        auto px = Load(df, rows.GetInputRow(0, c) + x);
-        Store(px, df, rows.GetOutputRow(c) + x);
-      }
-      continue;
-    }
-
-    const auto sm = Load(df, sad_mul + ix);
-    const auto inv_sigma = Set(DF(), row_sigma[bx]) * sm;
-
-    decltype(Zero(df)) sads[12];
-    for (size_t i = 0; i < 12; i++) sads[i] = Zero(df);
-    constexpr std::array<int, 2> sads_off[12] = {
-        {{-2, 0}}, {{-1, -1}}, {{-1, 0}}, {{-1, 1}}, {{0, -2}}, {{0, -1}},
-        {{0, 1}},  {{0, 2}},   {{1, -1}}, {{1, 0}},  {{1, 1}},  {{2, 0}},
-    };
-
-    // compute sads
-    // TODO(veluca): consider unrolling and optimizing this.
+// Step 1: 3x3 plus-shaped kernel with 5 SADs per pixel (also 3x3
+// plus-shaped). So this makes this filter a 5x5 filter.
+template <class D>
+JXL_INLINE void Epf1Vector(D d, const FilterRows& rows, const LoopFilter& lf,
+                           const float* JXL_RESTRICT row_sigma,
+                           const SadMul& sad_mul, size_t x,
+                           size_t sigma_x_offset) {
+  const size_t ix = (x + sigma_x_offset) % kBlockDim;
+  const auto sigma = LoadSigma(d, row_sigma, x + sigma_x_offset);
+  const auto skip = sigma < Set(d, kMinSigma);
+  if (AllTrue(skip)) {
     for (size_t c = 0; c < 3; c++) {
-      auto scale = Set(df, lf.epf_channel_scale[c]);
-      for (size_t i = 0; i < 12; i++) {
-        auto sad = Zero(df);
-        constexpr std::array<int, 2> plus_off[] = {
-            {{0, 0}}, {{-1, 0}}, {{0, -1}}, {{1, 0}}, {{0, 1}}};
-        for (size_t j = 0; j < 5; j++) {
-          const auto r11 = LoadU(
-              df, rows.GetInputRow(plus_off[j][0], c) + x + plus_off[j][1]);
-          const auto c11 =
-              LoadU(df, rows.GetInputRow(sads_off[i][0] + plus_off[j][0], c) +
-                            x + sads_off[i][1] + plus_off[j][1]);
-          sad += AbsDiff(r11, c11);
-        }
-        sads[i] = MulAdd(sad, scale, sads[i]);
-      }
+      auto px = LoadPixels(d, rows.GetInputRow(0, c) + x);
+      StorePixels(px, d, rows.GetOutputRow(c) + x);
     }
-    const auto x_cc = LoadU(df, rows.GetInputRow(0, 0) + x);
-    const auto y_cc = LoadU(df, rows.GetInputRow(0, 1) + x);
-    const auto b_cc = LoadU(df, rows.GetInputRow(0, 2) + x);
-
-    auto w = Set(df, 1);
-    auto X = x_cc;
-    auto Y = y_cc;
-    auto B = b_cc;
+    return;
+  }
 
-    for (size_t i = 0; i < 12; i++) {
-      AddPixelStep1</*aligned=*/false>(/*row=*/sads_off[i][0], rows,
-                                       x + sads_off[i][1], sads[i], inv_sigma,
-                                       lf, &X, &Y, &B, &w);
-    }
+  const auto sm = LoadPixels(d, sad_mul.values + ix);
+  const auto inv_sigma = sigma * sm;
+  auto sad0 = Zero(d);
+  auto sad1 = Zero(d);
+  auto sad2 = Zero(d);
+  auto sad3 = Zero(d);
 
+  // compute sads
+  for (size_t c = 0; c < 3; c++) {
+    // center px = 22, px above = 21
+    auto t = Undefined(d);
+
+    const auto p20 = LoadPixels(d, rows.GetInputRow(-2, c) + x);
+    const auto p21 = LoadPixels(d, rows.GetInputRow(-1, c) + x);
+    auto sad0c = AbsDiff(p20, p21);  // SAD 2, 1
+
+    const auto p11 = LoadU(d, rows.GetInputRow(-1, c) + x - 1);
+    auto sad1c = AbsDiff(p11, p21);  // SAD 1, 2
+
+    const auto p31 = LoadU(d, rows.GetInputRow(-1, c) + x + 1);
+    auto sad2c = AbsDiff(p31, p21);  // SAD 3, 2
+
+    const auto p02 = LoadU(d, rows.GetInputRow(0, c) + x - 2);
+    const auto p12 = LoadU(d, rows.GetInputRow(0, c) + x - 1);
+    sad1c += AbsDiff(p02, p12);  // SAD 1, 2
+    sad0c += AbsDiff(p11, p12);  // SAD 2, 1
+
+    const auto p22 = LoadU(d, rows.GetInputRow(0, c) + x);
+    t = AbsDiff(p12, p22);
+    sad1c += t;  // SAD 1, 2
+    sad2c += t;  // SAD 3, 2
+    t = AbsDiff(p22, p21);
+    auto sad3c = t;  // SAD 2, 3
+    sad0c += t;      // SAD 2, 1
+
+    const auto p32 = LoadU(d, rows.GetInputRow(0, c) + x + 1);
+    sad0c += AbsDiff(p31, p32);  // SAD 2, 1
+    t = AbsDiff(p22, p32);
+    sad1c += t;  // SAD 1, 2
+    sad2c += t;  // SAD 3, 2
+
+    const auto p42 = LoadU(d, rows.GetInputRow(0, c) + x + 2);
+    sad2c += AbsDiff(p42, p32);  // SAD 3, 2
+
+    const auto p13 = LoadU(d, rows.GetInputRow(1, c) + x - 1);
+    sad3c += AbsDiff(p13, p12);  // SAD 2, 3
+
+    const auto p23 = LoadPixels(d, rows.GetInputRow(1, c) + x);
+    t = AbsDiff(p22, p23);
+    sad0c += t;                  // SAD 2, 1
+    sad3c += t;                  // SAD 2, 3
+    sad1c += AbsDiff(p13, p23);  // SAD 1, 2
+
+    const auto p33 = LoadU(d, rows.GetInputRow(1, c) + x + 1);
+    sad2c += AbsDiff(p33, p23);  // SAD 3, 2
+    sad3c += AbsDiff(p33, p32);  // SAD 2, 3
+
+    const auto p24 = LoadPixels(d, rows.GetInputRow(2, c) + x);
+    sad3c += AbsDiff(p24, p23);  // SAD 2, 3
+
+    auto scale = Set(d, lf.epf_channel_scale[c]);
+    sad0 = MulAdd(sad0c, scale, sad0);
+    sad1 = MulAdd(sad1c, scale, sad1);
+    sad2 = MulAdd(sad2c, scale, sad2);
+    sad3 = MulAdd(sad3c, scale, sad3);
+  }
+  const auto x_cc = LoadPixels(d, rows.GetInputRow(0, 0) + x);
+  const auto y_cc = LoadPixels(d, rows.GetInputRow(0, 1) + x);
+  const auto b_cc = LoadPixels(d, rows.GetInputRow(0, 2) + x);
+
+  auto w = Set(d, 1);
+  auto X = x_cc;
+  auto Y = y_cc;
+  auto B = b_cc;
+
+  // Top row
+  AddPixelStep1</*aligned=*/true>(d, /*row=*/-1, rows, x, sad0, inv_sigma, lf,
+                                  &X, &Y, &B, &w);
+  // Center
+  AddPixelStep1</*aligned=*/false>(d, /*row=*/0, rows, x - 1, sad1, inv_sigma,
+                                   lf, &X, &Y, &B, &w);
+  AddPixelStep1</*aligned=*/false>(d, /*row=*/0, rows, x + 1, sad2, inv_sigma,
+                                   lf, &X, &Y, &B, &w);
+  // Bottom
+  AddPixelStep1</*aligned=*/true>(d, /*row=*/1, rows, x, sad3, inv_sigma, lf,
+                                  &X, &Y, &B, &w);
 #if JXL_HIGH_PRECISION
-    auto inv_w = Set(df, 1.0f) / w;
+  auto inv_w = Set(d, 1.0f) / w;
 #else
-    auto inv_w = ApproximateReciprocal(w);
+  auto inv_w = ApproximateReciprocal(w);
 #endif
-    Store(X * inv_w, df, rows.GetOutputRow(0) + x);
-    Store(Y * inv_w, df, rows.GetOutputRow(1) + x);
-    Store(B * inv_w, df, rows.GetOutputRow(2) + x);
-  }
+  StoreFiltered(d, skip, x_cc, X * inv_w, rows.GetOutputRow(0) + x);
+  StoreFiltered(d, skip, y_cc, Y * inv_w, rows.GetOutputRow(1) + x);
+  StoreFiltered(d, skip, b_cc, B * inv_w, rows.GetOutputRow(2) + x);
 }
 
-// Step 1: 3x3 plus-shaped kernel with 5 SADs per pixel (also 3x3
-// plus-shaped). So this makes this filter a 5x5 filter.
 void Epf1Row(const FilterRows& rows, const LoopFilter& lf,
              const FilterWeights& filter_weights, size_t x0, size_t x1,
              size_t sigma_x_offset, size_t image_y_mod_8) {
@@ -283,125 +461,70 @@ void Epf1Row(const FilterRows& rows, const LoopFilter& lf,
 
   float sm = 1.0f;
   float bsm = sm * lf.epf_border_sad_mul;
+  const SadMul sad_mul(sm, bsm, image_y_mod_8);
 
-  HWY_ALIGN float sad_mul[kBlockDim] = {bsm, sm, sm, sm, sm, sm, sm, bsm};
-
-  if (image_y_mod_8 == 0 || image_y_mod_8 == kBlockDim - 1) {
-    for (size_t i = 0; i < kBlockDim; i += Lanes(df)) {
-      Store(Set(df, bsm), df, sad_mul + i);
-    }
+  const DFull dfull;
+  size_t x = x0;
+  for (; x + Lanes(dfull) <= x1; x += Lanes(dfull)) {
+    Epf1Vector(dfull, rows, lf, row_sigma, sad_mul, x, sigma_x_offset);
   }
+  for (; x < x1; x += Lanes(df)) {
+    Epf1Vector(df, rows, lf, row_sigma, sad_mul, x, sigma_x_offset);
+  }
+}
 
-  for (size_t x = x0; x < x1; x += Lanes(df)) {
-    size_t bx = (x + sigma_x_offset) / kBlockDim;
-    size_t ix = (x + sigma_x_offset) % kBlockDim;
-    if (row_sigma[bx] < kMinSigma) {
-      for (size_t c = 0; c < 3; c++) {
-        auto px = Load(df, rows.GetInputRow(0, c) + x);
-        Store(px, df, rows.GetOutputRow(c) + x);
-      }
-      continue;
+// Step 2: 3x3 plus-shaped kernel with a single reference pixel, ran on
+// the output of the previous step.
+template <class D>
+JXL_INLINE void Epf2Vector(D d, const FilterRows& rows, const LoopFilter& lf,
+                           const float* JXL_RESTRICT row_sigma,
+                           const SadMul& sad_mul, size_t x,
+                           size_t sigma_x_offset) {
+  const size_t ix = (x + sigma_x_offset) % kBlockDim;
+  const auto sigma = LoadSigma(d, row_sigma, x + sigma_x_offset);
+  const auto skip = sigma < Set(d, kMinSigma);
+  if (AllTrue(skip)) {
+    for (size_t c = 0; c < 3; c++) {
+      auto px = LoadPixels(d, rows.GetInputRow(0, c) + x);
+      StorePixels(px, d, rows.GetOutputRow(c) + x);
     }
+    return;
+  }
 
-    const auto sm = Load(df, sad_mul + ix);
-    const auto inv_sigma = Set(DF(), row_sigma[bx]) * sm;
-    auto sad0 = Zero(df);
-    auto sad1 = Zero(df);
-    auto sad2 = Zero(df);
-    auto sad3 = Zero(df);
+  const auto sm = LoadPixels(d, sad_mul.values + ix);
+  const auto inv_sigma = sigma * sm;
+
+  const auto x_cc = LoadPixels(d, rows.GetInputRow(0, 0) + x);
+  const auto y_cc = LoadPixels(d, rows.GetInputRow(0, 1) + x);
+  const auto b_cc = LoadPixels(d, rows.GetInputRow(0, 2) + x);
+
+  auto w = Set(d, 1);
+  auto X = x_cc;
+  auto Y = y_cc;
+  auto B = b_cc;
+
+  // Top row
+  AddPixelStep2</*aligned=*/true>(d, /*row=*/-1, rows, x, x_cc, y_cc, b_cc,
+                                  inv_sigma, lf, &X, &Y, &B, &w);
+  // Center
+  AddPixelStep2</*aligned=*/false>(d, /*row=*/0, rows, x - 1, x_cc, y_cc, b_cc,
+                                   inv_sigma, lf, &X, &Y, &B, &w);
+  AddPixelStep2</*aligned=*/false>(d, /*row=*/0, rows, x + 1, x_cc, y_cc, b_cc,
+                                   inv_sigma, lf, &X, &Y, &B, &w);
+  // Bottom
+  AddPixelStep2</*aligned=*/true>(d, /*row=*/1, rows, x, x_cc, y_cc, b_cc,
+                                  inv_sigma, lf, &X, &Y, &B, &w);
 
-    // compute sads
-    for (size_t c = 0; c < 3; c++) {
-      // center px = 22, px above = 21
-      auto t = Undefined(df);
-
-      const auto p20 = Load(df, rows.GetInputRow(-2, c) + x);
-      const auto p21 = Load(df, rows.GetInputRow(-1, c) + x);
-      auto sad0c = AbsDiff(p20, p21);  // SAD 2, 1
-
-      const auto p11 = LoadU(df, rows.GetInputRow(-1, c) + x - 1);
-      auto sad1c = AbsDiff(p11, p21);  // SAD 1, 2
-
-      const auto p31 = LoadU(df, rows.GetInputRow(-1, c) + x + 1);
-      auto sad2c = AbsDiff(p31, p21);  // SAD 3, 2
-
-      const auto p02 = LoadU(df, rows.GetInputRow(0, c) + x - 2);
-      const auto p12 = LoadU(df, rows.GetInputRow(0, c) + x - 1);
-      sad1c += AbsDiff(p02, p12);  // SAD 1, 2
-      sad0c += AbsDiff(p11, p12);  // SAD 2, 1
-
-      const auto p22 = LoadU(df, rows.GetInputRow(0, c) + x);
-      t = AbsDiff(p12, p22);
-      sad1c += t;  // SAD 1, 2
-      sad2c += t;  // SAD 3, 2
-      t = AbsDiff(p22, p21);
-      auto sad3c = t;  // SAD 2, 3
-      sad0c += t;      // SAD 2, 1
-
-      const auto p32 = LoadU(df, rows.GetInputRow(0, c) + x + 1);
-      sad0c += AbsDiff(p31, p32);  // SAD 2, 1
-      t = AbsDiff(p22, p32);
-      sad1c += t;  // SAD 1, 2
-      sad2c += t;  // SAD 3, 2
-
-      const auto p42 = LoadU(df, rows.GetInputRow(0, c) + x + 2);
-      sad2c += AbsDiff(p42, p32);  // SAD 3, 2
-
-      const auto p13 = LoadU(df, rows.GetInputRow(1, c) + x - 1);
-      sad3c += AbsDiff(p13, p12);  // SAD 2, 3
-
-      const auto p23 = Load(df, rows.GetInputRow(1, c) + x);
-      t = AbsDiff(p22, p23);
-      sad0c += t;                  // SAD 2, 1
-      sad3c += t;                  // SAD 2, 3
-      sad1c += AbsDiff(p13, p23);  // SAD 1, 2
-
-      const auto p33 = LoadU(df, rows.GetInputRow(1, c) + x + 1);
-      sad2c += AbsDiff(p33, p23);  // SAD 3, 2
-      sad3c += AbsDiff(p33, p32);  // SAD 2, 3
-
-      const auto p24 = Load(df, rows.GetInputRow(2, c) + x);
-      sad3c += AbsDiff(p24, p23);  // SAD 2, 3
-
-      auto scale = Set(df, lf.epf_channel_scale[c]);
-      sad0 = MulAdd(sad0c, scale, sad0);
-      sad1 = MulAdd(sad1c, scale, sad1);
-      sad2 = MulAdd(sad2c, scale, sad2);
-      sad3 = MulAdd(sad3c, scale, sad3);
-    }
-    const auto x_cc = Load(df, rows.GetInputRow(0, 0) + x);
-    const auto y_cc = Load(df, rows.GetInputRow(0, 1) + x);
-    const auto b_cc = Load(df, rows.GetInputRow(0, 2) + x);
-
-    auto w = Set(df, 1);
-    auto X = x_cc;
-    auto Y = y_cc;
-    auto B = b_cc;
-
-    // Top row
-    AddPixelStep1</*aligned=*/true>(/*row=*/-1, rows, x, sad0, inv_sigma, lf,
-                                    &X, &Y, &B, &w);
-    // Center
-    AddPixelStep1</*aligned=*/false>(/*row=*/0, rows, x - 1, sad1, inv_sigma,
-                                     lf, &X, &Y, &B, &w);
-    AddPixelStep1</*aligned=*/false>(/*row=*/0, rows, x + 1, sad2, inv_sigma,
-                                     lf, &X, &Y, &B, &w);
-    // Bottom
-    AddPixelStep1</*aligned=*/true>(/*row=*/1, rows, x, sad3, inv_sigma, lf, &X,
-                                    &Y, &B, &w);
 #if JXL_HIGH_PRECISION
-    auto inv_w = Set(df, 1.0f) / w;
+  auto inv_w = Set(d, 1.0f) / w;
 #else
-    auto inv_w = ApproximateReciprocal(w);
+  auto inv_w = ApproximateReciprocal(w);
 #endif
-    Store(X * inv_w, df, rows.GetOutputRow(0) + x);
-    Store(Y * inv_w, df, rows.GetOutputRow(1) + x);
-    Store(B * inv_w, df, rows.GetOutputRow(2) + x);
-  }
+  StoreFiltered(d, skip, x_cc, X * inv_w, rows.GetOutputRow(0) + x);
+  StoreFiltered(d, skip, y_cc, Y * inv_w, rows.GetOutputRow(1) + x);
+  StoreFiltered(d, skip, b_cc, B * inv_w, rows.GetOutputRow(2) + x);
 }
 
-// Step 2: 3x3 plus-shaped kernel with a single reference pixel, ran on
-// the output of the previous step.
 void Epf2Row(const FilterRows& rows, const LoopFilter& lf,
              const FilterWeights& filter_weights, size_t x0, size_t x1,
              size_t sigma_x_offset, size_t image_y_mod_8) {
@@ -410,59 +533,15 @@ void Epf2Row(const FilterRows& rows, const LoopFilter& lf,
 
   float sm = lf.epf_pass2_sigma_scale;
   float bsm = sm * lf.epf_border_sad_mul;
+  const SadMul sad_mul(sm, bsm, image_y_mod_8);
 
-  HWY_ALIGN float sad_mul[kBlockDim] = {bsm, sm, sm, sm, sm, sm, sm, bsm};
-
-  if (image_y_mod_8 == 0 || image_y_mod_8 == kBlockDim - 1) {
-    for (size_t i = 0; i < kBlockDim; i += Lanes(df)) {
-      Store(Set(df, bsm), df, sad_mul + i);
-    }
+  const DFull dfull;
+  size_t x = x0;
+  for (; x + Lanes(dfull) <= x1; x += Lanes(dfull)) {
+    Epf2Vector(dfull, rows, lf, row_sigma, sad_mul, x, sigma_x_offset);
   }
-
-  for (size_t x = x0; x < x1; x += Lanes(df)) {
-    size_t bx = (x + sigma_x_offset) / kBlockDim;
-    size_t ix = (x + sigma_x_offset) % kBlockDim;
-
-    if (row_sigma[bx] < kMinSigma) {
-      for (size_t c = 0; c < 3; c++) {
-        auto px = Load(df, rows.GetInputRow(0, c) + x);
-        Store(px, df, rows.GetOutputRow(c) + x);
-      }
-      continue;
-    }
-
-    const auto sm = Load(df, sad_mul + ix);
-    const auto inv_sigma = Set(DF(), row_sigma[bx]) * sm;
-
-    const auto x_cc = Load(df, rows.GetInputRow(0, 0) + x);
-    const auto y_cc = Load(df, rows.GetInputRow(0, 1) + x);
-    const auto b_cc = Load(df, rows.GetInputRow(0, 2) + x);
-
-    auto w = Set(df, 1);
-    auto X = x_cc;
-    auto Y = y_cc;
-    auto B = b_cc;
-
-    // Top row
-    AddPixelStep2</*aligned=*/true>(/*row=*/-1, rows, x, x_cc, y_cc, b_cc,
-                                    inv_sigma, lf, &X, &Y, &B, &w);
-    // Center
-    AddPixelStep2</*aligned=*/false>(/*row=*/0, rows, x - 1, x_cc, y_cc, b_cc,
-                                     inv_sigma, lf, &X, &Y, &B, &w);
-    AddPixelStep2</*aligned=*/false>(/*row=*/0, rows, x + 1, x_cc, y_cc, b_cc,
-                                     inv_sigma, lf, &X, &Y, &B, &w);
-    // Bottom
-    AddPixelStep2</*aligned=*/true>(/*row=*/1, rows, x, x_cc, y_cc, b_cc,
-                                    inv_sigma, lf, &X, &Y, &B, &w);
-
-#if JXL_HIGH_PRECISION
-    auto inv_w = Set(df, 1.0f) / w;
-#else
-    auto inv_w = ApproximateReciprocal(w);
-#endif
-    Store(X * inv_w, df, rows.GetOutputRow(0) + x);
-    Store(Y * inv_w, df, rows.GetOutputRow(1) + x);
-    Store(B * inv_w, df, rows.GetOutputRow(2) + x);
+  for (; x < x1; x += Lanes(df)) {
+    Epf2Vector(df, rows, lf, row_sigma, sad_mul, x, sigma_x_offset);
   }
 }
 
@@ -672,7 +751,7 @@ FilterPipeline* PrepareFilterPipeline(
 
   JXL_DASSERT(image_rect.xsize() == input_rect.xsize());
   JXL_DASSERT(image_rect.xsize() == output_rect.xsize());
-  FilterPipeline* fp = &(dec_state->filter_pipelines[thread]);
+  FilterPipeline* fp = &(dec_state->scratch.filter_pipelines[thread]);
   fp->image_rect = image_rect;
 
   HWY_DYNAMIC_DISPATCH(FilterPipelineInit)
@@ -0,0 +1,65 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/frame_index.h"
+
+#include "lib/jxl/base/byte_order.h"
+
+namespace jxl {
+namespace {
+
+Status ReadVarint(Span<const uint8_t> data, size_t* pos, uint64_t* value) {
+  *value = 0;
+  for (size_t shift = 0; shift < 64; shift += 7) {
+    if (*pos >= data.size()) return JXL_FAILURE("Frame index too short");
+    uint8_t byte = data[(*pos)++];
+    *value |= static_cast<uint64_t>(byte & 127) << shift;
+    if (!(byte & 128)) return true;
+  }
+  return JXL_FAILURE("Frame index varint too long");
+}
+
+}  // namespace
+
+Status ReadFrameIndex(Span<const uint8_t> data, FrameIndex* index) {
+  size_t pos = 0;
+  uint64_t num_entries;
+  JXL_RETURN_IF_ERROR(ReadVarint(data, &pos, &num_entries));
+  if (pos + 8 > data.size()) return JXL_FAILURE("Frame index too short");
+  index->tnum = LoadBE32(data.data() + pos);
+  index->tden = LoadBE32(data.data() + pos + 4);
+  pos += 8;
+  if (index->tden == 0) return JXL_FAILURE("Invalid frame index tick unit");
+  // Each entry takes at least 3 bytes.
+  if (num_entries == 0 || num_entries > (data.size() - pos) / 3) {
+    return JXL_FAILURE("Invalid amount of frame index entries");
+  }
+  index->entries.resize(num_entries);
+  FrameIndexEntry next = {0, 0, 0};
+  for (size_t i = 0; i < num_entries; i++) {
+    uint64_t offset, ticks, frames;
+    JXL_RETURN_IF_ERROR(ReadVarint(data, &pos, &offset));
+    JXL_RETURN_IF_ERROR(ReadVarint(data, &pos, &ticks));
+    JXL_RETURN_IF_ERROR(ReadVarint(data, &pos, &frames));
+    if (i > 0 && offset == 0) {
+      return JXL_FAILURE("Frame index entries must be increasing");
+    }
+    if (next.codestream_offset + offset < next.codestream_offset ||
+        next.timestamp + ticks < next.timestamp ||
+        next.frame_number + frames < next.frame_number) {
+      return JXL_FAILURE("Frame index overflow");
+    }
+    next.codestream_offset += offset;
+    index->entries[i] = next;
+    next.timestamp += ticks;
+    next.frame_number += frames;
+    if (i + 1 < num_entries && frames == 0) {
+      return JXL_FAILURE("Frame index entries must be increasing");
+    }
+  }
+  return true;
+}
+
+}  // namespace jxl
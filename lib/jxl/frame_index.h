@@ -0,0 +1,53 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_FRAME_INDEX_H_
+#define LIB_JXL_FRAME_INDEX_H_
+
+// Frame index ("jxli" box) of an animation, which lists the frames from which
+// decoding can start without decoding any earlier frame.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/base/status.h"
+
+namespace jxl {
+
+struct FrameIndexEntry {
+  // Byte offset of the first frame header of the indexed frame, from the start
+  // of the codestream. If the displayed frame is composed of several frames,
+  // this is the first of those.
+  uint64_t codestream_offset;
+  // Amount of displayed frames before the indexed frame, i.e. the amount of
+  // frames to pass to JxlDecoderSkipFrames to decode it.
+  uint64_t frame_number;
+  // Sum of the durations, in ticks, of the displayed frames before it.
+  uint64_t timestamp;
+};
+
+struct FrameIndex {
+  // A tick lasts tnum / tden seconds.
+  uint32_t tnum = 1;
+  uint32_t tden = 1000;
+  // Sorted by frame_number, the first entry is always the first frame.
+  std::vector<FrameIndexEntry> entries;
+};
+
+// Parses the contents of a "jxli" box. The box stores, in this order, the
+// number of entries NF as a varint, TNUM and TDEN as 32-bit big endian
+// integers, and for each entry its codestream offset relative to the previous
+// entry (or to the start of the codestream for the first one), the ticks until
+// the next entry and the displayed frames until the next entry, as varints.
+// Varints are little endian groups of 7 bits, with the high bit of each byte
+// set if another byte follows.
+Status ReadFrameIndex(Span<const uint8_t> data, FrameIndex* index);
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_FRAME_INDEX_H_
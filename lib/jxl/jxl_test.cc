@@ -1387,6 +1387,57 @@ TEST(JxlTest, RoundtripAnimationPatches) {
 
 #endif  // JPEGXL_ENABLE_GIF
 
+TEST(JxlTest, RoundtripAnimationFramesMT) {
+  ThreadPoolInternal pool(4);
+  const size_t xsize = 300, ysize = 200, num_frames = 6;
+  CodecInOut io;
+  io.SetSize(xsize, ysize);
+  io.metadata.m.SetUintSamples(8);
+  io.metadata.m.color_encoding = ColorEncoding::SRGB();
+  io.metadata.m.have_animation = true;
+  io.frames.clear();
+  // Frames that replace the whole canvas and are not saved as references, so
+  // they can all be decoded at the same time.
+  for (size_t i = 0; i < num_frames; i++) {
+    Image3F color(xsize, ysize);
+    for (size_t c = 0; c < 3; c++) {
+      for (size_t y = 0; y < ysize; y++) {
+        float* JXL_RESTRICT row = color.PlaneRow(c, y);
+        for (size_t x = 0; x < xsize; x++) {
+          row[x] = ((x * (c + 1) + y * (i + 1) + 40 * i) % 256) * (1.0f / 255);
+        }
+      }
+    }
+    ImageBundle frame(&io.metadata.m);
+    frame.SetFromImage(std::move(color), io.metadata.m.color_encoding);
+    frame.duration = 1;
+    io.frames.push_back(std::move(frame));
+  }
+
+  CompressParams cparams;
+  // Patches would make the frames reference a patch frame.
+  cparams.patches = Override::kOff;
+  cparams.dots = Override::kOff;
+  DecompressParams dparams;
+  PaddedBytes compressed;
+  PassesEncoderState enc_state;
+  ASSERT_TRUE(EncodeFile(cparams, &io, &enc_state, &compressed,
+                         /*aux_out=*/nullptr, &pool));
+
+  // Frames decoded concurrently must be identical to the ones decoded one
+  // after the other.
+  CodecInOut io_st, io_mt;
+  ASSERT_TRUE(DecodeFile(dparams, compressed, &io_st, /*pool=*/nullptr));
+  ASSERT_TRUE(DecodeFile(dparams, compressed, &io_mt, &pool));
+  EXPECT_EQ(0u, io_st.dec_max_concurrent_frames);
+  EXPECT_EQ(num_frames, io_mt.dec_max_concurrent_frames);
+  ASSERT_EQ(num_frames, io_st.frames.size());
+  ASSERT_EQ(num_frames, io_mt.frames.size());
+  for (size_t i = 0; i < num_frames; i++) {
+    EXPECT_TRUE(SamePixels(*io_st.frames[i].color(), *io_mt.frames[i].color()));
+  }
+}
+
 #if JPEGXL_ENABLE_JPEG
 
 namespace {
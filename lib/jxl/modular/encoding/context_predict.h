@@ -60,8 +60,21 @@ struct Header : public Fields {
 struct State {
   pixel_type_w prediction[kNumPredictors] = {};
   pixel_type_w pred = 0;  // *before* removing the added bits.
-  std::vector<uint32_t> pred_errors[kNumPredictors];
+  // Errors of the sub-predictors on the current row, with the kNumPredictors
+  // values of a pixel next to each other. Starts with two pixels of zeros, so
+  // that the first pixels of the row can read their W and WW errors.
+  std::vector<uint32_t> pred_errors;
+  // Sums of the sub-predictor errors on the N, NE and NW pixels of the
+  // previous row, computed once the previous row is done. Same layout as
+  // pred_errors, without the padding.
+  std::vector<uint32_t> pred_error_sums;
   std::vector<int32_t> error;
+  // Terms of the predictions and properties that only depend on the errors on
+  // the previous row (teN, teNE and teNW), computed with pred_error_sums.
+  std::vector<pixel_type_w> error_sum_N_NE;
+  std::vector<pixel_type_w> error_sum_N_NW;
+  std::vector<pixel_type_w> error_p3_partial;
+  std::vector<pixel_type_w> error_max_N_NW_NE;
   Header header;
 
   // Allows to approximate division by a number from 1 to 64.
@@ -72,12 +85,16 @@ struct State {
   }
 
   State(Header header, size_t xsize, size_t ysize) : header(header) {
+    pred_errors.resize((xsize + 2) * kNumPredictors);
+    // There is no row before the first one.
+    pred_error_sums.resize(xsize * kNumPredictors);
     // Extra margin to avoid out-of-bounds writes.
-    // All have space for two rows of data.
-    for (size_t i = 0; i < 4; i++) {
-      pred_errors[i].resize((xsize + 2) * 2);
-    }
+    // Has space for two rows of data.
     error.resize((xsize + 2) * 2);
+    error_sum_N_NE.resize(xsize);
+    error_sum_N_NW.resize(xsize);
+    error_p3_partial.resize(xsize);
+    error_max_N_NW_NE.resize(xsize);
     // Initialize division lookup table.
     for (int i = 0; i < 64; i++) {
       divlookup[i] = (1 << 24) / (i + 1);
@@ -124,14 +141,19 @@ struct State {
     size_t cur_row = y & 1 ? 0 : (xsize + 2);
     size_t prev_row = y & 1 ? (xsize + 2) : 0;
     size_t pos_N = prev_row + x;
-    size_t pos_NE = x < xsize - 1 ? pos_N + 1 : pos_N;
     size_t pos_NW = x > 0 ? pos_N - 1 : pos_N;
+    // The weights use the errors on N, NE and NW, to which the errors on W and
+    // WW are added (on the last column, NE is N and W is counted twice).
+    const uint32_t *JXL_RESTRICT sums = &pred_error_sums[x * kNumPredictors];
+    const uint32_t *JXL_RESTRICT errors_WW = &pred_errors[x * kNumPredictors];
+    const uint32_t *JXL_RESTRICT errors_W = errors_WW + kNumPredictors;
+    const uint32_t shift_W = x + 1 == xsize ? 1 : 0;
     std::array<uint32_t, kNumPredictors> weights;
     for (size_t i = 0; i < kNumPredictors; i++) {
-      // pred_errors[pos_N] also contains the error of pixel W.
-      // pred_errors[pos_NW] also contains the error of pixel WW.
-      weights[i] = pred_errors[i][pos_N] + pred_errors[i][pos_NE] +
-                   pred_errors[i][pos_NW];
+      // The error on W, from the previous call, is added last.
+      weights[i] = (sums[i] + errors_WW[i]) + (errors_W[i] << shift_W);
+    }
+    for (size_t i = 0; i < kNumPredictors; i++) {
       weights[i] = ErrorWeight(weights[i], header.w[i]);
     }
 
@@ -144,24 +166,21 @@ struct State {
     pixel_type_w teW = x == 0 ? 0 : error[cur_row + x - 1];
     pixel_type_w teN = error[pos_N];
     pixel_type_w teNW = error[pos_NW];
-    pixel_type_w sumWN = teN + teW;
-    pixel_type_w teNE = error[pos_NE];
 
     if (compute_properties) {
-      pixel_type_w p = teW;
-      if (std::abs(teN) > std::abs(p)) p = teN;
-      if (std::abs(teNW) > std::abs(p)) p = teNW;
-      if (std::abs(teNE) > std::abs(p)) p = teNE;
+      // Largest absolute value among teW, teN, teNW and teNE, the first one
+      // in this order in case of ties.
+      pixel_type_w p = error_max_N_NW_NE[x];
+      if (std::abs(teW) >= std::abs(p)) p = teW;
       (*properties)[offset++] = p;
     }
 
     prediction[0] = W + NE - N;
-    prediction[1] = N - (((sumWN + teNE) * header.p1C) >> 5);
-    prediction[2] = W - (((sumWN + teNW) * header.p2C) >> 5);
-    prediction[3] =
-        N - ((teNW * header.p3Ca + teN * header.p3Cb + teNE * header.p3Cc +
-              (NN - N) * header.p3Cd + (NW - W) * header.p3Ce) >>
-             5);
+    prediction[1] = N - (((error_sum_N_NE[x] + teW) * header.p1C) >> 5);
+    prediction[2] = W - (((error_sum_N_NW[x] + teW) * header.p2C) >> 5);
+    prediction[3] = N - ((error_p3_partial[x] + (NN - N) * header.p3Cd +
+                          (NW - W) * header.p3Ce) >>
+                         5);
 
     pred = WeightedAverage(prediction, weights);
 
@@ -180,17 +199,54 @@ struct State {
   JXL_INLINE void UpdateErrors(pixel_type_w val, size_t x, size_t y,
                                size_t xsize) {
     size_t cur_row = y & 1 ? 0 : (xsize + 2);
-    size_t prev_row = y & 1 ? (xsize + 2) : 0;
     val = AddBits(val);
     error[cur_row + x] = pred - val;
+    uint32_t *JXL_RESTRICT errors = &pred_errors[(x + 2) * kNumPredictors];
     for (size_t i = 0; i < kNumPredictors; i++) {
-      pixel_type_w err =
+      errors[i] =
           (std::abs(prediction[i] - val) + kPredictionRound) >> kPredExtraBits;
-      // For predicting in the next row.
-      pred_errors[i][cur_row + x] = err;
-      // Add the error on this pixel to the error on the NE pixel. This has the
-      // effect of adding the error on this pixel to the E and EE pixels.
-      pred_errors[i][prev_row + x + 1] += err;
+    }
+    if (x + 1 == xsize) FinishRow(y, xsize);
+  }
+
+ private:
+  // Computes the terms of the next row that only depend on this row.
+  void FinishRow(size_t y, size_t xsize) {
+    ComputeErrorSums(xsize);
+    const int32_t *JXL_RESTRICT row = &error[y & 1 ? 0 : (xsize + 2)];
+    for (size_t x = 0; x < xsize; x++) {
+      pixel_type_w teN = row[x];
+      pixel_type_w teNW = row[x > 0 ? x - 1 : x];
+      pixel_type_w teNE = row[x + 1 < xsize ? x + 1 : x];
+      error_sum_N_NE[x] = teN + teNE;
+      error_sum_N_NW[x] = teN + teNW;
+      error_p3_partial[x] =
+          teNW * header.p3Ca + teN * header.p3Cb + teNE * header.p3Cc;
+      pixel_type_w p = teN;
+      if (std::abs(teNW) > std::abs(p)) p = teNW;
+      if (std::abs(teNE) > std::abs(p)) p = teNE;
+      error_max_N_NW_NE[x] = p;
+    }
+  }
+
+  // Computes the pred_error_sums of the next row from pred_errors.
+  void ComputeErrorSums(size_t xsize) {
+    const uint32_t *JXL_RESTRICT errors = &pred_errors[2 * kNumPredictors];
+    uint32_t *JXL_RESTRICT sums = pred_error_sums.data();
+    constexpr size_t kStep = kNumPredictors;
+    if (xsize == 1) {
+      for (size_t i = 0; i < kStep; i++) sums[i] = errors[i] * 3;
+      return;
+    }
+    // NW is N on the first column, and NE is N on the last one.
+    for (size_t i = 0; i < kStep; i++) {
+      sums[i] = errors[i] * 2 + errors[i + kStep];
+    }
+    for (size_t i = kStep; i < (xsize - 1) * kStep; i++) {
+      sums[i] = errors[i - kStep] + errors[i] + errors[i + kStep];
+    }
+    for (size_t i = (xsize - 1) * kStep; i < xsize * kStep; i++) {
+      sums[i] = errors[i - kStep] + errors[i] * 2;
     }
   }
 };
@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <queue>
 
 #include "lib/jxl/base/printf_macros.h"
@@ -124,6 +125,208 @@ FlatTree FilterTree(const Tree &global_tree,
   return output;
 }
 
+namespace {
+
+JXL_INLINE pixel_type MakePixel(uint64_t v, pixel_type multiplier,
+                                pixel_type_w offset) {
+  JXL_DASSERT((v & 0xFFFFFFFF) == v);
+  pixel_type_w val = UnpackSigned(v);
+  // if it overflows, it overflows, and we have a problem anyway
+  return val * multiplier + offset;
+}
+
+// What a flattened tree needs to be evaluated, besides the properties that
+// only depend on the neighbouring pixels, which are cheaper to compute than to
+// check for.
+struct TreeUsage {
+  // Indices of the properties computed from previous channels that the tree
+  // reads, relative to kNumNonrefProperties.
+  std::vector<uint32_t> ref_props;
+  // Predictor of all the leaves, or -1 if the leaves use different predictors.
+  int predictor = -1;
+};
+
+TreeUsage AnalyzeTree(const FlatTree &tree) {
+  TreeUsage usage;
+  bool first_leaf = true;
+  for (const FlatDecisionNode &node : tree) {
+    if (node.property0 == -1) {
+      const int predictor = static_cast<int>(node.predictor);
+      if (first_leaf || usage.predictor != predictor) {
+        usage.predictor = first_leaf ? predictor : -1;
+      }
+      first_leaf = false;
+      continue;
+    }
+    for (int32_t property :
+         {node.property0, node.properties[0], node.properties[1]}) {
+      if (property >= static_cast<int32_t>(kNumNonrefProperties)) {
+        usage.ref_props.push_back(property - kNumNonrefProperties);
+      }
+    }
+  }
+  std::sort(usage.ref_props.begin(), usage.ref_props.end());
+  usage.ref_props.erase(
+      std::unique(usage.ref_props.begin(), usage.ref_props.end()),
+      usage.ref_props.end());
+  return usage;
+}
+
+// Same as Predict<kUseTree | kUseWP> in context_predict.h, except that the
+// weighted predictor is only run if kWP, the properties of previous channels
+// are only copied if kRefs and only for the ones the tree reads, and
+// kPredictor, if not -1, replaces the predictor of the leaves. If kInterior,
+// the pixel must have all its neighbours: y > 1 and 1 < x < w - 2.
+template <bool kWP, bool kRefs, int kPredictor, bool kInterior>
+JXL_INLINE void DecodePixelWithTree(
+    size_t x, size_t y, size_t w, pixel_type *JXL_RESTRICT pp,
+    const intptr_t onerow, const MATreeLookup &tree_lookup,
+    const std::vector<uint32_t> &ref_props, const Channel &references,
+    weighted::State *wp_state, Properties *properties, BitReader *br,
+    ANSSymbolReader *reader) {
+  pixel_type_w left, top, topleft, topright, leftleft, toptop, toprightright;
+  if (kInterior) {
+    left = pp[-1];
+    top = pp[-onerow];
+    topleft = pp[-1 - onerow];
+    topright = pp[1 - onerow];
+    leftleft = pp[-2];
+    toptop = pp[-onerow - onerow];
+    toprightright = pp[2 - onerow];
+  } else {
+    left = (x ? pp[-1] : (y ? pp[-onerow] : 0));
+    top = (y ? pp[-onerow] : left);
+    topleft = (x && y ? pp[-1 - onerow] : left);
+    topright = (x + 1 < w && y ? pp[1 - onerow] : top);
+    leftleft = (x > 1 ? pp[-2] : left);
+    toptop = (y > 1 ? pp[-onerow - onerow] : top);
+    toprightright = (x + 2 < w && y ? pp[2 - onerow] : topright);
+  }
+
+  PropertyVal *JXL_RESTRICT p = properties->data();
+  p[3] = x;
+  p[4] = std::abs(top);
+  p[5] = std::abs(left);
+  p[6] = top;
+  p[7] = left;
+  // p[9] still holds the local gradient of the previous pixel.
+  p[8] = left - p[9];
+  p[9] = left + top - topleft;
+  p[10] = left - topleft;
+  p[11] = topleft - top;
+  p[12] = top - topright;
+  p[13] = top - toptop;
+  p[14] = left - leftleft;
+
+  pixel_type_w wp_pred = 0;
+  if (kWP) {
+    wp_pred = wp_state->Predict</*compute_properties=*/true>(
+        x, y, w, top, left, topright, topleft, toptop, properties, kWPProp);
+  }
+  if (kRefs) {
+    const pixel_type *JXL_RESTRICT rp = references.Row(x);
+    for (uint32_t i : ref_props) p[kNumNonrefProperties + i] = rp[i];
+  }
+
+  MATreeLookup::LookupResult lr = tree_lookup.Lookup(*properties);
+  const Predictor predictor =
+      kPredictor < 0 ? lr.predictor : static_cast<Predictor>(kPredictor);
+  pixel_type_w guess =
+      lr.offset + detail::PredictOne(predictor, left, top, toptop, topleft,
+                                     topright, leftleft, toprightright,
+                                     wp_pred);
+  uint64_t v = reader->ReadHybridUintClustered(lr.context, br);
+  pp[0] = MakePixel(v, lr.multiplier, guess);
+  if (kWP) wp_state->UpdateErrors(pp[0], x, y, w);
+}
+
+using TreeKernel = void (*)(
+    const FlatTree &tree, const TreeUsage &usage,
+    const weighted::Header &wp_header,
+    const std::array<pixel_type, kNumStaticProperties> &static_props,
+    size_t num_props, pixel_type chan, BitReader *br, ANSSymbolReader *reader,
+    Image *image);
+
+template <bool kWP, bool kRefs, int kPredictor>
+void DecodeChannelWithTree(
+    const FlatTree &tree, const TreeUsage &usage,
+    const weighted::Header &wp_header,
+    const std::array<pixel_type, kNumStaticProperties> &static_props,
+    size_t num_props, pixel_type chan, BitReader *br, ANSSymbolReader *reader,
+    Image *image) {
+  Channel &channel = image->channel[chan];
+  const size_t w = channel.w;
+  MATreeLookup tree_lookup(tree);
+  Properties properties = Properties(num_props);
+  const intptr_t onerow = channel.plane.PixelsPerRow();
+  Channel references(kRefs ? properties.size() - kNumNonrefProperties : 0, w);
+  weighted::State wp_state(wp_header, kWP ? w : 0, kWP ? channel.h : 0);
+  for (size_t y = 0; y < channel.h; y++) {
+    pixel_type *JXL_RESTRICT p = channel.Row(y);
+    InitPropsRow(&properties, static_props, y);
+    if (kRefs) PrecomputeReferences(channel, y, *image, chan, &references);
+    // Pixels in [x_interior_begin, x_interior_end) have all their neighbours.
+    size_t x_interior_begin = w, x_interior_end = w;
+    if (y > 1 && w > 4) {
+      x_interior_begin = 2;
+      x_interior_end = w - 2;
+    }
+    size_t x = 0;
+    for (; x < x_interior_begin; x++) {
+      DecodePixelWithTree<kWP, kRefs, kPredictor, /*kInterior=*/false>(
+          x, y, w, p + x, onerow, tree_lookup, usage.ref_props, references,
+          &wp_state, &properties, br, reader);
+    }
+    for (; x < x_interior_end; x++) {
+      DecodePixelWithTree<kWP, kRefs, kPredictor, /*kInterior=*/true>(
+          x, y, w, p + x, onerow, tree_lookup, usage.ref_props, references,
+          &wp_state, &properties, br, reader);
+    }
+    for (; x < w; x++) {
+      DecodePixelWithTree<kWP, kRefs, kPredictor, /*kInterior=*/false>(
+          x, y, w, p + x, onerow, tree_lookup, usage.ref_props, references,
+          &wp_state, &properties, br, reader);
+    }
+  }
+}
+
+template <bool kWP, bool kRefs>
+TreeKernel SelectTreeKernel(int predictor) {
+  switch (predictor) {
+    case static_cast<int>(Predictor::Zero):
+      return &DecodeChannelWithTree<kWP, kRefs,
+                                    static_cast<int>(Predictor::Zero)>;
+    case static_cast<int>(Predictor::Left):
+      return &DecodeChannelWithTree<kWP, kRefs,
+                                    static_cast<int>(Predictor::Left)>;
+    case static_cast<int>(Predictor::Top):
+      return &DecodeChannelWithTree<kWP, kRefs,
+                                    static_cast<int>(Predictor::Top)>;
+    case static_cast<int>(Predictor::Gradient):
+      return &DecodeChannelWithTree<kWP, kRefs,
+                                    static_cast<int>(Predictor::Gradient)>;
+    case static_cast<int>(Predictor::Weighted):
+      return &DecodeChannelWithTree<kWP, kRefs,
+                                    static_cast<int>(Predictor::Weighted)>;
+    default:
+      return &DecodeChannelWithTree<kWP, kRefs, -1>;
+  }
+}
+
+// Picks the kernel that computes only what the tree uses. `wp` tells whether
+// the tree uses the weighted predictor or its property.
+TreeKernel SelectTreeKernel(bool wp, const TreeUsage &usage) {
+  const bool refs = !usage.ref_props.empty();
+  if (wp) {
+    return refs ? SelectTreeKernel<true, true>(usage.predictor)
+                : SelectTreeKernel<true, false>(usage.predictor);
+  }
+  return refs ? SelectTreeKernel<false, true>(usage.predictor)
+              : SelectTreeKernel<false, false>(usage.predictor);
+}
+
+}  // namespace
+
 Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
                                  const std::vector<uint8_t> &context_map,
                                  const Tree &global_tree,
@@ -158,14 +361,6 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
   JXL_DEBUG_V(3, "Decoded MA tree with %" PRIuS " nodes", tree.size());
 
   // MAANS decode
-  const auto make_pixel = [](uint64_t v, pixel_type multiplier,
-                             pixel_type_w offset) -> pixel_type {
-    JXL_DASSERT((v & 0xFFFFFFFF) == v);
-    pixel_type_w val = UnpackSigned(v);
-    // if it overflows, it overflows, and we have a problem anyway
-    return val * multiplier + offset;
-  };
-
   if (tree.size() == 1) {
     // special optimized case: no meta-adaptation, so no need
     // to compute properties.
@@ -180,7 +375,7 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
         // Special-case: histogram has a single symbol, with no extra bits, and
         // we use ANS mode.
         JXL_DEBUG_V(8, "Fastest track.");
-        pixel_type v = make_pixel(value, multiplier, offset);
+        pixel_type v = MakePixel(value, multiplier, offset);
         for (size_t y = 0; y < channel.h; y++) {
           pixel_type *JXL_RESTRICT r = channel.Row(y);
           std::fill(r, r + channel.w, v);
@@ -192,7 +387,7 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
           pixel_type *JXL_RESTRICT r = channel.Row(y);
           for (size_t x = 0; x < channel.w; x++) {
             uint32_t v = reader->ReadHybridUintClustered(ctx_id, br);
-            r[x] = make_pixel(v, multiplier, offset);
+            r[x] = MakePixel(v, multiplier, offset);
           }
         }
       }
@@ -208,7 +403,7 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
           pixel_type topleft = (x && y ? *(r + x - 1 - onerow) : left);
           pixel_type guess = ClampedGradient(top, left, topleft);
           uint64_t v = reader->ReadHybridUintClustered(ctx_id, br);
-          r[x] = make_pixel(v, 1, guess);
+          r[x] = MakePixel(v, 1, guess);
         }
       }
     } else if (predictor != Predictor::Weighted) {
@@ -223,7 +418,7 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
           pixel_type_w g = pred.guess + offset;
           uint64_t v = reader->ReadHybridUintClustered(ctx_id, br);
           // NOTE: pred.multiplier is unset.
-          r[x] = make_pixel(v, multiplier, g);
+          r[x] = MakePixel(v, multiplier, g);
         }
       }
     } else {
@@ -238,7 +433,7 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
                                .guess +
                            offset;
           uint64_t v = reader->ReadHybridUintClustered(ctx_id, br);
-          r[x] = make_pixel(v, multiplier, g);
+          r[x] = MakePixel(v, multiplier, g);
           wp_state.UpdateErrors(r[x], x, y, channel.w);
         }
       }
@@ -277,7 +472,7 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
                 kPropRangeFast - 1);
         uint32_t ctx_id = context_lookup[pos];
         uint64_t v = reader->ReadHybridUintClustered(ctx_id, br);
-        r[x] = make_pixel(v, multipliers[pos],
+        r[x] = MakePixel(v, multipliers[pos],
                           static_cast<pixel_type_w>(offsets[pos]) + guess);
       }
     }
@@ -304,51 +499,17 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
                                       kPropRangeFast - 1);
         uint32_t ctx_id = context_lookup[pos];
         uint64_t v = reader->ReadHybridUintClustered(ctx_id, br);
-        r[x] = make_pixel(v, multipliers[pos],
+        r[x] = MakePixel(v, multipliers[pos],
                           static_cast<pixel_type_w>(offsets[pos]) + guess);
         wp_state.UpdateErrors(r[x], x, y, channel.w);
       }
     }
-  } else if (!tree_has_wp_prop_or_pred) {
-    // special optimized case: the weighted predictor and its properties are not
-    // used, so no need to compute weights and properties.
-    JXL_DEBUG_V(8, "Slow track.");
-    MATreeLookup tree_lookup(tree);
-    Properties properties = Properties(num_props);
-    const intptr_t onerow = channel.plane.PixelsPerRow();
-    Channel references(properties.size() - kNumNonrefProperties, channel.w);
-    for (size_t y = 0; y < channel.h; y++) {
-      pixel_type *JXL_RESTRICT p = channel.Row(y);
-      PrecomputeReferences(channel, y, *image, chan, &references);
-      InitPropsRow(&properties, static_props, y);
-      for (size_t x = 0; x < channel.w; x++) {
-        PredictionResult res =
-            PredictTreeNoWP(&properties, channel.w, p + x, onerow, x, y,
-                            tree_lookup, references);
-        uint64_t v = reader->ReadHybridUintClustered(res.context, br);
-        p[x] = make_pixel(v, res.multiplier, res.guess);
-      }
-    }
   } else {
-    JXL_DEBUG_V(8, "Slowest track.");
-    MATreeLookup tree_lookup(tree);
-    Properties properties = Properties(num_props);
-    const intptr_t onerow = channel.plane.PixelsPerRow();
-    Channel references(properties.size() - kNumNonrefProperties, channel.w);
-    weighted::State wp_state(wp_header, channel.w, channel.h);
-    for (size_t y = 0; y < channel.h; y++) {
-      pixel_type *JXL_RESTRICT p = channel.Row(y);
-      InitPropsRow(&properties, static_props, y);
-      PrecomputeReferences(channel, y, *image, chan, &references);
-      for (size_t x = 0; x < channel.w; x++) {
-        PredictionResult res =
-            PredictTreeWP(&properties, channel.w, p + x, onerow, x, y,
-                          tree_lookup, references, &wp_state);
-        uint64_t v = reader->ReadHybridUintClustered(res.context, br);
-        p[x] = make_pixel(v, res.multiplier, res.guess);
-        wp_state.UpdateErrors(p[x], x, y, channel.w);
-      }
-    }
+    JXL_DEBUG_V(8, "Slow track.");
+    const TreeUsage usage = AnalyzeTree(tree);
+    const TreeKernel kernel = SelectTreeKernel(tree_has_wp_prop_or_pred, usage);
+    kernel(tree, usage, wp_header, static_props, num_props, chan, br, reader,
+           image);
   }
   return true;
 }
@@ -383,7 +544,8 @@ Status ModularDecode(BitReader *br, Image &image, GroupHeader &header,
                      size_t group_id, ModularOptions *options,
                      const Tree *global_tree, const ANSCode *global_code,
                      const std::vector<uint8_t> *global_ctx_map,
-                     bool allow_truncated_group) {
+                     bool allow_truncated_group,
+                     LZ77WindowStorage *lz77_window) {
   if (image.channel.empty()) return true;
 
   // decode transforms
@@ -406,6 +568,8 @@ Status ModularDecode(BitReader *br, Image &image, GroupHeader &header,
 
   size_t num_chans = 0;
   size_t distance_multiplier = 0;
+  // At most one symbol is decoded per pixel.
+  uint64_t max_num_symbols = 0;
   for (size_t i = 0; i < nb_channels; i++) {
     Channel &channel = image.channel[i];
     if (!channel.w || !channel.h) {
@@ -418,6 +582,7 @@ Status ModularDecode(BitReader *br, Image &image, GroupHeader &header,
     if (channel.w > distance_multiplier) {
       distance_multiplier = channel.w;
     }
+    max_num_symbols += static_cast<uint64_t>(channel.w) * channel.h;
     num_chans++;
   }
   if (num_chans == 0) return true;
@@ -462,7 +627,9 @@ Status ModularDecode(BitReader *br, Image &image, GroupHeader &header,
   }
 
   // Read channels
-  ANSSymbolReader reader(code, br, distance_multiplier);
+  ANSSymbolReader reader(
+      code, br, distance_multiplier,
+      std::min<uint64_t>(max_num_symbols, kWindowSize), lz77_window);
   for (size_t i = 0; i < nb_channels; i++) {
     Channel &channel = image.channel[i];
     if (!channel.w || !channel.h) {
@@ -494,7 +661,8 @@ Status ModularGenericDecompress(BitReader *br, Image &image,
                                 ModularOptions *options, bool undo_transforms,
                                 const Tree *tree, const ANSCode *code,
                                 const std::vector<uint8_t> *ctx_map,
-                                bool allow_truncated_group) {
+                                bool allow_truncated_group,
+                                LZ77WindowStorage *lz77_window) {
 #ifdef JXL_ENABLE_ASSERT
   std::vector<std::pair<uint32_t, uint32_t>> req_sizes(image.channel.size());
   for (size_t c = 0; c < req_sizes.size(); c++) {
@@ -504,7 +672,8 @@ Status ModularGenericDecompress(BitReader *br, Image &image,
   GroupHeader local_header;
   if (header == nullptr) header = &local_header;
   auto dec_status = ModularDecode(br, image, *header, group_id, options, tree,
-                                  code, ctx_map, allow_truncated_group);
+                                  code, ctx_map, allow_truncated_group,
+                                  lz77_window);
   if (!allow_truncated_group) JXL_RETURN_IF_ERROR(dec_status);
   if (dec_status.IsFatalError()) return dec_status;
   if (undo_transforms) image.undo_transforms(header->wp_header);
@@ -129,7 +129,8 @@ Status ModularGenericDecompress(BitReader *br, Image &image,
                                 const Tree *tree = nullptr,
                                 const ANSCode *code = nullptr,
                                 const std::vector<uint8_t> *ctx_map = nullptr,
-                                bool allow_truncated_group = false);
+                                bool allow_truncated_group = false,
+                                LZ77WindowStorage *lz77_window = nullptr);
 }  // namespace jxl
 
 #endif  // LIB_JXL_MODULAR_ENCODING_ENCODING_H_
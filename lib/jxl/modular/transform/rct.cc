@@ -5,7 +5,16 @@
 
 #include "lib/jxl/modular/transform/rct.h"
 
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jxl/modular/transform/rct.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+HWY_BEFORE_NAMESPACE();
 namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::ShiftRight;
 
 template <int transform_type>
 void InvRCTRow(const pixel_type* in0, const pixel_type* in1,
@@ -15,7 +24,39 @@ void InvRCTRow(const pixel_type* in0, const pixel_type* in1,
                 "Invalid transform type");
   int second = transform_type >> 1;
   int third = transform_type & 1;
-  for (size_t x = 0; x < w; x++) {
+
+  // Integer additions of vectors wrap around like PixelAdd.
+  const HWY_FULL(pixel_type) d;
+  const size_t N = Lanes(d);
+  size_t x = 0;
+  for (; x + N <= w; x += N) {
+    if (transform_type == 6) {
+      auto Y = LoadU(d, in0 + x);
+      auto Co = LoadU(d, in1 + x);
+      auto Cg = LoadU(d, in2 + x);
+      auto tmp = Y - ShiftRight<1>(Cg);
+      auto G = Cg + tmp;
+      auto B = tmp - ShiftRight<1>(Co);
+      auto R = B + Co;
+      StoreU(R, d, out0 + x);
+      StoreU(G, d, out1 + x);
+      StoreU(B, d, out2 + x);
+    } else {
+      auto First = LoadU(d, in0 + x);
+      auto Second = LoadU(d, in1 + x);
+      auto Third = LoadU(d, in2 + x);
+      if (third) Third = Third + First;
+      if (second == 1) {
+        Second = Second + First;
+      } else if (second == 2) {
+        Second = Second + ShiftRight<1>(First + Third);
+      }
+      StoreU(First, d, out0 + x);
+      StoreU(Second, d, out1 + x);
+      StoreU(Third, d, out2 + x);
+    }
+  }
+  for (; x < w; x++) {
     if (transform_type == 6) {
       pixel_type Y = in0[x];
       pixel_type Co = in1[x];
@@ -96,4 +137,18 @@ Status InvRCT(Image& input, size_t begin_c, size_t rct_type, ThreadPool* pool) {
   return true;
 }
 
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+
+HWY_EXPORT(InvRCT);
+Status InvRCT(Image& input, size_t begin_c, size_t rct_type, ThreadPool* pool) {
+  return HWY_DYNAMIC_DISPATCH(InvRCT)(input, begin_c, rct_type, pool);
+}
+
 }  // namespace jxl
+#endif  // HWY_ONCE
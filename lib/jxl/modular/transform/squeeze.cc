@@ -13,7 +13,190 @@
 #include "lib/jxl/modular/modular_image.h"
 #include "lib/jxl/modular/transform/transform.h"
 
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jxl/modular/transform/squeeze.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+HWY_BEFORE_NAMESPACE();
 namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::Vec;
+
+// Computes the two pixels that were averaged into `avg`, given the residual,
+// the next average and the previous (left or top) pixel of the output.
+JXL_INLINE void UnsqueezePixel(pixel_type_w residual, pixel_type_w avg,
+                               pixel_type_w next_avg, pixel_type_w prev,
+                               pixel_type *JXL_RESTRICT first,
+                               pixel_type *JXL_RESTRICT second) {
+  pixel_type_w tendency = SmoothTendency(prev, avg, next_avg);
+  pixel_type_w diff = residual + tendency;
+  pixel_type_w A =
+      ((avg * 2) + diff + (diff > 0 ? -(diff & 1) : (diff & 1))) >> 1;
+  *first = A;
+  *second = A - diff;
+}
+
+#if HWY_TARGET != HWY_SCALAR
+
+using D = HWY_FULL(pixel_type);
+using V = Vec<D>;
+
+// Returns floor(x / 3) for non-negative x.
+HWY_INLINE V DivideBy3(const V x) {
+  const D d;
+  const hwy::HWY_NAMESPACE::Repartition<uint64_t, D> du64;
+  // For 0 <= x < 2^31, this is the upper half of x * 0x55555556.
+  const V k = Set(d, 0x55555556);
+  const V even = BitCast(d, ShiftRight<32>(BitCast(du64, MulEven(x, k))));
+  const V odd_x = BitCast(d, ShiftRight<32>(BitCast(du64, x)));
+  const V odd = BitCast(d, MulEven(odd_x, k));
+  return OddEven(odd, even);
+}
+
+// Same as SmoothTendency, without branches. Only exact if all the inputs are
+// in (-2^28, 2^28).
+HWY_INLINE V VectorSmoothTendency(const V B, const V a, const V n) {
+  const D d;
+  const V zero = Zero(d);
+  const V one = Set(d, 1);
+  const V Ba = B - a;
+  const V an = a - n;
+  const V absBa2 = Abs(Ba) + Abs(Ba);
+  const V absan2 = Abs(an) + Abs(an);
+  // If B, a and n are monotonic, |B - n| = |B - a| + |a - n|, and the division
+  // of 4 |B - a| + 3 |a - n| + 6 by 12 can be split in two.
+  V absdiff = ShiftRight<2>(DivideBy3(Abs(Ba)) + Abs(B - n) + Set(d, 2));
+  absdiff =
+      IfThenElse(absdiff - (absdiff & one) > absBa2, absBa2 + one, absdiff);
+  absdiff = IfThenElse(absdiff + (absdiff & one) > absan2, absan2, absdiff);
+  const V diff = IfThenElse(B < n, zero - absdiff, absdiff);
+  // There is no tendency if B - a and a - n have opposite signs.
+  return IfThenElse(Max(Ba, an) > zero,
+                    IfThenZeroElse(Min(Ba, an) < zero, diff), diff);
+}
+
+// Vector version of UnsqueezePixel. Returns false, leaving the outputs
+// untouched, if some input is too large for 32-bit lanes to give the same
+// result.
+HWY_INLINE bool UnsqueezeVector(const V residual, const V avg,
+                                const V next_avg, const V prev, V *first,
+                                V *second) {
+  const D d;
+  const V zero = Zero(d);
+  const V magnitude = Abs(residual) | Abs(avg) | Abs(next_avg) | Abs(prev);
+  if (!AllTrue(ShiftRight<28>(magnitude) == zero)) return false;
+  const V tendency = VectorSmoothTendency(prev, avg, next_avg);
+  const V diff = residual + tendency;
+  const V diff_bit = diff & Set(d, 1);
+  const V A = ShiftRight<1>(avg + avg + diff +
+                            IfThenElse(diff > zero, zero - diff_bit, diff_bit));
+  *first = A;
+  *second = A - diff;
+  return true;
+}
+
+#endif  // HWY_TARGET != HWY_SCALAR
+
+// Unsqueezes row y of the channel, starting from the input column x_begin.
+// The output columns before 2 * x_begin must be computed already.
+void InvHSqueezeRow(const Channel &chin, const Channel &chin_residual,
+                    size_t y, size_t x_begin, Channel *chout) {
+  const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y);
+  const pixel_type *JXL_RESTRICT p_avg = chin.Row(y);
+  pixel_type *JXL_RESTRICT p_out = chout->Row(y);
+  for (size_t x = x_begin; x < chin_residual.w; x++) {
+    pixel_type_w avg = p_avg[x];
+    pixel_type_w next_avg = (x + 1 < chin.w ? p_avg[x + 1] : avg);
+    // The first pixel uses the average as its left neighbour.
+    pixel_type_w left = (x ? p_out[(x << 1) - 1] : avg);
+    UnsqueezePixel(p_residual[x], avg, next_avg, left, p_out + (x << 1),
+                   p_out + (x << 1) + 1);
+  }
+  if (chout->w & 1) p_out[chout->w - 1] = p_avg[chin.w - 1];
+}
+
+#if HWY_TARGET != HWY_SCALAR
+
+// Same as InvHSqueezeRow for the Lanes(D()) rows starting at y0, with one row
+// per lane.
+void InvHSqueezeRows(const Channel &chin, const Channel &chin_residual,
+                     size_t y0, Channel *chout) {
+  const D d;
+  const size_t N = Lanes(d);
+  const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y0);
+  const pixel_type *JXL_RESTRICT p_avg = chin.Row(y0);
+  const V residual_offsets =
+      Iota(d, 0) *
+      Set(d, static_cast<pixel_type>(chin_residual.plane.PixelsPerRow()));
+  const V avg_offsets =
+      Iota(d, 0) * Set(d, static_cast<pixel_type>(chin.plane.PixelsPerRow()));
+  HWY_ALIGN pixel_type first[MaxLanes(d)];
+  HWY_ALIGN pixel_type second[MaxLanes(d)];
+  pixel_type *p_out[MaxLanes(d)];
+  for (size_t i = 0; i < N; i++) p_out[i] = chout->Row(y0 + i);
+
+  V avg = GatherIndex(d, p_avg, avg_offsets);
+  V left = avg;
+  for (size_t x = 0; x < chin_residual.w; x++) {
+    const V residual = GatherIndex(d, p_residual + x, residual_offsets);
+    const V next_avg =
+        x + 1 < chin.w ? GatherIndex(d, p_avg + x + 1, avg_offsets) : avg;
+    V A, B;
+    if (!UnsqueezeVector(residual, avg, next_avg, left, &A, &B)) {
+      for (size_t i = 0; i < N; i++) {
+        InvHSqueezeRow(chin, chin_residual, y0 + i, x, chout);
+      }
+      return;
+    }
+    Store(A, d, first);
+    Store(B, d, second);
+    for (size_t i = 0; i < N; i++) {
+      p_out[i][x << 1] = first[i];
+      p_out[i][(x << 1) + 1] = second[i];
+    }
+    avg = next_avg;
+    left = B;
+  }
+  if (chout->w & 1) {
+    for (size_t i = 0; i < N; i++) {
+      p_out[i][chout->w - 1] = chin.Row(y0 + i)[chin.w - 1];
+    }
+  }
+}
+
+#endif  // HWY_TARGET != HWY_SCALAR
+
+// Unsqueezes the columns [x0, x1) of the two output rows computed from one row
+// of averages and residuals. p_navg is the next row of averages, and p_pout
+// the output row above p_out.
+void InvVSqueezeRow(const pixel_type *JXL_RESTRICT p_residual,
+                    const pixel_type *JXL_RESTRICT p_avg,
+                    const pixel_type *JXL_RESTRICT p_navg,
+                    const pixel_type *JXL_RESTRICT p_pout,
+                    pixel_type *JXL_RESTRICT p_out,
+                    pixel_type *JXL_RESTRICT p_nout, size_t x0, size_t x1) {
+  size_t x = x0;
+#if HWY_TARGET != HWY_SCALAR
+  const D d;
+  for (; x + Lanes(d) <= x1; x += Lanes(d)) {
+    V first, second;
+    if (!UnsqueezeVector(LoadU(d, p_residual + x), LoadU(d, p_avg + x),
+                         LoadU(d, p_navg + x), LoadU(d, p_pout + x), &first,
+                         &second)) {
+      break;
+    }
+    StoreU(first, d, p_out + x);
+    StoreU(second, d, p_nout + x);
+  }
+#endif
+  for (; x < x1; x++) {
+    UnsqueezePixel(p_residual[x], p_avg[x], p_navg[x], p_pout[x], p_out + x,
+                   p_nout + x);
+  }
+}
 
 void InvHSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
   JXL_ASSERT(c < input.channel.size());
@@ -43,39 +226,26 @@ void InvHSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
     return;
   }
 
+  // Each row depends on the previous output pixel, so vectors hold several
+  // rows instead of consecutive pixels.
+#if HWY_TARGET != HWY_SCALAR
+  const size_t rows_per_task = Lanes(D());
+#else
+  const size_t rows_per_task = 1;
+#endif
   RunOnPool(
-      pool, 0, chin.h, ThreadPool::SkipInit(),
+      pool, 0, DivCeil(chin.h, rows_per_task), ThreadPool::SkipInit(),
       [&](const int task, const int thread) {
-        const size_t y = task;
-        const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y);
-        const pixel_type *JXL_RESTRICT p_avg = chin.Row(y);
-        pixel_type *JXL_RESTRICT p_out = chout.Row(y);
-
-        // special case for x=0 so we don't have to check x>0
-        pixel_type_w avg = p_avg[0];
-        pixel_type_w next_avg = (1 < chin.w ? p_avg[1] : avg);
-        pixel_type_w tendency = SmoothTendency(avg, avg, next_avg);
-        pixel_type_w diff = p_residual[0] + tendency;
-        pixel_type_w A =
-            ((avg * 2) + diff + (diff > 0 ? -(diff & 1) : (diff & 1))) >> 1;
-        pixel_type_w B = A - diff;
-        p_out[0] = A;
-        p_out[1] = B;
-
-        for (size_t x = 1; x < chin_residual.w; x++) {
-          pixel_type_w diff_minus_tendency = p_residual[x];
-          pixel_type_w avg = p_avg[x];
-          pixel_type_w next_avg = (x + 1 < chin.w ? p_avg[x + 1] : avg);
-          pixel_type_w left = p_out[(x << 1) - 1];
-          pixel_type_w tendency = SmoothTendency(left, avg, next_avg);
-          pixel_type_w diff = diff_minus_tendency + tendency;
-          pixel_type_w A =
-              ((avg * 2) + diff + (diff > 0 ? -(diff & 1) : (diff & 1))) >> 1;
-          p_out[x << 1] = A;
-          pixel_type_w B = A - diff;
-          p_out[(x << 1) + 1] = B;
+        const size_t y0 = task * rows_per_task;
+#if HWY_TARGET != HWY_SCALAR
+        if (y0 + rows_per_task <= chin.h) {
+          InvHSqueezeRows(chin, chin_residual, y0, &chout);
+          return;
+        }
+#endif
+        for (size_t y = y0; y < std::min(y0 + rows_per_task, chin.h); y++) {
+          InvHSqueezeRow(chin, chin_residual, y, /*x_begin=*/0, &chout);
         }
-        if (chout.w & 1) p_out[chout.w - 1] = p_avg[chin.w - 1];
       },
       "InvHorizontalSqueeze");
   input.channel[c] = std::move(chout);
@@ -110,8 +280,6 @@ void InvVSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
     return;
   }
 
-  intptr_t onerow_in = chin.plane.PixelsPerRow();
-  intptr_t onerow_out = chout.plane.PixelsPerRow();
   constexpr int kColsPerThread = 64;
   RunOnPool(
       pool, 0, DivCeil(chin.w, kColsPerThread), ThreadPool::SkipInit(),
@@ -121,28 +289,16 @@ void InvVSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
         // We only iterate up to std::min(chin_residual.h, chin.h) which is
         // always chin_residual.h.
         for (size_t y = 0; y < chin_residual.h; y++) {
-          const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y);
-          const pixel_type *JXL_RESTRICT p_avg = chin.Row(y);
-          pixel_type *JXL_RESTRICT p_out = chout.Row(y << 1);
-          for (size_t x = x0; x < x1; x++) {
-            pixel_type_w diff_minus_tendency = p_residual[x];
-            pixel_type_w avg = p_avg[x];
-
-            pixel_type_w next_avg = avg;
-            if (y + 1 < chin.h) next_avg = p_avg[x + onerow_in];
-            pixel_type_w top =
-                (y > 0 ? p_out[static_cast<ssize_t>(x) - onerow_out] : avg);
-            pixel_type_w tendency = SmoothTendency(top, avg, next_avg);
-            pixel_type_w diff = diff_minus_tendency + tendency;
-            pixel_type_w out =
-                ((avg * 2) + diff + (diff > 0 ? -(diff & 1) : (diff & 1))) >> 1;
-
-            p_out[x] = out;
-            // If the chin_residual.h == chin.h, the output has an even number
-            // of rows so the next line is fine. Otherwise, this loop won't
-            // write to the last output row which is handled separately.
-            p_out[x + onerow_out] = p_out[x] - diff;
-          }
+          const pixel_type *p_avg = chin.Row(y);
+          // The last row has no next average, and the first one no top pixel;
+          // the average is used instead.
+          const pixel_type *p_navg = y + 1 < chin.h ? chin.Row(y + 1) : p_avg;
+          const pixel_type *p_pout = y > 0 ? chout.Row((y << 1) - 1) : p_avg;
+          // If the chin_residual.h == chin.h, the output has an even number
+          // of rows so the next line is fine. Otherwise, this loop won't
+          // write to the last output row which is handled separately.
+          InvVSqueezeRow(chin_residual.Row(y), p_avg, p_navg, p_pout,
+                         chout.Row(y << 1), chout.Row((y << 1) + 1), x0, x1);
         }
       },
       "InvVertSqueeze");
@@ -158,6 +314,24 @@ void InvVSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
   input.channel[c] = std::move(chout);
 }
 
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+
+HWY_EXPORT(InvHSqueeze);
+void InvHSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
+  return HWY_DYNAMIC_DISPATCH(InvHSqueeze)(input, c, rc, pool);
+}
+
+HWY_EXPORT(InvVSqueeze);
+void InvVSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
+  return HWY_DYNAMIC_DISPATCH(InvVSqueeze)(input, c, rc, pool);
+}
+
 void DefaultSqueezeParameters(std::vector<SqueezeParams> *parameters,
                               const Image &image) {
   int nb_channels = image.channel.size() - image.nb_meta_channels;
@@ -325,3 +499,4 @@ Status InvSqueeze(Image &input, std::vector<SqueezeParams> parameters,
 }
 
 }  // namespace jxl
+#endif  // HWY_ONCE
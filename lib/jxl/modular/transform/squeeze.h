@@ -75,9 +75,9 @@ inline pixel_type_w SmoothTendency(pixel_type_w B, pixel_type_w a,
   return diff;
 }
 
-void InvHSqueeze(Image &input, int c, int rc, ThreadPool *pool);
+void InvHSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool);
 
-void InvVSqueeze(Image &input, int c, int rc, ThreadPool *pool);
+void InvVSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool);
 
 void DefaultSqueezeParameters(std::vector<SqueezeParams> *parameters,
                               const Image &image);
@@ -7,6 +7,7 @@
 #include <stdio.h>
 
 #include <array>
+#include <limits>
 #include <string>
 #include <utility>
 #include <vector>
@@ -32,8 +33,12 @@
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/image_test_utils.h"
+#include "lib/jxl/modular/encoding/context_predict.h"
 #include "lib/jxl/modular/encoding/enc_encoding.h"
 #include "lib/jxl/modular/encoding/encoding.h"
+#include "lib/jxl/modular/transform/palette.h"
+#include "lib/jxl/modular/transform/rct.h"
+#include "lib/jxl/modular/transform/squeeze.h"
 #include "lib/jxl/test_utils.h"
 #include "lib/jxl/testdata.h"
 
@@ -247,6 +252,112 @@ TEST(ModularTest, RoundtripExtraProperties) {
   }
 }
 
+// Encodes the image with the tree, using the generic prediction code of the
+// encoder, and checks that the decoder, which evaluates the tree with a kernel
+// specialized for it, reconstructs the image.
+void TestTreeRoundtrip(Image& image, const Tree& tree) {
+  std::vector<Token> tree_tokens;
+  Tree decoded_tree;
+  TokenizeTree(tree, &tree_tokens, &decoded_tree);
+  ModularOptions options;
+  options.skip_encoder_fast_path = true;
+  GroupHeader header;
+  std::vector<std::vector<Token>> tokens(1);
+  size_t width;
+  ASSERT_TRUE(ModularGenericCompress(
+      image, options, /*writer=*/nullptr, /*aux_out=*/nullptr, /*layer=*/0,
+      /*group_id=*/0, /*tree_samples=*/nullptr, /*total_pixels=*/nullptr,
+      &decoded_tree, &header, &tokens[0], &width));
+  const size_t num_contexts = (decoded_tree.size() + 1) / 2;
+  BitWriter writer;
+  EntropyEncodingData code;
+  std::vector<uint8_t> context_map;
+  HistogramParams params;
+  params.image_widths.push_back(width);
+  BuildAndEncodeHistograms(params, num_contexts, tokens, &code, &context_map,
+                           &writer, /*layer=*/0, /*aux_out=*/nullptr);
+  ASSERT_TRUE(Bundle::Write(header, &writer, /*layer=*/0, /*aux_out=*/nullptr));
+  WriteTokens(tokens[0], code, context_map, &writer, /*layer=*/0,
+              /*aux_out=*/nullptr);
+  writer.ZeroPadToByte();
+
+  Image decoded(image.w, image.h, image.bitdepth, image.channel.size());
+  ANSCode decoded_code;
+  std::vector<uint8_t> decoded_context_map;
+  Status status = true;
+  {
+    BitReader reader(writer.GetSpan());
+    BitReaderScopedCloser closer(&reader, &status);
+    ASSERT_TRUE(DecodeHistograms(&reader, num_contexts, &decoded_code,
+                                 &decoded_context_map));
+    ASSERT_TRUE(ModularGenericDecompress(
+        &reader, decoded, /*header=*/nullptr, /*group_id=*/0, &options,
+        /*undo_transforms=*/true, &decoded_tree, &decoded_code,
+        &decoded_context_map));
+  }
+  ASSERT_TRUE(status);
+  for (size_t c = 0; c < image.channel.size(); c++) {
+    VerifyEqual(image.channel[c].plane, decoded.channel[c].plane);
+  }
+}
+
+TEST(ModularTest, RoundtripTreeKernels) {
+  // Wide enough to have interior pixels, whose loop skips the border checks.
+  constexpr size_t kXSize = 67;
+  constexpr size_t kYSize = 41;
+  Image image(kXSize, kYSize, /*bitdepth=*/8, 3);
+  Rng rng(0);
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < kYSize; y++) {
+      pixel_type* row = image.channel[c].Row(y);
+      for (size_t x = 0; x < kXSize; x++) {
+        row[x] = (3 * x + 5 * y + 40 * c) % 200 + rng.UniformI(0, 32);
+      }
+    }
+  }
+  const Predictor kMixedNoWP[] = {Predictor::Gradient, Predictor::Select,
+                                  Predictor::Left, Predictor::Average4};
+  const Predictor kMixedWP[] = {Predictor::Weighted, Predictor::Gradient,
+                                Predictor::TopRight, Predictor::Zero};
+  // A kernel is picked for whether the tree needs the weighted predictor,
+  // whether it reads properties of previous channels, and the predictor of
+  // all its leaves, if there is one. The predictors are -1 for leaves with
+  // different predictors, and Zero, Left, Top, Gradient and Weighted, which
+  // have their own kernels.
+  for (bool wp : {false, true}) {
+    for (bool refs : {false, true}) {
+      for (int predictor : {-1, 0, 1, 2, 5, 6}) {
+        const bool mixed = predictor < 0;
+        if (!wp && predictor == static_cast<int>(Predictor::Weighted)) continue;
+        // Each split sends the pixels above its value to a leaf. The split
+        // on x keeps the tree off the decoder tracks for WP-only trees.
+        std::vector<std::pair<int, int>> splits = {{3, kXSize / 2}};
+        if (wp) splits.emplace_back(kWPProp, 0);
+        if (refs) splits.emplace_back(kNumNonrefProperties + 1, 100);
+        splits.emplace_back(9, 0);
+        Tree tree;
+        for (size_t i = 0; i <= splits.size(); i++) {
+          Predictor leaf_predictor = static_cast<Predictor>(predictor);
+          if (mixed) {
+            leaf_predictor = wp ? kMixedWP[i % 4] : kMixedNoWP[i % 4];
+          }
+          if (i == splits.size()) {
+            tree.push_back(PropertyDecisionNode::Leaf(leaf_predictor, i));
+            break;
+          }
+          tree.push_back(PropertyDecisionNode::Split(
+              splits[i].first, splits[i].second, /*lchild=*/2 * i + 1,
+              /*rchild=*/2 * i + 2));
+          tree.push_back(PropertyDecisionNode::Leaf(leaf_predictor, i));
+        }
+        SCOPED_TRACE(testing::Message() << "wp " << wp << " refs " << refs
+                                        << " predictor " << predictor);
+        TestTreeRoundtrip(image, tree);
+      }
+    }
+  }
+}
+
 TEST(ModularTest, RoundtripLosslessCustomSqueeze) {
   ThreadPool* pool = nullptr;
   const PaddedBytes orig =
@@ -321,5 +432,358 @@ TEST(ModularTest, RoundtripLosslessCustomFloat) {
                                      /*distmap=*/nullptr, pool));
 }
 
+TEST(ModularTest, InvRCTMatchesScalar) {
+  // Not a multiple of the vector size, so that the scalar tail runs too.
+  constexpr size_t kXSize = 77;
+  constexpr size_t kYSize = 2;
+  Rng rng(0);
+  for (size_t rct_type = 0; rct_type < 42; rct_type++) {
+    Image image(kXSize, kYSize, /*bitdepth=*/8, 3);
+    for (size_t c = 0; c < 3; c++) {
+      // The second row uses the full range, so that the additions wrap around.
+      GenerateImage(rng, &image.channel[c].plane, -1000, 1000);
+      pixel_type* row = image.channel[c].Row(1);
+      for (size_t x = 0; x < kXSize; x++) {
+        row[x] = rng.UniformI(std::numeric_limits<pixel_type>::min(),
+                              std::numeric_limits<pixel_type>::max());
+      }
+    }
+    const int permutation = rct_type / 7;
+    const int custom = rct_type % 7;
+    std::vector<ImageI> expected;
+    for (size_t c = 0; c < 3; c++) expected.emplace_back(kXSize, kYSize);
+    for (size_t y = 0; y < kYSize; y++) {
+      for (size_t x = 0; x < kXSize; x++) {
+        pixel_type in[3];
+        for (size_t c = 0; c < 3; c++) in[c] = image.channel[c].Row(y)[x];
+        pixel_type out[3] = {in[0], in[1], in[2]};
+        if (custom == 6) {
+          pixel_type tmp = PixelAdd(in[0], -(in[2] >> 1));
+          out[1] = PixelAdd(in[2], tmp);
+          out[2] = PixelAdd(tmp, -(in[1] >> 1));
+          out[0] = PixelAdd(out[2], in[1]);
+        } else {
+          if (custom & 1) out[2] = PixelAdd(in[2], in[0]);
+          if ((custom >> 1) == 1) {
+            out[1] = PixelAdd(in[1], in[0]);
+          } else if ((custom >> 1) == 2) {
+            out[1] = PixelAdd(in[1], PixelAdd(in[0], out[2]) >> 1);
+          }
+        }
+        expected[permutation % 3].Row(y)[x] = out[0];
+        expected[(permutation + 1 + permutation / 3) % 3].Row(y)[x] = out[1];
+        expected[(permutation + 2 - permutation / 3) % 3].Row(y)[x] = out[2];
+      }
+    }
+    ASSERT_TRUE(InvRCT(image, /*begin_c=*/0, rct_type, /*pool=*/nullptr));
+    for (size_t c = 0; c < 3; c++) {
+      SCOPED_TRACE(testing::Message() << "rct_type " << rct_type << " c " << c);
+      VerifyEqual(expected[c], image.channel[c].plane);
+    }
+  }
+}
+
+// Computes the two pixels that were averaged into `avg` one at a time, with
+// 64-bit intermediate values.
+void ScalarUnsqueezePixel(pixel_type_w residual, pixel_type_w avg,
+                          pixel_type_w next_avg, pixel_type_w prev,
+                          pixel_type* first, pixel_type* second) {
+  pixel_type_w diff = residual + SmoothTendency(prev, avg, next_avg);
+  pixel_type_w A =
+      ((avg * 2) + diff + (diff > 0 ? -(diff & 1) : (diff & 1))) >> 1;
+  *first = A;
+  *second = A - diff;
+}
+
+TEST(ModularTest, InvSqueezeMatchesScalar) {
+  // The vector squeeze is only used while all the values are below 2^28.
+  constexpr pixel_type kThreshold = 1 << 28;
+  Rng rng(0);
+  // 0: small values, 1: values just below the threshold, 2: like 1, with some
+  // values at or just above the threshold.
+  const auto fill = [&rng](int range, ImageI* plane) {
+    for (size_t y = 0; y < plane->ysize(); y++) {
+      pixel_type* row = plane->Row(y);
+      for (size_t x = 0; x < plane->xsize(); x++) {
+        if (range == 0) {
+          row[x] = rng.UniformI(-1000, 1000);
+          continue;
+        }
+        const bool above = range == 2 && rng.UniformI(0, 16) == 0;
+        row[x] = above ? rng.UniformI(kThreshold, kThreshold + 64)
+                       : rng.UniformI(kThreshold - 64, kThreshold);
+        if (rng.UniformI(0, 2)) row[x] = -row[x];
+      }
+    }
+  };
+  for (bool horizontal : {true, false}) {
+    for (int range = 0; range < 3; range++) {
+      // Odd output sizes, which are not multiples of the vector size either.
+      const size_t avg_w = horizontal ? 20 : 37;
+      const size_t avg_h = horizontal ? 37 : 20;
+      const size_t res_w = horizontal ? avg_w - 1 : avg_w;
+      const size_t res_h = horizontal ? avg_h : avg_h - 1;
+      Image image(avg_w, avg_h, /*bitdepth=*/8, 2);
+      image.channel[1] = Channel(res_w, res_h);
+      fill(range, &image.channel[0].plane);
+      fill(range, &image.channel[1].plane);
+
+      const ImageI& avg = image.channel[0].plane;
+      const ImageI& res = image.channel[1].plane;
+      ImageI expected(horizontal ? avg_w + res_w : avg_w,
+                      horizontal ? avg_h : avg_h + res_h);
+      if (horizontal) {
+        for (size_t y = 0; y < avg_h; y++) {
+          pixel_type* out = expected.Row(y);
+          for (size_t x = 0; x < res_w; x++) {
+            const pixel_type* p_avg = avg.Row(y);
+            pixel_type_w next = x + 1 < avg_w ? p_avg[x + 1] : p_avg[x];
+            pixel_type_w left = x ? out[2 * x - 1] : p_avg[x];
+            ScalarUnsqueezePixel(res.Row(y)[x], p_avg[x], next, left,
+                                 out + 2 * x, out + 2 * x + 1);
+          }
+          if (expected.xsize() & 1) {
+            out[expected.xsize() - 1] = avg.Row(y)[avg_w - 1];
+          }
+        }
+      } else {
+        for (size_t y = 0; y < res_h; y++) {
+          const pixel_type* p_avg = avg.Row(y);
+          const pixel_type* p_navg = y + 1 < avg_h ? avg.Row(y + 1) : p_avg;
+          const pixel_type* p_top = y ? expected.Row(2 * y - 1) : p_avg;
+          for (size_t x = 0; x < avg_w; x++) {
+            ScalarUnsqueezePixel(res.Row(y)[x], p_avg[x], p_navg[x], p_top[x],
+                                 expected.Row(2 * y) + x,
+                                 expected.Row(2 * y + 1) + x);
+          }
+        }
+        if (expected.ysize() & 1) {
+          for (size_t x = 0; x < avg_w; x++) {
+            expected.Row(expected.ysize() - 1)[x] = avg.Row(avg_h - 1)[x];
+          }
+        }
+      }
+
+      if (horizontal) {
+        InvHSqueeze(image, /*c=*/0, /*rc=*/1, /*pool=*/nullptr);
+      } else {
+        InvVSqueeze(image, /*c=*/0, /*rc=*/1, /*pool=*/nullptr);
+      }
+      SCOPED_TRACE(testing::Message()
+                   << "horizontal " << horizontal << " range " << range);
+      VerifyEqual(expected, image.channel[0].plane);
+    }
+  }
+}
+
+TEST(ModularTest, InvPaletteMatchesScalar) {
+  constexpr size_t kXSize = 77;
+  constexpr size_t kYSize = 4;
+  constexpr uint32_t kNbColors = 20;
+  Rng rng(0);
+  for (int bitdepth : {8, 12}) {
+    for (uint32_t nb_deltas : {0u, 4u}) {
+      for (int nb : {1, 3}) {
+        Image image(kXSize, kYSize, bitdepth, 2);
+        image.nb_meta_channels = 1;
+        image.channel[0] = Channel(kNbColors + nb_deltas, nb);
+        const int palette_size = image.channel[0].w;
+        GenerateImage(rng, &image.channel[0].plane, 0, 1 << bitdepth);
+        // The first row only has explicit palette entries. The other ones
+        // also have a few delta palette entries (negative indices) and
+        // implicit ones (indices past the palette).
+        for (size_t y = 0; y < kYSize; y++) {
+          pixel_type* row = image.channel[1].Row(y);
+          for (size_t x = 0; x < kXSize; x++) {
+            const int kind = y ? rng.UniformI(0, 8) : 2;
+            if (kind == 0) {
+              row[x] = rng.UniformI(-150, 0);
+            } else if (kind == 1) {
+              row[x] = rng.UniformI(palette_size, palette_size + 200);
+            } else {
+              row[x] = rng.UniformI(0, palette_size);
+            }
+          }
+        }
+
+        // The zero predictor adds nothing to the delta entries, and indices
+        // are only clamped when there is a single channel and no deltas.
+        const bool clamp = nb == 1 && nb_deltas == 0;
+        std::vector<ImageI> expected;
+        for (int c = 0; c < nb; c++) {
+          expected.emplace_back(kXSize, kYSize);
+          for (size_t y = 0; y < kYSize; y++) {
+            for (size_t x = 0; x < kXSize; x++) {
+              int index = image.channel[1].Row(y)[x];
+              if (clamp) index = Clamp1(index, 0, palette_size - 1);
+              expected[c].Row(y)[x] = palette_internal::GetPaletteValue(
+                  image.channel[0].Row(0), index, c, palette_size,
+                  image.channel[0].plane.PixelsPerRow(), bitdepth);
+            }
+          }
+        }
+
+        ASSERT_TRUE(InvPalette(image, /*begin_c=*/0, kNbColors, nb_deltas,
+                               Predictor::Zero, weighted::Header(),
+                               /*pool=*/nullptr));
+        ASSERT_EQ(static_cast<size_t>(nb), image.channel.size());
+        for (int c = 0; c < nb; c++) {
+          SCOPED_TRACE(testing::Message()
+                       << "bitdepth " << bitdepth << " nb_deltas " << nb_deltas
+                       << " nb " << nb << " c " << c);
+          VerifyEqual(expected[c], image.channel[c].plane);
+        }
+      }
+    }
+  }
+}
+
+// Weighted predictor that computes everything for each pixel, without the
+// per-row terms precomputed by weighted::State.
+class ReferenceWPState {
+ public:
+  ReferenceWPState(const weighted::Header& header, size_t xsize)
+      : header_(header), helper_(header, xsize, 1) {
+    for (size_t i = 0; i < weighted::kNumPredictors; i++) {
+      pred_errors_[i].resize((xsize + 2) * 2);
+    }
+    error_.resize((xsize + 2) * 2);
+  }
+
+  pixel_type_w Predict(size_t x, size_t y, size_t xsize, pixel_type_w N,
+                       pixel_type_w W, pixel_type_w NE, pixel_type_w NW,
+                       pixel_type_w NN, pixel_type_w* property) {
+    size_t cur_row = y & 1 ? 0 : (xsize + 2);
+    size_t prev_row = y & 1 ? (xsize + 2) : 0;
+    size_t pos_N = prev_row + x;
+    size_t pos_NE = x < xsize - 1 ? pos_N + 1 : pos_N;
+    size_t pos_NW = x > 0 ? pos_N - 1 : pos_N;
+    std::array<uint32_t, weighted::kNumPredictors> weights;
+    for (size_t i = 0; i < weighted::kNumPredictors; i++) {
+      // pred_errors_[pos_N] also contains the error of pixel W.
+      // pred_errors_[pos_NW] also contains the error of pixel WW.
+      weights[i] = pred_errors_[i][pos_N] + pred_errors_[i][pos_NE] +
+                   pred_errors_[i][pos_NW];
+      weights[i] = helper_.ErrorWeight(weights[i], header_.w[i]);
+    }
+
+    N = weighted::State::AddBits(N);
+    W = weighted::State::AddBits(W);
+    NE = weighted::State::AddBits(NE);
+    NW = weighted::State::AddBits(NW);
+    NN = weighted::State::AddBits(NN);
+
+    pixel_type_w teW = x == 0 ? 0 : error_[cur_row + x - 1];
+    pixel_type_w teN = error_[pos_N];
+    pixel_type_w teNW = error_[pos_NW];
+    pixel_type_w teNE = error_[pos_NE];
+
+    *property = teW;
+    if (std::abs(teN) > std::abs(*property)) *property = teN;
+    if (std::abs(teNW) > std::abs(*property)) *property = teNW;
+    if (std::abs(teNE) > std::abs(*property)) *property = teNE;
+
+    prediction[0] = W + NE - N;
+    prediction[1] = N - (((teN + teW + teNE) * header_.p1C) >> 5);
+    prediction[2] = W - (((teN + teW + teNW) * header_.p2C) >> 5);
+    prediction[3] =
+        N - ((teNW * header_.p3Ca + teN * header_.p3Cb + teNE * header_.p3Cc +
+              (NN - N) * header_.p3Cd + (NW - W) * header_.p3Ce) >>
+             5);
+
+    pred = helper_.WeightedAverage(prediction, weights);
+    if (((teN ^ teW) | (teN ^ teNW)) <= 0) {
+      pixel_type_w mx = std::max(W, std::max(NE, N));
+      pixel_type_w mn = std::min(W, std::min(NE, N));
+      pred = std::max(mn, std::min(mx, pred));
+    }
+    return (pred + weighted::kPredictionRound) >> weighted::kPredExtraBits;
+  }
+
+  void UpdateErrors(pixel_type_w val, size_t x, size_t y, size_t xsize) {
+    size_t cur_row = y & 1 ? 0 : (xsize + 2);
+    size_t prev_row = y & 1 ? (xsize + 2) : 0;
+    val = weighted::State::AddBits(val);
+    error_[cur_row + x] = pred - val;
+    for (size_t i = 0; i < weighted::kNumPredictors; i++) {
+      pixel_type_w err = (std::abs(prediction[i] - val) +
+                          weighted::kPredictionRound) >>
+                         weighted::kPredExtraBits;
+      pred_errors_[i][cur_row + x] = err;
+      // Also counts this error on the E and EE pixels of the next row.
+      pred_errors_[i][prev_row + x + 1] += err;
+    }
+  }
+
+  pixel_type_w prediction[weighted::kNumPredictors] = {};
+  pixel_type_w pred = 0;
+
+ private:
+  weighted::Header header_;
+  // Only used for ErrorWeight and WeightedAverage.
+  weighted::State helper_;
+  std::vector<uint32_t> pred_errors_[weighted::kNumPredictors];
+  std::vector<int32_t> error_;
+};
+
+TEST(ModularTest, WeightedPredictorMatchesPerPixel) {
+  constexpr size_t kYSize = 9;
+  Rng rng(0);
+  std::vector<weighted::Header> headers(5);
+  for (int mode = 0; mode < 5; mode++) {
+    weighted::PredictorMode(mode, &headers[mode]);
+  }
+  for (size_t i = 0; i < 3; i++) {
+    weighted::Header header;
+    for (pixel_type* p : {&header.p1C, &header.p2C, &header.p3Ca, &header.p3Cb,
+                          &header.p3Cc, &header.p3Cd, &header.p3Ce}) {
+      *p = rng.UniformI(0, 32);
+    }
+    for (uint32_t& w : header.w) w = rng.UniformU(0, 16);
+    headers.push_back(header);
+  }
+  // Widths where every column is an edge column, and a wider one.
+  for (size_t xsize : {1u, 2u, 3u, 5u, 67u}) {
+    for (size_t h = 0; h < headers.size(); h++) {
+      for (pixel_type range : {1 << 4, 1 << 8, 1 << 20}) {
+        SCOPED_TRACE(testing::Message() << "xsize " << xsize << " header " << h
+                                        << " range " << range);
+        Channel channel(xsize, kYSize);
+        GenerateImage(rng, &channel.plane, -range, range);
+        weighted::State state(headers[h], xsize, kYSize);
+        ReferenceWPState reference(headers[h], xsize);
+        Properties properties(1);
+        const intptr_t onerow = channel.plane.PixelsPerRow();
+        for (size_t y = 0; y < kYSize; y++) {
+          const pixel_type* JXL_RESTRICT r = channel.Row(y);
+          for (size_t x = 0; x < xsize; x++) {
+            pixel_type_w left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
+            pixel_type_w top = (y ? *(r + x - onerow) : left);
+            pixel_type_w topleft = (x && y ? *(r + x - 1 - onerow) : left);
+            pixel_type_w topright =
+                (x + 1 < xsize && y ? *(r + x + 1 - onerow) : top);
+            pixel_type_w toptop = (y > 1 ? *(r + x - onerow - onerow) : top);
+            const int32_t guess = state.Predict</*compute_properties=*/true>(
+                x, y, xsize, top, left, topright, topleft, toptop, &properties,
+                /*offset=*/0);
+            pixel_type_w property;
+            const pixel_type_w expected_guess = reference.Predict(
+                x, y, xsize, top, left, topright, topleft, toptop, &property);
+            ASSERT_EQ(expected_guess, guess) << "x " << x << " y " << y;
+            ASSERT_EQ(property, properties[0]) << "x " << x << " y " << y;
+            ASSERT_EQ(reference.pred, state.pred) << "x " << x << " y " << y;
+            for (size_t i = 0; i < weighted::kNumPredictors; i++) {
+              ASSERT_EQ(reference.prediction[i], state.prediction[i])
+                  << "x " << x << " y " << y << " i " << i;
+            }
+            state.UpdateErrors(r[x], x, y, xsize);
+            reference.UpdateErrors(r[x], x, y, xsize);
+          }
+        }
+      }
+    }
+  }
+}
+
 }  // namespace
 }  // namespace jxl
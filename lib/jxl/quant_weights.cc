@@ -9,7 +9,12 @@
 
 #include <algorithm>
 #include <cmath>
+#include <deque>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <utility>
 
 #include "lib/jxl/base/bits.h"
@@ -444,6 +449,123 @@ Status ComputeQuantTable(const QuantEncoding& encoding,
   return true;
 }
 
+// Serializes the parameters of `encoding` that ComputeQuantTable reads, to
+// identify its result.
+std::string QuantTableKey(const QuantEncoding& encoding,
+                          DequantMatrices::QuantTable kind) {
+  std::string key;
+  const auto append = [&key](const void* data, size_t size) {
+    key.append(static_cast<const char*>(data), size);
+  };
+  const auto append_params = [&append](const DctQuantWeightParams& params) {
+    const size_t num_bands =
+        std::min(params.num_distance_bands,
+                 size_t{DctQuantWeightParams::kMaxDistanceBands});
+    append(&num_bands, sizeof(num_bands));
+    for (size_t c = 0; c < 3; c++) {
+      append(params.distance_bands[c].data(), num_bands * sizeof(float));
+    }
+  };
+  append(&kind, sizeof(kind));
+  append(&encoding.mode, sizeof(encoding.mode));
+  switch (encoding.mode) {
+    case QuantEncoding::kQuantModeLibrary:
+      append(&encoding.predefined, sizeof(encoding.predefined));
+      break;
+    case QuantEncoding::kQuantModeID:
+      append(&encoding.idweights, sizeof(encoding.idweights));
+      break;
+    case QuantEncoding::kQuantModeDCT2:
+      append(&encoding.dct2weights, sizeof(encoding.dct2weights));
+      break;
+    case QuantEncoding::kQuantModeDCT4:
+      append_params(encoding.dct_params);
+      append(&encoding.dct4multipliers, sizeof(encoding.dct4multipliers));
+      break;
+    case QuantEncoding::kQuantModeDCT4X8:
+      append_params(encoding.dct_params);
+      append(&encoding.dct4x8multipliers, sizeof(encoding.dct4x8multipliers));
+      break;
+    case QuantEncoding::kQuantModeDCT:
+      append_params(encoding.dct_params);
+      break;
+    case QuantEncoding::kQuantModeRAW:
+      append(&encoding.qraw.qtable_den, sizeof(encoding.qraw.qtable_den));
+      if (encoding.qraw.qtable) {
+        append(encoding.qraw.qtable->data(),
+               encoding.qraw.qtable->size() * sizeof(int));
+      }
+      break;
+    case QuantEncoding::kQuantModeAFV:
+      append_params(encoding.dct_params);
+      append_params(encoding.dct_params_afv_4x4);
+      append(&encoding.afv_weights, sizeof(encoding.afv_weights));
+      break;
+  }
+  return key;
+}
+
+// Custom quantization tables computed so far, so that the frames and images
+// that use the same encodings (e.g. from the same encoder settings) share them.
+// The oldest tables are evicted once the cache is full; DequantMatrices that
+// still use them keep them alive.
+class QuantTableCache {
+ public:
+  std::shared_ptr<const float> Find(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = tables_.find(key);
+    if (it == tables_.end()) return nullptr;
+    return it->second;
+  }
+
+  void Insert(const std::string& key, std::shared_ptr<const float> table,
+              size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!tables_.emplace(key, std::move(table)).second) return;
+    order_.emplace_back(key, size);
+    size_ += size;
+    while (size_ > kMaxSize) {
+      tables_.erase(order_.front().first);
+      size_ -= order_.front().second;
+      order_.pop_front();
+    }
+  }
+
+ private:
+  // Maximum total size of the cached tables, in floats.
+  static constexpr size_t kMaxSize = 1 << 22;
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<const float>> tables_;
+  // Keys and sizes of the cached tables, oldest first.
+  std::deque<std::pair<std::string, size_t>> order_;
+  size_t size_ = 0;
+};
+
+// Returns the table for `encoding` from the cache, computing and caching it
+// if needed: the weights of the three channels followed by their inverses.
+Status GetCustomQuantTable(const QuantEncoding& encoding,
+                           DequantMatrices::QuantTable kind,
+                           std::shared_ptr<const float>* table) {
+  static QuantTableCache* cache = new QuantTableCache();
+  const std::string key = QuantTableKey(encoding, kind);
+  *table = cache->Find(key);
+  if (*table) return true;
+  const size_t num = DequantMatrices::required_size_x[kind] *
+                     DequantMatrices::required_size_y[kind] * kDCTBlockSize;
+  hwy::AlignedFreeUniquePtr<float[]> storage =
+      hwy::AllocateAligned<float>(6 * num);
+  size_t pos = 0;
+  JXL_RETURN_IF_ERROR(ComputeQuantTable(encoding, storage.get(),
+                                        storage.get() + 3 * num, kind, kind,
+                                        &pos));
+  JXL_ASSERT(pos == 3 * num);
+  const auto deleter = storage.get_deleter();
+  table->reset(storage.release(), deleter);
+  cache->Insert(key, *table, 6 * num);
+  return true;
+}
+
 }  // namespace
 
 // These definitions are needed before C++17.
@@ -1126,13 +1248,12 @@ const QuantEncoding* DequantMatrices::Library() {
 }
 
 Status DequantMatrices::Compute() {
-  size_t pos = 0;
-
   struct DefaultMatrices {
     DefaultMatrices() {
       const QuantEncoding* library = Library();
       size_t pos = 0;
       for (size_t i = 0; i < kNum; i++) {
+        offsets[i] = pos;
         JXL_CHECK(ComputeQuantTable(library[i], table, inv_table, i,
                                     QuantTable(i), &pos));
       }
@@ -1140,6 +1261,7 @@ Status DequantMatrices::Compute() {
     }
     HWY_ALIGN_MAX float table[kTotalTableSize];
     HWY_ALIGN_MAX float inv_table[kTotalTableSize];
+    size_t offsets[kNum];
   };
 
   static const DefaultMatrices& default_matrices =
@@ -1147,38 +1269,41 @@ Status DequantMatrices::Compute() {
 
   JXL_ASSERT(encodings_.size() == kNum);
 
-  bool has_nondefault_matrix = false;
-  for (const auto& enc : encodings_) {
-    if (enc.mode != QuantEncoding::kQuantModeLibrary) {
-      has_nondefault_matrix = true;
-    }
+  // Library matrices are used in place; custom ones are left for
+  // EnsureComputed().
+  for (size_t table = 0; table < kNum; table++) {
+    custom_tables_[table].reset();
   }
-  if (has_nondefault_matrix) {
-    table_storage_ = hwy::AllocateAligned<float>(2 * kTotalTableSize);
-    table_ = table_storage_.get();
-    inv_table_ = table_storage_.get() + kTotalTableSize;
-    for (size_t table = 0; table < kNum; table++) {
-      size_t prev_pos = pos;
-      if (encodings_[table].mode == QuantEncoding::kQuantModeLibrary) {
-        size_t num = required_size_[table] * kDCTBlockSize;
-        memcpy(table_storage_.get() + prev_pos,
-               default_matrices.table + prev_pos, num * sizeof(float) * 3);
-        memcpy(table_storage_.get() + kTotalTableSize + prev_pos,
-               default_matrices.inv_table + prev_pos, num * sizeof(float) * 3);
-        pos += num * 3;
-      } else {
-        JXL_RETURN_IF_ERROR(
-            ComputeQuantTable(encodings_[table], table_storage_.get(),
-                              table_storage_.get() + kTotalTableSize, table,
-                              QuantTable(table), &pos));
-      }
+  for (size_t i = 0; i < AcStrategy::kNumValidStrategies; i++) {
+    const size_t table = kQuantTable[i];
+    const bool is_default =
+        encodings_[table].mode == QuantEncoding::kQuantModeLibrary;
+    const size_t num = required_size_[table] * kDCTBlockSize;
+    for (size_t c = 0; c < 3; c++) {
+      const size_t offset = default_matrices.offsets[table] + c * num;
+      table_[i * 3 + c] =
+          is_default ? default_matrices.table + offset : nullptr;
+      inv_table_[i * 3 + c] =
+          is_default ? default_matrices.inv_table + offset : nullptr;
     }
-    JXL_ASSERT(pos == kTotalTableSize);
-  } else {
-    table_ = default_matrices.table;
-    inv_table_ = default_matrices.inv_table;
   }
+  return true;
+}
 
+Status DequantMatrices::EnsureComputed(uint32_t acs_mask) {
+  for (size_t i = 0; i < AcStrategy::kNumValidStrategies; i++) {
+    if ((acs_mask & (1u << i)) == 0 || table_[i * 3] != nullptr) continue;
+    const size_t table = kQuantTable[i];
+    if (!custom_tables_[table]) {
+      JXL_RETURN_IF_ERROR(GetCustomQuantTable(
+          encodings_[table], QuantTable(table), &custom_tables_[table]));
+    }
+    const size_t num = required_size_[table] * kDCTBlockSize;
+    for (size_t c = 0; c < 3; c++) {
+      table_[i * 3 + c] = custom_tables_[table].get() + c * num;
+      inv_table_[i * 3 + c] = custom_tables_[table].get() + (3 + c) * num;
+    }
+  }
   return true;
 }
 
@@ -11,6 +11,7 @@
 
 #include <array>
 #include <hwy/aligned_allocator.h>
+#include <memory>
 #include <utility>
 #include <vector>
 
@@ -365,21 +366,6 @@ class DequantMatrices {
 
   DequantMatrices() {
     encodings_.resize(size_t(QuantTable::kNum), QuantEncoding::Library(0));
-    size_t pos = 0;
-    size_t offsets[kNum * 3];
-    for (size_t i = 0; i < size_t(QuantTable::kNum); i++) {
-      encodings_[i] = QuantEncoding::Library(0);
-      size_t num = required_size_[i] * kDCTBlockSize;
-      for (size_t c = 0; c < 3; c++) {
-        offsets[3 * i + c] = pos + c * num;
-      }
-      pos += 3 * num;
-    }
-    for (size_t i = 0; i < AcStrategy::kNumValidStrategies; i++) {
-      for (size_t c = 0; c < 3; c++) {
-        table_offsets_[i * 3 + c] = offsets[kQuantTable[i] * 3 + c];
-      }
-    }
     // Default quantization tables need to be valid.
     JXL_CHECK(Compute());
   }
@@ -393,20 +379,19 @@ class DequantMatrices {
   // .cc file.
   static const DequantLibraryInternal LibraryInit();
 
-  JXL_INLINE size_t MatrixOffset(size_t quant_kind, size_t c) const {
-    JXL_DASSERT(quant_kind < AcStrategy::kNumValidStrategies);
-    return table_offsets_[quant_kind * 3 + c];
-  }
-
-  // Returns aligned memory.
+  // Returns aligned memory. The matrices of the three channels of a quant_kind
+  // are contiguous. Custom matrices must have been computed by
+  // EnsureComputed() first.
   JXL_INLINE const float* Matrix(size_t quant_kind, size_t c) const {
     JXL_DASSERT(quant_kind < AcStrategy::kNumValidStrategies);
-    return &table_[MatrixOffset(quant_kind, c)];
+    JXL_DASSERT(table_[quant_kind * 3 + c] != nullptr);
+    return table_[quant_kind * 3 + c];
   }
 
   JXL_INLINE const float* InvMatrix(size_t quant_kind, size_t c) const {
     JXL_DASSERT(quant_kind < AcStrategy::kNumValidStrategies);
-    return &inv_table_[MatrixOffset(quant_kind, c)];
+    JXL_DASSERT(inv_table_[quant_kind * 3 + c] != nullptr);
+    return inv_table_[quant_kind * 3 + c];
   }
 
   // DC quants are used in modular mode for XYB multipliers.
@@ -428,10 +413,18 @@ class DequantMatrices {
     }
   }
 
+  // Only reads the encodings: the custom matrices are computed by
+  // EnsureComputed().
   Status Decode(BitReader* br,
                 ModularFrameDecoder* modular_frame_decoder = nullptr);
   Status DecodeDC(BitReader* br);
 
+  // Computes the matrices of the strategies in `acs_mask` (a bit per raw
+  // AcStrategy) that are not computed yet. Matrices with a custom encoding are
+  // shared, through a process-wide cache, with any other DequantMatrices that
+  // has the same encoding for them.
+  Status EnsureComputed(uint32_t acs_mask);
+
   const std::vector<QuantEncoding>& encodings() const { return encodings_; }
 
   static constexpr size_t required_size_x[] = {1, 1, 1, 1, 2,  4, 1,  1, 2,
@@ -454,13 +447,14 @@ class DequantMatrices {
   static constexpr size_t kTotalTableSize =
       ArraySum(required_size_) * kDCTBlockSize * 3;
 
-  // kTotalTableSize entries followed by kTotalTableSize for inv_table
-  hwy::AlignedFreeUniquePtr<float[]> table_storage_;
-  const float* table_;
-  const float* inv_table_;
+  // Matrices of each QuantTable with a custom encoding, once computed: the
+  // three channels, followed by their inverses. Null for the library ones.
+  std::shared_ptr<const float> custom_tables_[kNum];
+  // Matrix of each AcStrategy and channel, or nullptr if not computed yet.
+  const float* table_[AcStrategy::kNumValidStrategies * 3];
+  const float* inv_table_[AcStrategy::kNumValidStrategies * 3];
   float dc_quant_[3] = {kDCQuant[0], kDCQuant[1], kDCQuant[2]};
   float inv_dc_quant_[3] = {kInvDCQuant[0], kInvDCQuant[1], kInvDCQuant[2]};
-  size_t table_offsets_[AcStrategy::kNumValidStrategies * 3];
   std::vector<QuantEncoding> encodings_;
 };
 
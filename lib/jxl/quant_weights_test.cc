@@ -15,6 +15,7 @@
 #include "lib/jxl/base/random.h"
 #include "lib/jxl/dct_for_test.h"
 #include "lib/jxl/dec_transforms_testonly.h"
+#include "lib/jxl/enc_bit_writer.h"
 #include "lib/jxl/enc_modular.h"
 #include "lib/jxl/enc_quant_weights.h"
 #include "lib/jxl/enc_transforms.h"
@@ -157,6 +158,37 @@ TEST(QuantWeightsTest, RAW) {
   RoundtripMatrices(encodings);
 }
 
+// Custom matrices are computed only for the requested transforms, and shared
+// between the DequantMatrices with the same encodings.
+TEST(QuantWeightsTest, ComputeOnDemand) {
+  std::vector<QuantEncoding> encodings(DequantMatrices::kNum,
+                                       QuantEncoding::Library(0));
+  for (size_t i = 0; i < DequantMatrices::kNum; i++) {
+    encodings[i] = DequantMatrices::Library()[i];
+  }
+  DequantMatrices full;
+  CodecMetadata metadata;
+  FrameHeader frame_header(&metadata);
+  ModularFrameEncoder encoder(frame_header, CompressParams{});
+  DequantMatricesSetCustom(&full, encodings, &encoder);
+
+  BitWriter writer;
+  ASSERT_TRUE(DequantMatricesEncode(&full, &writer, 0, nullptr));
+  writer.ZeroPadToByte();
+  BitReader br(writer.GetSpan());
+  DequantMatrices lazy;
+  ASSERT_TRUE(lazy.Decode(&br));
+  ASSERT_TRUE(br.Close());
+  ASSERT_TRUE(lazy.EnsureComputed(1u << AcStrategy::DCT16X16));
+
+  for (size_t c = 0; c < 3; c++) {
+    EXPECT_EQ(full.Matrix(AcStrategy::DCT16X16, c),
+              lazy.Matrix(AcStrategy::DCT16X16, c));
+    EXPECT_EQ(full.InvMatrix(AcStrategy::DCT16X16, c),
+              lazy.InvMatrix(AcStrategy::DCT16X16, c));
+  }
+}
+
 class QuantWeightsTargetTest : public hwy::TestWithParamTarget {};
 HWY_TARGET_INSTANTIATE_TEST_SUITE_P(QuantWeightsTargetTest);
 
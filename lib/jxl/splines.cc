@@ -140,7 +140,7 @@ void ComputeSegments(const Spline::Point& center, const float intensity,
 void DrawSegments(Image3F* const opsin, const Rect& opsin_rect,
                   const Rect& image_rect, bool add,
                   const SplineSegment* segments, const size_t* segment_indices,
-                  const size_t* segment_y_start) {
+                  const size_t* segment_start, size_t num_columns) {
   JXL_ASSERT(image_rect.ysize() == 1);
   float* JXL_RESTRICT rows[3] = {
       opsin_rect.PlaneRow(opsin, 0, 0) - image_rect.x0(),
@@ -148,9 +148,21 @@ void DrawSegments(Image3F* const opsin, const Rect& opsin_rect,
       opsin_rect.PlaneRow(opsin, 2, 0) - image_rect.x0(),
   };
   size_t y = image_rect.y0();
-  for (size_t i = segment_y_start[y]; i < segment_y_start[y + 1]; i++) {
-    DrawSegment(segments[segment_indices[i]], add, y, image_rect.x0(),
-                image_rect.x0() + image_rect.xsize(), rows);
+  const size_t x0 = image_rect.x0();
+  const size_t x1 = image_rect.x0() + image_rect.xsize();
+  const size_t* row_start = segment_start + y * num_columns;
+  // A segment is listed in every column it overlaps, so each column only draws
+  // the pixels inside of it.
+  for (size_t column = x0 / kSplineColumnWidth;
+       column < num_columns && column * kSplineColumnWidth < x1; column++) {
+    const size_t column_x0 =
+        std::max<size_t>(x0, column * kSplineColumnWidth);
+    const size_t column_x1 =
+        std::min<size_t>(x1, (column + 1) * kSplineColumnWidth);
+    for (size_t i = row_start[column]; i < row_start[column + 1]; i++) {
+      DrawSegment(segments[segment_indices[i]], add, y, column_x0, column_x1,
+                  rows);
+    }
   }
 }
 
@@ -449,7 +461,8 @@ void Splines::Clear() {
   starting_points_.clear();
   segments_.clear();
   segment_indices_.clear();
-  segment_y_start_.clear();
+  segment_start_.clear();
+  num_columns_ = 0;
 }
 
 Status Splines::Decode(jxl::BitReader* br, size_t num_pixels) {
@@ -505,7 +518,7 @@ Status Splines::InitializeDrawCache(size_t image_xsize, size_t image_ysize,
   // boundaries.
   segments_.clear();
   segment_indices_.clear();
-  segment_y_start_.clear();
+  segment_start_.clear();
   std::vector<std::pair<size_t, size_t>> segments_by_y;
   for (size_t i = 0; i < splines_.size(); ++i) {
     const Spline spline =
@@ -533,18 +546,37 @@ Status Splines::InitializeDrawCache(size_t image_xsize, size_t image_ysize,
     HWY_DYNAMIC_DISPATCH(SegmentsFromPoints)
     (spline, points_to_draw, arc_length, segments_, segments_by_y);
   }
-  std::sort(segments_by_y.begin(), segments_by_y.end());
-  segment_indices_.resize(segments_by_y.size());
-  segment_y_start_.resize(image_ysize + 1);
-  for (size_t i = 0; i < segments_by_y.size(); i++) {
-    segment_indices_[i] = segments_by_y[i].second;
-    size_t y = segments_by_y[i].first;
-    if (y < image_ysize) {
-      segment_y_start_[y + 1]++;
+  // Spread the segments of each row over the columns that they overlap, with
+  // the same bounds as DrawSegment. Segments outside of the image are dropped.
+  num_columns_ = DivCeil(image_xsize, kSplineColumnWidth);
+  std::vector<std::pair<size_t, size_t>> segments_by_bucket;
+  segments_by_bucket.reserve(segments_by_y.size());
+  for (const auto& y_and_segment : segments_by_y) {
+    const size_t y = y_and_segment.first;
+    if (y >= image_ysize) continue;
+    const SplineSegment& segment = segments_[y_and_segment.second];
+    const ssize_t x0 = std::max<ssize_t>(
+        0, segment.center_x - segment.maximum_distance + 0.5f);
+    const ssize_t x1 = std::min<ssize_t>(
+        image_xsize, segment.center_x + segment.maximum_distance + 1.5f);
+    if (x0 >= x1) continue;
+    for (size_t column = x0 / kSplineColumnWidth;
+         column <= (x1 - 1) / kSplineColumnWidth; column++) {
+      segments_by_bucket.emplace_back(y * num_columns_ + column,
+                                      y_and_segment.second);
     }
   }
-  for (size_t y = 0; y < image_ysize; y++) {
-    segment_y_start_[y + 1] += segment_y_start_[y];
+  // Within a bucket, segments stay in the order in which they are added.
+  std::sort(segments_by_bucket.begin(), segments_by_bucket.end());
+  const size_t num_buckets = image_ysize * num_columns_;
+  segment_indices_.resize(segments_by_bucket.size());
+  segment_start_.assign(num_buckets + 1, 0);
+  for (size_t i = 0; i < segments_by_bucket.size(); i++) {
+    segment_indices_[i] = segments_by_bucket[i].second;
+    segment_start_[segments_by_bucket[i].first + 1]++;
+  }
+  for (size_t i = 0; i < num_buckets; i++) {
+    segment_start_[i + 1] += segment_start_[i];
   }
   return true;
 }
@@ -556,7 +588,7 @@ void Splines::Apply(Image3F* const opsin, const Rect& opsin_rect,
   for (size_t iy = 0; iy < image_rect.ysize(); iy++) {
     HWY_DYNAMIC_DISPATCH(DrawSegments)
     (opsin, opsin_rect.Line(iy), image_rect.Line(iy), add, segments_.data(),
-     segment_indices_.data(), segment_y_start_.data());
+     segment_indices_.data(), segment_start_.data(), num_columns_);
   }
 }
 
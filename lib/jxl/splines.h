@@ -26,6 +26,10 @@ namespace jxl {
 
 static constexpr float kDesiredRenderingDistance = 1.f;
 
+// Besides by row, the draw cache indexes the segments by columns of this many
+// pixels, so that drawing a rect only visits the segments that overlap it.
+static constexpr size_t kSplineColumnWidth = 256;
+
 enum SplineEntropyContexts : size_t {
   kQuantizationAdjustmentContext = 0,
   kStartingPositionContext,
@@ -135,8 +139,12 @@ class Splines {
   std::vector<QuantizedSpline> splines_;
   std::vector<Spline::Point> starting_points_;
   std::vector<SplineSegment> segments_;
+  // Indices into segments_, grouped by row and then by column. The segments of
+  // column `x` of row `y` are in [segment_start_[i], segment_start_[i + 1]),
+  // for i = y * num_columns_ + x.
   std::vector<size_t> segment_indices_;
-  std::vector<size_t> segment_y_start_;
+  std::vector<size_t> segment_start_;
+  size_t num_columns_ = 0;
 };
 
 }  // namespace jxl
@@ -135,6 +135,8 @@ jxl::Status DecodeJpegXlContainerOneShot(const uint8_t* data, size_t size,
   container->xmlc.clear();
   container->jumb = nullptr;
   container->jumb_size = 0;
+  container->frame_index = nullptr;
+  container->frame_index_size = 0;
   container->codestream = nullptr;
   container->codestream_size = 0;
   container->jpeg_reconstruction = nullptr;
@@ -173,10 +175,11 @@ jxl::Status DecodeJpegXlContainerOneShot(const uint8_t* data, size_t size,
       const char* expected = "jxl \0\0\0\0jxl ";
       if (memcmp(expected, in, 12) != 0) return JXL_FAILURE("Invalid ftyp");
     } else if (!memcmp("jxli", box.type, 4)) {
-      // TODO(lode): parse JXL frame index box
       if (container->codestream) {
         return JXL_FAILURE("frame index must come before codestream");
       }
+      container->frame_index = in;
+      container->frame_index_size = data_size;
     } else if (!memcmp("jxlc", box.type, 4)) {
       container->codestream = in;
       container->codestream_size = data_size;
@@ -263,6 +266,11 @@ jxl::Status EncodeJpegXlContainerOneShot(const JpegXlContainer& container,
                                          out));
   }
 
+  if (container.frame_index) {
+    JXL_RETURN_IF_ERROR(AppendBoxAndData("jxli", container.frame_index,
+                                         container.frame_index_size, out));
+  }
+
   if (container.codestream) {
     JXL_RETURN_IF_ERROR(AppendBoxAndData("jxlc", container.codestream,
                                          container.codestream_size, out));
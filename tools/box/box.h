@@ -85,7 +85,10 @@ struct JpegXlContainer {
   const uint8_t* jumb = nullptr;  // Not owned
   size_t jumb_size = 0;
 
-  // TODO(lode): add frame index data
+  // Frame index ("jxli" box) data, or null if not present in the container.
+  // The data is not parsed here, see jxl::ReadFrameIndex.
+  const uint8_t* frame_index = nullptr;  // Not owned
+  size_t frame_index_size = 0;
 
   // JPEG reconstruction data, or null if not present in the container.
   const uint8_t* jpeg_reconstruction = nullptr;
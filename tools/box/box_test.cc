@@ -21,6 +21,7 @@ TEST(BoxTest, BoxTest) {
   jxl::PaddedBytes xml0(test_size);
   jxl::PaddedBytes xml1(test_size);
   jxl::PaddedBytes jumb(test_size);
+  jxl::PaddedBytes frame_index(test_size);
   jxl::PaddedBytes codestream(test_size);
   // Generate arbitrary data for the codestreams: the test is not testing
   // the contents of them but whether they are preserved in the container.
@@ -30,6 +31,7 @@ TEST(BoxTest, BoxTest) {
     xml0[i] = v++;
     xml1[i] = v++;
     jumb[i] = v++;
+    frame_index[i] = v++;
     codestream[i] = v++;
   }
 
@@ -41,6 +43,8 @@ TEST(BoxTest, BoxTest) {
   container.xmlc.emplace_back(xml1.data(), xml1.size());
   container.jumb = jumb.data();
   container.jumb_size = jumb.size();
+  container.frame_index = frame_index.data();
+  container.frame_index_size = frame_index.size();
   container.codestream = codestream.data();
   container.codestream_size = codestream.size();
 
@@ -71,6 +75,9 @@ TEST(BoxTest, BoxTest) {
   }
   EXPECT_EQ(jumb.size(), container2.jumb_size);
   EXPECT_EQ(0, memcmp(jumb.data(), container2.jumb, container2.jumb_size));
+  EXPECT_EQ(frame_index.size(), container2.frame_index_size);
+  EXPECT_EQ(0, memcmp(frame_index.data(), container2.frame_index,
+                      container2.frame_index_size));
   EXPECT_EQ(codestream.size(), container2.codestream_size);
   EXPECT_EQ(0, memcmp(codestream.data(), container2.codestream,
                       container2.codestream_size));
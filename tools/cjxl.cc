@@ -306,6 +306,11 @@ void CompressArgs::AddCommandLineOptions(CommandLineParser* cmdline) {
                          "Exif/XMP/JPEG bitstream reconstruction data)",
                          &no_container, &SetBooleanTrue, 2);
 
+  cmdline->AddOptionFlag('\0', "frame_index",
+                         "For animations, add a frame index box to the "
+                         "container, for faster seeking to frames",
+                         &frame_index, &SetBooleanTrue, 2);
+
   // Target distance/size/bpp
   opt_distance_id = cmdline->AddOptionValue(
       'd', "distance", "maxError",
@@ -726,6 +731,7 @@ jxl::Status CompressArgs::ValidateArgsAfterLoad(
       !io.blobs.jumbf.empty() || !io.blobs.iptc.empty() || jpeg_transcode) {
     use_container = true;
   }
+  if (frame_index && io.metadata.m.have_animation) use_container = true;
   if (no_container) use_container = false;
   if (jpeg_transcode && params.modular_mode) {
     fprintf(stderr,
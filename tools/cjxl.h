@@ -48,6 +48,7 @@ struct CompressArgs {
   bool version = false;
   bool use_container = false;
   bool no_container = false;
+  bool frame_index = false;
   bool quiet = false;
 
   const char* file_in = nullptr;
@@ -8,6 +8,7 @@
 #include "jxl/encode.h"
 #include "lib/jxl/base/file_io.h"
 #include "lib/jxl/base/profiler.h"
+#include "lib/jxl/enc_frame_index.h"
 #include "lib/jxl/jpeg/enc_jpeg_data.h"
 #include "tools/box/box.h"
 #include "tools/cjxl.h"
@@ -108,6 +109,18 @@ int CompressJpegXlMain(int argc, const char* argv[]) {
       container.jpeg_reconstruction = jpeg_data.data();
       container.jpeg_reconstruction_size = jpeg_data.size();
     }
+    jxl::PaddedBytes frame_index;
+    if (args.frame_index && io.metadata.m.have_animation) {
+      jxl::FrameIndex index;
+      if (!jxl::ComputeFrameIndex(jxl::Span<const uint8_t>(compressed),
+                                  &index)) {
+        fprintf(stderr, "Failed to compute frame index\n");
+        return CjxlRetCode::ERR_CONTAINER;
+      }
+      jxl::WriteFrameIndex(index, &frame_index);
+      container.frame_index = frame_index.data();
+      container.frame_index_size = frame_index.size();
+    }
     jxl::PaddedBytes container_file;
     if (!EncodeJpegXlContainerOneShot(container, &container_file)) {
       fprintf(stderr, "Failed to encode container format\n");